@@ -31,16 +31,21 @@
 #include "cryb/impl.h"
 
 #include <sys/types.h>
+#include <sys/file.h>
+#include <sys/stat.h>
 
 #include <err.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <inttypes.h>
 #include <limits.h>
+#include <pthread.h>
 #include <pwd.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <cryb/ctype.h>
@@ -50,17 +55,26 @@
 
 #define MAX_KEYURI_SIZE	4096
 
-/* XXX hardcoded windows */
-#define HOTP_WINDOW	9
-#define TOTP_WINDOW	2
+#define CALC_CHUNK	1024	/* codes per otp_generate_range() call */
+
+#define BULK_BATCH	1024	/* entries per store transaction */
+#define BULK_CHUNK	16	/* entries claimed at a time */
+#define BULK_MAXJOBS	256
+
+#define RESYNC_MAXDEPTH	100000000	/* counters for resync --deep */
+#define RESYNC_MAXDEPTH2 1000000	/* ... with only two codes */
 
 enum { RET_SUCCESS, RET_FAILURE, RET_ERROR, RET_USAGE, RET_UNAUTH };
 
 static char *user;
 static char *keyfile;
+static char *storepath;
+static unsigned int njobs;
 static int verbose;
 static int readonly;
 static int numbered;
+static int keyfmt = OTP_KEYFMT_URI;	/* format of the key file */
+static int lockfd = -1;			/* locked key file */
 
 static int isroot;		/* running as root */
 static int issameuser;		/* real user same as target user */
@@ -97,80 +111,173 @@ otpkey_print_uri(oath_key *key)
 	return (RET_SUCCESS);
 }
 
+/*
+ * Lock the key file against concurrent updates, so that two concurrent
+ * invocations cannot both accept the same code.  Since the file may be
+ * replaced while we wait for the lock, we check that the file we
+ * locked is still the one in place.  The lock is held until we exit.
+ */
+static int
+otpkey_lock(void)
+{
+	struct stat fsb, sb;
+	int fd;
+
+	for (;;) {
+		/* read-only is enough unless we update it in place */
+		if ((fd = open(keyfile, O_RDWR|O_CLOEXEC)) < 0 &&
+		    (fd = open(keyfile, O_RDONLY|O_CLOEXEC)) < 0) {
+			/* let otpkey_load() deal with it */
+			return (RET_SUCCESS);
+		}
+		if (flock(fd, LOCK_EX) != 0 || fstat(fd, &fsb) != 0) {
+			warn("%s", keyfile);
+			close(fd);
+			return (RET_ERROR);
+		}
+		if (stat(keyfile, &sb) == 0 && sb.st_dev == fsb.st_dev &&
+		    sb.st_ino == fsb.st_ino) {
+			lockfd = fd;
+			return (RET_SUCCESS);
+		}
+		close(fd);
+	}
+}
+
 /*
  * Load key from file
  */
 static int
 otpkey_load(oath_key *key)
 {
-	char keyuri[MAX_KEYURI_SIZE];
-	ssize_t rlen;
-	size_t len;
-	int fd;
+	otp_uri_error uerr;
+	int fd, ret, serrno;
 
 	if (verbose)
 		warnx("loading key from %s", keyfile);
-	/* read from file  */
-	if ((fd = open(keyfile, O_RDONLY)) < 0)
-		return (-1);
-	if ((rlen = read(fd, keyuri, sizeof keyuri - 1)) < 0) {
-		warn("%s", keyfile);
-		close(fd);
+	if ((fd = open(keyfile, O_RDONLY|O_CLOEXEC)) < 0)
 		return (-1);
-	}
+	ret = otp_key_load(key, fd, &uerr);
+	serrno = errno;
 	close(fd);
-	/* cut off at the first newline character */
-	for (len = 0; len < (size_t)rlen; len++)
-		if (keyuri[len] == '\n')
-			break;
-	while (len > 0 && is_ws(keyuri[len - 1]))
-		len--;
-	keyuri[len] = '\0';
-	/* check and parse */
-	if (strlcmp("otpauth://", keyuri, 10) != 0) {
-		warnx("%s: unrecognized key file format", keyfile);
-		return (RET_ERROR);
-	}
-	if (oath_key_from_uri(key, keyuri) != 0) {
-		warnx("%s: invalid key URI", keyfile);
-		if (errno == EACCES || errno == EPERM)
-			return (RET_UNAUTH);
+	if (ret < 0) {
+		if (serrno != EINVAL) {
+			errno = serrno;
+			warn("%s", keyfile);
+			return (-1);
+		}
+		warnx("%s: offset %zu: %s", keyfile, uerr.offset, uerr.msg);
 		return (RET_ERROR);
 	}
+	keyfmt = ret;
 	return (RET_SUCCESS);
 }
 
 /*
- * Save key to file
+ * Save key to file.  The key is written to a temporary file in the
+ * same directory, which is then renamed into place, so the key file
+ * always contains either the old or the new key, even after a crash.
  * XXX liboath should take care of this for us
  */
 static int
-otpkey_save(oath_key *key)
+otpkey_save_file(const char *path, oath_key *key, int fmt)
 {
 	char keyuri[MAX_KEYURI_SIZE];
+	char *dir, *p, *tmpfile;
+	struct stat sb;
 	ssize_t wlen;
 	size_t len;
 	int fd;
 
 	if (verbose)
-		warnx("saving key to %s", keyfile);
+		warnx("saving key to %s", path);
 	len = sizeof keyuri;
-	if (oath_key_to_uri(key, keyuri, &len) != 0) {
-		warnx("failed to convert key to otpauth URI");
+	if (fmt == OTP_KEYFMT_BINARY) {
+		if (otp_key_to_binary(key, keyuri, &len) != 0) {
+			warnx("failed to convert key to binary form");
+			return (-1);
+		}
+	} else {
+		if (oath_key_to_uri(key, keyuri, &len) != 0) {
+			warnx("failed to convert key to otpauth URI");
+			return (-1);
+		}
+		keyuri[len - 1] = '\n';
+	}
+	if (asprintf(&tmpfile, "%s.XXXXXX", path) < 0) {
+		warn("asprintf()");
 		return (-1);
 	}
-	keyuri[len - 1] = '\n';
-	if ((fd = open(keyfile, O_WRONLY|O_CREAT|O_TRUNC, 0600)) < 0) {
-		warn("%s", keyfile);
+	if ((fd = mkstemp(tmpfile)) < 0) {
+		warn("%s", tmpfile);
+		free(tmpfile);
 		return (-1);
 	}
-	if ((wlen = write(fd, keyuri, len)) < 0 || (size_t)wlen < len) {
-		warn("%s", keyfile);
+	/* preserve the ownership and mode of the existing file */
+	if (stat(path, &sb) == 0 &&
+	    (fchown(fd, sb.st_uid, sb.st_gid) != 0 ||
+		fchmod(fd, sb.st_mode & 0777) != 0) && verbose)
+		warn("%s", tmpfile);
+	if ((wlen = write(fd, keyuri, len)) < 0 || (size_t)wlen < len ||
+	    fsync(fd) != 0) {
+		warn("%s", tmpfile);
 		close(fd);
-		return (-1);
+		goto fail;
+	}
+	if (close(fd) != 0 || rename(tmpfile, path) != 0) {
+		warn("%s", path);
+		goto fail;
+	}
+	free(tmpfile);
+	/* make the rename itself durable */
+	if ((dir = strdup(path)) != NULL) {
+		if ((p = strrchr(dir, '/')) == NULL)
+			strcpy(dir, ".");
+		else if (p == dir)
+			p[1] = '\0';
+		else
+			*p = '\0';
+		if ((fd = open(dir, O_RDONLY|O_DIRECTORY|O_CLOEXEC)) >= 0) {
+			(void)fsync(fd);
+			close(fd);
+		}
+		free(dir);
 	}
-	close(fd);
 	return (0);
+fail:
+	unlink(tmpfile);
+	free(tmpfile);
+	return (-1);
+}
+
+static int
+otpkey_save(oath_key *key)
+{
+
+	return (otpkey_save_file(keyfile, key, keyfmt));
+}
+
+/*
+ * Save a key whose counter or last used time step has advanced.  A
+ * binary key file which we hold locked is updated in place; anything
+ * else is rewritten.
+ */
+static int
+otpkey_advance(oath_key *key)
+{
+
+	if (keyfmt == OTP_KEYFMT_BINARY && lockfd >= 0) {
+		if (verbose)
+			warnx("updating key in %s", keyfile);
+		if (otp_key_update(key, lockfd) == 0)
+			return (RET_SUCCESS);
+		/* opened read-only; fall back to replacing the file */
+		if (errno != EBADF) {
+			warn("%s", keyfile);
+			return (RET_ERROR);
+		}
+	}
+	return (otpkey_save(key));
 }
 
 /*
@@ -192,7 +299,7 @@ otpkey_genkey(int argc, char *argv[])
 	if (oath_key_create(&key, mode, oh_undef, 0, "", user, NULL, 0) != 0)
 		return (RET_ERROR);
 	ret = readonly ? otpkey_print_uri(&key) : otpkey_save(&key);
-	oath_key_destroy(&key);
+	otp_key_destroy(&key);
 	return (ret);
 }
 
@@ -202,6 +309,7 @@ otpkey_genkey(int argc, char *argv[])
 static int
 otpkey_setkey(int argc, char *argv[])
 {
+	otp_uri_error uerr;
 	oath_key key;
 	int ret;
 
@@ -211,10 +319,12 @@ otpkey_setkey(int argc, char *argv[])
 	(void)argv;
 	if (!isroot && !issameuser)
 		return (RET_UNAUTH);
-	if (oath_key_from_uri(&key, argv[0]) != 0)
+	if (otp_key_parse(&key, argv[0], strlen(argv[0]), &uerr) < 0) {
+		warnx("offset %zu: %s", uerr.offset, uerr.msg);
 		return (RET_ERROR);
+	}
 	ret = otpkey_save(&key);
-	oath_key_destroy(&key);
+	otp_key_destroy(&key);
 	return (ret);
 }
 
@@ -235,7 +345,7 @@ otpkey_getkey(int argc, char *argv[])
 	if ((ret = otpkey_load(&key)) != RET_SUCCESS)
 		return (ret);
 	ret = otpkey_print_hex(&key);
-	oath_key_destroy(&key);
+	otp_key_destroy(&key);
 	return (ret);
 }
 
@@ -256,7 +366,7 @@ otpkey_geturi(int argc, char *argv[])
 	if ((ret = otpkey_load(&key)) != RET_SUCCESS)
 		return (ret);
 	ret = otpkey_print_uri(&key);
-	oath_key_destroy(&key);
+	otp_key_destroy(&key);
 	return (ret);
 }
 
@@ -274,6 +384,8 @@ otpkey_verify(int argc, char *argv[])
 
 	if (argc < 1)
 		return (RET_USAGE);
+	if (!readonly && (ret = otpkey_lock()) != RET_SUCCESS)
+		return (ret);
 	if ((ret = otpkey_load(&key)) != RET_SUCCESS)
 		return (ret);
 	response = strtoul(*argv, &end, 10);
@@ -291,13 +403,65 @@ otpkey_verify(int argc, char *argv[])
 		if (key.mode == om_hotp && key.counter > counter + 1)
 			warnx("skipped %lu codes", key.counter - counter - 1);
 	}
-	ret = match ? readonly ? RET_SUCCESS : otpkey_save(&key) : RET_FAILURE;
-	oath_key_destroy(&key);
+	ret = match ? readonly ? RET_SUCCESS : otpkey_advance(&key) :
+	    RET_FAILURE;
+	otp_key_destroy(&key);
 	return (ret);
 }
 
 /*
- * Compute the current code
+ * Parse a counter value or a time for calc --from / --to.
+ */
+static int
+otpkey_calc_arg(const char *str, uint64_t *val)
+{
+	uintmax_t v;
+	char *end;
+
+	errno = 0;
+	v = strtoumax(str, &end, 10);
+	if (end == str || *end != '\0' || errno != 0 || v > UINT64_MAX)
+		return (-1);
+	*val = v;
+	return (0);
+}
+
+/*
+ * Print the codes for an arbitrary range of counter values or times,
+ * without touching the keyfile.
+ */
+static int
+otpkey_calc_range(oath_key *key, uint64_t from, uint64_t n)
+{
+	unsigned int codes[CALC_CHUNK];
+	unsigned int chunk, i;
+	uint64_t seq, step;
+
+	step = key->mode == om_totp ? key->timestep : 1;
+	seq = from;
+	while (n > 0) {
+		chunk = n < CALC_CHUNK ? n : CALC_CHUNK;
+		if (otp_generate_range(key, seq, chunk, codes) != 0) {
+			warnx("OATH error");
+			return (RET_ERROR);
+		}
+		for (i = 0; i < chunk; ++i) {
+			if (numbered)
+				printf("%6ju ", (uintmax_t)((seq + i) * step));
+			printf("%.*u\n", (int)key->digits, codes[i]);
+		}
+		seq += chunk;
+		n -= chunk;
+	}
+	if (fflush(stdout) != 0) {
+		warn("stdout");
+		return (RET_ERROR);
+	}
+	return (RET_SUCCESS);
+}
+
+/*
+ * Compute the current code, or the codes for a given range
  */
 static int
 otpkey_calc(int argc, char *argv[])
@@ -305,33 +469,78 @@ otpkey_calc(int argc, char *argv[])
 	oath_key key;
 	unsigned int current;
 	unsigned long i, n;
+	uint64_t from, to;
 	uintmax_t count;
 	char *end;
-	int ret;
+	int hasfrom, hasto, ret;
 
+	hasfrom = hasto = 0;
+	from = to = 0;
+	while (argc >= 2) {
+		if (strcmp(argv[0], "--from") == 0 ||
+		    strcmp(argv[0], "-f") == 0) {
+			if (otpkey_calc_arg(argv[1], &from) != 0)
+				return (RET_USAGE);
+			hasfrom = 1;
+		} else if (strcmp(argv[0], "--to") == 0 ||
+		    strcmp(argv[0], "-t") == 0) {
+			if (otpkey_calc_arg(argv[1], &to) != 0)
+				return (RET_USAGE);
+			hasto = 1;
+		} else {
+			break;
+		}
+		argc -= 2;
+		argv += 2;
+	}
 	if (argc > 1)
 		return (RET_USAGE);
 	if (argc > 0) {
 		n = strtoul(argv[0], &end, 10);
-		if (end == argv[0] || *end != '\0' || n < 1 || n > 1000)
+		if (end == argv[0] || *end != '\0' || n < 1 ||
+		    (!hasfrom && !hasto && n > 1000))
 			return (RET_USAGE);
 	} else {
 		n = 1;
 	}
+	if (hasto && argc > 0)
+		return (RET_USAGE);
+	if (hasfrom || hasto) {
+		if ((ret = otpkey_load(&key)) != RET_SUCCESS)
+			return (ret);
+		if (key.mode == om_totp) {
+			/* times to time steps */
+			if (!hasfrom)
+				from = time(NULL);
+			from /= key.timestep;
+			if (hasto)
+				to /= key.timestep;
+		} else if (!hasfrom) {
+			from = key.counter;
+		}
+		if (!hasto)
+			ret = otpkey_calc_range(&key, from, n);
+		else if (to < from || (from == 0 && to == UINT64_MAX))
+			ret = RET_USAGE;
+		else
+			ret = otpkey_calc_range(&key, from, to - from + 1);
+		otp_key_destroy(&key);
+		return (ret);
+	}
+	if (!readonly && (ret = otpkey_lock()) != RET_SUCCESS)
+		return (ret);
 	if ((ret = otpkey_load(&key)) != RET_SUCCESS)
 		return (ret);
 	for (i = 0; i < n; ++i) {
+		current = otp_calc(&key);
 		switch (key.mode) {
 		case om_hotp:
-			current = oath_hotp_current(&key);
 			count = key.counter;
 			break;
 		case om_totp:
-			current = oath_totp_current(&key);
 			count = key.lastused * key.timestep;
 			break;
 		default:
-			current = UINT_MAX;
 			count = 0;
 		}
 		if (current == UINT_MAX) {
@@ -344,52 +553,495 @@ otpkey_calc(int argc, char *argv[])
 		printf("%.*d\n", (int)key.digits, current);
 	}
 	if (ret == RET_SUCCESS && !readonly)
-		ret = otpkey_save(&key);
-	oath_key_destroy(&key);
+		ret = otpkey_advance(&key);
+	otp_key_destroy(&key);
 	return (ret);
 }
 
 /*
- * Resynchronize
+ * Resynchronize, optionally searching far beyond the normal window
  */
 static int
 otpkey_resync(int argc, char *argv[])
 {
+	struct timespec t0, t1;
 	oath_key key;
-	unsigned long counter;
+	uint64_t searched;
 	unsigned long response[3];
+	unsigned long depth;
 	char *end;
-	int i, match, n, ret, w;
+	double secs;
+	int i, match, n, ret;
 
+	depth = 0;
+	if (argc >= 2 && strcmp(argv[0], "--deep") == 0) {
+		depth = strtoul(argv[1], &end, 10);
+		if (end == argv[1] || *end != '\0' || depth < 1 ||
+		    depth > RESYNC_MAXDEPTH)
+			return (RET_USAGE);
+		argc -= 2;
+		argv += 2;
+	}
 	if (argc < 2 || argc > 3)
 		return (RET_USAGE);
 	n = argc;
-	for (i = 0, w = 1; i < n; ++i) {
+	if (n < 3 && depth > RESYNC_MAXDEPTH2) {
+		warnx("searching more than %u counters requires three codes",
+		    RESYNC_MAXDEPTH2);
+		return (RET_USAGE);
+	}
+	for (i = 0; i < n; ++i) {
 		response[i] = strtoul(argv[i], &end, 10);
 		if (end == argv[i] || *end != '\0')
 			response[i] = UINT_MAX; /* never valid */
-		w = w * (HOTP_WINDOW + 1);
 	}
-	w -= n;
+	if (!readonly && (ret = otpkey_lock()) != RET_SUCCESS)
+		return (ret);
 	if ((ret = otpkey_load(&key)) != RET_SUCCESS)
 		return (ret);
-	if (key.mode == om_hotp)
-		counter = key.counter;
-	match = otp_resync(&key, response, n);
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	if (depth > 0)
+		match = otp_resync_deep(&key, response, n, depth, njobs);
+	else
+		match = otp_resync(&key, response, n);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
 	if (match < 0) {
 		warnx("OATH error");
 		match = 0;
 	}
 	if (verbose) {
 		warnx("resynchronization %s", match ? "succeeded" : "failed");
-		if (counter > key.counter + 1)
-			warnx("skipped %lu codes", key.counter - counter);
+		if (match > 1)
+			warnx("skipped %d codes", match - 1);
+		if (depth > 0) {
+			searched = match ? (uint64_t)match + n - 1 : depth;
+			secs = (t1.tv_sec - t0.tv_sec) +
+			    (t1.tv_nsec - t0.tv_nsec) / 1e9;
+			warnx("searched %ju counters in %.3f s with %u "
+			    "threads, %.0f counters/s", (uintmax_t)searched,
+			    secs, njobs, secs > 0 ? searched / secs : 0.0);
+		}
+	}
+	ret = match ? readonly ? RET_SUCCESS : otpkey_advance(&key) :
+	    RET_FAILURE;
+	otp_key_destroy(&key);
+	return (ret);
+}
+
+/*
+ * Rewrite the key file in the given format
+ */
+static int
+otpkey_convert(int argc, int fmt)
+{
+	oath_key key;
+	int ret;
+
+	if (argc != 0)
+		return (RET_USAGE);
+	if (!isroot && !issameuser)
+		return (RET_UNAUTH);
+	if ((ret = otpkey_lock()) != RET_SUCCESS)
+		return (ret);
+	if ((ret = otpkey_load(&key)) != RET_SUCCESS)
+		return (ret);
+	if (keyfmt == fmt) {
+		if (verbose)
+			warnx("%s is already in %s form", keyfile,
+			    fmt == OTP_KEYFMT_URI ? "URI" : "binary");
+		ret = RET_SUCCESS;
+	} else {
+		keyfmt = fmt;
+		ret = otpkey_save(&key);
 	}
-	ret = match ? readonly ? RET_SUCCESS : otpkey_save(&key) : RET_FAILURE;
-	oath_key_destroy(&key);
+	otp_key_destroy(&key);
 	return (ret);
 }
 
+/*
+ * Convert the key file from binary to otpauth URI form
+ */
+static int
+otpkey_export_uri(int argc, char *argv[])
+{
+
+	(void)argv;
+	return (otpkey_convert(argc, OTP_KEYFMT_URI));
+}
+
+/*
+ * Convert the key file from otpauth URI to binary form
+ */
+static int
+otpkey_import_uri(int argc, char *argv[])
+{
+
+	(void)argv;
+	return (otpkey_convert(argc, OTP_KEYFMT_BINARY));
+}
+
+/*
+ * Bulk provisioning.  The main thread reads entries from stdin in
+ * batches; the worker pool, which the main thread joins, generates or
+ * parses the keys and formats the URIs; and the main thread then
+ * writes the entire batch to the key store under a single lock and
+ * prints the URIs in input order.
+ */
+struct bulk_entry {
+	char		*line;
+	size_t		 linesize;
+	unsigned long	 lineno;
+	char		 user[OTPD_MAXUSERLEN + 1];
+	oath_key	 key;
+	char		 uri[MAX_KEYURI_SIZE];
+	size_t		 urilen;
+	int		 ret;
+};
+
+struct bulk {
+	oath_mode	 mode;			/* om_undef for import */
+	int		 savefiles;		/* write keyfiles */
+	struct bulk_entry *ents;
+	size_t		 nents;
+	size_t		 next;			/* next unclaimed */
+	unsigned int	 gen;			/* batch generation */
+	unsigned int	 busy;			/* workers running */
+	int		 quit;
+	pthread_mutex_t	 mtx;
+	pthread_cond_t	 work;
+	pthread_cond_t	 idle;
+};
+
+/*
+ * Check that a user name is safe to use in a file name, and copy it
+ * into the entry.
+ */
+static int
+otpkey_bulk_user(struct bulk_entry *e, const char *str, size_t len)
+{
+	size_t i;
+
+	if (len == 0 || len >= sizeof e->user || str[0] == '.')
+		return (-1);
+	for (i = 0; i < len; ++i)
+		if (str[i] == '/' || str[i] == '\0' || is_ws(str[i]))
+			return (-1);
+	memcpy(e->user, str, len);
+	e->user[len] = '\0';
+	return (0);
+}
+
+/*
+ * Generate or parse the key for a single entry, format it, and if we
+ * are not using a key store, save it.
+ */
+static void
+otpkey_bulk_one(struct bulk *b, struct bulk_entry *e)
+{
+	otp_uri_error uerr;
+	char *path;
+
+	if (e->ret != RET_SUCCESS)
+		return;
+	e->ret = RET_ERROR;
+	if (b->mode != om_undef) {
+		if (oath_key_create(&e->key, b->mode, oh_undef, 0, "",
+		    e->user, NULL, 0) != 0) {
+			warnx("line %lu: failed to generate key", e->lineno);
+			return;
+		}
+	} else {
+		if (otp_key_parse(&e->key, e->line, strlen(e->line),
+		    &uerr) < 0) {
+			warnx("line %lu: offset %zu: %s", e->lineno,
+			    uerr.offset, uerr.msg);
+			return;
+		}
+		if (e->user[0] == '\0' &&
+		    otpkey_bulk_user(e, e->key.label, e->key.labellen) != 0) {
+			warnx("line %lu: invalid user name", e->lineno);
+			goto fail;
+		}
+	}
+	e->urilen = sizeof e->uri;
+	if (oath_key_to_uri(&e->key, e->uri, &e->urilen) != 0) {
+		warnx("line %lu: failed to convert key to otpauth URI",
+		    e->lineno);
+		goto fail;
+	}
+	e->uri[e->urilen - 1] = '\n';
+	if (b->savefiles) {
+		if (asprintf(&path, "/var/oath/%s.otpauth", e->user) < 0) {
+			warn("asprintf()");
+			goto fail;
+		}
+		if (otpkey_save_file(path, &e->key, OTP_KEYFMT_URI) != 0) {
+			free(path);
+			goto fail;
+		}
+		free(path);
+	}
+	e->ret = RET_SUCCESS;
+	return;
+fail:
+	otp_key_destroy(&e->key);
+}
+
+/*
+ * Claim and process entries until the batch is exhausted.  Entries are
+ * claimed a few at a time so the workers are not constantly contending
+ * for the cursor.
+ */
+static void
+otpkey_bulk_run(struct bulk *b)
+{
+	size_t i, j;
+
+	for (;;) {
+		i = __atomic_fetch_add(&b->next, BULK_CHUNK, __ATOMIC_RELAXED);
+		if (i >= b->nents)
+			break;
+		for (j = i; j < i + BULK_CHUNK && j < b->nents; ++j)
+			otpkey_bulk_one(b, &b->ents[j]);
+	}
+}
+
+static void *
+otpkey_bulk_worker(void *arg)
+{
+	struct bulk *b = arg;
+	unsigned int gen;
+
+	pthread_mutex_lock(&b->mtx);
+	gen = b->gen;
+	for (;;) {
+		while (b->gen == gen && !b->quit)
+			pthread_cond_wait(&b->work, &b->mtx);
+		if (b->quit)
+			break;
+		gen = b->gen;
+		pthread_mutex_unlock(&b->mtx);
+		otpkey_bulk_run(b);
+		pthread_mutex_lock(&b->mtx);
+		if (--b->busy == 0)
+			pthread_cond_signal(&b->idle);
+	}
+	pthread_mutex_unlock(&b->mtx);
+	return (NULL);
+}
+
+/*
+ * Read up to BULK_BATCH entries from stdin.  For bulk-genkey, each
+ * entry is a user name.  For bulk-import, each entry is an otpauth URI,
+ * optionally preceded by a user name; if there is none, the URI's label
+ * is used.  Blank lines and comments are skipped.  Malformed entries
+ * are marked as failed and will be skipped by the workers.
+ */
+static size_t
+otpkey_bulk_read(struct bulk *b, unsigned long *lineno)
+{
+	struct bulk_entry *e;
+	char *p, *q;
+	size_t len, ulen, n;
+
+	for (n = 0; n < BULK_BATCH; ) {
+		e = &b->ents[n];
+		if (getline(&e->line, &e->linesize, stdin) < 0)
+			break;
+		++*lineno;
+		for (p = e->line; is_ws(*p); ++p)
+			/* nothing */ ;
+		len = strlen(p);
+		while (len > 0 && is_ws(p[len - 1]))
+			--len;
+		p[len] = '\0';
+		if (len == 0 || *p == '#')
+			continue;
+		e->lineno = *lineno;
+		e->user[0] = '\0';
+		e->ret = RET_SUCCESS;
+		q = p;
+		if (b->mode != om_undef) {
+			ulen = len;
+		} else if (strlcmp("otpauth://", p, 10) == 0) {
+			ulen = 0;
+		} else {
+			for (ulen = 0; p[ulen] != '\0' && !is_ws(p[ulen]);
+			    ++ulen)
+				/* nothing */ ;
+			for (q = p + ulen; is_ws(*q); ++q)
+				/* nothing */ ;
+			if (strlcmp("otpauth://", q, 10) != 0) {
+				warnx("line %lu: invalid key URI", *lineno);
+				e->ret = RET_ERROR;
+			}
+		}
+		if (e->ret == RET_SUCCESS && ulen > 0 &&
+		    otpkey_bulk_user(e, p, ulen) != 0) {
+			warnx("line %lu: invalid user name", *lineno);
+			e->ret = RET_ERROR;
+		}
+		if (b->mode == om_undef)
+			memmove(e->line, q, strlen(q) + 1);
+		++n;
+	}
+	return (n);
+}
+
+/*
+ * Process one batch, using the worker pool as well as the calling
+ * thread.
+ */
+static void
+otpkey_bulk_process(struct bulk *b, unsigned int nworkers)
+{
+
+	b->next = 0;
+	pthread_mutex_lock(&b->mtx);
+	b->busy = nworkers;
+	b->gen++;
+	pthread_cond_broadcast(&b->work);
+	pthread_mutex_unlock(&b->mtx);
+	otpkey_bulk_run(b);
+	pthread_mutex_lock(&b->mtx);
+	while (b->busy > 0)
+		pthread_cond_wait(&b->idle, &b->mtx);
+	pthread_mutex_unlock(&b->mtx);
+}
+
+/*
+ * Generate or import keys for many users at once.  The keys are written
+ * to the key store if one was specified, to individual keyfiles if not,
+ * or nowhere if writeback is disabled.  In all cases, the resulting
+ * otpauth URIs are printed to stdout.
+ */
+static int
+otpkey_bulk(oath_mode mode)
+{
+	const char *users[BULK_BATCH];
+	const oath_key *keys[BULK_BATCH];
+	struct bulk_entry *e;
+	struct bulk b;
+	otp_store *st;
+	pthread_t *tids;
+	unsigned long lineno;
+	unsigned int i, nworkers;
+	size_t j, n, nkeys;
+	int fatal, ret;
+
+	if (!isroot)
+		return (RET_UNAUTH);
+	st = NULL;
+	if (storepath != NULL && !readonly &&
+	    (st = otp_store_open(storepath, O_RDWR|O_CREAT)) == NULL) {
+		warn("%s", storepath);
+		return (RET_ERROR);
+	}
+	memset(&b, 0, sizeof b);
+	b.mode = mode;
+	b.savefiles = st == NULL && !readonly;
+	pthread_mutex_init(&b.mtx, NULL);
+	pthread_cond_init(&b.work, NULL);
+	pthread_cond_init(&b.idle, NULL);
+	if ((b.ents = calloc(BULK_BATCH, sizeof *b.ents)) == NULL ||
+	    (tids = calloc(njobs, sizeof *tids)) == NULL)
+		err(1, "calloc()");
+	for (nworkers = 0; nworkers < njobs - 1; ++nworkers) {
+		if ((errno = pthread_create(&tids[nworkers], NULL,
+		    otpkey_bulk_worker, &b)) != 0) {
+			warn("pthread_create()");
+			break;
+		}
+	}
+	ret = RET_SUCCESS;
+	lineno = 0;
+	while ((n = otpkey_bulk_read(&b, &lineno)) > 0) {
+		b.nents = n;
+		otpkey_bulk_process(&b, nworkers);
+		for (j = nkeys = 0; j < n; ++j) {
+			e = &b.ents[j];
+			if (e->ret != RET_SUCCESS) {
+				ret = RET_ERROR;
+				continue;
+			}
+			users[nkeys] = e->user;
+			keys[nkeys] = &e->key;
+			++nkeys;
+		}
+		fatal = st != NULL && nkeys > 0 &&
+		    otp_store_update_batch(st, users, keys, nkeys) != 0;
+		if (fatal) {
+			warn("%s", storepath);
+			ret = RET_ERROR;
+		}
+		for (j = 0; j < n; ++j) {
+			e = &b.ents[j];
+			if (e->ret != RET_SUCCESS)
+				continue;
+			if (!fatal)
+				fwrite(e->uri, 1, e->urilen, stdout);
+			otp_key_destroy(&e->key);
+			memset(e->uri, 0, sizeof e->uri);
+		}
+		if (fatal)
+			break;
+		if (verbose)
+			warnx("%lu lines processed", lineno);
+	}
+	if (ferror(stdin)) {
+		warn("stdin");
+		ret = RET_ERROR;
+	}
+	if (fflush(stdout) != 0) {
+		warn("stdout");
+		ret = RET_ERROR;
+	}
+	pthread_mutex_lock(&b.mtx);
+	b.quit = 1;
+	pthread_cond_broadcast(&b.work);
+	pthread_mutex_unlock(&b.mtx);
+	for (i = 0; i < nworkers; ++i)
+		pthread_join(tids[i], NULL);
+	for (j = 0; j < BULK_BATCH; ++j)
+		free(b.ents[j].line);
+	free(b.ents);
+	free(tids);
+	pthread_cond_destroy(&b.idle);
+	pthread_cond_destroy(&b.work);
+	pthread_mutex_destroy(&b.mtx);
+	if (st != NULL)
+		otp_store_close(st);
+	return (ret);
+}
+
+/*
+ * Generate keys for a list of users read from stdin
+ */
+static int
+otpkey_bulk_genkey(int argc, char *argv[])
+{
+	oath_mode mode;
+
+	if (argc != 1)
+		return (RET_USAGE);
+	if ((mode = oath_mode_value(argv[0])) == om_undef)
+		return (RET_USAGE);
+	return (otpkey_bulk(mode));
+}
+
+/*
+ * Import keys from a list of otpauth URIs read from stdin
+ */
+static int
+otpkey_bulk_import(int argc, char *argv[])
+{
+
+	if (argc != 0)
+		return (RET_USAGE);
+	(void)argv;
+	return (otpkey_bulk(om_undef));
+}
+
 /*
  * Print usage string and exit.
  */
@@ -397,20 +1049,31 @@ static void
 usage(void)
 {
 	fprintf(stderr,
-	    "usage: otpkey [-hnrvw] [-u user] [-k keyfile] command\n"
+	    "usage: otpkey [-hnrvw] [-j jobs] [-u user] [-k keyfile] command\n"
+	    "       otpkey [-rvw] [-j jobs] [-s store] bulk-command\n"
 	    "\n"
 	    "Commands:\n"
 	    "    calc [count]\n"
             "                Print the next code(s)\n"
+	    "    calc --from start [--to end | count]\n"
+	    "                Print the codes for a range of counters or times\n"
+	    "    export-uri  Convert the key file to otpauth URI form\n"
 	    "    genkey hotp | totp\n"
 	    "                Generate a new key\n"
 	    "    getkey      Print the key in hexadecimal form\n"
 	    "    geturi      Print the key in otpauth URI form\n"
-	    "    resync code1 code2 [code3]\n"
-	    "                Resynchronize an HOTP token\n"
+	    "    import-uri  Convert the key file to binary form\n"
+	    "    resync [--deep depth] code1 code2 [code3]\n"
+	    "                Resynchronize an HOTP token; a depth over\n"
+	    "                1,000,000 requires three codes\n"
 	    "    setkey      Generate a new key\n"
 	    "    verify code\n"
-	    "                Verify an HOTP or TOTP code\n");
+	    "                Verify an HOTP or TOTP code\n"
+	    "\n"
+	    "Bulk commands (read from stdin, write URIs to stdout):\n"
+	    "    bulk-genkey hotp | totp\n"
+	    "                Generate keys for a list of users\n"
+	    "    bulk-import Import a list of [user] otpauth URIs\n");
 	exit(1);
 }
 
@@ -418,14 +1081,26 @@ int
 main(int argc, char *argv[])
 {
 	struct passwd *pw;
+	unsigned long n;
+	long ncpu;
 	int opt, ret;
-	char *cmd;
+	char *cmd, *end;
 
 	/*
-	 * Parse command-line options
+	 * Parse command-line options.  The leading + stops GNU getopt
+	 * from permuting the command's own options, such as calc --from,
+	 * into ours; other implementations already stop at the first
+	 * non-option argument.
 	 */
-	while ((opt = getopt(argc, argv, "hk:nru:vw")) != -1)
+	while ((opt = getopt(argc, argv, "+hj:k:nrs:u:vw")) != -1)
 		switch (opt) {
+		case 'j':
+			n = strtoul(optarg, &end, 10);
+			if (end == optarg || *end != '\0' || n < 1 ||
+			    n > BULK_MAXJOBS)
+				usage();
+			njobs = n;
+			break;
 		case 'k':
 			keyfile = optarg;
 			break;
@@ -435,6 +1110,9 @@ main(int argc, char *argv[])
 		case 'r':
 			readonly = 1;
 			break;
+		case 's':
+			storepath = optarg;
+			break;
 		case 'u':
 			user = optarg;
 			break;
@@ -456,6 +1134,12 @@ main(int argc, char *argv[])
 		usage();
 	cmd = *argv++;
 
+	if (njobs == 0) {
+		if ((ncpu = sysconf(_SC_NPROCESSORS_ONLN)) < 1)
+			ncpu = 1;
+		njobs = ncpu > BULK_MAXJOBS ? BULK_MAXJOBS : ncpu;
+	}
+
 	/*
 	 * Check whether we are (really!) root.
 	 */
@@ -499,14 +1183,22 @@ main(int argc, char *argv[])
 	 */
 	if (strcmp(cmd, "help") == 0)
 		ret = RET_USAGE;
+	else if (strcmp(cmd, "bulk-genkey") == 0)
+		ret = otpkey_bulk_genkey(argc, argv);
+	else if (strcmp(cmd, "bulk-import") == 0)
+		ret = otpkey_bulk_import(argc, argv);
 	else if (strcmp(cmd, "calc") == 0)
 		ret = otpkey_calc(argc, argv);
+	else if (strcmp(cmd, "export-uri") == 0)
+		ret = otpkey_export_uri(argc, argv);
 	else if (strcmp(cmd, "genkey") == 0)
 		ret = otpkey_genkey(argc, argv);
 	else if (strcmp(cmd, "getkey") == 0)
 		ret = otpkey_getkey(argc, argv);
 	else if (strcmp(cmd, "geturi") == 0 || strcmp(cmd, "uri") == 0)
 		ret = otpkey_geturi(argc, argv);
+	else if (strcmp(cmd, "import-uri") == 0)
+		ret = otpkey_import_uri(argc, argv);
 	else if (strcmp(cmd, "resync") == 0)
 		ret = otpkey_resync(argc, argv);
 	else if (strcmp(cmd, "setkey") == 0)
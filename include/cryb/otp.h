@@ -38,11 +38,387 @@ CRYB_BEGIN
 
 const char *cryb_otp_version(void);
 
+#define otp_wipe		cryb_otp_wipe
+
+void otp_wipe(void *, size_t);
+
+#define otp_simd_select		cryb_otp_simd_select
+#define otp_simd_name		cryb_otp_simd_name
+
+int otp_simd_select(const char *);
+const char *otp_simd_name(void);
+
+/*
+ * Verification policy.  HOTP codes are accepted up to hotp_lookahead
+ * codes ahead of the counter.  TOTP codes are accepted from
+ * totp_lookbehind time steps before to totp_lookahead time steps after
+ * the current time step plus totp_skew.  Resynchronization searches at
+ * most resync_window counter values.  With OTP_POLICY_CONSTTIME, the
+ * whole window is computed and compared every time, so the cost of a
+ * verification does not reveal whether or where the response matched.
+ */
+typedef struct otp_policy {
+	unsigned int		 hotp_lookahead;
+	unsigned int		 totp_lookahead;
+	unsigned int		 totp_lookbehind;
+	int			 totp_skew;
+	unsigned int		 resync_window;
+	unsigned int		 flags;
+} otp_policy;
+
+#define OTP_POLICY_CONSTTIME	0x0001	/* constant-time window matching */
+
+#define otp_policy_init		cryb_otp_policy_init
+
+void otp_policy_init(otp_policy *);
+
+/*
+ * Key file formats, and where and why otp_key_parse() or otp_key_load()
+ * rejected a key.
+ */
+#define OTP_KEYFMT_URI		0	/* otpauth URI */
+#define OTP_KEYFMT_BINARY	1	/* fixed-size binary record */
+
+typedef struct otp_uri_error {
+	size_t			 offset;
+	const char		*msg;
+} otp_uri_error;
+
+#define otp_key_destroy		cryb_otp_key_destroy
+#define otp_key_parse		cryb_otp_key_parse
+#define otp_key_load		cryb_otp_key_load
+#define otp_key_to_binary	cryb_otp_key_to_binary
+#define otp_key_update		cryb_otp_key_update
+#define otp_key_refresh		cryb_otp_key_refresh
+#define otp_key_to_wire		cryb_otp_key_to_wire
+#define otp_key_from_wire	cryb_otp_key_from_wire
+#define otp_calc		cryb_otp_calc
+#define otp_generate_range	cryb_otp_generate_range
 #define otp_verify		cryb_otp_verify
+#define otp_verify_policy	cryb_otp_verify_policy
+#define otp_verify_shared	cryb_otp_verify_shared
+#define otp_verify_batch	cryb_otp_verify_batch
 #define otp_resync		cryb_otp_resync
+#define otp_resync_policy	cryb_otp_resync_policy
+#define otp_resync_range	cryb_otp_resync_range
+#define otp_resync_deep		cryb_otp_resync_deep
 
+void otp_key_destroy(oath_key *);
+int otp_key_parse(oath_key *, const char *, size_t, otp_uri_error *);
+int otp_key_load(oath_key *, int, otp_uri_error *);
+int otp_key_to_binary(const oath_key *, void *, size_t *);
+int otp_key_update(const oath_key *, int);
+int otp_key_refresh(oath_key *, int);
+int otp_key_to_wire(const oath_key *, void *, size_t *);
+int otp_key_from_wire(oath_key *, const void *, size_t);
+unsigned int otp_calc(oath_key *);
+int otp_generate_range(const oath_key *, uint64_t, unsigned int,
+    unsigned int *);
 int otp_verify(oath_key *, unsigned long);
+int otp_verify_policy(oath_key *, unsigned long, const otp_policy *);
+int otp_verify_shared(oath_key *, unsigned long, const otp_policy *);
+int otp_verify_batch(oath_key **, const unsigned long *, int *, size_t);
 int otp_resync(oath_key *, unsigned long *, unsigned int);
+int otp_resync_policy(oath_key *, const unsigned long *, unsigned int,
+    const otp_policy *);
+int otp_resync_range(oath_key *, const unsigned long *, unsigned int,
+    unsigned int);
+int otp_resync_deep(oath_key *, const unsigned long *, unsigned int,
+    unsigned int, unsigned int);
+
+#define otp_user_lock		cryb_otp_user_lock
+#define otp_user_unlock		cryb_otp_user_unlock
+
+void otp_user_lock(const char *);
+void otp_user_unlock(const char *);
+
+typedef struct otp_store otp_store;
+typedef struct otp_repl otp_repl;
+typedef struct otp_replay otp_replay;
+typedef struct otp_throttle otp_throttle;
+typedef struct otp_wal otp_wal;
+
+#define otp_replay_create	cryb_otp_replay_create
+#define otp_replay_destroy	cryb_otp_replay_destroy
+#define otp_verify_replay	cryb_otp_verify_replay
+
+otp_replay *otp_replay_create(unsigned int);
+void otp_replay_destroy(otp_replay *);
+int otp_verify_replay(oath_key *, unsigned long, const otp_policy *,
+    otp_replay *, const char *);
+
+#define otp_throttle_create	cryb_otp_throttle_create
+#define otp_throttle_destroy	cryb_otp_throttle_destroy
+#define otp_verify_throttle	cryb_otp_verify_throttle
+
+otp_throttle *otp_throttle_create(unsigned int, unsigned int, unsigned int);
+void otp_throttle_destroy(otp_throttle *);
+int otp_verify_throttle(oath_key *, unsigned long, const otp_policy *,
+    otp_throttle *, const char *);
+
+#define otp_store_open		cryb_otp_store_open
+#define otp_store_lookup	cryb_otp_store_lookup
+#define otp_store_update	cryb_otp_store_update
+#define otp_store_update_batch	cryb_otp_store_update_batch
+#define otp_store_remove	cryb_otp_store_remove
+#define otp_store_next		cryb_otp_store_next
+#define otp_store_verify	cryb_otp_store_verify
+#define otp_store_resync	cryb_otp_store_resync
+#define otp_store_import	cryb_otp_store_import
+#define otp_store_policy	cryb_otp_store_policy
+#define otp_store_set_policy	cryb_otp_store_set_policy
+#define otp_store_set_wal	cryb_otp_store_set_wal
+#define otp_store_set_throttle	cryb_otp_store_set_throttle
+#define otp_store_set_replay	cryb_otp_store_set_replay
+#define otp_store_set_repl	cryb_otp_store_set_repl
+#define otp_store_close		cryb_otp_store_close
+
+otp_store *otp_store_open(const char *, int);
+int otp_store_lookup(otp_store *, const char *, oath_key *);
+int otp_store_update(otp_store *, const char *, const oath_key *);
+int otp_store_update_batch(otp_store *, const char *const *,
+    const oath_key *const *, size_t);
+int otp_store_remove(otp_store *, const char *, const oath_key *);
+int otp_store_next(otp_store *, uint32_t *, char *, size_t);
+int otp_store_verify(otp_store *, const char *, unsigned long);
+int otp_store_resync(otp_store *, const char *, const unsigned long *,
+    unsigned int);
+int otp_store_import(otp_store *, const char *, const char *);
+int otp_store_policy(otp_store *, const char *, otp_policy *);
+int otp_store_set_policy(otp_store *, const char *, const otp_policy *);
+int otp_store_set_wal(otp_store *, otp_wal *);
+int otp_store_set_throttle(otp_store *, otp_throttle *);
+int otp_store_set_replay(otp_store *, otp_replay *);
+int otp_store_set_repl(otp_store *, otp_repl *);
+void otp_store_close(otp_store *);
+
+/*
+ * Batched key file I/O.
+ */
+typedef struct otp_keyio otp_keyio;
+
+#define OTP_KEYIO_POSIX		0x0001	/* do not use io_uring */
+
+#define otp_keyio_create	cryb_otp_keyio_create
+#define otp_keyio_backend	cryb_otp_keyio_backend
+#define otp_keyio_register	cryb_otp_keyio_register
+#define otp_keyio_load		cryb_otp_keyio_load
+#define otp_keyio_update	cryb_otp_keyio_update
+#define otp_keyio_destroy	cryb_otp_keyio_destroy
+
+otp_keyio *otp_keyio_create(unsigned int, unsigned int, int);
+const char *otp_keyio_backend(const otp_keyio *);
+int otp_keyio_register(otp_keyio *, const char *);
+int otp_keyio_load(otp_keyio *, const char *const *, oath_key *, int *,
+    size_t);
+int otp_keyio_update(otp_keyio *, const char *const *, const oath_key *,
+    int *, size_t);
+void otp_keyio_destroy(otp_keyio *);
+
+/*
+ * Asynchronous verification against a store.  The callback receives
+ * the caller's argument, the return value of otp_store_verify(), and
+ * the error it set, if any.
+ */
+typedef struct otp_async otp_async;
+typedef void (*otp_async_cb)(void *, int, int);
+
+#define OTP_ASYNC_WORKER	0x0001	/* run callbacks on worker threads */
+
+#define otp_async_create	cryb_otp_async_create
+#define otp_async_fd		cryb_otp_async_fd
+#define otp_async_verify	cryb_otp_async_verify
+#define otp_async_complete	cryb_otp_async_complete
+#define otp_async_destroy	cryb_otp_async_destroy
+
+otp_async *otp_async_create(otp_store *const *, unsigned int, unsigned int,
+    int);
+int otp_async_fd(const otp_async *);
+int otp_async_verify(otp_async *, const char *, unsigned long,
+    otp_async_cb, void *);
+int otp_async_complete(otp_async *);
+void otp_async_destroy(otp_async *);
+
+typedef struct otp_stats otp_stats;
+
+#define otp_stats_enable	cryb_otp_stats_enable
+#define otp_stats_snapshot	cryb_otp_stats_snapshot
+#define otp_stats_export	cryb_otp_stats_export
+#define otp_stats_free		cryb_otp_stats_free
+
+void otp_stats_enable(int);
+otp_stats *otp_stats_snapshot(void);
+int otp_stats_export(const otp_stats *, int);
+void otp_stats_free(otp_stats *);
+
+#define otp_wal_open		cryb_otp_wal_open
+#define otp_wal_checkpoint	cryb_otp_wal_checkpoint
+#define otp_wal_close		cryb_otp_wal_close
+
+otp_wal *otp_wal_open(const char *, const char *);
+int otp_wal_checkpoint(otp_wal *);
+void otp_wal_close(otp_wal *);
+
+/*
+ * Shared-secret authentication for connections between hosts.  The
+ * side which accepts a connection sends a random nonce, and the side
+ * which initiated it answers with one of its own.  A session key is
+ * derived from the shared secret and both nonces, and every message
+ * in either direction is followed by a truncated HMAC-SHA256 tag over
+ * its direction, its sequence number within the connection, and its
+ * contents, so messages cannot be forged, altered, reordered, or
+ * replayed in another connection.
+ */
+#define OTP_AUTH_NONCELEN	16
+#define OTP_AUTH_TAGLEN		16
+#define OTP_AUTH_MINSECRET	16	/* shortest acceptable secret */
+
+#define OTP_AUTH_INITIATOR	0
+#define OTP_AUTH_ACCEPTOR	1
+
+typedef struct otp_secret otp_secret;
+typedef struct otp_auth otp_auth;
+
+#define otp_secret_load		cryb_otp_secret_load
+#define otp_secret_free		cryb_otp_secret_free
+#define otp_auth_nonce		cryb_otp_auth_nonce
+#define otp_auth_create		cryb_otp_auth_create
+#define otp_auth_sign		cryb_otp_auth_sign
+#define otp_auth_check		cryb_otp_auth_check
+#define otp_auth_destroy	cryb_otp_auth_destroy
+
+otp_secret *otp_secret_load(const char *);
+void otp_secret_free(otp_secret *);
+int otp_auth_nonce(void *);
+otp_auth *otp_auth_create(const otp_secret *, const void *, const void *,
+    int);
+void otp_auth_sign(otp_auth *, const void *, size_t, void *);
+int otp_auth_check(otp_auth *, const void *, size_t, const void *);
+void otp_auth_destroy(otp_auth *);
+
+#define OTP_REPL_MAXPEERS	32	/* peers per replicator */
+
+#define otp_repl_create		cryb_otp_repl_create
+#define otp_repl_start		cryb_otp_repl_start
+#define otp_repl_destroy	cryb_otp_repl_destroy
+
+otp_repl *otp_repl_create(const char *, const otp_secret *, const char *,
+    const char *const *, unsigned int);
+int otp_repl_start(otp_repl *);
+void otp_repl_destroy(otp_repl *);
+
+/*
+ * otpd protocol.  Every message starts with an eight-byte header: the
+ * protocol version, the operation (in a request) or status (in a
+ * response), the length of the payload which follows, and a tag which
+ * the daemon copies from each request to its response.  The payload
+ * of a request consists of the length of the user name, the user name,
+ * the number of responses, and the responses.  Responses have no
+ * payload.  Multi-byte integers are in network byte order.  A client
+ * may send any number of requests without waiting; they are answered
+ * in order.
+ *
+ * The daemon can also be told to accept key migration requests, which
+ * are used to move keys between shards.  A list request carries a
+ * four-byte cursor, and its response carries the next cursor followed
+ * by zero or more user names, each preceded by its length; no names
+ * means the end has been reached.  An export request carries a user
+ * name, preceded by its length, and its response carries the user's
+ * key.  Import and remove requests carry a user name, preceded by its
+ * length, followed by a key; the key replaces the user's key, or is
+ * what the user's key must still be for it to be removed.  Keys are
+ * encoded with otp_key_to_wire(), in network byte order, so they can
+ * be moved between hosts with different byte orders.
+ *
+ * If the daemon has a shared secret, which it must have to listen on
+ * TCP, connections are authenticated: before anything else, the nonces
+ * are exchanged as described above for otp_auth, and every request and
+ * response is then followed by its tag, which is not included in the
+ * length in the header.  A request with a bad tag causes the daemon to
+ * drop the connection.
+ */
+#define OTPD_SOCKET		"/var/run/otpd.sock"
+#define OTPD_VERSION		1
+#define OTPD_HDRLEN		8
+#define OTPD_MAXUSERLEN		63
+#define OTPD_MAXRESPONSES	8
+#define OTPD_MAXLEN		(OTPD_HDRLEN + 1 + OTPD_MAXUSERLEN + 1 + \
+				    4 * OTPD_MAXRESPONSES)
+#define OTPD_MAXBODY		4096	/* largest payload of any kind */
+
+#define OTPD_VERIFY		1	/* otp_store_verify() */
+#define OTPD_RESYNC		2	/* otp_store_resync() */
+#define OTPD_LIST		3	/* otp_store_next() */
+#define OTPD_EXPORT		4	/* otp_store_lookup() */
+#define OTPD_IMPORT		5	/* otp_store_update() */
+#define OTPD_REMOVE		6	/* otp_store_remove() */
+
+#define OTPD_REJECT		0
+#define OTPD_ACCEPT		1
+#define OTPD_NOKEY		2	/* user has no key */
+#define OTPD_INVALID		3	/* malformed request */
+#define OTPD_ERROR		4	/* internal error */
+#define OTPD_CHANGED		5	/* key changed, not removed */
+
+typedef struct otp_client otp_client;
+
+#define otp_client_open		cryb_otp_client_open
+#define otp_client_auth		cryb_otp_client_auth
+#define otp_client_verify	cryb_otp_client_verify
+#define otp_client_resync	cryb_otp_client_resync
+#define otp_client_verify_batch	cryb_otp_client_verify_batch
+#define otp_client_close	cryb_otp_client_close
+
+otp_client *otp_client_open(const char *);
+int otp_client_auth(otp_client *, const otp_secret *);
+int otp_client_verify(otp_client *, const char *, unsigned long);
+int otp_client_resync(otp_client *, const char *, const unsigned long *,
+    unsigned int);
+int otp_client_verify_batch(otp_client *, const char **,
+    const unsigned long *, int *, size_t);
+void otp_client_close(otp_client *);
+
+/*
+ * Sharded key store.  Users are partitioned across a number of otpd
+ * instances by consistent hashing, and requests are sent to the
+ * instance which owns the user.
+ */
+typedef struct otp_shardmap otp_shardmap;
+typedef struct otp_shard otp_shard;
+
+#define OTP_SHARD_DRYRUN	0x0001	/* count keys, do not move them */
+
+#define otp_shardmap_create	cryb_otp_shardmap_create
+#define otp_shardmap_load	cryb_otp_shardmap_load
+#define otp_shardmap_add	cryb_otp_shardmap_add
+#define otp_shardmap_count	cryb_otp_shardmap_count
+#define otp_shardmap_owner	cryb_otp_shardmap_owner
+#define otp_shardmap_name	cryb_otp_shardmap_name
+#define otp_shardmap_addr	cryb_otp_shardmap_addr
+#define otp_shardmap_set_secret	cryb_otp_shardmap_set_secret
+#define otp_shardmap_destroy	cryb_otp_shardmap_destroy
+#define otp_shard_open		cryb_otp_shard_open
+#define otp_shard_verify	cryb_otp_shard_verify
+#define otp_shard_resync	cryb_otp_shard_resync
+#define otp_shard_rebalance	cryb_otp_shard_rebalance
+#define otp_shard_close		cryb_otp_shard_close
+
+otp_shardmap *otp_shardmap_create(void);
+otp_shardmap *otp_shardmap_load(const char *, unsigned long *);
+int otp_shardmap_add(otp_shardmap *, const char *, const char *,
+    unsigned int);
+unsigned int otp_shardmap_count(const otp_shardmap *);
+int otp_shardmap_owner(const otp_shardmap *, const char *);
+const char *otp_shardmap_name(const otp_shardmap *, unsigned int);
+const char *otp_shardmap_addr(const otp_shardmap *, unsigned int);
+int otp_shardmap_set_secret(otp_shardmap *, const otp_secret *);
+void otp_shardmap_destroy(otp_shardmap *);
+otp_shard *otp_shard_open(const otp_shardmap *);
+int otp_shard_verify(otp_shard *, const char *, unsigned long);
+int otp_shard_resync(otp_shard *, const char *, const unsigned long *,
+    unsigned int);
+long otp_shard_rebalance(const otp_shardmap *, const otp_shardmap *, int);
+void otp_shard_close(otp_shard *);
 
 CRYB_END
 
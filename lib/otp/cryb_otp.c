@@ -43,3 +43,15 @@ cryb_otp_version(void)
 
 	return (cryb_otp_version_string);
 }
+
+/*
+ * Overwrite sensitive data in a way the compiler will not elide.
+ */
+void
+otp_wipe(void *buf, size_t len)
+{
+	volatile uint8_t *p;
+
+	for (p = buf; len > 0; --len)
+		*p++ = 0;
+}
@@ -0,0 +1,258 @@
+/*-
+ * Copyright (c) 2026 Dag-Erling Smørgrav
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "cryb/impl.h"
+
+#include <sys/eventfd.h>
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <cryb/oath.h>
+#include <cryb/otp.h>
+
+#include "cryb_otp_impl.h"
+
+/*
+ * Asynchronous verification.  Requests are queued and served by a
+ * pool of worker threads, each of which does the key lookup, HMAC
+ * computation and counter update through otp_store_verify().
+ *
+ * Unless OTP_ASYNC_WORKER was specified, completed requests go on a
+ * second list and the eventfd returned by otp_async_fd() is
+ * signalled.  The caller polls that descriptor alongside its own and
+ * calls otp_async_complete() when it becomes readable, which runs the
+ * callbacks in the caller's thread.  Either way, any number of
+ * requests can be outstanding without tying up a caller thread each.
+ */
+
+static void *
+otp_async_worker(void *arg)
+{
+	struct otp_async_worker *w = arg;
+	otp_async *as = w->as;
+	struct otp_async_req *req;
+	int signal;
+
+	pthread_mutex_lock(&as->mtx);
+	for (;;) {
+		while (as->pending == NULL && !as->stopping)
+			pthread_cond_wait(&as->cv, &as->mtx);
+		if ((req = as->pending) == NULL)
+			break;
+		if ((as->pending = req->next) == NULL)
+			as->ptail = &as->pending;
+		pthread_mutex_unlock(&as->mtx);
+		req->next = NULL;
+		req->result = otp_store_verify(w->st, req->user,
+		    req->response);
+		req->error = req->result < 0 ? errno : 0;
+		if (as->flags & OTP_ASYNC_WORKER) {
+			req->cb(req->arg, req->result, req->error);
+			free(req);
+			pthread_mutex_lock(&as->mtx);
+			as->nqueued--;
+			continue;
+		}
+		pthread_mutex_lock(&as->mtx);
+		/* only the first completion in a batch needs to signal */
+		signal = as->done == NULL;
+		*as->dtail = req;
+		as->dtail = &req->next;
+		if (signal)
+			(void)eventfd_write(as->efd, 1);
+	}
+	pthread_mutex_unlock(&as->mtx);
+	return (NULL);
+}
+
+/*
+ * Create an asynchronous verifier with nthreads worker threads and at
+ * most maxqueue requests outstanding.  Each worker uses the
+ * corresponding entry in st[], which must be a separate handle on the
+ * store: a handle's locks and mapping are not safe to share between
+ * threads, so the same handle must not appear twice, nor be used by
+ * the caller until the verifier is destroyed.  The handles remain the
+ * caller's and must stay open until then.
+ */
+otp_async *
+otp_async_create(otp_store *const *st, unsigned int nthreads,
+    unsigned int maxqueue, int flags)
+{
+	otp_async *as;
+	unsigned int i;
+	int serrno;
+
+	if (maxqueue == 0)
+		maxqueue = OTP_ASYNC_MAXQUEUE;
+	if (nthreads == 0 || (flags & ~OTP_ASYNC_WORKER) != 0) {
+		errno = EINVAL;
+		return (NULL);
+	}
+	if ((as = calloc(1, sizeof *as)) == NULL)
+		return (NULL);
+	as->flags = flags;
+	as->maxqueue = maxqueue;
+	as->ptail = &as->pending;
+	as->dtail = &as->done;
+	as->efd = -1;
+	pthread_mutex_init(&as->mtx, NULL);
+	pthread_cond_init(&as->cv, NULL);
+	if ((as->efd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC)) < 0)
+		goto fail;
+	if ((as->workers = calloc(nthreads, sizeof *as->workers)) == NULL)
+		goto fail;
+	for (i = 0; i < nthreads; ++i) {
+		as->workers[i].as = as;
+		as->workers[i].st = st[i];
+	}
+	for (as->nthreads = 0; as->nthreads < nthreads; as->nthreads++) {
+		if ((errno = pthread_create(&as->workers[as->nthreads].thr,
+		    NULL, otp_async_worker, &as->workers[as->nthreads])) != 0)
+			goto fail;
+	}
+	return (as);
+fail:
+	serrno = errno;
+	otp_async_destroy(as);
+	errno = serrno;
+	return (NULL);
+}
+
+/*
+ * Return a descriptor which becomes readable when completed requests
+ * are waiting for otp_async_complete().
+ */
+int
+otp_async_fd(const otp_async *as)
+{
+
+	return (as->efd);
+}
+
+/*
+ * Queue a verification request.  The callback will be called with the
+ * return value of otp_store_verify() and, if that was -1, the error it
+ * set.  Returns 0 if the request was queued, and -1 with errno set to
+ * EAGAIN if too many requests are outstanding or to EINVAL if the user
+ * name is too long.
+ */
+int
+otp_async_verify(otp_async *as, const char *user, unsigned long response,
+    otp_async_cb cb, void *arg)
+{
+	struct otp_async_req *req;
+	size_t len;
+
+	if ((len = strlen(user)) >= sizeof req->user) {
+		errno = EINVAL;
+		return (-1);
+	}
+	if ((req = malloc(sizeof *req)) == NULL)
+		return (-1);
+	req->next = NULL;
+	req->cb = cb;
+	req->arg = arg;
+	req->response = response;
+	memcpy(req->user, user, len + 1);
+	pthread_mutex_lock(&as->mtx);
+	if (as->nqueued >= as->maxqueue || as->stopping) {
+		pthread_mutex_unlock(&as->mtx);
+		free(req);
+		errno = EAGAIN;
+		return (-1);
+	}
+	as->nqueued++;
+	*as->ptail = req;
+	as->ptail = &req->next;
+	pthread_cond_signal(&as->cv);
+	pthread_mutex_unlock(&as->mtx);
+	return (0);
+}
+
+/*
+ * Run the callbacks for all completed requests.  Returns the number of
+ * callbacks run.
+ */
+int
+otp_async_complete(otp_async *as)
+{
+	struct otp_async_req *req, *next;
+	eventfd_t n;
+	int count;
+
+	(void)eventfd_read(as->efd, &n);
+	pthread_mutex_lock(&as->mtx);
+	req = as->done;
+	as->done = NULL;
+	as->dtail = &as->done;
+	pthread_mutex_unlock(&as->mtx);
+	for (count = 0; req != NULL; req = next, ++count) {
+		next = req->next;
+		req->cb(req->arg, req->result, req->error);
+		free(req);
+	}
+	if (count > 0) {
+		pthread_mutex_lock(&as->mtx);
+		as->nqueued -= count;
+		pthread_mutex_unlock(&as->mtx);
+	}
+	return (count);
+}
+
+/*
+ * Wait for all outstanding requests to be served, run their callbacks
+ * if that has not already happened, and destroy the verifier.
+ */
+void
+otp_async_destroy(otp_async *as)
+{
+	unsigned int i;
+
+	if (as == NULL)
+		return;
+	pthread_mutex_lock(&as->mtx);
+	as->stopping = 1;
+	pthread_cond_broadcast(&as->cv);
+	pthread_mutex_unlock(&as->mtx);
+	for (i = 0; i < as->nthreads; ++i)
+		pthread_join(as->workers[i].thr, NULL);
+	if (as->efd >= 0) {
+		(void)otp_async_complete(as);
+		close(as->efd);
+	}
+	pthread_cond_destroy(&as->cv);
+	pthread_mutex_destroy(&as->mtx);
+	free(as->workers);
+	free(as);
+}
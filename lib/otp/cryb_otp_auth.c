@@ -0,0 +1,335 @@
+/*-
+ * Copyright (c) 2026 Dag-Erling Smørgrav
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "cryb/impl.h"
+
+#include <sys/types.h>
+#include <sys/random.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <cryb/endian.h>
+#include <cryb/oath.h>
+#include <cryb/otp.h>
+
+#include "cryb_otp_impl.h"
+
+/*
+ * Shared-secret authentication.  All of it is HMAC-SHA256, built on
+ * the bare compression function, starting from the state after the
+ * inner and outer key pads, which is computed once per secret and once
+ * per session.
+ */
+
+#define OTP_AUTH_LABEL		"cryb-otp auth 1"
+#define OTP_AUTH_MAXSECRET	1024
+
+struct otp_sha256 {
+	uint32_t		 h[8];
+	uint8_t			 blk[64];
+	size_t			 blen;
+	uint64_t		 total;
+};
+
+static void
+otp_sha256_update(struct otp_sha256 *ctx, const void *data, size_t len)
+{
+	const uint8_t *p = data;
+	size_t n;
+
+	ctx->total += len;
+	while (len > 0) {
+		n = sizeof ctx->blk - ctx->blen;
+		if (n > len)
+			n = len;
+		memcpy(ctx->blk + ctx->blen, p, n);
+		ctx->blen += n;
+		p += n;
+		len -= n;
+		if (ctx->blen == sizeof ctx->blk) {
+			otp_sha256_block(ctx->h, ctx->blk);
+			ctx->blen = 0;
+		}
+	}
+}
+
+static void
+otp_sha256_final(struct otp_sha256 *ctx, uint8_t *md)
+{
+	static const uint8_t zero[64] = { 0x80 };
+	uint8_t len[8];
+	unsigned int i;
+
+	be64enc(len, ctx->total * 8);
+	otp_sha256_update(ctx, zero, ctx->blen < 56 ?
+	    56 - ctx->blen : 120 - ctx->blen);
+	otp_sha256_update(ctx, len, sizeof len);
+	for (i = 0; i < 8; ++i)
+		be32enc(md + 4 * i, ctx->h[i]);
+	otp_wipe(ctx, sizeof *ctx);
+}
+
+/*
+ * Precompute the inner and outer states for an HMAC key.
+ */
+static void
+otp_mac_init(struct otp_mac *mac, const uint8_t *key, size_t len)
+{
+	struct otp_sha256 ctx;
+	uint8_t k[64], pad[64];
+	unsigned int i, j;
+
+	memset(k, 0, sizeof k);
+	if (len > sizeof k) {
+		memcpy(ctx.h, otp_sha256_iv, sizeof ctx.h);
+		ctx.blen = 0;
+		ctx.total = 0;
+		otp_sha256_update(&ctx, key, len);
+		otp_sha256_final(&ctx, k);
+	} else {
+		memcpy(k, key, len);
+	}
+	for (i = 0; i < 2; ++i) {
+		for (j = 0; j < sizeof pad; ++j)
+			pad[j] = k[j] ^ (i == 0 ? 0x36 : 0x5c);
+		memcpy(mac->h[i], otp_sha256_iv, sizeof mac->h[i]);
+		otp_sha256_block(mac->h[i], pad);
+	}
+	otp_wipe(k, sizeof k);
+	otp_wipe(pad, sizeof pad);
+}
+
+static void
+otp_mac_start(struct otp_sha256 *ctx, const struct otp_mac *mac)
+{
+
+	memcpy(ctx->h, mac->h[0], sizeof ctx->h);
+	ctx->blen = 0;
+	ctx->total = sizeof ctx->blk;
+}
+
+static void
+otp_mac_finish(struct otp_sha256 *ctx, const struct otp_mac *mac,
+    uint8_t *md)
+{
+	uint8_t imd[32];
+
+	otp_sha256_final(ctx, imd);
+	memcpy(ctx->h, mac->h[1], sizeof ctx->h);
+	ctx->blen = 0;
+	ctx->total = sizeof ctx->blk;
+	otp_sha256_update(ctx, imd, sizeof imd);
+	otp_sha256_final(ctx, md);
+	otp_wipe(imd, sizeof imd);
+}
+
+/*
+ * Load a shared secret from a file.  Trailing line breaks are ignored,
+ * so the secret may be a line of text, but what remains must be at
+ * least OTP_AUTH_MINSECRET bytes long.  Returns NULL with errno set on
+ * error.
+ */
+otp_secret *
+otp_secret_load(const char *path)
+{
+	uint8_t buf[OTP_AUTH_MAXSECRET + 1];
+	otp_secret *secret;
+	ssize_t rlen;
+	size_t len;
+	int fd, serrno;
+
+	if ((fd = open(path, O_RDONLY|O_CLOEXEC)) < 0)
+		return (NULL);
+	for (len = 0; len < sizeof buf; len += rlen) {
+		if ((rlen = read(fd, buf + len, sizeof buf - len)) < 0) {
+			if (errno == EINTR) {
+				rlen = 0;
+				continue;
+			}
+			serrno = errno;
+			close(fd);
+			otp_wipe(buf, sizeof buf);
+			errno = serrno;
+			return (NULL);
+		}
+		if (rlen == 0)
+			break;
+	}
+	close(fd);
+	while (len > 0 && (buf[len - 1] == '\n' || buf[len - 1] == '\r'))
+		len--;
+	secret = NULL;
+	if (len < OTP_AUTH_MINSECRET || len > OTP_AUTH_MAXSECRET)
+		errno = EINVAL;
+	else if ((secret = calloc(1, sizeof *secret)) != NULL)
+		otp_mac_init(&secret->mac, buf, len);
+	otp_wipe(buf, sizeof buf);
+	return (secret);
+}
+
+/*
+ * Wipe and free a shared secret.
+ */
+void
+otp_secret_free(otp_secret *secret)
+{
+
+	if (secret == NULL)
+		return;
+	otp_wipe(secret, sizeof *secret);
+	free(secret);
+}
+
+/*
+ * Fill a buffer with OTP_AUTH_NONCELEN random bytes.  Returns 0 on
+ * success and -1 on error.
+ */
+int
+otp_auth_nonce(void *buf)
+{
+	uint8_t *p = buf;
+	ssize_t rlen;
+	size_t len;
+
+	for (len = 0; len < OTP_AUTH_NONCELEN; len += rlen) {
+		if ((rlen = getrandom(p + len, OTP_AUTH_NONCELEN - len,
+		    0)) < 0) {
+			if (errno != EINTR)
+				return (-1);
+			rlen = 0;
+		}
+	}
+	return (0);
+}
+
+/*
+ * Set up an authenticated session from the shared secret, the nonce
+ * sent by the acceptor, and the nonce sent by the initiator.  The role
+ * is either OTP_AUTH_INITIATOR or OTP_AUTH_ACCEPTOR.  Returns NULL
+ * with errno set on error.
+ */
+otp_auth *
+otp_auth_create(const otp_secret *secret, const void *anonce,
+    const void *inonce, int role)
+{
+	struct otp_sha256 ctx;
+	uint8_t key[32];
+	otp_auth *auth;
+
+	if (role != OTP_AUTH_INITIATOR && role != OTP_AUTH_ACCEPTOR) {
+		errno = EINVAL;
+		return (NULL);
+	}
+	if ((auth = calloc(1, sizeof *auth)) == NULL)
+		return (NULL);
+	otp_mac_start(&ctx, &secret->mac);
+	otp_sha256_update(&ctx, OTP_AUTH_LABEL, sizeof OTP_AUTH_LABEL);
+	otp_sha256_update(&ctx, anonce, OTP_AUTH_NONCELEN);
+	otp_sha256_update(&ctx, inonce, OTP_AUTH_NONCELEN);
+	otp_mac_finish(&ctx, &secret->mac, key);
+	otp_mac_init(&auth->mac, key, sizeof key);
+	otp_wipe(key, sizeof key);
+	auth->role = role;
+	return (auth);
+}
+
+/*
+ * Compute the tag for a message in a given direction.
+ */
+static void
+otp_auth_tag(const otp_auth *auth, int dir, uint64_t seq, const void *buf,
+    size_t len, uint8_t *md)
+{
+	struct otp_sha256 ctx;
+	uint8_t hdr[9];
+
+	hdr[0] = dir;
+	be64enc(hdr + 1, seq);
+	otp_mac_start(&ctx, &auth->mac);
+	otp_sha256_update(&ctx, hdr, sizeof hdr);
+	otp_sha256_update(&ctx, buf, len);
+	otp_mac_finish(&ctx, &auth->mac, md);
+}
+
+/*
+ * Compute the tag for the next message we send, and store it in tag,
+ * which must have room for OTP_AUTH_TAGLEN bytes.
+ */
+void
+otp_auth_sign(otp_auth *auth, const void *buf, size_t len, void *tag)
+{
+	uint8_t md[32];
+
+	otp_auth_tag(auth, auth->role, auth->sent++, buf, len, md);
+	memcpy(tag, md, OTP_AUTH_TAGLEN);
+	otp_wipe(md, sizeof md);
+}
+
+/*
+ * Check the tag of the next message we receive.  Returns 0 if it is
+ * correct and -1 with errno set to EBADMSG if it is not, in which case
+ * the connection should be dropped.
+ */
+int
+otp_auth_check(otp_auth *auth, const void *buf, size_t len,
+    const void *tag)
+{
+	const uint8_t *t = tag;
+	uint8_t md[32], diff;
+	unsigned int i;
+
+	otp_auth_tag(auth, !auth->role, auth->received, buf, len, md);
+	for (i = 0, diff = 0; i < OTP_AUTH_TAGLEN; ++i)
+		diff |= md[i] ^ t[i];
+	otp_wipe(md, sizeof md);
+	if (diff != 0) {
+		errno = EBADMSG;
+		return (-1);
+	}
+	auth->received++;
+	return (0);
+}
+
+/*
+ * Wipe and free an authenticated session.
+ */
+void
+otp_auth_destroy(otp_auth *auth)
+{
+
+	if (auth == NULL)
+		return;
+	otp_wipe(auth, sizeof *auth);
+	free(auth);
+}
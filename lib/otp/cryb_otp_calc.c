@@ -0,0 +1,102 @@
+/*-
+ * Copyright (c) 2026 Dag-Erling Smørgrav
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "cryb/impl.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#include <cryb/oath.h>
+#include <cryb/otp.h>
+
+#include "cryb_otp_impl.h"
+
+/*
+ * Compute the current code for a key and advance the key past it, like
+ * oath_hotp_current() and oath_totp_current() but using the cached HMAC
+ * state.  Returns UINT_MAX on error.
+ */
+unsigned int
+otp_calc(oath_key *key)
+{
+	const struct otp_hmac *hm;
+	unsigned int code;
+	uint64_t seq;
+
+	if ((hm = otp_hmac_get(key)) == NULL)
+		return (UINT_MAX);
+	switch (key->mode) {
+	case om_hotp:
+		if (key->counter == UINT64_MAX)
+			return (UINT_MAX);
+		code = otp_hmac_code(hm, key->counter);
+		key->counter++;
+		break;
+	case om_totp:
+		if (key->timestep == 0)
+			return (UINT_MAX);
+		seq = (uint64_t)time(NULL) / key->timestep;
+		code = otp_hmac_code(hm, seq);
+		if (seq > key->lastused)
+			key->lastused = seq;
+		break;
+	default:
+		code = UINT_MAX;
+	}
+	return (code);
+}
+
+/*
+ * Compute the codes for count consecutive counter values (HOTP) or time
+ * steps (TOTP), starting at start, without modifying the key.  Returns
+ * 0 on success and -1 with errno set to EINVAL if the key is invalid or
+ * the range extends past the end of the counter space.
+ */
+int
+otp_generate_range(const oath_key *key, uint64_t start, unsigned int count,
+    unsigned int *out)
+{
+	const struct otp_hmac *hm;
+
+	if ((key->mode != om_hotp && key->mode != om_totp) ||
+	    (key->mode == om_totp && key->timestep == 0) ||
+	    (count > 0 && start > UINT64_MAX - (count - 1))) {
+		errno = EINVAL;
+		return (-1);
+	}
+	if ((hm = otp_hmac_get(key)) == NULL) {
+		errno = EINVAL;
+		return (-1);
+	}
+	otp_hmac_codes(hm, start, count, out);
+	return (0);
+}
@@ -0,0 +1,657 @@
+/*-
+ * Copyright (c) 2026 Dag-Erling Smørgrav
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "cryb/impl.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include <errno.h>
+#include <netdb.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <cryb/endian.h>
+#include <cryb/oath.h>
+#include <cryb/otp.h>
+
+#include "cryb_otp_impl.h"
+
+/*
+ * Client side of the otpd protocol.  A client handle is a connection
+ * to the daemon; it must not be used by more than one thread at a
+ * time.  If the connection fails or the daemon violates the protocol,
+ * the connection is closed and all further calls fail with ENOTCONN.
+ * Connections over TCP must be authenticated with otp_client_auth()
+ * before they are used.
+ */
+
+/*
+ * Connect to a Unix socket.
+ */
+static int
+otp_client_connect_unix(const char *path)
+{
+	struct sockaddr_un sun;
+	int fd, serrno;
+
+	memset(&sun, 0, sizeof sun);
+	sun.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof sun.sun_path) {
+		errno = ENAMETOOLONG;
+		return (-1);
+	}
+	strcpy(sun.sun_path, path);
+	if ((fd = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0)) < 0)
+		return (-1);
+	if (connect(fd, (struct sockaddr *)&sun, sizeof sun) != 0) {
+		serrno = errno;
+		close(fd);
+		errno = serrno;
+		return (-1);
+	}
+	return (fd);
+}
+
+/*
+ * Split a TCP address of the form host:port, where the host may be
+ * enclosed in brackets, into its parts.  The host is left empty if it
+ * was omitted.  Returns 0 on success and -1 with errno set to EINVAL
+ * if the address is malformed or the host does not fit.
+ */
+int
+otp_addr_split(const char *addr, char *host, size_t size, const char **port)
+{
+	const char *p;
+	size_t len;
+
+	if (*addr == '[') {
+		if ((p = strchr(addr, ']')) == NULL || p[1] != ':') {
+			errno = EINVAL;
+			return (-1);
+		}
+		len = p++ - ++addr;
+	} else if ((p = strrchr(addr, ':')) != NULL) {
+		len = p - addr;
+	} else {
+		errno = EINVAL;
+		return (-1);
+	}
+	if (len >= size || *++p == '\0') {
+		errno = EINVAL;
+		return (-1);
+	}
+	memcpy(host, addr, len);
+	host[len] = '\0';
+	*port = p;
+	return (0);
+}
+
+/*
+ * Connect to a TCP address of the form accepted by otp_addr_split().
+ * The host defaults to the loopback address.
+ */
+static int
+otp_client_connect_tcp(const char *addr)
+{
+	struct addrinfo hints, *ai, *res;
+	char host[256];
+	const char *port;
+	int fd, one, ret, serrno;
+
+	if (otp_addr_split(addr, host, sizeof host, &port) != 0)
+		return (-1);
+	memset(&hints, 0, sizeof hints);
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if ((ret = getaddrinfo(*host != '\0' ? host : NULL, port, &hints,
+	    &res)) != 0) {
+		if (ret != EAI_SYSTEM)
+			errno = EHOSTUNREACH;
+		return (-1);
+	}
+	for (fd = -1, ai = res; ai != NULL && fd < 0; ai = ai->ai_next) {
+		if ((fd = socket(ai->ai_family, ai->ai_socktype|SOCK_CLOEXEC,
+		    ai->ai_protocol)) < 0)
+			continue;
+		if (connect(fd, ai->ai_addr, ai->ai_addrlen) != 0) {
+			serrno = errno;
+			close(fd);
+			errno = serrno;
+			fd = -1;
+		}
+	}
+	freeaddrinfo(res);
+	/* requests are small and latency-bound */
+	one = 1;
+	if (fd >= 0)
+		(void)setsockopt(fd, IPPROTO_TCP, TCP_NODELAY,
+		    &one, sizeof one);
+	return (fd);
+}
+
+/*
+ * Connect to an address.  An address which contains a slash is the
+ * path of a Unix socket; anything else is a TCP address of the form
+ * host:port.  Returns the socket, or -1 on error.
+ */
+int
+otp_connect(const char *addr)
+{
+
+	if (strchr(addr, '/') != NULL)
+		return (otp_client_connect_unix(addr));
+	return (otp_client_connect_tcp(addr));
+}
+
+/*
+ * Connect to the daemon at the given address, or at the default path
+ * if addr is NULL.  See otp_connect() for the form of the address.
+ */
+otp_client *
+otp_client_open(const char *addr)
+{
+	otp_client *cl;
+	int serrno;
+
+	if (addr == NULL)
+		addr = OTPD_SOCKET;
+	if ((cl = calloc(1, sizeof *cl)) == NULL)
+		return (NULL);
+	if ((cl->fd = otp_connect(addr)) < 0) {
+		serrno = errno;
+		free(cl);
+		errno = serrno;
+		return (NULL);
+	}
+	return (cl);
+}
+
+/*
+ * Drop the connection after an error.
+ */
+static int
+otp_client_fail(otp_client *cl, int err)
+{
+
+	if (cl->fd >= 0)
+		close(cl->fd);
+	cl->fd = -1;
+	errno = err;
+	return (-1);
+}
+
+/*
+ * Send the contents of the buffer.  Never raise SIGPIPE: we may be
+ * running inside someone else's process.
+ */
+static int
+otp_client_send(otp_client *cl, size_t len)
+{
+	ssize_t wlen;
+	size_t off;
+
+	for (off = 0; off < len; off += wlen) {
+		if ((wlen = send(cl->fd, cl->buf + off, len - off,
+		    MSG_NOSIGNAL)) < 0) {
+			if (errno == EINTR) {
+				wlen = 0;
+				continue;
+			}
+			return (otp_client_fail(cl, errno));
+		}
+	}
+	return (0);
+}
+
+/*
+ * Receive exactly len bytes into the buffer, starting at the given
+ * offset.
+ */
+static int
+otp_client_recv(otp_client *cl, size_t off, size_t len)
+{
+	ssize_t rlen;
+
+	for (len += off; off < len; off += rlen) {
+		if ((rlen = recv(cl->fd, cl->buf + off, len - off, 0)) < 0) {
+			if (errno == EINTR) {
+				rlen = 0;
+				continue;
+			}
+			return (otp_client_fail(cl, errno));
+		}
+		if (rlen == 0)
+			return (otp_client_fail(cl, ECONNRESET));
+	}
+	return (0);
+}
+
+/*
+ * Authenticate a connection with a shared secret: receive the daemon's
+ * nonce, send ours, and set up the session.  Returns 0 on success and
+ * -1 with errno set on error.
+ */
+int
+otp_client_auth(otp_client *cl, const otp_secret *secret)
+{
+	uint8_t nonce[OTP_AUTH_NONCELEN];
+
+	if (cl->fd < 0) {
+		errno = ENOTCONN;
+		return (-1);
+	}
+	if (cl->auth != NULL) {
+		errno = EINVAL;
+		return (-1);
+	}
+	if (otp_client_recv(cl, 0, OTP_AUTH_NONCELEN) != 0)
+		return (-1);
+	if (otp_auth_nonce(nonce) != 0 ||
+	    (cl->auth = otp_auth_create(secret, cl->buf, nonce,
+		OTP_AUTH_INITIATOR)) == NULL)
+		return (otp_client_fail(cl, errno));
+	memcpy(cl->buf, nonce, sizeof nonce);
+	return (otp_client_send(cl, sizeof nonce));
+}
+
+/*
+ * Encode a request.  Returns its length, or 0 if it cannot be encoded.
+ */
+static size_t
+otp_client_encode(uint8_t *p, uint8_t op, uint32_t tag, const char *user,
+    const unsigned long *response, unsigned int n)
+{
+	size_t len, userlen;
+	unsigned int i;
+
+	userlen = strlen(user);
+	if (userlen == 0 || userlen > OTPD_MAXUSERLEN ||
+	    n < 1 || n > OTPD_MAXRESPONSES)
+		return (0);
+	for (i = 0; i < n; ++i)
+		if ((uint64_t)response[i] > UINT32_MAX)
+			return (0);
+	len = 1 + userlen + 1 + 4 * n;
+	p[0] = OTPD_VERSION;
+	p[1] = op;
+	be16enc(p + 2, len);
+	be32enc(p + 4, tag);
+	p += OTPD_HDRLEN;
+	*p++ = userlen;
+	memcpy(p, user, userlen);
+	p += userlen;
+	*p++ = n;
+	for (i = 0; i < n; ++i, p += 4)
+		be32enc(p, response[i]);
+	return (OTPD_HDRLEN + len);
+}
+
+/*
+ * Translate a status into a result in the style of otp_verify(), and
+ * set errno to match.
+ */
+static int
+otp_client_result(uint8_t status)
+{
+
+	switch (status) {
+	case OTPD_REJECT:
+		return (0);
+	case OTPD_ACCEPT:
+		return (1);
+	case OTPD_NOKEY:
+		errno = ENOENT;
+		break;
+	case OTPD_INVALID:
+		errno = EINVAL;
+		break;
+	default:
+		errno = EIO;
+		break;
+	}
+	return (-1);
+}
+
+/*
+ * Send n requests of the same kind, each with nresp responses, and
+ * collect the results.  Requests which cannot be encoded are not sent
+ * and their result is -1.  Returns -1 if communication with the daemon
+ * failed, and 0 otherwise.
+ */
+static int
+otp_client_call(otp_client *cl, uint8_t op, const char **user,
+    const unsigned long *response, unsigned int nresp, int *result,
+    size_t n)
+{
+	size_t sent[OTP_CLIENT_BATCH];
+	size_t i, j, len, nsent, reqlen, taglen;
+	uint8_t *p;
+
+	if (cl->fd < 0) {
+		errno = ENOTCONN;
+		return (-1);
+	}
+	taglen = cl->auth != NULL ? OTP_AUTH_TAGLEN : 0;
+	for (i = 0; i < n; i += j) {
+		/* encode and send a batch */
+		for (j = nsent = len = 0; j < OTP_CLIENT_BATCH && i + j < n;
+		    ++j) {
+			reqlen = otp_client_encode(cl->buf + len, op,
+			    cl->tag + nsent, user[i + j],
+			    response + (i + j) * nresp, nresp);
+			if (reqlen == 0) {
+				result[i + j] = -1;
+				errno = EINVAL;
+				continue;
+			}
+			if (cl->auth != NULL)
+				otp_auth_sign(cl->auth, cl->buf + len, reqlen,
+				    cl->buf + len + reqlen);
+			sent[nsent++] = i + j;
+			len += reqlen + taglen;
+		}
+		if (nsent == 0)
+			continue;
+		if (otp_client_send(cl, len) != 0 ||
+		    otp_client_recv(cl, 0, nsent * (OTPD_HDRLEN + taglen)) != 0)
+			return (-1);
+		/* collect the responses */
+		for (p = cl->buf, len = 0; len < nsent;
+		    ++len, p += OTPD_HDRLEN + taglen) {
+			if (cl->auth != NULL && otp_auth_check(cl->auth,
+			    p, OTPD_HDRLEN, p + OTPD_HDRLEN) != 0)
+				return (otp_client_fail(cl, EBADMSG));
+			if (p[0] != OTPD_VERSION || be16dec(p + 2) != 0 ||
+			    be32dec(p + 4) != cl->tag + len)
+				return (otp_client_fail(cl, EPROTO));
+			result[sent[len]] = otp_client_result(p[1]);
+		}
+		cl->tag += nsent;
+	}
+	return (0);
+}
+
+/*
+ * Verify a response for a user.  Returns 1 if it was accepted, 0 if it
+ * was rejected, and -1 with errno set on error, including ENOENT if the
+ * user has no key.
+ */
+int
+otp_client_verify(otp_client *cl, const char *user, unsigned long response)
+{
+	int result;
+
+	if (otp_client_call(cl, OTPD_VERIFY, &user, &response, 1,
+	    &result, 1) != 0)
+		return (-1);
+	return (result);
+}
+
+/*
+ * Resynchronize a user's key.  Returns the same as otp_client_verify().
+ */
+int
+otp_client_resync(otp_client *cl, const char *user,
+    const unsigned long *response, unsigned int n)
+{
+	int result;
+
+	if (otp_client_call(cl, OTPD_RESYNC, &user, response, n,
+	    &result, 1) != 0)
+		return (-1);
+	return (result);
+}
+
+/*
+ * Verify n responses for n users, pipelining the requests.  On return,
+ * each element of results is what otp_client_verify() would have
+ * returned for the corresponding user and response.  Returns 0 on
+ * success and -1 if communication with the daemon failed.
+ */
+int
+otp_client_verify_batch(otp_client *cl, const char **users,
+    const unsigned long *responses, int *results, size_t n)
+{
+
+	return (otp_client_call(cl, OTPD_VERIFY, users, responses, 1,
+	    results, n));
+}
+
+/*
+ * Send a single request whose payload the caller has placed in the
+ * buffer after the header, and receive the response.  On return, the
+ * payload of the response, if any, is at the start of the buffer, and
+ * its length is in *rlen.  Returns the status, or -1 if communication
+ * with the daemon failed.
+ */
+static int
+otp_client_exchange(otp_client *cl, uint8_t op, size_t len, size_t *rlen)
+{
+	uint8_t *p, status;
+	size_t taglen;
+
+	if (cl->fd < 0) {
+		errno = ENOTCONN;
+		return (-1);
+	}
+	taglen = cl->auth != NULL ? OTP_AUTH_TAGLEN : 0;
+	p = cl->buf;
+	p[0] = OTPD_VERSION;
+	p[1] = op;
+	be16enc(p + 2, len);
+	be32enc(p + 4, cl->tag);
+	if (cl->auth != NULL)
+		otp_auth_sign(cl->auth, p, OTPD_HDRLEN + len,
+		    p + OTPD_HDRLEN + len);
+	if (otp_client_send(cl, OTPD_HDRLEN + len + taglen) != 0 ||
+	    otp_client_recv(cl, 0, OTPD_HDRLEN) != 0)
+		return (-1);
+	if (p[0] != OTPD_VERSION || be32dec(p + 4) != cl->tag ||
+	    (*rlen = be16dec(p + 2)) > OTPD_MAXBODY)
+		return (otp_client_fail(cl, EPROTO));
+	if (otp_client_recv(cl, OTPD_HDRLEN, *rlen + taglen) != 0)
+		return (-1);
+	if (cl->auth != NULL && otp_auth_check(cl->auth, p,
+	    OTPD_HDRLEN + *rlen, p + OTPD_HDRLEN + *rlen) != 0)
+		return (otp_client_fail(cl, EBADMSG));
+	status = p[1];
+	cl->tag++;
+	memmove(p, p + OTPD_HDRLEN, *rlen);
+	return (status);
+}
+
+/*
+ * Check the status of a response to a key migration request, which is
+ * never a rejection.  Returns 0 if the request succeeded and -1 with
+ * errno set otherwise.
+ */
+static int
+otp_client_status(otp_client *cl, int status)
+{
+
+	if (status == OTPD_ACCEPT)
+		return (0);
+	if (status == OTPD_REJECT)
+		return (otp_client_fail(cl, EPROTO));
+	if (status == OTPD_CHANGED) {
+		errno = EAGAIN;
+		return (-1);
+	}
+	return (otp_client_result(status));
+}
+
+/*
+ * Encode a user name, preceded by its length, after the header.
+ * Returns the length of the encoded name, or 0 if it is invalid.
+ */
+static size_t
+otp_client_user(otp_client *cl, const char *user)
+{
+	size_t userlen;
+
+	userlen = strlen(user);
+	if (userlen == 0 || userlen > OTPD_MAXUSERLEN) {
+		errno = EINVAL;
+		return (0);
+	}
+	cl->buf[OTPD_HDRLEN] = userlen;
+	memcpy(cl->buf + OTPD_HDRLEN + 1, user, userlen);
+	return (1 + userlen);
+}
+
+/*
+ * Retrieve the next batch of users who have a key, starting at the
+ * given cursor, which should be zero to start with.  The names are
+ * stored in buf, which should be at least OTPD_MAXBODY bytes long, one
+ * after the other, each followed by a NUL character, and the cursor is
+ * advanced past them.  Returns the number of names, which is 0 once
+ * the end has been reached, or -1 on error.
+ */
+int
+otp_client_list(otp_client *cl, uint32_t *cursor, char *buf, size_t size)
+{
+	const uint8_t *p, *end;
+	size_t len, rlen;
+	int n, status;
+
+	be32enc(cl->buf + OTPD_HDRLEN, *cursor);
+	if ((status = otp_client_exchange(cl, OTPD_LIST, 4, &rlen)) < 0 ||
+	    otp_client_status(cl, status) != 0)
+		return (-1);
+	if (rlen < 4)
+		return (otp_client_fail(cl, EPROTO));
+	p = cl->buf;
+	end = p + rlen;
+	*cursor = be32dec(p);
+	for (p += 4, n = 0; p < end; p += 1 + len, ++n) {
+		len = *p;
+		if (len == 0 || len > OTPD_MAXUSERLEN || p + 1 + len > end)
+			return (otp_client_fail(cl, EPROTO));
+		if (len >= size) {
+			errno = ENOSPC;
+			return (-1);
+		}
+		memcpy(buf, p + 1, len);
+		buf[len] = '\0';
+		buf += len + 1;
+		size -= len + 1;
+	}
+	return (n);
+}
+
+/*
+ * Retrieve a user's key from the daemon's store.  Returns 0 on success
+ * and -1 with errno set on error, including ENOENT if the user has no
+ * key.
+ */
+int
+otp_client_export(otp_client *cl, const char *user, oath_key *key)
+{
+	size_t len, rlen;
+	int status;
+
+	if ((len = otp_client_user(cl, user)) == 0)
+		return (-1);
+	if ((status = otp_client_exchange(cl, OTPD_EXPORT, len, &rlen)) < 0 ||
+	    otp_client_status(cl, status) != 0)
+		return (-1);
+	status = otp_key_from_wire(key, cl->buf, rlen);
+	otp_wipe(cl->buf, OTPD_HDRLEN + rlen + OTP_AUTH_TAGLEN);
+	if (status < 0)
+		return (otp_client_fail(cl, EPROTO));
+	return (0);
+}
+
+/*
+ * Send a request which carries a user name and a key.
+ */
+static int
+otp_client_keyop(otp_client *cl, uint8_t op, const char *user,
+    const oath_key *key)
+{
+	size_t len, rlen, reclen;
+	int status;
+
+	if ((len = otp_client_user(cl, user)) == 0)
+		return (-1);
+	reclen = sizeof cl->buf - OTPD_HDRLEN - len - OTP_AUTH_TAGLEN;
+	if (otp_key_to_wire(key, cl->buf + OTPD_HDRLEN + len, &reclen) != 0)
+		return (-1);
+	status = otp_client_exchange(cl, op, len + reclen, &rlen);
+	otp_wipe(cl->buf, OTPD_HDRLEN + len + reclen + OTP_AUTH_TAGLEN);
+	if (status < 0)
+		return (-1);
+	return (otp_client_status(cl, status));
+}
+
+/*
+ * Insert or replace a user's key in the daemon's store.  Returns 0 on
+ * success and -1 with errno set on error.
+ */
+int
+otp_client_import(otp_client *cl, const char *user, const oath_key *key)
+{
+
+	return (otp_client_keyop(cl, OTPD_IMPORT, user, key));
+}
+
+/*
+ * Remove a user's key from the daemon's store, provided it is still
+ * the given key.  Returns 0 on success and -1 with errno set on error,
+ * including EAGAIN if the key has changed and ENOENT if the user has
+ * no key.
+ */
+int
+otp_client_remove(otp_client *cl, const char *user, const oath_key *key)
+{
+
+	return (otp_client_keyop(cl, OTPD_REMOVE, user, key));
+}
+
+/*
+ * Close the connection.
+ */
+void
+otp_client_close(otp_client *cl)
+{
+
+	if (cl == NULL)
+		return;
+	if (cl->fd >= 0)
+		close(cl->fd);
+	otp_auth_destroy(cl->auth);
+	free(cl);
+}
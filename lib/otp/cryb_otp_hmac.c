@@ -0,0 +1,186 @@
+/*-
+ * Copyright (c) 2026 Dag-Erling Smørgrav
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "cryb/impl.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <cryb/endian.h>
+#include <cryb/oath.h>
+#include <cryb/otp.h>
+
+#include "cryb_otp_impl.h"
+
+static const unsigned int otp_pow10[] = {
+	1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000,
+	1000000000
+};
+
+/*
+ * Precompute the inner and outer hash states for a key.
+ */
+int
+otp_hmac_init(struct otp_hmac *hm, const oath_key *key)
+{
+	uint8_t pad[128];
+	unsigned int bsize, i;
+
+	if (key->digits < 1 || key->digits > 9) {
+		errno = EINVAL;
+		return (-1);
+	}
+	hm->digits = key->digits;
+	switch (key->hash) {
+	case oh_undef:
+	case oh_sha1:
+		hm->hash = oh_sha1;
+		bsize = 64;
+		break;
+	case oh_sha256:
+		hm->hash = oh_sha256;
+		bsize = 64;
+		break;
+	case oh_sha512:
+		hm->hash = oh_sha512;
+		bsize = 128;
+		break;
+	default:
+		errno = EINVAL;
+		return (-1);
+	}
+	if (key->keylen > bsize) {
+		errno = EINVAL;
+		return (-1);
+	}
+	for (i = 0; i < 2; ++i) {
+		memset(pad, i == 0 ? 0x36 : 0x5c, bsize);
+		for (unsigned int j = 0; j < key->keylen; ++j)
+			pad[j] ^= key->key[j];
+		switch (hm->hash) {
+		case oh_sha1:
+			memcpy(hm->h.sha1[i], otp_sha1_iv, sizeof otp_sha1_iv);
+			otp_sha1_block(hm->h.sha1[i], pad);
+			break;
+		case oh_sha256:
+			memcpy(hm->h.sha256[i], otp_sha256_iv,
+			    sizeof otp_sha256_iv);
+			otp_sha256_block(hm->h.sha256[i], pad);
+			break;
+		case oh_sha512:
+			memcpy(hm->h.sha512[i], otp_sha512_iv,
+			    sizeof otp_sha512_iv);
+			otp_sha512_block(hm->h.sha512[i], pad);
+			break;
+		default:
+			break;
+		}
+	}
+	otp_wipe(pad, sizeof pad);
+	return (0);
+}
+
+/*
+ * Compute the HOTP code for a given counter value (RFC 4226 section
+ * 5.3).  The message is always a single eight-byte block, so padding
+ * and length are known in advance.
+ */
+unsigned int
+otp_hmac_code(const struct otp_hmac *hm, uint64_t counter)
+{
+	uint8_t block[128], md[64];
+	uint32_t h32[8];
+	uint64_t h64[8];
+	unsigned int i, mdlen, off;
+	uint32_t code;
+
+	memset(block, 0, sizeof block);
+	be64enc(block, counter);
+	block[8] = 0x80;
+	switch (hm->hash) {
+	case oh_sha1:
+		mdlen = 20;
+		memcpy(h32, hm->h.sha1[0], 20);
+		be64enc(block + 56, (64 + 8) * 8);
+		otp_sha1_block(h32, block);
+		memset(block, 0, 64);
+		for (i = 0; i < 5; ++i)
+			be32enc(block + 4 * i, h32[i]);
+		block[20] = 0x80;
+		be64enc(block + 56, (64 + 20) * 8);
+		memcpy(h32, hm->h.sha1[1], 20);
+		otp_sha1_block(h32, block);
+		for (i = 0; i < 5; ++i)
+			be32enc(md + 4 * i, h32[i]);
+		break;
+	case oh_sha256:
+		mdlen = 32;
+		memcpy(h32, hm->h.sha256[0], 32);
+		be64enc(block + 56, (64 + 8) * 8);
+		otp_sha256_block(h32, block);
+		memset(block, 0, 64);
+		for (i = 0; i < 8; ++i)
+			be32enc(block + 4 * i, h32[i]);
+		block[32] = 0x80;
+		be64enc(block + 56, (64 + 32) * 8);
+		memcpy(h32, hm->h.sha256[1], 32);
+		otp_sha256_block(h32, block);
+		for (i = 0; i < 8; ++i)
+			be32enc(md + 4 * i, h32[i]);
+		break;
+	case oh_sha512:
+		mdlen = 64;
+		memcpy(h64, hm->h.sha512[0], 64);
+		be64enc(block + 120, (128 + 8) * 8);
+		otp_sha512_block(h64, block);
+		memset(block, 0, 128);
+		for (i = 0; i < 8; ++i)
+			be64enc(block + 8 * i, h64[i]);
+		block[64] = 0x80;
+		be64enc(block + 120, (128 + 64) * 8);
+		memcpy(h64, hm->h.sha512[1], 64);
+		otp_sha512_block(h64, block);
+		for (i = 0; i < 8; ++i)
+			be64enc(md + 8 * i, h64[i]);
+		break;
+	default:
+		return (UINT_MAX);
+	}
+	/* dynamic truncation */
+	off = md[mdlen - 1] & 0x0f;
+	code = be32dec(md + off) & 0x7fffffff;
+	otp_wipe(block, sizeof block);
+	otp_wipe(md, sizeof md);
+	otp_wipe(h32, sizeof h32);
+	otp_wipe(h64, sizeof h64);
+	return (code % otp_pow10[hm->digits]);
+}
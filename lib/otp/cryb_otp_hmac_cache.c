@@ -0,0 +1,207 @@
+/*-
+ * Copyright (c) 2026 Dag-Erling Smørgrav
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "cryb/impl.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <cryb/oath.h>
+#include <cryb/otp.h>
+
+#include "cryb_otp_impl.h"
+
+/*
+ * Per-thread cache of precomputed HMAC state.  Entries are indexed by
+ * the address of the key, but are only used if the key material still
+ * matches, so a key that is modified or replaced in place simply
+ * causes a cache miss.  Entries are filled on first use, and wiped
+ * when evicted.  Since the entries hold copies of the secret, every
+ * thread's cache is kept on a list so otp_key_destroy() can wipe the
+ * key's entries in all of them, and a thread's cache is wiped when the
+ * thread exits.  Each cache has its own lock, which only its owner and
+ * otp_key_destroy() ever take, so it is normally uncontended.
+ */
+
+#define OTP_HMAC_CACHE_SIZE	64
+
+struct otp_hmac_entry {
+	const oath_key		*key;
+	oath_hash		 hash;
+	unsigned int		 digits;
+	size_t			 keylen;
+	uint8_t			 keydata[sizeof ((oath_key *)0)->key];
+	struct otp_hmac		 hm;
+};
+
+struct otp_hmac_thread {
+	pthread_mutex_t		 mtx;
+	struct otp_hmac_thread	*prev, *next;
+	struct otp_hmac_entry	 ent[OTP_HMAC_CACHE_SIZE];
+};
+
+static pthread_mutex_t otp_hmac_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t otp_hmac_once = PTHREAD_ONCE_INIT;
+static pthread_key_t otp_hmac_key;
+static struct otp_hmac_thread *otp_hmac_threads;
+static __thread struct otp_hmac_thread *otp_hmac_self;
+
+static unsigned int
+otp_hmac_slot(const oath_key *key)
+{
+	uintptr_t h;
+
+	h = (uintptr_t)key;
+	h ^= h >> 17;
+	h ^= h >> 7;
+	return (h % OTP_HMAC_CACHE_SIZE);
+}
+
+/*
+ * Thread exit: wipe and release the thread's cache.
+ */
+static void
+otp_hmac_exit(void *arg)
+{
+	struct otp_hmac_thread *ht = arg;
+
+	pthread_mutex_lock(&otp_hmac_mtx);
+	if (ht->prev != NULL)
+		ht->prev->next = ht->next;
+	else
+		otp_hmac_threads = ht->next;
+	if (ht->next != NULL)
+		ht->next->prev = ht->prev;
+	pthread_mutex_unlock(&otp_hmac_mtx);
+	/* in case the thread verifies anything after this */
+	otp_hmac_self = NULL;
+	pthread_mutex_destroy(&ht->mtx);
+	otp_wipe(ht, sizeof *ht);
+	free(ht);
+}
+
+static void
+otp_hmac_init_once(void)
+{
+
+	pthread_key_create(&otp_hmac_key, otp_hmac_exit);
+}
+
+/*
+ * Return the calling thread's cache, allocating it on first use.
+ */
+static struct otp_hmac_thread *
+otp_hmac_thread(void)
+{
+	struct otp_hmac_thread *ht;
+
+	if ((ht = otp_hmac_self) != NULL)
+		return (ht);
+	pthread_once(&otp_hmac_once, otp_hmac_init_once);
+	if ((ht = calloc(1, sizeof *ht)) == NULL)
+		return (NULL);
+	pthread_mutex_init(&ht->mtx, NULL);
+	pthread_mutex_lock(&otp_hmac_mtx);
+	if ((ht->next = otp_hmac_threads) != NULL)
+		ht->next->prev = ht;
+	otp_hmac_threads = ht;
+	pthread_mutex_unlock(&otp_hmac_mtx);
+	pthread_setspecific(otp_hmac_key, ht);
+	otp_hmac_self = ht;
+	return (ht);
+}
+
+/*
+ * Return the HMAC state for a key, computing it if necessary.
+ */
+const struct otp_hmac *
+otp_hmac_get(const oath_key *key)
+{
+	struct otp_hmac_thread *ht;
+	struct otp_hmac_entry *ent;
+
+	if ((ht = otp_hmac_thread()) == NULL)
+		return (NULL);
+	ent = &ht->ent[otp_hmac_slot(key)];
+	pthread_mutex_lock(&ht->mtx);
+	if (ent->key == key && ent->hash == key->hash &&
+	    ent->digits == key->digits && ent->keylen == key->keylen &&
+	    key->keylen <= sizeof ent->keydata &&
+	    memcmp(ent->keydata, key->key, key->keylen) == 0) {
+		pthread_mutex_unlock(&ht->mtx);
+		otp_stats_count(OTP_STAT_HMAC_HIT);
+		return (&ent->hm);
+	}
+	otp_stats_count(OTP_STAT_HMAC_MISS);
+	otp_wipe(ent, sizeof *ent);
+	if (key->keylen > sizeof ent->keydata) {
+		pthread_mutex_unlock(&ht->mtx);
+		errno = EINVAL;
+		return (NULL);
+	}
+	if (otp_hmac_init(&ent->hm, key) != 0) {
+		pthread_mutex_unlock(&ht->mtx);
+		return (NULL);
+	}
+	ent->key = key;
+	ent->hash = key->hash;
+	ent->digits = key->digits;
+	ent->keylen = key->keylen;
+	memcpy(ent->keydata, key->key, key->keylen);
+	pthread_mutex_unlock(&ht->mtx);
+	return (&ent->hm);
+}
+
+/*
+ * Wipe any cached state for a key in every thread, then destroy the
+ * key.
+ */
+void
+otp_key_destroy(oath_key *key)
+{
+	struct otp_hmac_thread *ht;
+	struct otp_hmac_entry *ent;
+	unsigned int slot;
+
+	slot = otp_hmac_slot(key);
+	pthread_mutex_lock(&otp_hmac_mtx);
+	for (ht = otp_hmac_threads; ht != NULL; ht = ht->next) {
+		ent = &ht->ent[slot];
+		pthread_mutex_lock(&ht->mtx);
+		if (ent->key == key)
+			otp_wipe(ent, sizeof *ent);
+		pthread_mutex_unlock(&ht->mtx);
+	}
+	pthread_mutex_unlock(&otp_hmac_mtx);
+	oath_key_destroy(key);
+}
@@ -30,11 +30,672 @@
 #ifndef CRYB_OTP_IMPL_H_INCLUDED
 #define CRYB_OTP_IMPL_H_INCLUDED
 
-/* XXX hardcoded windows */
+#include <sys/types.h>
+
+#include <pthread.h>
+#include <time.h>
+
+/* default windows, see otp_policy_init() */
 #define HOTP_WINDOW	9
 #define TOTP_WINDOW	2
 
+#define OTP_MAX_KEYURI_SIZE	4096
+
+/* resynchronization limits */
+#define OTP_RESYNC_MAXCODES	8
+#define OTP_RESYNC_MAXWINDOW	100000
+#define OTP_RESYNC_MAXDEPTH	(1U << 30)
+#define OTP_RESYNC_MAXDEPTH1	(HOTP_WINDOW + 1) /* with a single code */
+#define OTP_RESYNC_MAXDEPTH2	1000000		/* with two codes */
+#define OTP_RESYNC_BLOCK	4096	/* positions per deep search block */
+#define OTP_RESYNC_MAXTHREADS	256
+
+/* stripes in the per-user lock table */
+#define OTP_USER_NLOCKS		1024
+
+/*
+ * Hash compression functions
+ */
+#define otp_sha1_iv		cryb_otp_sha1_iv
+#define otp_sha256_iv		cryb_otp_sha256_iv
+#define otp_sha512_iv		cryb_otp_sha512_iv
+#define otp_sha1_block		cryb_otp_sha1_block
+#define otp_sha256_block	cryb_otp_sha256_block
+#define otp_sha512_block	cryb_otp_sha512_block
+
+extern const uint32_t otp_sha1_iv[5];
+extern const uint32_t otp_sha256_iv[8];
+extern const uint64_t otp_sha512_iv[8];
+void otp_sha1_block(uint32_t *, const uint8_t *);
+void otp_sha256_block(uint32_t *, const uint8_t *);
+void otp_sha512_block(uint64_t *, const uint8_t *);
+
+/*
+ * Maximum number of codes computed in parallel
+ */
+#define OTP_MB_MAXLANES		16
+
+/*
+ * HMAC state for a key: the hash state after absorbing the inner and
+ * outer padded key blocks, which is all we need to compute a code
+ * with two compressions instead of four.
+ */
+struct otp_hmac {
+	oath_hash		 hash;
+	unsigned int		 digits;
+	union {
+		uint32_t	 sha1[2][5];
+		uint32_t	 sha256[2][8];
+		uint64_t	 sha512[2][8];
+	} h;
+};
+
+#define otp_hmac_init		cryb_otp_hmac_init
+#define otp_hmac_get		cryb_otp_hmac_get
+#define otp_hmac_code		cryb_otp_hmac_code
+#define otp_hmac_codes		cryb_otp_hmac_codes
+#define otp_hotp_match		cryb_otp_hotp_match
+#define otp_totp_match		cryb_otp_totp_match
+#define otp_hotp_match_ct	cryb_otp_hotp_match_ct
+#define otp_totp_match_ct	cryb_otp_totp_match_ct
+#define otp_policy_check	cryb_otp_policy_check
+#define otp_verify_hmac		cryb_otp_verify_hmac
+
+int otp_hmac_init(struct otp_hmac *, const oath_key *);
+const struct otp_hmac *otp_hmac_get(const oath_key *);
+unsigned int otp_hmac_code(const struct otp_hmac *, uint64_t);
+void otp_hmac_codes(const struct otp_hmac *, uint64_t, unsigned int,
+    unsigned int *);
+int otp_hotp_match(const struct otp_hmac *, oath_key *, unsigned long,
+    unsigned int);
+int otp_totp_match(const struct otp_hmac *, oath_key *, unsigned long,
+    unsigned int, unsigned int, int, time_t);
+int otp_hotp_match_ct(const struct otp_hmac *, oath_key *, unsigned long,
+    unsigned int);
+int otp_totp_match_ct(const struct otp_hmac *, oath_key *, unsigned long,
+    unsigned int, unsigned int, int, time_t);
+int otp_policy_check(const otp_policy *);
+int otp_verify_hmac(const struct otp_hmac *, oath_key *, unsigned long,
+    const otp_policy *, time_t);
+
+/*
+ * Key store file layout: a fixed-size header, followed by an open-
+ * addressed hash index, followed by a dense array of fixed-size key
+ * records.  Both the number of index slots and the number of records
+ * are powers of two, and there are always twice as many slots as
+ * records.  Everything is in host byte order; the magic number doubles
+ * as a byte order mark.
+ */
+#define OTP_STORE_MAGIC		0x4f545053	/* "OTPS" */
+#define OTP_STORE_VERSION	2
+#define OTP_STORE_MINRECS	1024
+
+#define OTP_STORE_STALE		0x0001		/* superseded by new file */
+
+#define OTP_STORE_POLICY	0x0001		/* policy is set */
+#define OTP_STORE_CONSTTIME	0x0002		/* OTP_POLICY_CONSTTIME */
+
+struct otp_store_polrec {
+	uint32_t		 flags;
+	uint32_t		 hotp_lookahead;
+	uint32_t		 totp_lookahead;
+	uint32_t		 totp_lookbehind;
+	int32_t			 totp_skew;
+	uint32_t		 resync_window;
+};
+
+struct otp_store_header {
+	uint32_t		 magic;
+	uint32_t		 version;
+	uint32_t		 flags;
+	uint32_t		 recsize;
+	uint32_t		 nslots;
+	uint32_t		 nrecs;
+	uint32_t		 nused;
+	uint32_t		 polseq;	/* seqlock for policy */
+	uint32_t		 reserved[2];
+	struct otp_store_polrec	 policy;	/* store default */
+};
+
+struct otp_store_slot {
+	uint32_t		 hashval;
+	uint32_t		 recno;		/* 1-based, 0 if unused */
+};
+
+struct otp_store_record {
+	uint32_t		 seq;		/* odd while being written */
+	uint32_t		 hashval;
+	uint8_t			 mode;
+	uint8_t			 hash;
+	uint8_t			 digits;
+	uint8_t			 keylen;
+	uint32_t		 timestep;
+	uint64_t		 counter;
+	uint64_t		 lastused;
+	char			 user[64];
+	char			 label[64];
+	char			 issuer[64];
+	uint8_t			 key[64];
+	struct otp_store_polrec	 policy;	/* per-key override */
+};
+
 struct otp_store {
+	char			*path;
+	int			 fd;
+	int			 oflags;
+	void			*base;
+	size_t			 size;
+	struct otp_store_header	*hdr;
+	struct otp_store_slot	*slots;
+	struct otp_store_record	*recs;
+	struct otp_wal		*wal;
+	struct otp_throttle	*throttle;
+	struct otp_replay	*replay;
+	struct otp_repl		*repl;
+};
+
+#define OTP_STORE_MERGE_PEER	0x0001		/* reject implausible values */
+
+#define otp_store_merge		cryb_otp_store_merge
+
+int otp_store_merge(otp_store *, const char *, oath_mode, uint64_t, int);
+
+/*
+ * Binary key file: a single record, in host byte order like the key
+ * store.  The counter and last used time step must stay where they
+ * are, since otp_key_update() writes them in place.
+ */
+#define OTP_KEYREC_MAGIC	0x4f54504b	/* "OTPK" */
+#define OTP_KEYREC_VERSION	1
+
+struct otp_keyrec {
+	uint32_t		 magic;
+	uint32_t		 version;
+	uint8_t			 mode;
+	uint8_t			 hash;
+	uint8_t			 digits;
+	uint8_t			 keylen;
+	uint32_t		 timestep;
+	uint64_t		 counter;	/* offset 16 */
+	uint64_t		 lastused;	/* offset 24 */
+	char			 label[64];
+	char			 issuer[64];
+	uint8_t			 key[64];
+};
+
+#define otp_keyrec_magic	cryb_otp_keyrec_magic
+#define otp_keyrec_parse	cryb_otp_keyrec_parse
+
+int otp_keyrec_magic(const void *, size_t);
+int otp_keyrec_parse(oath_key *, const void *, size_t, otp_uri_error *);
+
+/*
+ * Write-ahead log of counter advances.  Each record carries the new
+ * counter (HOTP) or last used time step (TOTP) for a user, and a
+ * checksum so a torn record at the end of the log can be detected.
+ */
+#define OTP_WAL_MAGIC		0x4f54504c	/* "OTPL" */
+#define OTP_WAL_BUFRECS		256		/* initial buffer size */
+#define OTP_WAL_MAXSIZE		(4 * 1024 * 1024) /* checkpoint threshold */
+
+struct otp_wal_record {
+	uint32_t		 magic;
+	uint32_t		 check;		/* FNV-1a of the rest */
+	uint64_t		 value;
+	uint8_t			 mode;
+	uint8_t			 reserved[7];
+	char			 user[64];
+};
+
+struct otp_wal {
+	char			*path;
+	char			*storepath;
+	int			 fd;
+	pthread_mutex_t		 mtx;
+	pthread_cond_t		 cv;
+	struct otp_wal_record	*buf;		/* records being appended */
+	size_t			 nbuf, bufsize;
+	struct otp_wal_record	*spare;		/* records being written */
+	size_t			 sparesize;
+	uint64_t		 appended;	/* records appended */
+	uint64_t		 synced;	/* records known durable */
+	int			 busy;		/* leader at work */
+	int			 failed;	/* a write failed */
+	off_t			 size;		/* current log size */
+};
+
+#define otp_wal_append		cryb_otp_wal_append
+
+int otp_wal_append(otp_wal *, const char *, oath_mode, uint64_t);
+
+/*
+ * Shared secrets and authenticated sessions.  Both hold the HMAC-SHA256
+ * state after the inner and outer key pads; a session also counts the
+ * messages it has sent and received.
+ */
+struct otp_mac {
+	uint32_t		 h[2][8];
+};
+
+struct otp_secret {
+	struct otp_mac		 mac;
+};
+
+struct otp_auth {
+	struct otp_mac		 mac;
+	int			 role;
+	uint64_t		 sent;
+	uint64_t		 received;
+};
+
+/*
+ * otpd client.  Requests are sent in batches of at most
+ * OTP_CLIENT_BATCH, and all responses to one batch are read before the
+ * next is sent, so neither side can end up blocking on a full socket
+ * buffer while the other does the same.  The buffer is also large
+ * enough for any single request or response.  On an authenticated
+ * connection, every message is followed by its tag.
+ */
+#define OTP_CLIENT_BATCH	64
+
+struct otp_client {
+	int			 fd;
+	uint32_t		 tag;
+	otp_auth		*auth;
+	uint8_t			 buf[OTP_CLIENT_BATCH *
+				     (OTPD_MAXLEN + OTP_AUTH_TAGLEN)];
+};
+
+#define otp_addr_split		cryb_otp_addr_split
+#define otp_connect		cryb_otp_connect
+#define otp_client_list		cryb_otp_client_list
+#define otp_client_export	cryb_otp_client_export
+#define otp_client_import	cryb_otp_client_import
+#define otp_client_remove	cryb_otp_client_remove
+
+int otp_addr_split(const char *, char *, size_t, const char **);
+int otp_connect(const char *);
+int otp_client_list(otp_client *, uint32_t *, char *, size_t);
+int otp_client_export(otp_client *, const char *, oath_key *);
+int otp_client_import(otp_client *, const char *, const oath_key *);
+int otp_client_remove(otp_client *, const char *, const oath_key *);
+
+/*
+ * Failure tracker.  An open-addressed table of users who have recently
+ * failed verification, each with a failure count, a deadline before
+ * which further attempts are refused, and fingerprints of the last few
+ * codes that were rejected and the key state they were rejected for.
+ * Entries are claimed and updated with atomic operations only.
+ */
+#define OTP_THROTTLE_SIZE	65536		/* default table size */
+#define OTP_THROTTLE_PROBE	8		/* entries probed per lookup */
+#define OTP_THROTTLE_NREJECT	4		/* rejected codes per user */
+#define OTP_THROTTLE_MAXSHIFT	10		/* backoff doublings */
+
+struct otp_throttle_entry {
+	uint32_t		 hashval;	/* 0 if unused */
+	uint32_t		 failures;	/* consecutive failures */
+	uint64_t		 last;		/* last failure (ms) */
+	uint64_t		 deadline;	/* refuse until (ms) */
+	uint32_t		 next;		/* next rejected[] slot */
+	uint32_t		 reserved;
+	uint64_t		 rejected[OTP_THROTTLE_NREJECT];
+};
+
+struct otp_throttle {
+	uint32_t		 mask;
+	unsigned int		 maxfail;
+	uint64_t		 backoff;	/* ms */
+	struct otp_throttle_entry *ents;
+};
+
+#define otp_throttle_state	cryb_otp_throttle_state
+#define otp_throttle_check	cryb_otp_throttle_check
+#define otp_throttle_record	cryb_otp_throttle_record
+
+uint64_t otp_throttle_state(const oath_key *, time_t);
+int otp_throttle_check(otp_throttle *, const char *, const unsigned long *,
+    uint64_t);
+void otp_throttle_record(otp_throttle *, const char *, const unsigned long *,
+    uint64_t, int);
+
+/*
+ * TOTP replay cache: a ring of open-addressed sets of users, one set
+ * per time step.  Each set has mask + 1 entries.
+ */
+#define OTP_REPLAY_NSTEPS	64		/* time steps in the ring */
+#define OTP_REPLAY_SIZE		16384		/* default logins per step */
+
+struct otp_replay {
+	uint32_t		 mask;
+	uint64_t		*ents;
+};
+
+#define otp_replay_insert	cryb_otp_replay_insert
+#define otp_replay_apply	cryb_otp_replay_apply
+
+int otp_replay_insert(otp_replay *, const char *, uint64_t);
+int otp_replay_apply(otp_replay *, const char *, oath_key *,
+    const otp_policy *, time_t);
+
+/*
+ * Asynchronous verifier.  Requests wait on the pending list for a
+ * worker and, once served, on the done list for otp_async_complete().
+ * nqueued counts requests on either list or in a worker's hands.
+ * Each worker has a store handle of its own.
+ */
+#define OTP_ASYNC_MAXQUEUE	4096		/* default queue limit */
+
+struct otp_async_req {
+	struct otp_async_req	*next;
+	otp_async_cb		 cb;
+	void			*arg;
+	unsigned long		 response;
+	int			 result;
+	int			 error;
+	char			 user[64];
+};
+
+struct otp_async_worker {
+	struct otp_async	*as;
+	otp_store		*st;
+	pthread_t		 thr;
+};
+
+struct otp_async {
+	int			 flags;
+	int			 efd;		/* completion eventfd */
+	struct otp_async_worker	*workers;
+	unsigned int		 nthreads;
+	pthread_mutex_t		 mtx;
+	pthread_cond_t		 cv;
+	struct otp_async_req	*pending, **ptail;
+	struct otp_async_req	*done, **dtail;
+	unsigned int		 nqueued, maxqueue;
+	int			 stopping;
+};
+
+/*
+ * Batched key file I/O.  The ring is only used if fd is not -1.  Hot
+ * key files are indexed by an open-addressed table of 1-based indices
+ * into hot[], and each has a slot of OTP_MAX_KEYURI_SIZE bytes in
+ * hotbuf, which is registered with the ring.  res, hotof and scratch
+ * have one entry or slot per key in a batch of at most chunk keys.
+ */
+#define OTP_KEYIO_DEPTH		64		/* default keys per round */
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+struct otp_keyio_ring {
+	int			 fd;
+	void			*ring;
+	size_t			 ringlen;
+	struct io_uring_sqe	*sqes;
+	size_t			 sqeslen;
+	uint32_t		*sqtail, *sqarray, sqmask;
+	uint32_t		*cqhead, *cqtail, cqmask;
+	struct io_uring_cqe	*cqes;
+	unsigned int		 entries;
+	uint32_t		 tail;		/* local submission tail */
+	unsigned int		 queued;	/* entries not yet submitted */
+};
+
+struct otp_keyio_hot {
+	char			*path;
+	uint32_t		 hashval;
+	int			 fd;
+	char			*buf;
+};
+
+struct otp_keyio {
+	struct otp_keyio_ring	 ring;
+	size_t			 chunk;
+	struct otp_keyio_hot	*hot;
+	unsigned int		 nhot, maxhot;
+	uint32_t		*hotidx, hotmask;
+	char			*hotbuf;
+	int32_t			*res;
+	int			*hotof;
+	char			*scratch;
+};
+
+/*
+ * Counter replication.  The receiving side of a connection sends a
+ * nonce, and the sending side answers with its own nonce, a magic
+ * number and a version, and a tag, as described for otp_auth.  The
+ * sender then sends frames, each of which consists of its length,
+ * any number of records, and a tag.  A record consists of the mode,
+ * the length of the user name, the new counter (HOTP) or last used
+ * time step (TOTP), and the user name.  Everything is in network byte
+ * order.  An empty frame is a keepalive.  Each peer has a queue of
+ * encoded records, which its sender swaps with a spare buffer when it
+ * is ready to send them.
+ */
+#define OTP_REPL_MAGIC		0x4f545052	/* "OTPR" */
+#define OTP_REPL_VERSION	2
+#define OTP_REPL_HELLOLEN	8
+#define OTP_REPL_HDRLEN		10
+#define OTP_REPL_MAXREC		(OTP_REPL_HDRLEN + 63)
+#define OTP_REPL_FRAMEHDR	4
+#define OTP_REPL_BATCH		16384		/* bytes that trigger a send */
+#define OTP_REPL_MAXFRAME \
+	(OTP_REPL_BATCH - OTP_REPL_FRAMEHDR - OTP_AUTH_TAGLEN)
+#define OTP_REPL_MAXQUEUE	(256 * 1024)	/* bytes before overflow */
+#define OTP_REPL_INTERVAL	10		/* ms between batches */
+#define OTP_REPL_BACKOFF	1000		/* ms between connections */
+#define OTP_REPL_KEEPALIVE	1000		/* ms between keepalives */
+#define OTP_REPL_TIMEOUT	5		/* s before a peer is dead */
+
+struct otp_repl_peer {
+	struct otp_repl		*repl;
+	char			*addr;
+	pthread_t		 thr;
+	pthread_mutex_t		 mtx;
+	pthread_cond_t		 cv;
+	int			 started;
+	int			 fd;
+	int			 connected;	/* queue accepts records */
+	int			 overflow;	/* records were dropped */
+	int			 stopping;
+	uint8_t			*buf;		/* records being queued */
+	size_t			 buflen;
+	uint8_t			*spare;		/* records being sent */
+	otp_store		*st;		/* for snapshots */
+	otp_auth		*auth;		/* NULL until connected */
+	uint8_t			 frame[OTP_REPL_BATCH];
+};
+
+struct otp_repl_conn {
+	int			 fd;
+	otp_auth		*auth;		/* NULL until hello */
+	time_t			 last;		/* last hello or frame */
+	uint8_t			 nonce[OTP_AUTH_NONCELEN];
+	size_t			 len;
+	uint8_t			 buf[OTP_REPL_BATCH];
+};
+
+struct otp_repl {
+	const otp_secret	*secret;
+	otp_store		*st;		/* for merges */
+	int			 lsock;
+	int			 stopfd;
+	int			 started;
+	pthread_t		 thr;
+	struct otp_repl_peer	*peers;
+	unsigned int		 npeers;
+	struct otp_repl_conn	*conns[OTP_REPL_MAXPEERS];
+};
+
+#define otp_repl_publish	cryb_otp_repl_publish
+
+void otp_repl_publish(otp_repl *, const char *, oath_mode, uint64_t);
+
+/*
+ * Shard map: a consistent hash ring on which each shard has a number
+ * of points proportional to its weight.  A user belongs to the shard
+ * which owns the first point at or after the hash of the user's name.
+ * The ring depends only on the names and weights of the shards, not on
+ * the order in which they were added, so every client which has the
+ * same shards agrees on who owns whom.
+ */
+#define OTP_SHARD_VNODES	128		/* points per unit of weight */
+#define OTP_SHARD_MAXWEIGHT	64
+#define OTP_SHARD_MAXSHARDS	1024
+#define OTP_SHARD_MAXNAME	63
+#define OTP_SHARD_RETRIES	8		/* attempts to move a key */
+
+struct otp_shard_point {
+	uint64_t		 hash;
+	const char		*name;		/* shard name, for ties */
+	unsigned int		 shard;
 };
 
+struct otp_shard_info {
+	char			*name;
+	char			*addr;
+	unsigned int		 weight;
+};
+
+struct otp_shardmap {
+	struct otp_shard_info	*shards;
+	unsigned int		 nshards;
+	struct otp_shard_point	*ring;
+	size_t			 npoints;
+	const otp_secret	*secret;	/* shared by all shards */
+};
+
+struct otp_shard {
+	const otp_shardmap	*map;
+	otp_client		**conns;
+};
+
+/*
+ * Instrumentation: per-thread counters, window offsets, and latency
+ * and depth histograms.  Histograms are log-linear, with four buckets
+ * per power of two.  The structure must consist of uint64_t only, as
+ * snapshots sum it up as an array.
+ */
+#define OTP_STATS_MAXOFFSET	32
+#define OTP_STATS_NBUCKETS	256
+
+enum otp_stat {
+	OTP_STAT_HOTP_HIT,
+	OTP_STAT_HOTP_MISS,
+	OTP_STAT_HOTP_ERROR,
+	OTP_STAT_TOTP_HIT,
+	OTP_STAT_TOTP_MISS,
+	OTP_STAT_TOTP_ERROR,
+	OTP_STAT_RESYNC_HIT,
+	OTP_STAT_RESYNC_MISS,
+	OTP_STAT_HMAC_HIT,
+	OTP_STAT_HMAC_MISS,
+	OTP_STAT_REPLAY_HIT,
+	OTP_STAT_REPLAY_MISS,
+	OTP_STAT_THROTTLED,
+	OTP_STAT_NCOUNTERS
+};
+
+enum otp_hist {
+	OTP_HIST_VERIFY_HOTP,
+	OTP_HIST_VERIFY_TOTP,
+	OTP_HIST_RESYNC,
+	OTP_HIST_RESYNC_DEPTH,
+	OTP_HIST_KEY_LOAD,
+	OTP_HIST_KEY_SAVE,
+	OTP_HIST_WAL,
+	OTP_HIST_NHISTS
+};
+
+struct otp_stats_hist {
+	uint64_t		 count;
+	uint64_t		 sum;
+	uint64_t		 bucket[OTP_STATS_NBUCKETS];
+};
+
+struct otp_stats {
+	uint64_t		 counter[OTP_STAT_NCOUNTERS];
+	uint64_t		 hotp_offset[2 * OTP_STATS_MAXOFFSET + 1];
+	uint64_t		 totp_offset[2 * OTP_STATS_MAXOFFSET + 1];
+	struct otp_stats_hist	 hist[OTP_HIST_NHISTS];
+};
+
+#define otp_stats_enabled	cryb_otp_stats_enabled
+#define otp_stats_do_count	cryb_otp_stats_do_count
+#define otp_stats_do_offset	cryb_otp_stats_do_offset
+#define otp_stats_do_record	cryb_otp_stats_do_record
+#define otp_stats_do_clock	cryb_otp_stats_do_clock
+#define otp_stats_do_elapsed	cryb_otp_stats_do_elapsed
+
+extern int otp_stats_enabled;
+void otp_stats_do_count(unsigned int);
+void otp_stats_do_offset(oath_mode, int64_t);
+void otp_stats_do_record(unsigned int, uint64_t);
+uint64_t otp_stats_do_clock(void);
+void otp_stats_do_elapsed(unsigned int, uint64_t);
+
+#define OTP_STATS_ENABLED()						\
+	__builtin_expect(__atomic_load_n(&otp_stats_enabled,		\
+	    __ATOMIC_RELAXED), 0)
+
+/*
+ * Recording hooks.  These test whether recording is on before calling
+ * out of line, so when it is off, an event costs a single branch and
+ * the clock is never read.
+ */
+static inline void
+otp_stats_count(unsigned int c)
+{
+
+	if (OTP_STATS_ENABLED())
+		otp_stats_do_count(c);
+}
+
+static inline void
+otp_stats_offset(oath_mode mode, int64_t offset)
+{
+
+	if (OTP_STATS_ENABLED())
+		otp_stats_do_offset(mode, offset);
+}
+
+static inline void
+otp_stats_record(unsigned int h, uint64_t value)
+{
+
+	if (OTP_STATS_ENABLED())
+		otp_stats_do_record(h, value);
+}
+
+/*
+ * Return a timestamp for otp_stats_elapsed(), or 0 if recording is off.
+ */
+static inline uint64_t
+otp_stats_clock(void)
+{
+
+	return (OTP_STATS_ENABLED() ? otp_stats_do_clock() : 0);
+}
+
+static inline void
+otp_stats_elapsed(unsigned int h, uint64_t start)
+{
+
+	if (start != 0)
+		otp_stats_do_elapsed(h, start);
+}
+
+/*
+ * 32-bit FNV-1a, used to hash user names.
+ */
+static inline uint32_t
+otp_strhash(const char *str)
+{
+	uint32_t h;
+
+	for (h = 0x811c9dc5; *str != '\0'; ++str)
+		h = (h ^ (uint8_t)*str) * 0x01000193;
+	return (h);
+}
+
 #endif
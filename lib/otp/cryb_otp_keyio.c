@@ -0,0 +1,718 @@
+/*-
+ * Copyright (c) 2026 Dag-Erling Smørgrav
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "cryb/impl.h"
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#if HAVE_IO_URING
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <cryb/oath.h>
+#include <cryb/otp.h>
+
+#include "cryb_otp_impl.h"
+
+/*
+ * Batched key file I/O.  A daemon which keeps one key file per user
+ * spends most of its I/O time on system calls: open, read and close to
+ * load a key, and open, write, fdatasync and close to advance it.  On
+ * Linux, we submit these through an io_uring instead, in two rounds
+ * per batch: first all the opens, then all the reads or writes, each
+ * hard-linked to the fdatasync and close that follow it.  Frequently
+ * used key files can be registered, which keeps them open as fixed
+ * files and gives each of them a slot in a registered buffer, so
+ * loading or advancing such a key is a single round with no opens or
+ * closes.
+ *
+ * Where io_uring is not available, or has been disabled by the
+ * administrator, the same interface is implemented with ordinary
+ * system calls.
+ *
+ * A key I/O context must not be used by more than one thread at a
+ * time, and the caller is responsible for serializing access to each
+ * key, as with otp_key_update().
+ */
+
+static struct otp_keyio_hot *
+otp_keyio_hot_lookup(otp_keyio *kio, const char *path)
+{
+	struct otp_keyio_hot *hot;
+	uint32_t h, i;
+
+	if (kio->nhot == 0)
+		return (NULL);
+	h = otp_strhash(path);
+	for (i = h & kio->hotmask; kio->hotidx[i] != 0;
+	     i = (i + 1) & kio->hotmask) {
+		hot = &kio->hot[kio->hotidx[i] - 1];
+		if (hot->hashval == h && strcmp(hot->path, path) == 0)
+			return (hot);
+	}
+	return (NULL);
+}
+
+#if HAVE_IO_URING
+
+/*
+ * Offset and value of the field which otp_key_update() writes.
+ */
+static int
+otp_keyio_field(const oath_key *key, off_t *off, uint64_t *val)
+{
+
+	switch (key->mode) {
+	case om_hotp:
+		*off = offsetof(struct otp_keyrec, counter);
+		*val = key->counter;
+		return (0);
+	case om_totp:
+		*off = offsetof(struct otp_keyrec, lastused);
+		*val = key->lastused;
+		return (0);
+	default:
+		errno = EINVAL;
+		return (-1);
+	}
+}
+
+/*
+ * A minimal io_uring: just enough to submit a batch and wait for all
+ * of it to complete.
+ */
+static int
+otp_keyio_ring_setup(struct otp_keyio_ring *r, unsigned int depth)
+{
+	struct io_uring_params p;
+	struct {
+		struct io_uring_probe	 probe;
+		struct io_uring_probe_op ops[256];
+	} pr;
+	static const uint8_t need[] = {
+		IORING_OP_OPENAT, IORING_OP_CLOSE, IORING_OP_READ,
+		IORING_OP_WRITE, IORING_OP_READ_FIXED, IORING_OP_WRITE_FIXED,
+		IORING_OP_FSYNC,
+	};
+	unsigned int i;
+	uint8_t *ring;
+
+	memset(&p, 0, sizeof p);
+	if ((r->fd = syscall(__NR_io_uring_setup, depth, &p)) < 0)
+		return (-1);
+	memset(&pr, 0, sizeof pr);
+	if (!(p.features & IORING_FEAT_SINGLE_MMAP) ||
+	    syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_PROBE,
+	    &pr, 256) != 0)
+		goto nosys;
+	for (i = 0; i < sizeof need; ++i)
+		if (need[i] > pr.probe.last_op ||
+		    !(pr.ops[need[i]].flags & IO_URING_OP_SUPPORTED))
+			goto nosys;
+	r->ringlen = p.sq_off.array + p.sq_entries * sizeof(uint32_t);
+	if (r->ringlen < p.cq_off.cqes +
+	    p.cq_entries * sizeof(struct io_uring_cqe))
+		r->ringlen = p.cq_off.cqes +
+		    p.cq_entries * sizeof(struct io_uring_cqe);
+	r->sqeslen = p.sq_entries * sizeof(struct io_uring_sqe);
+	if ((r->ring = mmap(NULL, r->ringlen, PROT_READ|PROT_WRITE,
+	    MAP_SHARED|MAP_POPULATE, r->fd, IORING_OFF_SQ_RING)) == MAP_FAILED)
+		goto fail;
+	if ((r->sqes = mmap(NULL, r->sqeslen, PROT_READ|PROT_WRITE,
+	    MAP_SHARED|MAP_POPULATE, r->fd, IORING_OFF_SQES)) == MAP_FAILED) {
+		munmap(r->ring, r->ringlen);
+		goto fail;
+	}
+	ring = r->ring;
+	r->sqtail = (uint32_t *)(ring + p.sq_off.tail);
+	r->sqmask = *(uint32_t *)(ring + p.sq_off.ring_mask);
+	r->sqarray = (uint32_t *)(ring + p.sq_off.array);
+	r->cqhead = (uint32_t *)(ring + p.cq_off.head);
+	r->cqtail = (uint32_t *)(ring + p.cq_off.tail);
+	r->cqmask = *(uint32_t *)(ring + p.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe *)(ring + p.cq_off.cqes);
+	r->entries = p.sq_entries;
+	r->tail = *r->sqtail;
+	r->queued = 0;
+	return (0);
+nosys:
+	errno = ENOSYS;
+fail:
+	close(r->fd);
+	r->fd = -1;
+	return (-1);
+}
+
+static void
+otp_keyio_ring_teardown(struct otp_keyio_ring *r)
+{
+
+	if (r->fd < 0)
+		return;
+	munmap(r->sqes, r->sqeslen);
+	munmap(r->ring, r->ringlen);
+	close(r->fd);
+	r->fd = -1;
+}
+
+static struct io_uring_sqe *
+otp_keyio_sqe(struct otp_keyio_ring *r, uint8_t op, int fd, uint64_t tag)
+{
+	struct io_uring_sqe *sqe;
+	uint32_t idx;
+
+	idx = r->tail++ & r->sqmask;
+	r->sqarray[idx] = idx;
+	sqe = &r->sqes[idx];
+	memset(sqe, 0, sizeof *sqe);
+	sqe->opcode = op;
+	sqe->fd = fd;
+	sqe->user_data = tag;
+	r->queued++;
+	return (sqe);
+}
+
+/*
+ * Submit everything queued and wait for it to complete, passing each
+ * completion to the callback.
+ */
+static int
+otp_keyio_ring_run(struct otp_keyio_ring *r,
+    void (*cb)(otp_keyio *, uint64_t, int32_t), otp_keyio *kio)
+{
+	struct io_uring_cqe *cqe;
+	unsigned int pending, submit;
+	uint32_t head, tail;
+	int ret;
+
+	__atomic_store_n(r->sqtail, r->tail, __ATOMIC_RELEASE);
+	submit = pending = r->queued;
+	r->queued = 0;
+	while (pending > 0) {
+		ret = syscall(__NR_io_uring_enter, r->fd, submit, pending,
+		    IORING_ENTER_GETEVENTS, NULL, 0);
+		if (ret < 0 && errno != EINTR)
+			return (-1);
+		if (ret > 0)
+			submit -= ret;
+		head = *r->cqhead;
+		tail = __atomic_load_n(r->cqtail, __ATOMIC_ACQUIRE);
+		for (; head != tail; ++head, --pending) {
+			cqe = &r->cqes[head & r->cqmask];
+			cb(kio, cqe->user_data, cqe->res);
+		}
+		__atomic_store_n(r->cqhead, head, __ATOMIC_RELEASE);
+	}
+	return (0);
+}
+
+/*
+ * Each entry is tagged with the index of the key it belongs to, and
+ * possibly one of these.
+ */
+#define OTP_KEYIO_CLOSE		(1ULL << 32)	/* close: ignore */
+#define OTP_KEYIO_WRITE		(1ULL << 33)	/* write: check length */
+
+/*
+ * Record the result of an open or read.
+ */
+static void
+otp_keyio_done(otp_keyio *kio, uint64_t tag, int32_t res)
+{
+
+	if (tag & OTP_KEYIO_CLOSE)
+		return;
+	kio->res[tag] = res;
+}
+
+/*
+ * Record the first error in a write and sync.
+ */
+static void
+otp_keyio_status(otp_keyio *kio, uint64_t tag, int32_t res)
+{
+	uint32_t i = (uint32_t)tag;
+
+	if (tag & OTP_KEYIO_CLOSE)
+		return;
+	if ((tag & OTP_KEYIO_WRITE) && res >= 0 && res != sizeof(uint64_t))
+		res = -EIO;
+	if (res < 0 && kio->res[i] >= 0)
+		kio->res[i] = res;
+}
+
+/*
+ * Load a batch of at most kio->chunk keys.
+ */
+static int
+otp_keyio_uring_load(otp_keyio *kio, const char *const *paths,
+    oath_key *keys, int *results, size_t n)
+{
+	struct otp_keyio_ring *r = &kio->ring;
+	struct otp_keyio_hot *hot;
+	struct io_uring_sqe *sqe;
+	size_t i, nhot;
+	char *buf;
+	int ok;
+
+	/* round one: read hot files and open the others */
+	for (i = nhot = 0; i < n; ++i) {
+		if ((hot = otp_keyio_hot_lookup(kio, paths[i])) != NULL) {
+			kio->hotof[i] = hot - kio->hot;
+			sqe = otp_keyio_sqe(r, IORING_OP_READ_FIXED,
+			    kio->hotof[i], i);
+			sqe->flags = IOSQE_FIXED_FILE;
+			sqe->addr = (uintptr_t)hot->buf;
+			sqe->len = OTP_MAX_KEYURI_SIZE;
+			sqe->buf_index = 0;
+			nhot++;
+		} else {
+			kio->hotof[i] = -1;
+			sqe = otp_keyio_sqe(r, IORING_OP_OPENAT, AT_FDCWD, i);
+			sqe->addr = (uintptr_t)paths[i];
+			sqe->open_flags = O_RDONLY|O_CLOEXEC;
+		}
+	}
+	if (otp_keyio_ring_run(r, otp_keyio_done, kio) != 0)
+		return (-1);
+	/* round two: read and close the files we opened */
+	if (nhot < n) {
+		for (i = 0; i < n; ++i) {
+			if (kio->hotof[i] >= 0 || kio->res[i] < 0)
+				continue;
+			sqe = otp_keyio_sqe(r, IORING_OP_READ, kio->res[i], i);
+			sqe->flags = IOSQE_IO_HARDLINK;
+			sqe->addr = (uintptr_t)(kio->scratch +
+			    i * OTP_MAX_KEYURI_SIZE);
+			sqe->len = OTP_MAX_KEYURI_SIZE;
+			(void)otp_keyio_sqe(r, IORING_OP_CLOSE, kio->res[i],
+			    OTP_KEYIO_CLOSE | i);
+		}
+		if (otp_keyio_ring_run(r, otp_keyio_done, kio) != 0)
+			return (-1);
+	}
+	for (i = ok = 0; i < n; ++i) {
+		buf = kio->hotof[i] >= 0 ? kio->hot[kio->hotof[i]].buf :
+		    kio->scratch + i * OTP_MAX_KEYURI_SIZE;
+		if (kio->res[i] < 0) {
+			errno = -kio->res[i];
+			results[i] = -1;
+		} else {
+			results[i] = otp_key_parse(&keys[i], buf,
+			    kio->res[i], NULL);
+			otp_wipe(buf, kio->res[i]);
+		}
+		if (results[i] >= 0)
+			ok++;
+	}
+	return (ok);
+}
+
+/*
+ * Advance a batch of at most kio->chunk keys.
+ */
+static int
+otp_keyio_uring_update(otp_keyio *kio, const char *const *paths,
+    const oath_key *keys, int *results, size_t n)
+{
+	struct otp_keyio_ring *r = &kio->ring;
+	struct otp_keyio_hot *hot;
+	struct io_uring_sqe *sqe;
+	uint64_t val;
+	size_t i, nhot;
+	off_t off;
+	char *buf;
+	int fd, ok;
+
+	/* round one: open cold files */
+	for (i = nhot = 0; i < n; ++i) {
+		kio->res[i] = 0;
+		if (otp_keyio_field(&keys[i], &off, &val) != 0) {
+			kio->res[i] = -EINVAL;
+			continue;
+		}
+		if ((hot = otp_keyio_hot_lookup(kio, paths[i])) != NULL) {
+			kio->hotof[i] = hot - kio->hot;
+			nhot++;
+			continue;
+		}
+		kio->hotof[i] = -1;
+		sqe = otp_keyio_sqe(r, IORING_OP_OPENAT, AT_FDCWD, i);
+		sqe->addr = (uintptr_t)paths[i];
+		sqe->open_flags = O_WRONLY|O_CLOEXEC;
+	}
+	if (nhot < n && otp_keyio_ring_run(r, otp_keyio_done, kio) != 0)
+		return (-1);
+	/*
+	 * Round two: write, sync and (unless hot) close.  The links are
+	 * hard so a failed write cannot cancel the close.
+	 */
+	for (i = 0; i < n; ++i) {
+		if (kio->res[i] < 0 ||
+		    otp_keyio_field(&keys[i], &off, &val) != 0)
+			continue;
+		if (kio->hotof[i] >= 0) {
+			buf = kio->hot[kio->hotof[i]].buf;
+			memcpy(buf + off, &val, sizeof val);
+			fd = kio->hotof[i];
+			sqe = otp_keyio_sqe(r, IORING_OP_WRITE_FIXED, fd,
+			    OTP_KEYIO_WRITE | i);
+			sqe->flags = IOSQE_FIXED_FILE|IOSQE_IO_HARDLINK;
+			sqe->addr = (uintptr_t)(buf + off);
+			sqe->buf_index = 0;
+		} else {
+			buf = kio->scratch + i * OTP_MAX_KEYURI_SIZE;
+			memcpy(buf, &val, sizeof val);
+			fd = kio->res[i];
+			sqe = otp_keyio_sqe(r, IORING_OP_WRITE, fd,
+			    OTP_KEYIO_WRITE | i);
+			sqe->flags = IOSQE_IO_HARDLINK;
+			sqe->addr = (uintptr_t)buf;
+		}
+		sqe->len = sizeof val;
+		sqe->off = off;
+		kio->res[i] = 0;
+		sqe = otp_keyio_sqe(r, IORING_OP_FSYNC, fd, i);
+		sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+		if (kio->hotof[i] >= 0) {
+			sqe->flags = IOSQE_FIXED_FILE;
+		} else {
+			sqe->flags = IOSQE_IO_HARDLINK;
+			(void)otp_keyio_sqe(r, IORING_OP_CLOSE, fd,
+			    OTP_KEYIO_CLOSE | i);
+		}
+	}
+	if (otp_keyio_ring_run(r, otp_keyio_status, kio) != 0)
+		return (-1);
+	for (i = ok = 0; i < n; ++i) {
+		if (kio->res[i] < 0) {
+			errno = -kio->res[i];
+			results[i] = -1;
+		} else {
+			results[i] = 0;
+			ok++;
+		}
+	}
+	return (ok);
+}
+
+#endif
+
+/*
+ * The same, with ordinary system calls.
+ */
+static int
+otp_keyio_posix_load(otp_keyio *kio, const char *const *paths,
+    oath_key *keys, int *results, size_t n)
+{
+	struct otp_keyio_hot *hot;
+	size_t i;
+	int fd, ok, serrno;
+
+	for (i = ok = 0; i < n; ++i) {
+		if ((hot = otp_keyio_hot_lookup(kio, paths[i])) != NULL) {
+			results[i] = otp_key_load(&keys[i], hot->fd, NULL);
+		} else if ((fd = open(paths[i], O_RDONLY|O_CLOEXEC)) >= 0) {
+			results[i] = otp_key_load(&keys[i], fd, NULL);
+			serrno = errno;
+			close(fd);
+			errno = serrno;
+		} else {
+			results[i] = -1;
+		}
+		if (results[i] >= 0)
+			ok++;
+	}
+	return (ok);
+}
+
+static int
+otp_keyio_posix_update(otp_keyio *kio, const char *const *paths,
+    const oath_key *keys, int *results, size_t n)
+{
+	struct otp_keyio_hot *hot;
+	size_t i;
+	int fd, ok, serrno;
+
+	for (i = ok = 0; i < n; ++i) {
+		if ((hot = otp_keyio_hot_lookup(kio, paths[i])) != NULL) {
+			results[i] = otp_key_update(&keys[i], hot->fd);
+		} else if ((fd = open(paths[i], O_WRONLY|O_CLOEXEC)) >= 0) {
+			results[i] = otp_key_update(&keys[i], fd);
+			serrno = errno;
+			close(fd);
+			errno = serrno;
+		} else {
+			results[i] = -1;
+		}
+		if (results[i] == 0)
+			ok++;
+	}
+	return (ok);
+}
+
+/*
+ * Create a key I/O context which handles batches of up to depth keys
+ * per round and can hold up to maxhot registered key files.  Unless
+ * OTP_KEYIO_POSIX is specified, io_uring is used if it is available.
+ */
+otp_keyio *
+otp_keyio_create(unsigned int depth, unsigned int maxhot, int flags)
+{
+	otp_keyio *kio;
+	size_t hotsize;
+	int serrno;
+
+	if ((flags & ~OTP_KEYIO_POSIX) != 0) {
+		errno = EINVAL;
+		return (NULL);
+	}
+	if (depth == 0)
+		depth = OTP_KEYIO_DEPTH;
+	if ((kio = calloc(1, sizeof *kio)) == NULL)
+		return (NULL);
+	kio->ring.fd = -1;
+	kio->chunk = depth;
+	kio->maxhot = maxhot;
+	for (hotsize = 1; hotsize < 2 * (size_t)maxhot; hotsize *= 2)
+		/* nothing */ ;
+	kio->hotmask = hotsize - 1;
+	if ((kio->hot = calloc(maxhot + 1, sizeof *kio->hot)) == NULL ||
+	    (kio->hotidx = calloc(hotsize, sizeof *kio->hotidx)) == NULL)
+		goto fail;
+	if (maxhot > 0 && (kio->hotbuf = mmap(NULL,
+	    (size_t)maxhot * OTP_MAX_KEYURI_SIZE, PROT_READ|PROT_WRITE,
+	    MAP_PRIVATE|MAP_ANONYMOUS, -1, 0)) == MAP_FAILED) {
+		kio->hotbuf = NULL;
+		goto fail;
+	}
+#if HAVE_IO_URING
+	if (!(flags & OTP_KEYIO_POSIX) &&
+	    otp_keyio_ring_setup(&kio->ring, 3 * depth) == 0) {
+		struct iovec iov;
+		int *fds;
+		unsigned int i;
+
+		/* a cold update takes three entries */
+		if (kio->chunk > kio->ring.entries / 3)
+			kio->chunk = kio->ring.entries / 3;
+		if (maxhot > 0) {
+			/* an empty fixed file table and one big buffer */
+			if ((fds = malloc(maxhot * sizeof *fds)) == NULL)
+				goto fail;
+			for (i = 0; i < maxhot; ++i)
+				fds[i] = -1;
+			iov.iov_base = kio->hotbuf;
+			iov.iov_len = (size_t)maxhot * OTP_MAX_KEYURI_SIZE;
+			if (syscall(__NR_io_uring_register, kio->ring.fd,
+			    IORING_REGISTER_FILES, fds, maxhot) != 0 ||
+			    syscall(__NR_io_uring_register, kio->ring.fd,
+			    IORING_REGISTER_BUFFERS, &iov, 1) != 0)
+				otp_keyio_ring_teardown(&kio->ring);
+			free(fds);
+		}
+	}
+#endif
+	if ((kio->res = calloc(kio->chunk, sizeof *kio->res)) == NULL ||
+	    (kio->hotof = calloc(kio->chunk, sizeof *kio->hotof)) == NULL ||
+	    (kio->scratch = malloc((size_t)kio->chunk *
+	    OTP_MAX_KEYURI_SIZE)) == NULL)
+		goto fail;
+	return (kio);
+fail:
+	serrno = errno;
+	otp_keyio_destroy(kio);
+	errno = serrno;
+	return (NULL);
+}
+
+/*
+ * Return the name of the backend in use.
+ */
+const char *
+otp_keyio_backend(const otp_keyio *kio)
+{
+
+	return (kio->ring.fd >= 0 ? "io_uring" : "posix");
+}
+
+/*
+ * Register a frequently used key file.  It is kept open until the
+ * context is destroyed, so it must be a binary key file, which is
+ * updated in place; a key file which is replaced by renaming must be
+ * loaded by name.  Returns 0 on success and -1 with errno set to
+ * ENOSPC if there is no room for another key file.
+ */
+int
+otp_keyio_register(otp_keyio *kio, const char *path)
+{
+	struct otp_keyio_hot *hot;
+	uint32_t i;
+	int fd, serrno;
+
+	if (otp_keyio_hot_lookup(kio, path) != NULL)
+		return (0);
+	if (kio->nhot >= kio->maxhot) {
+		errno = ENOSPC;
+		return (-1);
+	}
+	hot = &kio->hot[kio->nhot];
+	if ((fd = open(path, O_RDWR|O_CLOEXEC)) < 0)
+		return (-1);
+	if ((hot->path = strdup(path)) == NULL)
+		goto fail;
+#if HAVE_IO_URING
+	if (kio->ring.fd >= 0) {
+		struct io_uring_files_update up;
+
+		memset(&up, 0, sizeof up);
+		up.offset = kio->nhot;
+		up.fds = (uintptr_t)&fd;
+		if (syscall(__NR_io_uring_register, kio->ring.fd,
+		    IORING_REGISTER_FILES_UPDATE, &up, 1) != 1)
+			goto fail;
+	}
+#endif
+	hot->fd = fd;
+	hot->hashval = otp_strhash(path);
+	hot->buf = kio->hotbuf + (size_t)kio->nhot * OTP_MAX_KEYURI_SIZE;
+	for (i = hot->hashval & kio->hotmask; kio->hotidx[i] != 0;
+	     i = (i + 1) & kio->hotmask)
+		/* nothing */ ;
+	kio->hotidx[i] = ++kio->nhot;
+	return (0);
+fail:
+	serrno = errno;
+	free(hot->path);
+	hot->path = NULL;
+	close(fd);
+	errno = serrno;
+	return (-1);
+}
+
+/*
+ * Load a batch of keys.  Each result is what otp_key_load() would have
+ * returned for that key.  Returns the number of keys loaded, or -1 if
+ * the batch could not be processed at all.
+ */
+int
+otp_keyio_load(otp_keyio *kio, const char *const *paths, oath_key *keys,
+    int *results, size_t n)
+{
+	size_t i, m;
+	int ok, ret;
+
+	for (i = ok = 0; i < n; i += m) {
+		m = n - i < kio->chunk ? n - i : kio->chunk;
+#if HAVE_IO_URING
+		if (kio->ring.fd >= 0)
+			ret = otp_keyio_uring_load(kio, paths + i, keys + i,
+			    results + i, m);
+		else
+#endif
+			ret = otp_keyio_posix_load(kio, paths + i, keys + i,
+			    results + i, m);
+		if (ret < 0)
+			return (-1);
+		ok += ret;
+	}
+	return (ok);
+}
+
+/*
+ * Advance a batch of binary key files in place, as otp_key_update()
+ * would.  Each result is 0 on success and -1 on failure.  Returns the
+ * number of keys updated, or -1 if the batch could not be processed at
+ * all.
+ */
+int
+otp_keyio_update(otp_keyio *kio, const char *const *paths,
+    const oath_key *keys, int *results, size_t n)
+{
+	size_t i, m;
+	int ok, ret;
+
+	for (i = ok = 0; i < n; i += m) {
+		m = n - i < kio->chunk ? n - i : kio->chunk;
+#if HAVE_IO_URING
+		if (kio->ring.fd >= 0)
+			ret = otp_keyio_uring_update(kio, paths + i, keys + i,
+			    results + i, m);
+		else
+#endif
+			ret = otp_keyio_posix_update(kio, paths + i, keys + i,
+			    results + i, m);
+		if (ret < 0)
+			return (-1);
+		ok += ret;
+	}
+	return (ok);
+}
+
+void
+otp_keyio_destroy(otp_keyio *kio)
+{
+	unsigned int i;
+
+	if (kio == NULL)
+		return;
+#if HAVE_IO_URING
+	otp_keyio_ring_teardown(&kio->ring);
+#endif
+	for (i = 0; i < kio->nhot; ++i) {
+		close(kio->hot[i].fd);
+		free(kio->hot[i].path);
+	}
+	if (kio->hotbuf != NULL) {
+		otp_wipe(kio->hotbuf, (size_t)kio->maxhot *
+		    OTP_MAX_KEYURI_SIZE);
+		munmap(kio->hotbuf, (size_t)kio->maxhot *
+		    OTP_MAX_KEYURI_SIZE);
+	}
+	if (kio->scratch != NULL) {
+		otp_wipe(kio->scratch, (size_t)kio->chunk *
+		    OTP_MAX_KEYURI_SIZE);
+		free(kio->scratch);
+	}
+	free(kio->hotof);
+	free(kio->res);
+	free(kio->hotidx);
+	free(kio->hot);
+	free(kio);
+}
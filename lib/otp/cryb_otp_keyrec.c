@@ -0,0 +1,308 @@
+/*-
+ * Copyright (c) 2026 Dag-Erling Smørgrav
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "cryb/impl.h"
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <cryb/endian.h>
+#include <cryb/oath.h>
+#include <cryb/otp.h>
+
+#include "cryb_otp_impl.h"
+
+/*
+ * Binary key records.  A key file in this format holds a single
+ * fixed-size record with the counter and last used time step at fixed
+ * offsets, so advancing a key costs one small pwrite() instead of
+ * re-encoding and replacing the whole file.
+ */
+
+/*
+ * Check whether a buffer starts with a binary key record, in either
+ * byte order.
+ */
+int
+otp_keyrec_magic(const void *buf, size_t len)
+{
+	uint32_t magic;
+
+	if (len < sizeof magic)
+		return (0);
+	memcpy(&magic, buf, sizeof magic);
+	return (magic == OTP_KEYREC_MAGIC ||
+	    magic == __builtin_bswap32(OTP_KEYREC_MAGIC));
+}
+
+/*
+ * Decode a binary key record.  Returns OTP_KEYFMT_BINARY on success,
+ * or -1 with errno set to EINVAL and err filled in as for
+ * otp_key_parse().
+ */
+int
+otp_keyrec_parse(oath_key *key, const void *buf, size_t len,
+    otp_uri_error *err)
+{
+	struct otp_keyrec rec;
+	const char *emsg;
+	size_t epos;
+
+	memset(key, 0, sizeof *key);
+	if (len < sizeof rec) {
+		epos = len;
+		emsg = "truncated key record";
+		goto fail;
+	}
+	/* the buffer may not be aligned */
+	memcpy(&rec, buf, sizeof rec);
+	if (rec.magic != OTP_KEYREC_MAGIC) {
+		epos = offsetof(struct otp_keyrec, magic);
+		emsg = "wrong byte order";
+		goto fail;
+	}
+	if (rec.version != OTP_KEYREC_VERSION) {
+		epos = offsetof(struct otp_keyrec, version);
+		emsg = "unsupported version";
+		goto fail;
+	}
+	if (rec.mode != om_hotp && rec.mode != om_totp) {
+		epos = offsetof(struct otp_keyrec, mode);
+		emsg = "unknown mode";
+		goto fail;
+	}
+	if (rec.hash <= oh_undef || rec.hash >= oh_max) {
+		epos = offsetof(struct otp_keyrec, hash);
+		emsg = "unknown algorithm";
+		goto fail;
+	}
+	if (rec.digits < 6 || rec.digits > 9) {
+		epos = offsetof(struct otp_keyrec, digits);
+		emsg = "digits must be between 6 and 9";
+		goto fail;
+	}
+	if (rec.keylen == 0 || rec.keylen > sizeof rec.key ||
+	    rec.keylen > sizeof key->key) {
+		epos = offsetof(struct otp_keyrec, keylen);
+		emsg = "invalid secret length";
+		goto fail;
+	}
+	if (rec.mode == om_totp && rec.timestep == 0) {
+		epos = offsetof(struct otp_keyrec, timestep);
+		emsg = "invalid number";
+		goto fail;
+	}
+	key->mode = (oath_mode)rec.mode;
+	key->hash = (oath_hash)rec.hash;
+	key->digits = rec.digits;
+	key->timestep = rec.timestep;
+	key->counter = rec.counter;
+	key->lastused = rec.lastused;
+	key->labellen = strnlen(rec.label, sizeof rec.label);
+	if (key->labellen >= sizeof key->label)
+		key->labellen = sizeof key->label - 1;
+	memcpy(key->label, rec.label, key->labellen);
+	key->issuerlen = strnlen(rec.issuer, sizeof rec.issuer);
+	if (key->issuerlen >= sizeof key->issuer)
+		key->issuerlen = sizeof key->issuer - 1;
+	memcpy(key->issuer, rec.issuer, key->issuerlen);
+	key->keylen = rec.keylen;
+	memcpy(key->key, rec.key, key->keylen);
+	otp_wipe(&rec, sizeof rec);
+	return (OTP_KEYFMT_BINARY);
+fail:
+	otp_wipe(&rec, sizeof rec);
+	if (err != NULL) {
+		err->offset = epos;
+		err->msg = emsg;
+	}
+	errno = EINVAL;
+	return (-1);
+}
+
+/*
+ * Encode a key as a binary key record.  On input, *len is the size of
+ * the buffer; on success, it is the size of the record.  Returns 0 on
+ * success and -1 with errno set to ENOSPC if the buffer is too small.
+ */
+int
+otp_key_to_binary(const oath_key *key, void *buf, size_t *len)
+{
+	struct otp_keyrec rec;
+	size_t n;
+
+	if (*len < sizeof rec) {
+		errno = ENOSPC;
+		return (-1);
+	}
+	if (key->keylen > sizeof rec.key) {
+		errno = EINVAL;
+		return (-1);
+	}
+	memset(&rec, 0, sizeof rec);
+	rec.magic = OTP_KEYREC_MAGIC;
+	rec.version = OTP_KEYREC_VERSION;
+	rec.mode = key->mode;
+	rec.hash = key->hash;
+	rec.digits = key->digits;
+	rec.keylen = key->keylen;
+	rec.timestep = key->timestep;
+	rec.counter = key->counter;
+	rec.lastused = key->lastused;
+	n = key->labellen < sizeof rec.label - 1 ?
+	    key->labellen : sizeof rec.label - 1;
+	memcpy(rec.label, key->label, n);
+	n = key->issuerlen < sizeof rec.issuer - 1 ?
+	    key->issuerlen : sizeof rec.issuer - 1;
+	memcpy(rec.issuer, key->issuer, n);
+	memcpy(rec.key, key->key, key->keylen);
+	memcpy(buf, &rec, sizeof rec);
+	otp_wipe(&rec, sizeof rec);
+	*len = sizeof rec;
+	return (0);
+}
+
+/*
+ * Encode a key for transmission to another host.  The record has the
+ * same layout as a binary key record, but its multi-byte fields are in
+ * network byte order.  Takes and returns the same as
+ * otp_key_to_binary().
+ */
+int
+otp_key_to_wire(const oath_key *key, void *buf, size_t *len)
+{
+	struct otp_keyrec rec;
+	size_t reclen;
+
+	reclen = sizeof rec;
+	if (*len < sizeof rec) {
+		errno = ENOSPC;
+		return (-1);
+	}
+	if (otp_key_to_binary(key, &rec, &reclen) != 0)
+		return (-1);
+	be32enc(&rec.magic, rec.magic);
+	be32enc(&rec.version, rec.version);
+	be32enc(&rec.timestep, rec.timestep);
+	be64enc(&rec.counter, rec.counter);
+	be64enc(&rec.lastused, rec.lastused);
+	memcpy(buf, &rec, sizeof rec);
+	otp_wipe(&rec, sizeof rec);
+	*len = sizeof rec;
+	return (0);
+}
+
+/*
+ * Decode a key encoded by otp_key_to_wire(), which must be exactly len
+ * bytes long.  Returns 0 on success and -1 with errno set to EINVAL if
+ * the record is malformed.
+ */
+int
+otp_key_from_wire(oath_key *key, const void *buf, size_t len)
+{
+	struct otp_keyrec rec;
+	int ret;
+
+	memset(key, 0, sizeof *key);
+	if (len != sizeof rec) {
+		errno = EINVAL;
+		return (-1);
+	}
+	memcpy(&rec, buf, sizeof rec);
+	rec.magic = be32dec(&rec.magic);
+	rec.version = be32dec(&rec.version);
+	rec.timestep = be32dec(&rec.timestep);
+	rec.counter = be64dec(&rec.counter);
+	rec.lastused = be64dec(&rec.lastused);
+	ret = otp_keyrec_parse(key, &rec, sizeof rec, NULL);
+	otp_wipe(&rec, sizeof rec);
+	return (ret < 0 ? -1 : 0);
+}
+
+/*
+ * Write a key's counter (HOTP) or last used time step (TOTP) back to
+ * a binary key file, in place, and wait for it to reach stable
+ * storage.  The rest of the record is not touched, so the caller must
+ * make sure the file holds the key the value belongs to, typically by
+ * holding a lock on it since it was loaded.  Returns 0 on success and
+ * -1 on error.
+ */
+int
+otp_key_update(const oath_key *key, int fd)
+{
+	uint64_t val;
+	off_t off;
+
+	switch (key->mode) {
+	case om_hotp:
+		val = key->counter;
+		off = offsetof(struct otp_keyrec, counter);
+		break;
+	case om_totp:
+		val = key->lastused;
+		off = offsetof(struct otp_keyrec, lastused);
+		break;
+	default:
+		errno = EINVAL;
+		return (-1);
+	}
+	if (pwrite(fd, &val, sizeof val, off) != (ssize_t)sizeof val ||
+	    fdatasync(fd) != 0)
+		return (-1);
+	return (0);
+}
+
+/*
+ * Read a key's counter and last used time step back from a binary key
+ * file, in place.  This is the converse of otp_key_update(), for
+ * callers which keep a parsed copy of a key and need to pick up
+ * changes made through another descriptor or by another process.
+ * Returns 0 on success and -1 on error, in which case the key is left
+ * untouched.
+ */
+int
+otp_key_refresh(oath_key *key, int fd)
+{
+	uint64_t val[2];
+	ssize_t rlen;
+
+	/* the two fields are adjacent */
+	if ((rlen = pread(fd, val, sizeof val,
+	    offsetof(struct otp_keyrec, counter))) != (ssize_t)sizeof val) {
+		if (rlen >= 0)
+			errno = EINVAL;
+		return (-1);
+	}
+	key->counter = val[0];
+	key->lastused = val[1];
+	return (0);
+}
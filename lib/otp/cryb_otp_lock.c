@@ -0,0 +1,74 @@
+/*-
+ * Copyright (c) 2026 Dag-Erling Smørgrav
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "cryb/impl.h"
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <cryb/oath.h>
+#include <cryb/otp.h>
+
+#include "cryb_otp_impl.h"
+
+/*
+ * Striped table of per-user locks.  Each user hashes to one of
+ * OTP_USER_NLOCKS mutexes, each on its own cache line, so unrelated
+ * users only contend if they happen to share a stripe.
+ */
+static struct otp_user_lock {
+	pthread_mutex_t		 mtx;
+} __attribute__((__aligned__(64))) otp_user_locks[OTP_USER_NLOCKS] = {
+	[0 ... OTP_USER_NLOCKS - 1] = { PTHREAD_MUTEX_INITIALIZER },
+};
+
+static inline pthread_mutex_t *
+otp_user_mutex(const char *user)
+{
+
+	return (&otp_user_locks[otp_strhash(user) % OTP_USER_NLOCKS].mtx);
+}
+
+/*
+ * Serialize operations on a user's key within the calling process.
+ */
+void
+otp_user_lock(const char *user)
+{
+
+	pthread_mutex_lock(otp_user_mutex(user));
+}
+
+void
+otp_user_unlock(const char *user)
+{
+
+	pthread_mutex_unlock(otp_user_mutex(user));
+}
@@ -0,0 +1,247 @@
+/*-
+ * Copyright (c) 2026 Dag-Erling Smørgrav
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "cryb/impl.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#include <cryb/oath.h>
+#include <cryb/otp.h>
+
+#include "cryb_otp_impl.h"
+
+/*
+ * The scan loops are written as always-inline helpers so that the
+ * wrappers below can instantiate them with the default windows as
+ * compile-time constants.  For the default policy, the chunking logic
+ * folds away and the entire window is computed in a single call to
+ * otp_hmac_codes() with a constant lane count.
+ */
+static inline __attribute__((__always_inline__)) int
+otp_hotp_scan(const struct otp_hmac *hm, oath_key *key,
+    unsigned long response, unsigned int window)
+{
+	unsigned int codes[OTP_MB_MAXLANES];
+	unsigned int i, j, n;
+
+	for (i = 0; i < window; i += n) {
+		n = window - i < OTP_MB_MAXLANES ? window - i : OTP_MB_MAXLANES;
+		otp_hmac_codes(hm, key->counter + i, n, codes);
+		for (j = 0; j < n; ++j) {
+			if (codes[j] == response) {
+				key->counter += i + j + 1;
+				return (1);
+			}
+		}
+	}
+	return (0);
+}
+
+static inline __attribute__((__always_inline__)) int
+otp_totp_scan(const struct otp_hmac *hm, oath_key *key,
+    unsigned long response, unsigned int behind, unsigned int ahead,
+    int skew, time_t now)
+{
+	unsigned int codes[OTP_MB_MAXLANES];
+	uint64_t first, last, seq;
+	unsigned int j, n;
+
+	seq = (uint64_t)now / key->timestep;
+	if (skew < 0)
+		seq = seq > (uint64_t)-(int64_t)skew ? seq + skew : 0;
+	else
+		seq += skew;
+	first = seq > behind ? seq - behind : 0;
+	last = seq + ahead;
+	if (key->lastused >= last)
+		return (0);
+	if (first <= key->lastused)
+		first = key->lastused + 1;
+	for (seq = first; seq <= last; seq += n) {
+		n = last - seq < OTP_MB_MAXLANES ?
+		    last - seq + 1 : OTP_MB_MAXLANES;
+		otp_hmac_codes(hm, seq, n, codes);
+		for (j = 0; j < n; ++j) {
+			if (codes[j] == response) {
+				key->lastused = seq + j;
+				return (1);
+			}
+		}
+	}
+	return (0);
+}
+
+/*
+ * Constant-time variants.  The entire window is always computed, even
+ * the parts of a TOTP window which have already been used, and every
+ * code is compared without branching on the result, so the cost
+ * depends only on the size of the window, not on whether or where the
+ * response matched.  The first match wins, as above.
+ */
+static inline __attribute__((__always_inline__)) uint64_t
+otp_ct_eq(uint64_t a, uint64_t b)
+{
+	uint64_t d;
+
+	/* 1 if a == b, otherwise 0 */
+	d = a ^ b;
+	return (((d | -d) >> 63) ^ 1);
+}
+
+static inline __attribute__((__always_inline__)) int
+otp_hotp_scan_ct(const struct otp_hmac *hm, oath_key *key,
+    unsigned long response, unsigned int window)
+{
+	unsigned int codes[OTP_MB_MAXLANES];
+	unsigned int i, j, n;
+	uint64_t found, hit, pos;
+
+	found = pos = 0;
+	for (i = 0; i < window; i += n) {
+		n = window - i < OTP_MB_MAXLANES ? window - i : OTP_MB_MAXLANES;
+		otp_hmac_codes(hm, key->counter + i, n, codes);
+		for (j = 0; j < n; ++j) {
+			hit = otp_ct_eq(codes[j], response) & ~found;
+			pos |= -hit & (i + j + 1);
+			found |= hit;
+		}
+	}
+	otp_wipe(codes, sizeof codes);
+	key->counter += pos;
+	return ((int)found);
+}
+
+static inline __attribute__((__always_inline__)) int
+otp_totp_scan_ct(const struct otp_hmac *hm, oath_key *key,
+    unsigned long response, unsigned int behind, unsigned int ahead,
+    int skew, time_t now)
+{
+	unsigned int codes[OTP_MB_MAXLANES];
+	uint64_t first, last, seq;
+	uint64_t found, hit, step;
+	unsigned int j, n;
+
+	seq = (uint64_t)now / key->timestep;
+	if (skew < 0)
+		seq = seq > (uint64_t)-(int64_t)skew ? seq + skew : 0;
+	else
+		seq += skew;
+	first = seq > behind ? seq - behind : 0;
+	last = seq + ahead;
+	found = step = 0;
+	for (seq = first; seq <= last; seq += n) {
+		n = last - seq < OTP_MB_MAXLANES ?
+		    last - seq + 1 : OTP_MB_MAXLANES;
+		otp_hmac_codes(hm, seq, n, codes);
+		for (j = 0; j < n; ++j) {
+			/* only time steps after the last used one count */
+			hit = otp_ct_eq(codes[j], response) &
+			    ((key->lastused - (seq + j)) >> 63) & ~found;
+			step |= -hit & (seq + j);
+			found |= hit;
+		}
+	}
+	otp_wipe(codes, sizeof codes);
+	key->lastused = (key->lastused & (found - 1)) | step;
+	return ((int)found);
+}
+
+/*
+ * Look for a matching HOTP code among the next window codes.  On
+ * success, the counter is advanced past the match.  Returns 1 on
+ * success, 0 on failure and -1 on error.
+ */
+int
+otp_hotp_match(const struct otp_hmac *hm, oath_key *key,
+    unsigned long response, unsigned int window)
+{
+
+	if (key->mode != om_hotp || window < 1 ||
+	    key->counter >= UINT64_MAX - window)
+		return (-1);
+	if (window == HOTP_WINDOW)
+		return (otp_hotp_scan(hm, key, response, HOTP_WINDOW));
+	return (otp_hotp_scan(hm, key, response, window));
+}
+
+/*
+ * Look for a matching TOTP code between behind time steps before and
+ * ahead time steps after the given time adjusted by skew time steps,
+ * skipping any time steps that have already been used.  On success,
+ * the matching time step is recorded as the last used.  Returns 1 on
+ * success, 0 on failure and -1 on error.
+ */
+int
+otp_totp_match(const struct otp_hmac *hm, oath_key *key,
+    unsigned long response, unsigned int behind, unsigned int ahead,
+    int skew, time_t now)
+{
+
+	if (key->mode != om_totp || key->timestep == 0 || now < 0)
+		return (-1);
+	if (behind == TOTP_WINDOW && ahead == TOTP_WINDOW && skew == 0) {
+		return (otp_totp_scan(hm, key, response,
+		    TOTP_WINDOW, TOTP_WINDOW, 0, now));
+	}
+	return (otp_totp_scan(hm, key, response, behind, ahead, skew, now));
+}
+
+/*
+ * Same as otp_hotp_match() and otp_totp_match(), but in constant time.
+ */
+int
+otp_hotp_match_ct(const struct otp_hmac *hm, oath_key *key,
+    unsigned long response, unsigned int window)
+{
+
+	if (key->mode != om_hotp || window < 1 ||
+	    key->counter >= UINT64_MAX - window)
+		return (-1);
+	if (window == HOTP_WINDOW)
+		return (otp_hotp_scan_ct(hm, key, response, HOTP_WINDOW));
+	return (otp_hotp_scan_ct(hm, key, response, window));
+}
+
+int
+otp_totp_match_ct(const struct otp_hmac *hm, oath_key *key,
+    unsigned long response, unsigned int behind, unsigned int ahead,
+    int skew, time_t now)
+{
+
+	if (key->mode != om_totp || key->timestep == 0 || now < 0)
+		return (-1);
+	if (behind == TOTP_WINDOW && ahead == TOTP_WINDOW && skew == 0) {
+		return (otp_totp_scan_ct(hm, key, response,
+		    TOTP_WINDOW, TOTP_WINDOW, 0, now));
+	}
+	return (otp_totp_scan_ct(hm, key, response, behind, ahead, skew,
+	    now));
+}
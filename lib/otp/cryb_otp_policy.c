@@ -0,0 +1,76 @@
+/*-
+ * Copyright (c) 2026 Dag-Erling Smørgrav
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "cryb/impl.h"
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <cryb/oath.h>
+#include <cryb/otp.h>
+
+#include "cryb_otp_impl.h"
+
+/*
+ * Initialize a verification policy with the default windows.
+ */
+void
+otp_policy_init(otp_policy *pol)
+{
+
+	pol->hotp_lookahead = HOTP_WINDOW;
+	pol->totp_lookahead = TOTP_WINDOW;
+	pol->totp_lookbehind = TOTP_WINDOW;
+	pol->totp_skew = 0;
+	pol->resync_window = OTP_RESYNC_MAXWINDOW;
+	pol->flags = 0;
+}
+
+/*
+ * Check that a verification policy is within bounds.  Returns 0 if it
+ * is and -1 with errno set to EINVAL if it is not.
+ */
+int
+otp_policy_check(const otp_policy *pol)
+{
+
+	if (pol->hotp_lookahead < 1 ||
+	    pol->hotp_lookahead > OTP_RESYNC_MAXWINDOW ||
+	    pol->totp_lookahead > OTP_RESYNC_MAXWINDOW ||
+	    pol->totp_lookbehind > OTP_RESYNC_MAXWINDOW ||
+	    pol->totp_skew > OTP_RESYNC_MAXWINDOW ||
+	    pol->totp_skew < -OTP_RESYNC_MAXWINDOW ||
+	    pol->resync_window > OTP_RESYNC_MAXWINDOW ||
+	    (pol->flags & ~OTP_POLICY_CONSTTIME) != 0) {
+		errno = EINVAL;
+		return (-1);
+	}
+	return (0);
+}
@@ -0,0 +1,779 @@
+/*-
+ * Copyright (c) 2026 Dag-Erling Smørgrav
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "cryb/impl.h"
+
+#include <sys/types.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <cryb/endian.h>
+#include <cryb/oath.h>
+#include <cryb/otp.h>
+
+#include "cryb_otp_impl.h"
+
+/*
+ * Counter replication between nodes which share a set of keys, such as
+ * a primary and a backup instance of otpradiusd.  Every counter advance
+ * on one node is sent to its peers, which raise their own copy of the
+ * counter to match.  Raising a counter to at least some value is
+ * idempotent and commutative, so replicas converge no matter in which
+ * order or how many times they hear of an advance, and verification
+ * never waits for a peer.  The price is that an advance made just
+ * before a node dies may not reach its peers.
+ *
+ * Each node pushes to each of its peers over a connection of its own,
+ * in batches.  Whenever a connection is established, and whenever a
+ * peer falls so far behind that its queue overflows, the sender starts
+ * over with a snapshot of every counter in its store, which is how a
+ * node that was down or unreachable catches up.
+ *
+ * Only counters are replicated.  Keys must be provisioned on every
+ * node, and advances for users a node does not know are ignored.
+ *
+ * Every node shares a secret, with which each connection is
+ * authenticated and each frame is tagged, so only peers can push
+ * advances.  Even so, an advance which no peer could have made by
+ * verifying or resynchronizing is ignored, and a connection which
+ * does not complete the handshake, or goes quiet, is closed, so
+ * strangers cannot tie up the slots reserved for peers.
+ */
+
+/*
+ * Encode a record.  Returns its length, or 0 if it cannot be encoded.
+ */
+static size_t
+otp_repl_encode(uint8_t *p, const char *user, oath_mode mode,
+    uint64_t value)
+{
+	size_t userlen;
+
+	userlen = strlen(user);
+	if (userlen == 0 || userlen > OTP_REPL_MAXREC - OTP_REPL_HDRLEN ||
+	    (mode != om_hotp && mode != om_totp))
+		return (0);
+	p[0] = mode;
+	p[1] = userlen;
+	be64enc(p + 2, value);
+	memcpy(p + OTP_REPL_HDRLEN, user, userlen);
+	return (OTP_REPL_HDRLEN + userlen);
+}
+
+/*
+ * Queue an advance for every connected peer.  The sender is woken when
+ * a batch starts, so it can wait a little for the rest, and when a
+ * batch is full.  A peer whose queue is full gets a snapshot instead.
+ */
+void
+otp_repl_publish(otp_repl *repl, const char *user, oath_mode mode,
+    uint64_t value)
+{
+	uint8_t rec[OTP_REPL_MAXREC];
+	struct otp_repl_peer *rp;
+	unsigned int i;
+	size_t len;
+
+	if ((len = otp_repl_encode(rec, user, mode, value)) == 0)
+		return;
+	for (i = 0; i < repl->npeers; ++i) {
+		rp = &repl->peers[i];
+		pthread_mutex_lock(&rp->mtx);
+		if (rp->connected && !rp->overflow) {
+			if (rp->buflen + len > OTP_REPL_MAXQUEUE) {
+				rp->overflow = 1;
+				rp->buflen = 0;
+				pthread_cond_signal(&rp->cv);
+			} else {
+				memcpy(rp->buf + rp->buflen, rec, len);
+				rp->buflen += len;
+				if (rp->buflen == len ||
+				    rp->buflen >= OTP_REPL_BATCH)
+					pthread_cond_signal(&rp->cv);
+			}
+		}
+		pthread_mutex_unlock(&rp->mtx);
+	}
+}
+
+/*
+ * Send the contents of a buffer.
+ */
+static int
+otp_repl_send(int fd, const uint8_t *buf, size_t len)
+{
+	ssize_t wlen;
+	size_t off;
+
+	for (off = 0; off < len; off += wlen) {
+		if ((wlen = send(fd, buf + off, len - off, MSG_NOSIGNAL)) < 0) {
+			if (errno == EINTR) {
+				wlen = 0;
+				continue;
+			}
+			return (-1);
+		}
+	}
+	return (0);
+}
+
+/*
+ * Send records in a single frame.
+ */
+static int
+otp_repl_frame(struct otp_repl_peer *rp, const uint8_t *recs, size_t len)
+{
+
+	be32enc(rp->frame, len);
+	memcpy(rp->frame + OTP_REPL_FRAMEHDR, recs, len);
+	otp_auth_sign(rp->auth, rp->frame, OTP_REPL_FRAMEHDR + len,
+	    rp->frame + OTP_REPL_FRAMEHDR + len);
+	return (otp_repl_send(rp->fd, rp->frame,
+	    OTP_REPL_FRAMEHDR + len + OTP_AUTH_TAGLEN));
+}
+
+/*
+ * Send a queue of records in as many frames as it takes, or an empty
+ * frame, which serves as a keepalive, if there are none.
+ */
+static int
+otp_repl_flush(struct otp_repl_peer *rp, const uint8_t *buf, size_t len)
+{
+	size_t n, off, reclen;
+
+	off = 0;
+	do {
+		for (n = 0; off + n < len; n += reclen) {
+			reclen = OTP_REPL_HDRLEN + buf[off + n + 1];
+			if (n + reclen > OTP_REPL_MAXFRAME)
+				break;
+		}
+		if (otp_repl_frame(rp, buf + off, n) != 0)
+			return (-1);
+		off += n;
+	} while (off < len);
+	return (0);
+}
+
+/*
+ * Send every counter in the store.  Advances made while the snapshot
+ * is being taken are also queued, and are sent afterwards, even though
+ * the snapshot may already reflect them.
+ */
+static int
+otp_repl_snapshot(struct otp_repl_peer *rp)
+{
+	char user[OTP_REPL_MAXREC - OTP_REPL_HDRLEN + 1];
+	uint32_t cursor;
+	oath_key key;
+	size_t len;
+	int ret;
+
+	len = 0;
+	cursor = 0;
+	while ((ret = otp_store_next(rp->st, &cursor, user,
+	    sizeof user)) > 0) {
+		/* removed since we saw it */
+		if (otp_store_lookup(rp->st, user, &key) != 0)
+			continue;
+		len += otp_repl_encode(rp->spare + len, user, key.mode,
+		    key.mode == om_hotp ? key.counter : key.lastused);
+		otp_key_destroy(&key);
+		if (len > OTP_REPL_MAXFRAME - OTP_REPL_MAXREC) {
+			if (otp_repl_frame(rp, rp->spare, len) != 0)
+				return (-1);
+			len = 0;
+		}
+	}
+	if (ret < 0)
+		return (-1);
+	return (otp_repl_frame(rp, rp->spare, len));
+}
+
+/*
+ * Wait up to the given number of milliseconds for something to happen.
+ * The caller must hold the peer's lock.
+ */
+static void
+otp_repl_wait(struct otp_repl_peer *rp, unsigned int ms)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	ts.tv_sec += ms / 1000;
+	ts.tv_nsec += (ms % 1000) * 1000000L;
+	if (ts.tv_nsec >= 1000000000L) {
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000L;
+	}
+	pthread_cond_timedwait(&rp->cv, &rp->mtx, &ts);
+}
+
+/*
+ * Connect to a peer and authenticate: receive its nonce, then send
+ * ours and the stream header.  A peer which stops reading would
+ * otherwise stall its sender forever, so give up on it after a while
+ * and start over.
+ */
+static int
+otp_repl_connect(struct otp_repl_peer *rp)
+{
+	uint8_t buf[OTP_AUTH_NONCELEN + OTP_REPL_HELLOLEN + OTP_AUTH_TAGLEN];
+	uint8_t nonce[OTP_AUTH_NONCELEN];
+	struct timeval tv;
+	uint8_t *p;
+	int fd;
+
+	if ((fd = otp_connect(rp->addr)) < 0)
+		return (-1);
+	tv.tv_sec = OTP_REPL_TIMEOUT;
+	tv.tv_usec = 0;
+	(void)setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof tv);
+	(void)setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof tv);
+	if (recv(fd, nonce, sizeof nonce, MSG_WAITALL) !=
+	    (ssize_t)sizeof nonce || otp_auth_nonce(buf) != 0 ||
+	    (rp->auth = otp_auth_create(rp->repl->secret, nonce, buf,
+		OTP_AUTH_INITIATOR)) == NULL) {
+		close(fd);
+		return (-1);
+	}
+	p = buf + OTP_AUTH_NONCELEN;
+	be32enc(p, OTP_REPL_MAGIC);
+	be32enc(p + 4, OTP_REPL_VERSION);
+	otp_auth_sign(rp->auth, p, OTP_REPL_HELLOLEN, p + OTP_REPL_HELLOLEN);
+	if (otp_repl_send(fd, buf, sizeof buf) != 0) {
+		otp_auth_destroy(rp->auth);
+		rp->auth = NULL;
+		close(fd);
+		return (-1);
+	}
+	return (fd);
+}
+
+/*
+ * Check whether the peer is still there.  Peers send nothing after
+ * their nonce, so if the socket is readable, the connection has been
+ * closed.
+ */
+static int
+otp_repl_alive(int fd)
+{
+	uint8_t b;
+	ssize_t rlen;
+
+	rlen = recv(fd, &b, 1, MSG_DONTWAIT|MSG_PEEK);
+	return (rlen < 0 && (errno == EAGAIN || errno == EWOULDBLOCK));
+}
+
+/*
+ * Drop the connection to a peer.  The caller must hold the peer's lock.
+ */
+static void
+otp_repl_drop(struct otp_repl_peer *rp)
+{
+
+	close(rp->fd);
+	rp->fd = -1;
+	otp_auth_destroy(rp->auth);
+	rp->auth = NULL;
+	rp->connected = 0;
+	rp->buflen = 0;
+}
+
+/*
+ * Sender thread: one per peer.  Connect, send a snapshot, then send
+ * batches of advances as they are queued, or keepalives if there are
+ * none, until told to stop.  If anything goes wrong, drop the
+ * connection and try again later.
+ */
+static void *
+otp_repl_sender(void *arg)
+{
+	struct otp_repl_peer *rp = arg;
+	uint8_t *p;
+	size_t len;
+	int fd, ret, snap;
+
+	pthread_mutex_lock(&rp->mtx);
+	while (!rp->stopping) {
+		if (rp->fd < 0) {
+			pthread_mutex_unlock(&rp->mtx);
+			fd = otp_repl_connect(rp);
+			pthread_mutex_lock(&rp->mtx);
+			if (fd < 0) {
+				if (!rp->stopping)
+					otp_repl_wait(rp, OTP_REPL_BACKOFF);
+				continue;
+			}
+			rp->fd = fd;
+			rp->connected = 1;
+			rp->overflow = 1;
+			rp->buflen = 0;
+		}
+		/*
+		 * While idle, check periodically that the peer has not
+		 * gone away, so that it gets a snapshot when it returns
+		 * rather than whenever we next have something to send,
+		 * and let it know that we have not gone away either.
+		 */
+		if (!rp->stopping && !rp->overflow && rp->buflen == 0) {
+			otp_repl_wait(rp, OTP_REPL_KEEPALIVE);
+			if (!otp_repl_alive(rp->fd)) {
+				otp_repl_drop(rp);
+				continue;
+			}
+		}
+		/* give the batch a chance to fill up */
+		if (!rp->stopping && !rp->overflow && rp->buflen > 0 &&
+		    rp->buflen < OTP_REPL_BATCH)
+			otp_repl_wait(rp, OTP_REPL_INTERVAL);
+		snap = rp->overflow;
+		rp->overflow = 0;
+		p = rp->buf;
+		rp->buf = rp->spare;
+		rp->spare = p;
+		len = rp->buflen;
+		rp->buflen = 0;
+		pthread_mutex_unlock(&rp->mtx);
+		if (snap)
+			ret = otp_repl_snapshot(rp);
+		else
+			ret = otp_repl_flush(rp, rp->spare, len);
+		pthread_mutex_lock(&rp->mtx);
+		if (ret != 0)
+			otp_repl_drop(rp);
+	}
+	pthread_mutex_unlock(&rp->mtx);
+	return (NULL);
+}
+
+/*
+ * Monotonic time in seconds, for connection timeouts.
+ */
+static time_t
+otp_repl_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec);
+}
+
+/*
+ * Close a connection from a peer.
+ */
+static void
+otp_repl_close(otp_repl *repl, unsigned int i)
+{
+	struct otp_repl_conn *c;
+
+	if ((c = repl->conns[i]) == NULL)
+		return;
+	close(c->fd);
+	otp_auth_destroy(c->auth);
+	free(c);
+	repl->conns[i] = NULL;
+}
+
+/*
+ * Find a free connection slot.  If there is none, make one by closing
+ * the connection which has waited longest for its hello, so strangers
+ * cannot crowd out peers which have authenticated.  Returns -1 if
+ * every slot is taken by an authenticated peer.
+ */
+static int
+otp_repl_slot(otp_repl *repl)
+{
+	struct otp_repl_conn *c;
+	unsigned int i;
+	int victim;
+
+	victim = -1;
+	for (i = 0; i < OTP_REPL_MAXPEERS; ++i) {
+		if ((c = repl->conns[i]) == NULL)
+			return (i);
+		if (c->auth == NULL && (victim < 0 ||
+		    c->last < repl->conns[victim]->last))
+			victim = i;
+	}
+	if (victim >= 0)
+		otp_repl_close(repl, victim);
+	return (victim);
+}
+
+/*
+ * Accept as many pending connections as we can, and send each our
+ * nonce.
+ */
+static void
+otp_repl_accept(otp_repl *repl)
+{
+	struct otp_repl_conn *c;
+	int fd, i;
+
+	while ((fd = accept4(repl->lsock, NULL, NULL, SOCK_CLOEXEC)) >= 0) {
+		if ((i = otp_repl_slot(repl)) < 0 ||
+		    (c = calloc(1, sizeof *c)) == NULL) {
+			close(fd);
+			continue;
+		}
+		if (otp_auth_nonce(c->nonce) != 0 ||
+		    send(fd, c->nonce, sizeof c->nonce,
+			MSG_DONTWAIT|MSG_NOSIGNAL) < (ssize_t)sizeof c->nonce) {
+			free(c);
+			close(fd);
+			continue;
+		}
+		c->fd = fd;
+		c->last = otp_repl_now();
+		repl->conns[i] = c;
+	}
+}
+
+/*
+ * Merge the records in a frame.  Returns -1 if the frame is malformed.
+ */
+static int
+otp_repl_merge(otp_repl *repl, const uint8_t *p, size_t len)
+{
+	char user[OTP_REPL_MAXREC - OTP_REPL_HDRLEN + 1];
+	const uint8_t *end;
+	size_t userlen;
+
+	for (end = p + len; p < end; p += OTP_REPL_HDRLEN + userlen) {
+		if (end - p < OTP_REPL_HDRLEN)
+			return (-1);
+		userlen = p[1];
+		if ((p[0] != om_hotp && p[0] != om_totp) ||
+		    userlen == 0 || userlen >= sizeof user ||
+		    (size_t)(end - p) < OTP_REPL_HDRLEN + userlen)
+			return (-1);
+		memcpy(user, p + OTP_REPL_HDRLEN, userlen);
+		user[userlen] = '\0';
+		if (strlen(user) != userlen)
+			return (-1);
+		/*
+		 * Fails if we do not know the user, which is fine, or if
+		 * the advance is implausible, in which case we keep what
+		 * we have.
+		 */
+		(void)otp_store_merge(repl->st, user, (oath_mode)p[0],
+		    be64dec(p + 2), OTP_STORE_MERGE_PEER);
+	}
+	return (0);
+}
+
+/*
+ * Read from a peer, check its hello, and merge every complete frame.
+ * Returns -1 if the connection should be closed.
+ */
+static int
+otp_repl_recv(otp_repl *repl, struct otp_repl_conn *c)
+{
+	const uint8_t *p, *end;
+	ssize_t rlen;
+	size_t len;
+
+	rlen = recv(c->fd, c->buf + c->len, sizeof c->buf - c->len, 0);
+	if (rlen <= 0)
+		return (rlen < 0 && errno == EINTR ? 0 : -1);
+	c->len += rlen;
+	p = c->buf;
+	end = p + c->len;
+	if (c->auth == NULL) {
+		if (end - p < OTP_AUTH_NONCELEN + OTP_REPL_HELLOLEN +
+		    OTP_AUTH_TAGLEN)
+			return (0);
+		if ((c->auth = otp_auth_create(repl->secret, c->nonce, p,
+		    OTP_AUTH_ACCEPTOR)) == NULL)
+			return (-1);
+		p += OTP_AUTH_NONCELEN;
+		if (otp_auth_check(c->auth, p, OTP_REPL_HELLOLEN,
+		    p + OTP_REPL_HELLOLEN) != 0 ||
+		    be32dec(p) != OTP_REPL_MAGIC ||
+		    be32dec(p + 4) != OTP_REPL_VERSION)
+			return (-1);
+		p += OTP_REPL_HELLOLEN + OTP_AUTH_TAGLEN;
+		c->last = otp_repl_now();
+	}
+	while (end - p >= OTP_REPL_FRAMEHDR) {
+		if ((len = be32dec(p)) > OTP_REPL_MAXFRAME)
+			return (-1);
+		if ((size_t)(end - p) <
+		    OTP_REPL_FRAMEHDR + len + OTP_AUTH_TAGLEN)
+			break;
+		if (otp_auth_check(c->auth, p, OTP_REPL_FRAMEHDR + len,
+		    p + OTP_REPL_FRAMEHDR + len) != 0 ||
+		    otp_repl_merge(repl, p + OTP_REPL_FRAMEHDR, len) != 0)
+			return (-1);
+		p += OTP_REPL_FRAMEHDR + len + OTP_AUTH_TAGLEN;
+		c->last = otp_repl_now();
+	}
+	c->len = end - p;
+	memmove(c->buf, p, c->len);
+	return (0);
+}
+
+/*
+ * Receiver thread: accept connections from peers and merge what they
+ * send us, until told to stop.  Connections which have not completed
+ * the handshake or sent a frame for a while are closed; peers send
+ * keepalives, so they are not.
+ */
+static void *
+otp_repl_receiver(void *arg)
+{
+	otp_repl *repl = arg;
+	struct pollfd pfd[2 + OTP_REPL_MAXPEERS];
+	struct otp_repl_conn *c;
+	unsigned int i;
+	time_t now;
+
+	for (;;) {
+		pfd[0].fd = repl->stopfd;
+		pfd[0].events = POLLIN;
+		pfd[1].fd = repl->lsock;
+		pfd[1].events = POLLIN;
+		for (i = 0; i < OTP_REPL_MAXPEERS; ++i) {
+			c = repl->conns[i];
+			pfd[2 + i].fd = c != NULL ? c->fd : -1;
+			pfd[2 + i].events = POLLIN;
+		}
+		if (poll(pfd, 2 + OTP_REPL_MAXPEERS,
+		    OTP_REPL_KEEPALIVE) < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		if (pfd[0].revents != 0)
+			break;
+		now = otp_repl_now();
+		for (i = 0; i < OTP_REPL_MAXPEERS; ++i) {
+			if ((c = repl->conns[i]) == NULL)
+				continue;
+			if (pfd[2 + i].revents != 0 &&
+			    otp_repl_recv(repl, c) != 0)
+				otp_repl_close(repl, i);
+			else if (now - c->last > OTP_REPL_TIMEOUT)
+				otp_repl_close(repl, i);
+		}
+		if (pfd[1].revents != 0)
+			otp_repl_accept(repl);
+	}
+	return (NULL);
+}
+
+/*
+ * Create the listening socket.
+ */
+static int
+otp_repl_listen(otp_repl *repl, const char *addr)
+{
+	struct addrinfo hints, *ai;
+	char host[256];
+	const char *port;
+	int one, ret;
+
+	if (otp_addr_split(addr, host, sizeof host, &port) != 0)
+		return (-1);
+	memset(&hints, 0, sizeof hints);
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE;
+	if ((ret = getaddrinfo(*host != '\0' ? host : NULL, port, &hints,
+	    &ai)) != 0) {
+		if (ret != EAI_SYSTEM)
+			errno = EADDRNOTAVAIL;
+		return (-1);
+	}
+	one = 1;
+	ret = -1;
+	if ((repl->lsock = socket(ai->ai_family,
+	    SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, ai->ai_protocol)) >= 0 &&
+	    setsockopt(repl->lsock, SOL_SOCKET, SO_REUSEADDR,
+		&one, sizeof one) == 0 &&
+	    bind(repl->lsock, ai->ai_addr, ai->ai_addrlen) == 0 &&
+	    listen(repl->lsock, OTP_REPL_MAXPEERS) == 0)
+		ret = 0;
+	freeaddrinfo(ai);
+	return (ret);
+}
+
+/*
+ * Create a replicator for the key store at the given path, which
+ * receives advances from peers on the given TCP address, if listen is
+ * not NULL, and sends advances to the given peers.  Connections in
+ * either direction are authenticated with the given secret, which
+ * every peer must share, and which must outlive the replicator.
+ * Nothing happens until otp_repl_start() is called, so the caller can
+ * detach from its terminal in between.  Advances are only sent for
+ * handles on the store which have been passed to otp_store_set_repl().
+ */
+otp_repl *
+otp_repl_create(const char *storepath, const otp_secret *secret,
+    const char *listen, const char *const *peers, unsigned int npeers)
+{
+	struct otp_repl_peer *rp;
+	pthread_condattr_t ca;
+	otp_repl *repl;
+	unsigned int i;
+	int serrno;
+
+	if (secret == NULL || npeers > OTP_REPL_MAXPEERS) {
+		errno = EINVAL;
+		return (NULL);
+	}
+	if ((repl = calloc(1, sizeof *repl)) == NULL)
+		return (NULL);
+	repl->secret = secret;
+	repl->lsock = repl->stopfd = -1;
+	if ((repl->peers = calloc(npeers ? npeers : 1,
+	    sizeof *repl->peers)) == NULL)
+		goto fail;
+	pthread_condattr_init(&ca);
+	pthread_condattr_setclock(&ca, CLOCK_MONOTONIC);
+	for (i = 0; i < npeers; ++i) {
+		rp = &repl->peers[i];
+		rp->repl = repl;
+		rp->fd = -1;
+		pthread_mutex_init(&rp->mtx, NULL);
+		pthread_cond_init(&rp->cv, &ca);
+		repl->npeers++;
+		if ((rp->addr = strdup(peers[i])) == NULL ||
+		    (rp->buf = malloc(OTP_REPL_MAXQUEUE)) == NULL ||
+		    (rp->spare = malloc(OTP_REPL_MAXQUEUE)) == NULL ||
+		    (rp->st = otp_store_open(storepath, O_RDONLY)) == NULL) {
+			pthread_condattr_destroy(&ca);
+			goto fail;
+		}
+	}
+	pthread_condattr_destroy(&ca);
+	if (listen != NULL &&
+	    ((repl->st = otp_store_open(storepath, O_RDWR)) == NULL ||
+	    otp_repl_listen(repl, listen) != 0))
+		goto fail;
+	if ((repl->stopfd = eventfd(0, EFD_CLOEXEC)) < 0)
+		goto fail;
+	return (repl);
+fail:
+	serrno = errno;
+	otp_repl_destroy(repl);
+	errno = serrno;
+	return (NULL);
+}
+
+/*
+ * Start sending to and receiving from peers.
+ */
+int
+otp_repl_start(otp_repl *repl)
+{
+	struct otp_repl_peer *rp;
+	unsigned int i;
+	int ret;
+
+	if (repl->lsock >= 0 && !repl->started) {
+		if ((ret = pthread_create(&repl->thr, NULL,
+		    otp_repl_receiver, repl)) != 0) {
+			errno = ret;
+			return (-1);
+		}
+		repl->started = 1;
+	}
+	for (i = 0; i < repl->npeers; ++i) {
+		rp = &repl->peers[i];
+		if (rp->started)
+			continue;
+		if ((ret = pthread_create(&rp->thr, NULL,
+		    otp_repl_sender, rp)) != 0) {
+			errno = ret;
+			return (-1);
+		}
+		rp->started = 1;
+	}
+	return (0);
+}
+
+/*
+ * Stop replicating and destroy the replicator.  Advances which have
+ * been queued are sent first, if possible.  Every store handle which
+ * was passed to otp_store_set_repl() must be closed or detached first.
+ */
+void
+otp_repl_destroy(otp_repl *repl)
+{
+	struct otp_repl_peer *rp;
+	unsigned int i;
+
+	if (repl == NULL)
+		return;
+	if (repl->started) {
+		eventfd_write(repl->stopfd, 1);
+		pthread_join(repl->thr, NULL);
+	}
+	for (i = 0; i < repl->npeers; ++i) {
+		rp = &repl->peers[i];
+		pthread_mutex_lock(&rp->mtx);
+		rp->stopping = 1;
+		pthread_cond_signal(&rp->cv);
+		pthread_mutex_unlock(&rp->mtx);
+		if (rp->started)
+			pthread_join(rp->thr, NULL);
+		if (rp->fd >= 0)
+			close(rp->fd);
+		otp_auth_destroy(rp->auth);
+		otp_store_close(rp->st);
+		free(rp->spare);
+		free(rp->buf);
+		free(rp->addr);
+		pthread_cond_destroy(&rp->cv);
+		pthread_mutex_destroy(&rp->mtx);
+	}
+	for (i = 0; i < OTP_REPL_MAXPEERS; ++i)
+		otp_repl_close(repl, i);
+	if (repl->stopfd >= 0)
+		close(repl->stopfd);
+	if (repl->lsock >= 0)
+		close(repl->lsock);
+	otp_store_close(repl->st);
+	free(repl->peers);
+	free(repl);
+}
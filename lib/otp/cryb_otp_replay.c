@@ -0,0 +1,277 @@
+/*-
+ * Copyright (c) 2026 Dag-Erling Smørgrav
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "cryb/impl.h"
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <cryb/oath.h>
+#include <cryb/otp.h>
+
+#include "cryb_otp_impl.h"
+
+/*
+ * The replay cache records which (user, time step) pairs have been
+ * used to log in, so a long-running process can prevent TOTP codes
+ * from being reused without having to make each new last used time
+ * step durable before answering.
+ *
+ * There is one open-addressed set per time step, in a ring of
+ * OTP_REPLAY_NSTEPS.  Each entry combines a 48-bit hash of the user
+ * name with the low 16 bits of the time step, so entries left over
+ * from the previous trip around the ring are recognizably stale and
+ * are simply overwritten; nothing ever needs to be cleared.  Entries
+ * are inserted with a compare-and-swap, so of two concurrent attempts
+ * to use the same code, exactly one succeeds.
+ *
+ * The cache only knows about the time steps it has recorded, not
+ * about the steps before them, so unlike lastused, it does not stop a
+ * code for an earlier time step from being accepted after a later one
+ * if both are within the window.  It does guarantee that each code is
+ * accepted at most once, which is what matters.
+ */
+
+#define OTP_REPLAY_TAG(step)	(((uint64_t)(step) & 0xffff) << 48)
+#define OTP_REPLAY_TAGMASK	(0xffffULL << 48)
+
+/*
+ * Hash a user name down to 48 bits, avoiding 0, which marks an empty
+ * entry.
+ */
+static uint64_t
+otp_replay_user(const char *user)
+{
+	uint64_t h;
+
+	for (h = 0xcbf29ce484222325ULL; *user != '\0'; ++user)
+		h = (h ^ (uint8_t)*user) * 0x100000001b3ULL;
+	h = (h ^ (h >> 48)) & ~OTP_REPLAY_TAGMASK;
+	return (h != 0 ? h : 1);
+}
+
+static uint64_t *
+otp_replay_bucket(otp_replay *rc, uint64_t step)
+{
+
+	return (rc->ents + (step % OTP_REPLAY_NSTEPS) * (rc->mask + 1));
+}
+
+/*
+ * Check whether a user has used a given time step.
+ */
+static int
+otp_replay_lookup(otp_replay *rc, uint64_t uh, uint64_t step)
+{
+	uint64_t *b, v, want;
+	uint32_t i, n;
+
+	b = otp_replay_bucket(rc, step);
+	want = OTP_REPLAY_TAG(step) | uh;
+	i = uh & rc->mask;
+	for (n = 0; n <= rc->mask; ++n) {
+		v = __atomic_load_n(&b[i], __ATOMIC_ACQUIRE);
+		if (v == want)
+			return (1);
+		if (v == 0 || (v & OTP_REPLAY_TAGMASK) != OTP_REPLAY_TAG(step))
+			return (0);
+		i = (i + 1) & rc->mask;
+	}
+	return (0);
+}
+
+/*
+ * Record that a user has used a given time step.  Returns 0 if it was
+ * recorded, 1 if it was already there, and -1 with errno set to ENOSPC
+ * if the set for that time step is full.
+ */
+int
+otp_replay_insert(otp_replay *rc, const char *user, uint64_t step)
+{
+	uint64_t *b, uh, v, want;
+	uint32_t i, n;
+
+	uh = otp_replay_user(user);
+	b = otp_replay_bucket(rc, step);
+	want = OTP_REPLAY_TAG(step) | uh;
+	i = uh & rc->mask;
+	n = 0;
+	while (n <= rc->mask) {
+		v = __atomic_load_n(&b[i], __ATOMIC_ACQUIRE);
+		if (v == want) {
+			otp_stats_count(OTP_STAT_REPLAY_HIT);
+			return (1);
+		}
+		if (v == 0 ||
+		    (v & OTP_REPLAY_TAGMASK) != OTP_REPLAY_TAG(step)) {
+			if (__atomic_compare_exchange_n(&b[i], &v, want, 0,
+			    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+				otp_stats_count(OTP_STAT_REPLAY_MISS);
+				return (0);
+			}
+			/* lost a race for this entry; look at it again */
+			continue;
+		}
+		i = (i + 1) & rc->mask;
+		++n;
+	}
+	errno = ENOSPC;
+	return (-1);
+}
+
+/*
+ * Raise a TOTP key's last used time step to the latest step within the
+ * policy's window that the user is known to have used.  Returns 0 on
+ * success and -1 with errno set to EINVAL if the window is too wide
+ * for the cache.
+ */
+int
+otp_replay_apply(otp_replay *rc, const char *user, oath_key *key,
+    const otp_policy *pol, time_t now)
+{
+	uint64_t first, last, seq, uh;
+
+	if (key->mode != om_totp || key->timestep == 0 || now < 0 ||
+	    pol->totp_lookbehind + pol->totp_lookahead >= OTP_REPLAY_NSTEPS) {
+		errno = EINVAL;
+		return (-1);
+	}
+	seq = (uint64_t)now / key->timestep;
+	if (pol->totp_skew < 0)
+		seq = seq > (uint64_t)-(int64_t)pol->totp_skew ?
+		    seq + pol->totp_skew : 0;
+	else
+		seq += pol->totp_skew;
+	first = seq > pol->totp_lookbehind ? seq - pol->totp_lookbehind : 0;
+	last = seq + pol->totp_lookahead;
+	if (first <= key->lastused)
+		first = key->lastused + 1;
+	uh = otp_replay_user(user);
+	for (seq = last; seq >= first && seq > 0; --seq) {
+		if (otp_replay_lookup(rc, uh, seq)) {
+			key->lastused = seq;
+			break;
+		}
+	}
+	return (0);
+}
+
+/*
+ * Create a replay cache with room for at least size logins per time
+ * step, or a default number if size is 0.
+ */
+otp_replay *
+otp_replay_create(unsigned int size)
+{
+	otp_replay *rc;
+	uint32_t n;
+
+	if (size == 0)
+		size = OTP_REPLAY_SIZE;
+	if (size > (1U << 24)) {
+		errno = EINVAL;
+		return (NULL);
+	}
+	/* keep the load factor at or below one half */
+	for (n = 64; n < 2 * size; n *= 2)
+		/* nothing */ ;
+	if ((rc = calloc(1, sizeof *rc)) == NULL)
+		return (NULL);
+	if ((rc->ents = calloc((size_t)n * OTP_REPLAY_NSTEPS,
+	    sizeof *rc->ents)) == NULL) {
+		free(rc);
+		return (NULL);
+	}
+	rc->mask = n - 1;
+	return (rc);
+}
+
+/*
+ * Destroy a replay cache.
+ */
+void
+otp_replay_destroy(otp_replay *rc)
+{
+
+	if (rc == NULL)
+		return;
+	free(rc->ents);
+	free(rc);
+}
+
+/*
+ * Check a response for a user like otp_verify_policy(), using the
+ * given replay cache to prevent TOTP codes from being reused.  On
+ * success, the key's last used time step is advanced as usual, but
+ * the caller does not need to save it before acting on the result.
+ * HOTP keys are verified without the cache.
+ */
+int
+otp_verify_replay(oath_key *key, unsigned long response,
+    const otp_policy *pol, otp_replay *rc, const char *user)
+{
+	const struct otp_hmac *hm;
+	otp_policy defpol;
+	uint64_t prev;
+	time_t now;
+	int ret;
+
+	if (key->mode != om_totp)
+		return (otp_verify_policy(key, response, pol));
+	if (pol == NULL) {
+		otp_policy_init(&defpol);
+		pol = &defpol;
+	} else if (otp_policy_check(pol) != 0) {
+		return (-1);
+	}
+	if ((hm = otp_hmac_get(key)) == NULL)
+		return (-1);
+	now = time(NULL);
+	prev = key->lastused;
+	if (otp_replay_apply(rc, user, key, pol, now) != 0)
+		return (-1);
+	if ((ret = otp_verify_hmac(hm, key, response, pol, now)) <= 0) {
+		key->lastused = prev;
+		return (ret);
+	}
+	switch (otp_replay_insert(rc, user, key->lastused)) {
+	case 0:
+		return (ret);
+	case 1:
+		/* someone beat us to it */
+		key->lastused = prev;
+		return (0);
+	default:
+		key->lastused = prev;
+		return (-1);
+	}
+}
@@ -30,67 +30,263 @@
 
 #include "cryb/impl.h"
 
+#include <errno.h>
+#include <pthread.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
-#include <cryb/assert.h>
 #include <cryb/oath.h>
 #include <cryb/otp.h>
 
 #include "cryb_otp_impl.h"
 
 /*
- * Resynchronize a desynchronized event-mode key.
+ * Resynchronize a desynchronized event-mode key: look for n consecutive
+ * codes matching the given responses among the first window counter
+ * values, starting at the key's current counter.  Each code in the
+ * window is computed exactly once and kept in a ring buffer of the
+ * last n codes, so the cost is O(window + n) regardless of n.  On
+ * success, the counter is advanced past the last response.
  *
- * XXX review carefully for off-by-one errors, and write unit tests
+ * Returns -1 on error, 0 on failure, or one more than the number of
+ * codes skipped on success.
  */
-
-static int
-otp_resync_recursive(oath_key *key, unsigned long *response,
-    unsigned int n, unsigned int w)
+int
+otp_resync_range(oath_key *key, const unsigned long *response,
+    unsigned int n, unsigned int window)
 {
-	uint64_t first, prev, last;
+	unsigned int codes[OTP_MB_MAXLANES], ring[OTP_RESYNC_MAXCODES];
+	const struct otp_hmac *hm;
+	unsigned int i, j, k, len, pos;
+	uint64_t first, t0;
 	int ret;
 
+	if (key->mode != om_hotp || n < 1 || n > OTP_RESYNC_MAXCODES ||
+	    window > OTP_RESYNC_MAXWINDOW || key->counter > UINT64_MAX - window)
+		return (-1);
+	if ((hm = otp_hmac_get(key)) == NULL)
+		return (-1);
+	t0 = otp_stats_clock();
 	first = key->counter;
-	last = first + w;
-	while (w > 0) {
-		prev = key->counter;
-		ret = oath_hotp_match(key, response[0], last - key->counter);
-		if (ret < 1)
-			return (ret);
-		assertf(key->counter > prev, "counter did not advance");
-		w -= key->counter - prev;
-		if (n == 1)
-			return (key->counter - prev);
-		prev = key->counter;
-		ret = otp_resync_recursive(key, response + 1, n - 1, w);
-		if (ret > 0)
-			return (ret);
-		key->counter = prev;
+	ret = 0;
+	for (i = 0; i < window && ret == 0; i += len) {
+		len = window - i < OTP_MB_MAXLANES ?
+		    window - i : OTP_MB_MAXLANES;
+		otp_hmac_codes(hm, first + i, len, codes);
+		for (j = 0; j < len; ++j) {
+			pos = i + j;
+			ring[pos % n] = codes[j];
+			/* wait for a complete sequence ending in a match */
+			if (pos + 1 < n || codes[j] != response[n - 1])
+				continue;
+			for (k = 0; k < n - 1; ++k)
+				if (ring[(pos + 1 + k) % n] != response[k])
+					break;
+			if (k == n - 1) {
+				key->counter = first + pos + 1;
+				ret = pos + 2 - n;
+				break;
+			}
+		}
 	}
-	return (0);
+	otp_wipe(codes, sizeof codes);
+	otp_wipe(ring, sizeof ring);
+	if (ret > 0)
+		otp_stats_record(OTP_HIST_RESYNC_DEPTH, key->counter - first);
+	otp_stats_count(ret > 0 ? OTP_STAT_RESYNC_HIT : OTP_STAT_RESYNC_MISS);
+	otp_stats_elapsed(OTP_HIST_RESYNC, t0);
+	return (ret);
 }
 
+/*
+ * Resynchronize under the given policy, or the default policy if pol
+ * is NULL.  The window is (hotp_lookahead + 1) to the power of the
+ * number of responses, capped at resync_window: with the default
+ * policy, 100 for two responses and 1,000 for three.
+ */
 int
-otp_resync(oath_key *key, unsigned long *response, unsigned int n)
+otp_resync_policy(oath_key *key, const unsigned long *response,
+    unsigned int n, const otp_policy *pol)
 {
-	unsigned int i, w;
-	int ret;
+	otp_policy defpol;
+	unsigned int i;
+	uint64_t w;
+
+	if (pol == NULL) {
+		otp_policy_init(&defpol);
+		pol = &defpol;
+	} else if (otp_policy_check(pol) != 0) {
+		return (-1);
+	}
 
 	/* only applicable to RFC 4226 HOTP for now */
 	/* note: n == 1 is identical to otp_verify() */
-	if (key->mode != om_hotp || n < 1)
+	if (key->mode != om_hotp || n < 1 || n > OTP_RESYNC_MAXCODES)
 		return (-1);
 
-	/* compute window size based on number of responses */
-	for (i = 0, w = 1; i < n; ++i)
-		w = w * (HOTP_WINDOW + 1);
+	/*
+	 * Compute window size based on number of responses.  This is
+	 * done in 64 bits, where it cannot exceed resync_window times
+	 * (hotp_lookahead + 1) and therefore cannot overflow.
+	 */
+	for (i = 0, w = 1; i < n && w <= pol->resync_window; ++i)
+		w = w * ((uint64_t)pol->hotp_lookahead + 1);
+	if (w > pol->resync_window)
+		w = pol->resync_window;
+
+	return (otp_resync_range(key, response, n, (unsigned int)w));
+}
+
+/*
+ * Resynchronize under the default policy.
+ */
+int
+otp_resync(oath_key *key, unsigned long *response, unsigned int n)
+{
+
+	return (otp_resync_policy(key, response, n, NULL));
+}
+
+/*
+ * Deep resynchronization, for tokens which have drifted much further
+ * than any window we would search during normal operation.  The range
+ * is divided into blocks of OTP_RESYNC_BLOCK starting positions, which
+ * threads claim in order from a shared cursor until the range is
+ * exhausted, so a thread which is slowed down by other work simply
+ * ends up claiming fewer blocks.  Each block computes its codes in
+ * SIMD batches, plus n - 1 extra codes so that a sequence which starts
+ * near the end of a block is still seen in full.  A thread which finds
+ * a sequence records its position if it is earlier than any found so
+ * far; since blocks are claimed in order, no thread needs to go past
+ * the earliest match, and the result is the same as for a linear
+ * search.
+ */
+struct otp_resync_deep {
+	struct otp_hmac		 hm;
+	const unsigned long	*response;
+	unsigned int		 n;
+	uint64_t		 first;		/* counter of position 0 */
+	uint64_t		 depth;		/* starting positions */
+	uint64_t		 next;		/* next block to claim */
+	uint64_t		 found;		/* earliest match, or depth */
+};
+
+static void *
+otp_resync_deep_worker(void *arg)
+{
+	struct otp_resync_deep *rd = arg;
+	unsigned int codes[OTP_RESYNC_BLOCK + OTP_RESYNC_MAXCODES];
+	uint64_t best, pos, start;
+	unsigned int i, k, len, m;
 
-	/* recursive search within window */
-	ret = otp_resync_recursive(key, response, n, w);
+	for (;;) {
+		start = __atomic_fetch_add(&rd->next, OTP_RESYNC_BLOCK,
+		    __ATOMIC_RELAXED);
+		if (start >= rd->depth ||
+		    start >= __atomic_load_n(&rd->found, __ATOMIC_RELAXED))
+			break;
+		m = rd->depth - start < OTP_RESYNC_BLOCK ?
+		    rd->depth - start : OTP_RESYNC_BLOCK;
+		len = m + rd->n - 1;
+		for (i = 0; i < len; i += k) {
+			k = len - i < OTP_MB_MAXLANES ?
+			    len - i : OTP_MB_MAXLANES;
+			otp_hmac_codes(&rd->hm, rd->first + start + i, k,
+			    codes + i);
+		}
+		for (i = 0; i < m; ++i) {
+			if (codes[i] != rd->response[0])
+				continue;
+			for (k = 1; k < rd->n; ++k)
+				if (codes[i + k] != rd->response[k])
+					break;
+			if (k < rd->n)
+				continue;
+			/* keep the earliest match */
+			pos = start + i;
+			best = __atomic_load_n(&rd->found, __ATOMIC_RELAXED);
+			while (pos < best &&
+			    !__atomic_compare_exchange_n(&rd->found, &best,
+			    pos, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				/* nothing */ ;
+			break;
+		}
+	}
+	otp_wipe(codes, sizeof codes);
+	return (NULL);
+}
 
-	/* ... */
+/*
+ * Look for n consecutive codes matching the given responses among the
+ * next depth counter values, using up to nthreads threads, or one per
+ * online processor if nthreads is 0.  The odds of a false match grow
+ * with the depth, so a single code is only searched for as far as
+ * otp_verify() would, two codes up to OTP_RESYNC_MAXDEPTH2 counters,
+ * and anything deeper requires at least three.  On success, the counter is
+ * advanced past the last response.  Returns the same as
+ * otp_resync_range().
+ */
+int
+otp_resync_deep(oath_key *key, const unsigned long *response,
+    unsigned int n, unsigned int depth, unsigned int nthreads)
+{
+	struct otp_resync_deep rd;
+	pthread_t *tids;
+	unsigned int i, nworkers;
+	uint64_t t0;
+	long ncpu;
+	int ret;
 
+	if (key->mode != om_hotp || n < 1 || n > OTP_RESYNC_MAXCODES ||
+	    depth < n || depth > OTP_RESYNC_MAXDEPTH ||
+	    (n == 1 && depth > OTP_RESYNC_MAXDEPTH1) ||
+	    (n == 2 && depth > OTP_RESYNC_MAXDEPTH2) ||
+	    key->counter > UINT64_MAX - depth) {
+		errno = EINVAL;
+		return (-1);
+	}
+	if (nthreads == 0) {
+		if ((ncpu = sysconf(_SC_NPROCESSORS_ONLN)) < 1)
+			ncpu = 1;
+		nthreads = ncpu;
+	}
+	if (nthreads > OTP_RESYNC_MAXTHREADS)
+		nthreads = OTP_RESYNC_MAXTHREADS;
+	memset(&rd, 0, sizeof rd);
+	if (otp_hmac_init(&rd.hm, key) != 0)
+		return (-1);
+	t0 = otp_stats_clock();
+	rd.response = response;
+	rd.n = n;
+	rd.first = key->counter;
+	rd.depth = rd.found = depth - n + 1;
+	/* the calling thread is one of the workers */
+	nworkers = 0;
+	if (nthreads > 1 &&
+	    (tids = calloc(nthreads - 1, sizeof *tids)) != NULL) {
+		for (; nworkers < nthreads - 1; ++nworkers)
+			if (pthread_create(&tids[nworkers], NULL,
+			    otp_resync_deep_worker, &rd) != 0)
+				break;
+	} else {
+		tids = NULL;
+	}
+	otp_resync_deep_worker(&rd);
+	for (i = 0; i < nworkers; ++i)
+		pthread_join(tids[i], NULL);
+	free(tids);
+	otp_wipe(&rd.hm, sizeof rd.hm);
+	ret = 0;
+	if (rd.found < rd.depth) {
+		key->counter = rd.first + rd.found + n;
+		ret = rd.found + 1;
+		otp_stats_record(OTP_HIST_RESYNC_DEPTH,
+		    key->counter - rd.first);
+	}
+	otp_stats_count(ret > 0 ? OTP_STAT_RESYNC_HIT : OTP_STAT_RESYNC_MISS);
+	otp_stats_elapsed(OTP_HIST_RESYNC, t0);
 	return (ret);
 }
@@ -0,0 +1,196 @@
+/*-
+ * Copyright (c) 2026 Dag-Erling Smørgrav
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "cryb/impl.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <cryb/endian.h>
+#include <cryb/oath.h>
+#include <cryb/otp.h>
+
+#include "cryb_otp_impl.h"
+
+/*
+ * Compute HOTP codes for a range of counter values using multi-buffer
+ * SHA-1: each vector lane computes the HMAC of a different counter, so
+ * a window of codes costs about as much as one or two scalar codes.
+ * The widest kernel supported by both the compiler and the CPU is
+ * selected at runtime.
+ */
+
+#if HAVE_X86_SIMD
+
+#define MB_NAME		otp_sha1_mb_sse2
+#define MB_TARGET	__attribute__((target("sse2")))
+#define MB_LANES	4
+#define MB_VEC		otp_sha1_v4
+#include "cryb_otp_sha1_mb.h"
+
+#define MB_NAME		otp_sha1_mb_avx2
+#define MB_TARGET	__attribute__((target("avx2")))
+#define MB_LANES	8
+#define MB_VEC		otp_sha1_v8
+#include "cryb_otp_sha1_mb.h"
+
+#define MB_NAME		otp_sha1_mb_avx512
+#define MB_TARGET	__attribute__((target("avx512f")))
+#define MB_LANES	16
+#define MB_VEC		otp_sha1_v16
+#include "cryb_otp_sha1_mb.h"
+
+#endif
+
+typedef void (*otp_sha1_mb_func)(const struct otp_hmac *, uint64_t,
+    uint32_t (*)[5]);
+
+static const struct otp_sha1_mb_impl {
+	const char		*name;
+	otp_sha1_mb_func	 func;
+	unsigned int		 lanes;
+} otp_sha1_mb_impls[] = {
+#if HAVE_X86_SIMD
+	{ "avx512",	otp_sha1_mb_avx512,	16 },
+	{ "avx2",	otp_sha1_mb_avx2,	 8 },
+	{ "sse2",	otp_sha1_mb_sse2,	 4 },
+#endif
+	{ "scalar",	NULL,			 1 },
+};
+
+#define OTP_SHA1_MB_NIMPLS \
+	(sizeof otp_sha1_mb_impls / sizeof otp_sha1_mb_impls[0])
+
+static const struct otp_sha1_mb_impl *otp_sha1_mb_impl;
+
+/*
+ * Check whether the CPU supports a given implementation.
+ */
+static int
+otp_sha1_mb_supported(const struct otp_sha1_mb_impl *impl)
+{
+
+#if HAVE_X86_SIMD
+	__builtin_cpu_init();
+	if (impl->func == otp_sha1_mb_avx512)
+		return (__builtin_cpu_supports("avx512f"));
+	if (impl->func == otp_sha1_mb_avx2)
+		return (__builtin_cpu_supports("avx2"));
+	if (impl->func == otp_sha1_mb_sse2)
+		return (__builtin_cpu_supports("sse2"));
+#endif
+	return (impl->func == NULL);
+}
+
+/*
+ * Select an implementation by name, or the best supported one if name
+ * is NULL.  Returns 0 on success and -1 if the named implementation
+ * does not exist or is not supported.
+ */
+int
+otp_simd_select(const char *name)
+{
+	const struct otp_sha1_mb_impl *impl;
+	unsigned int i;
+
+	for (i = 0; i < OTP_SHA1_MB_NIMPLS; ++i) {
+		impl = &otp_sha1_mb_impls[i];
+		if (name != NULL && strcmp(name, impl->name) != 0)
+			continue;
+		if (!otp_sha1_mb_supported(impl))
+			break;
+		__atomic_store_n(&otp_sha1_mb_impl, impl, __ATOMIC_RELEASE);
+		return (0);
+	}
+	return (-1);
+}
+
+static const struct otp_sha1_mb_impl *
+otp_sha1_mb_get(void)
+{
+	const struct otp_sha1_mb_impl *impl;
+
+	impl = __atomic_load_n(&otp_sha1_mb_impl, __ATOMIC_ACQUIRE);
+	if (impl == NULL) {
+		/* OTP_SIMD in the environment overrides the default */
+		if (otp_simd_select(getenv("OTP_SIMD")) != 0)
+			otp_simd_select(NULL);
+		impl = __atomic_load_n(&otp_sha1_mb_impl, __ATOMIC_ACQUIRE);
+	}
+	return (impl);
+}
+
+/*
+ * Return the name of the selected implementation.
+ */
+const char *
+otp_simd_name(void)
+{
+
+	return (otp_sha1_mb_get()->name);
+}
+
+/*
+ * Compute the HOTP codes for n consecutive counter values.
+ */
+void
+otp_hmac_codes(const struct otp_hmac *hm, uint64_t first, unsigned int n,
+    unsigned int *codes)
+{
+	static const unsigned int pow10[] = {
+		1, 10, 100, 1000, 10000, 100000, 1000000, 10000000,
+		100000000, 1000000000
+	};
+	const struct otp_sha1_mb_impl *impl;
+	uint32_t md[16][5];
+	uint8_t digest[20];
+	unsigned int i, l, off;
+
+	impl = otp_sha1_mb_get();
+	while (n > 0) {
+		if (hm->hash != oh_sha1 || impl->func == NULL || n == 1) {
+			*codes++ = otp_hmac_code(hm, first++);
+			--n;
+			continue;
+		}
+		/* lanes past the end of the range are computed and ignored */
+		impl->func(hm, first, md);
+		for (l = 0; l < impl->lanes && n > 0; ++l, ++first, --n) {
+			for (i = 0; i < 5; ++i)
+				be32enc(digest + 4 * i, md[l][i]);
+			off = digest[19] & 0x0f;
+			*codes++ = (be32dec(digest + off) & 0x7fffffff) %
+			    pow10[hm->digits];
+		}
+	}
+	otp_wipe(md, sizeof md);
+	otp_wipe(digest, sizeof digest);
+}
@@ -0,0 +1,114 @@
+/*-
+ * Copyright (c) 2026 Dag-Erling Smørgrav
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Multi-buffer HMAC-SHA1 kernel, included once per vector width by
+ * cryb_otp_sha1_mb.c with the following macros defined:
+ *
+ * MB_NAME	name of the function to generate
+ * MB_TARGET	function attributes selecting the instruction set
+ * MB_LANES	number of 32-bit lanes in a vector
+ * MB_VEC	name of the vector type to define
+ *
+ * The generated function computes the HMAC-SHA1 of MB_LANES consecutive
+ * counter values, starting at first, in parallel, and stores the
+ * resulting digests in md.
+ */
+
+typedef uint32_t MB_VEC __attribute__((vector_size(MB_LANES * 4)));
+
+#define MB_ROL(x, n)	(((x) << (n)) | ((x) >> (32 - (n))))
+
+#define MB_ROUND(f, k)							\
+	do {								\
+		if (i >= 16)						\
+			w[i & 15] = MB_ROL(w[(i - 3) & 15] ^		\
+			    w[(i - 8) & 15] ^ w[(i - 14) & 15] ^	\
+			    w[i & 15], 1);				\
+		t = MB_ROL(a, 5) + (f) + e + (k) + w[i & 15];		\
+		e = d;							\
+		d = c;							\
+		c = MB_ROL(b, 30);					\
+		b = a;							\
+		a = t;							\
+	} while (0)
+
+MB_TARGET static void
+MB_NAME(const struct otp_hmac *hm, uint64_t first, uint32_t (*md)[5])
+{
+	MB_VEC w[16], s[5], a, b, c, d, e, t;
+	unsigned int i, j, l;
+
+	/* inner hash: counter, padding, length of ipad block + counter */
+	for (l = 0; l < MB_LANES; ++l) {
+		w[0][l] = (uint32_t)((first + l) >> 32);
+		w[1][l] = (uint32_t)(first + l);
+	}
+	w[2] = (MB_VEC){ 0 } + 0x80000000U;
+	for (i = 3; i < 15; ++i)
+		w[i] = (MB_VEC){ 0 };
+	w[15] = (MB_VEC){ 0 } + (64 + 8) * 8;
+	for (j = 0; j < 2; ++j) {
+		a = s[0] = (MB_VEC){ 0 } + hm->h.sha1[j][0];
+		b = s[1] = (MB_VEC){ 0 } + hm->h.sha1[j][1];
+		c = s[2] = (MB_VEC){ 0 } + hm->h.sha1[j][2];
+		d = s[3] = (MB_VEC){ 0 } + hm->h.sha1[j][3];
+		e = s[4] = (MB_VEC){ 0 } + hm->h.sha1[j][4];
+		for (i = 0; i < 20; ++i)
+			MB_ROUND((b & c) | (~b & d), 0x5a827999U);
+		for (; i < 40; ++i)
+			MB_ROUND(b ^ c ^ d, 0x6ed9eba1U);
+		for (; i < 60; ++i)
+			MB_ROUND((b & c) | (b & d) | (c & d), 0x8f1bbcdcU);
+		for (; i < 80; ++i)
+			MB_ROUND(b ^ c ^ d, 0xca62c1d6U);
+		/* outer hash: inner digest, padding, opad block + digest */
+		w[0] = s[0] + a;
+		w[1] = s[1] + b;
+		w[2] = s[2] + c;
+		w[3] = s[3] + d;
+		w[4] = s[4] + e;
+		w[5] = (MB_VEC){ 0 } + 0x80000000U;
+		for (i = 6; i < 15; ++i)
+			w[i] = (MB_VEC){ 0 };
+		w[15] = (MB_VEC){ 0 } + (64 + 20) * 8;
+	}
+	for (l = 0; l < MB_LANES; ++l)
+		for (i = 0; i < 5; ++i)
+			md[l][i] = w[i][l];
+	otp_wipe(w, sizeof w);
+	otp_wipe(s, sizeof s);
+}
+
+#undef MB_ROUND
+#undef MB_ROL
+#undef MB_VEC
+#undef MB_LANES
+#undef MB_TARGET
+#undef MB_NAME
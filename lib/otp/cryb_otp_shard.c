@@ -0,0 +1,532 @@
+/*-
+ * Copyright (c) 2026 Dag-Erling Smørgrav
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "cryb/impl.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <cryb/oath.h>
+#include <cryb/otp.h>
+
+#include "cryb_otp_impl.h"
+
+/*
+ * Sharded key store.  Each shard is an otpd instance with a key store
+ * of its own, and the shard map decides which one a user belongs to.
+ * Verifications and resynchronizations, which are what advance a
+ * user's counter, are only ever sent to the owning shard, so the
+ * shards never need to coordinate.  When shards are added or removed,
+ * otp_shard_rebalance() moves the affected keys, and consistent
+ * hashing keeps that to the minimum: a new shard only takes users from
+ * the others, and a departing shard's users are spread over the rest.
+ */
+
+/*
+ * Hash a name and a point number onto the ring.  FNV-1a spreads the
+ * last few bytes of its input poorly, which matters here since point
+ * names differ only at the end, so finish with a 64-bit mixer.
+ */
+static uint64_t
+otp_shard_hash(const char *str, uint32_t n)
+{
+	uint64_t h;
+	unsigned int i;
+
+	for (h = 0xcbf29ce484222325ULL; *str != '\0'; ++str)
+		h = (h ^ (uint8_t)*str) * 0x100000001b3ULL;
+	for (i = 0; i < 4; ++i, n >>= 8)
+		h = (h ^ (n & 0xff)) * 0x100000001b3ULL;
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return (h);
+}
+
+/*
+ * Order points on the ring.  Ties, which are unlikely, are broken by
+ * shard name so the ring does not depend on the order of the shards.
+ */
+static int
+otp_shard_cmp(const void *a, const void *b)
+{
+	const struct otp_shard_point *pa = a, *pb = b;
+
+	if (pa->hash != pb->hash)
+		return (pa->hash < pb->hash ? -1 : 1);
+	return (strcmp(pa->name, pb->name));
+}
+
+/*
+ * Create an empty shard map.
+ */
+otp_shardmap *
+otp_shardmap_create(void)
+{
+
+	return (calloc(1, sizeof(otp_shardmap)));
+}
+
+/*
+ * Add a shard to a map.  The name identifies the shard on the ring and
+ * must be unique; the address is where its otpd instance listens, in
+ * the form accepted by otp_client_open().  A shard with twice the
+ * weight of another gets twice as many users.
+ */
+int
+otp_shardmap_add(otp_shardmap *map, const char *name, const char *addr,
+    unsigned int weight)
+{
+	struct otp_shard_info *shards, *si;
+	struct otp_shard_point *ring;
+	size_t i, npoints;
+
+	if (*name == '\0' || strlen(name) > OTP_SHARD_MAXNAME ||
+	    *addr == '\0' || weight < 1 || weight > OTP_SHARD_MAXWEIGHT) {
+		errno = EINVAL;
+		return (-1);
+	}
+	for (i = 0; i < map->nshards; ++i) {
+		if (strcmp(map->shards[i].name, name) == 0) {
+			errno = EEXIST;
+			return (-1);
+		}
+	}
+	if (map->nshards == OTP_SHARD_MAXSHARDS) {
+		errno = ENOSPC;
+		return (-1);
+	}
+	npoints = map->npoints + (size_t)weight * OTP_SHARD_VNODES;
+	if ((shards = realloc(map->shards,
+	    (map->nshards + 1) * sizeof *shards)) == NULL)
+		return (-1);
+	map->shards = shards;
+	if ((ring = realloc(map->ring, npoints * sizeof *ring)) == NULL)
+		return (-1);
+	map->ring = ring;
+	si = &map->shards[map->nshards];
+	if ((si->name = strdup(name)) == NULL)
+		return (-1);
+	if ((si->addr = strdup(addr)) == NULL) {
+		free(si->name);
+		return (-1);
+	}
+	si->weight = weight;
+	for (i = map->npoints; i < npoints; ++i) {
+		ring[i].hash = otp_shard_hash(name, i - map->npoints);
+		ring[i].name = si->name;
+		ring[i].shard = map->nshards;
+	}
+	map->nshards++;
+	map->npoints = npoints;
+	qsort(ring, npoints, sizeof *ring, otp_shard_cmp);
+	return (0);
+}
+
+/*
+ * Load a shard map from a file.  Each line names a shard, gives its
+ * address, and optionally its weight, which defaults to 1, separated
+ * by whitespace.  Blank lines and lines starting with # are ignored.
+ * If the file is malformed, errno is set to EINVAL and, if lineno is
+ * not NULL, it is set to the number of the offending line.
+ */
+otp_shardmap *
+otp_shardmap_load(const char *path, unsigned long *lineno)
+{
+	char *field[3], *end, *line, *p;
+	otp_shardmap *map;
+	unsigned long n, weight;
+	size_t linesize;
+	unsigned int i;
+	FILE *f;
+	int serrno;
+
+	if ((f = fopen(path, "re")) == NULL)
+		return (NULL);
+	if ((map = otp_shardmap_create()) == NULL) {
+		fclose(f);
+		return (NULL);
+	}
+	line = NULL;
+	linesize = 0;
+	for (n = 1; getline(&line, &linesize, f) >= 0; ++n) {
+		for (i = 0, p = line; i < 3; ++i) {
+			while (*p == ' ' || *p == '\t' || *p == '\n')
+				*p++ = '\0';
+			if (*p == '\0' || *p == '#')
+				break;
+			field[i] = p;
+			while (*p != '\0' && *p != ' ' && *p != '\t' &&
+			    *p != '\n')
+				++p;
+		}
+		while (*p == ' ' || *p == '\t' || *p == '\n')
+			*p++ = '\0';
+		if (i == 0)
+			continue;
+		weight = 1;
+		if (i == 3) {
+			weight = strtoul(field[2], &end, 10);
+			if (end == field[2] || *end != '\0')
+				weight = 0;
+		}
+		if (i < 2 || (*p != '\0' && *p != '#') ||
+		    weight < 1 || weight > OTP_SHARD_MAXWEIGHT) {
+			errno = EINVAL;
+			goto fail;
+		}
+		if (otp_shardmap_add(map, field[0], field[1], weight) != 0) {
+			if (errno == EEXIST)
+				errno = EINVAL;
+			goto fail;
+		}
+	}
+	if (ferror(f))
+		goto fail;
+	if (map->nshards == 0) {
+		errno = EINVAL;
+		goto fail;
+	}
+	free(line);
+	fclose(f);
+	return (map);
+fail:
+	serrno = errno;
+	if (serrno == EINVAL && lineno != NULL)
+		*lineno = n;
+	free(line);
+	fclose(f);
+	otp_shardmap_destroy(map);
+	errno = serrno;
+	return (NULL);
+}
+
+/*
+ * Number of shards in a map.
+ */
+unsigned int
+otp_shardmap_count(const otp_shardmap *map)
+{
+
+	return (map->nshards);
+}
+
+/*
+ * Find the shard which owns a user.  Returns the shard's index, or -1
+ * with errno set to ENOENT if the map is empty.
+ */
+int
+otp_shardmap_owner(const otp_shardmap *map, const char *user)
+{
+	uint64_t h;
+	size_t lo, hi, mid;
+
+	if (map->npoints == 0) {
+		errno = ENOENT;
+		return (-1);
+	}
+	h = otp_shard_hash(user, 0);
+	for (lo = 0, hi = map->npoints; lo < hi; ) {
+		mid = lo + (hi - lo) / 2;
+		if (map->ring[mid].hash < h)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	/* past the last point, wrap around to the first */
+	if (lo == map->npoints)
+		lo = 0;
+	return (map->ring[lo].shard);
+}
+
+/*
+ * Name and address of a shard, or NULL if there is no such shard.
+ */
+const char *
+otp_shardmap_name(const otp_shardmap *map, unsigned int i)
+{
+
+	return (i < map->nshards ? map->shards[i].name : NULL);
+}
+
+const char *
+otp_shardmap_addr(const otp_shardmap *map, unsigned int i)
+{
+
+	return (i < map->nshards ? map->shards[i].addr : NULL);
+}
+
+/*
+ * Set the secret with which connections to the shards are
+ * authenticated.  Every shard must use the same secret, which must
+ * outlive the map.
+ */
+int
+otp_shardmap_set_secret(otp_shardmap *map, const otp_secret *secret)
+{
+
+	map->secret = secret;
+	return (0);
+}
+
+/*
+ * Destroy a shard map.
+ */
+void
+otp_shardmap_destroy(otp_shardmap *map)
+{
+	unsigned int i;
+
+	if (map == NULL)
+		return;
+	for (i = 0; i < map->nshards; ++i) {
+		free(map->shards[i].name);
+		free(map->shards[i].addr);
+	}
+	free(map->shards);
+	free(map->ring);
+	free(map);
+}
+
+/*
+ * Create a client for a sharded key store.  Connections to the shards
+ * are made as they are needed.  The map must not be modified or
+ * destroyed while the client exists, and like otp_client, the client
+ * must not be used by more than one thread at a time.
+ */
+otp_shard *
+otp_shard_open(const otp_shardmap *map)
+{
+	otp_shard *sh;
+
+	if ((sh = calloc(1, sizeof *sh)) == NULL)
+		return (NULL);
+	if ((sh->conns = calloc(map->nshards ? map->nshards : 1,
+	    sizeof *sh->conns)) == NULL) {
+		free(sh);
+		return (NULL);
+	}
+	sh->map = map;
+	return (sh);
+}
+
+/*
+ * Connect to a shard, and authenticate if the map has a secret.
+ */
+static otp_client *
+otp_shard_connect(const otp_shardmap *map, unsigned int i)
+{
+	otp_client *cl;
+	int serrno;
+
+	if ((cl = otp_client_open(map->shards[i].addr)) == NULL)
+		return (NULL);
+	if (map->secret != NULL && otp_client_auth(cl, map->secret) != 0) {
+		serrno = errno;
+		otp_client_close(cl);
+		errno = serrno;
+		return (NULL);
+	}
+	return (cl);
+}
+
+/*
+ * Get a connection to a shard, reconnecting if the previous connection
+ * failed.  Requests are never retried on a new connection, since a
+ * request which was in flight when the old one failed may already have
+ * advanced the user's counter.
+ */
+static otp_client *
+otp_shard_conn(otp_shard *sh, unsigned int i)
+{
+
+	if (sh->conns[i] != NULL && sh->conns[i]->fd < 0) {
+		otp_client_close(sh->conns[i]);
+		sh->conns[i] = NULL;
+	}
+	if (sh->conns[i] == NULL)
+		sh->conns[i] = otp_shard_connect(sh->map, i);
+	return (sh->conns[i]);
+}
+
+/*
+ * Verify a response for a user on the shard which owns the user.
+ * Returns the same as otp_client_verify().
+ */
+int
+otp_shard_verify(otp_shard *sh, const char *user, unsigned long response)
+{
+	otp_client *cl;
+	int i;
+
+	if ((i = otp_shardmap_owner(sh->map, user)) < 0 ||
+	    (cl = otp_shard_conn(sh, i)) == NULL)
+		return (-1);
+	return (otp_client_verify(cl, user, response));
+}
+
+/*
+ * Resynchronize a user's key on the shard which owns the user.
+ * Returns the same as otp_client_resync().
+ */
+int
+otp_shard_resync(otp_shard *sh, const char *user,
+    const unsigned long *response, unsigned int n)
+{
+	otp_client *cl;
+	int i;
+
+	if ((i = otp_shardmap_owner(sh->map, user)) < 0 ||
+	    (cl = otp_shard_conn(sh, i)) == NULL)
+		return (-1);
+	return (otp_client_resync(cl, user, response, n));
+}
+
+/*
+ * Move one user's key from one shard to another: copy it, then remove
+ * it from the source if it has not changed in the meantime, or try
+ * again if it has.  Returns 1 if the key was moved, 0 if it was
+ * removed before we got to it, and -1 on error.
+ */
+static int
+otp_shard_move(otp_client *src, otp_client *dst, const char *user)
+{
+	oath_key key;
+	unsigned int i;
+	int ret;
+
+	for (i = 0; i < OTP_SHARD_RETRIES; ++i) {
+		if (otp_client_export(src, user, &key) != 0)
+			return (errno == ENOENT ? 0 : -1);
+		ret = otp_client_import(dst, user, &key);
+		if (ret == 0)
+			ret = otp_client_remove(src, user, &key);
+		otp_key_destroy(&key);
+		if (ret == 0)
+			return (1);
+		if (errno != EAGAIN)
+			return (-1);
+	}
+	return (-1);
+}
+
+/*
+ * Move every key whose owner differs between two shard maps from the
+ * shard which owns it in the first to the shard which owns it in the
+ * second.  Shards are matched by name, so a shard may change address
+ * between the maps.  With OTP_SHARD_DRYRUN, only count the keys which
+ * would be moved.  Returns the number of keys moved, or -1 on error,
+ * in which case the keys moved so far stay where they are, and the
+ * operation may simply be repeated.
+ *
+ * Clients should switch to the second map once the keys have been
+ * moved: until then, a client which uses the second map will not find
+ * the keys which have not been moved yet, and afterwards, a client
+ * which uses the first map will not find those which have.
+ */
+long
+otp_shard_rebalance(const otp_shardmap *from, const otp_shardmap *to,
+    int flags)
+{
+	char *names, *user;
+	otp_client *src, *dst;
+	otp_shard *dsh;
+	uint32_t cursor;
+	unsigned int i;
+	long moved;
+	int j, n, ret, serrno;
+
+	if ((names = malloc(OTPD_MAXBODY)) == NULL)
+		return (-1);
+	if ((dsh = otp_shard_open(to)) == NULL) {
+		free(names);
+		return (-1);
+	}
+	src = NULL;
+	moved = 0;
+	for (i = 0; i < from->nshards; ++i) {
+		if ((src = otp_shard_connect(from, i)) == NULL)
+			goto fail;
+		cursor = 0;
+		while ((n = otp_client_list(src, &cursor, names,
+		    OTPD_MAXBODY)) > 0) {
+			for (user = names; n > 0;
+			     --n, user += strlen(user) + 1) {
+				if ((j = otp_shardmap_owner(to, user)) < 0)
+					goto fail;
+				if (strcmp(to->shards[j].name,
+				    from->shards[i].name) == 0)
+					continue;
+				if (flags & OTP_SHARD_DRYRUN) {
+					moved++;
+					continue;
+				}
+				if ((dst = otp_shard_conn(dsh, j)) == NULL ||
+				    (ret = otp_shard_move(src, dst, user)) < 0)
+					goto fail;
+				moved += ret;
+			}
+		}
+		if (n < 0)
+			goto fail;
+		otp_client_close(src);
+		src = NULL;
+	}
+	otp_shard_close(dsh);
+	free(names);
+	return (moved);
+fail:
+	serrno = errno;
+	otp_client_close(src);
+	otp_shard_close(dsh);
+	free(names);
+	errno = serrno;
+	return (-1);
+}
+
+/*
+ * Close a sharded key store client and all its connections.
+ */
+void
+otp_shard_close(otp_shard *sh)
+{
+	unsigned int i;
+
+	if (sh == NULL)
+		return;
+	for (i = 0; i < sh->map->nshards; ++i)
+		otp_client_close(sh->conns[i]);
+	free(sh->conns);
+	free(sh);
+}
@@ -0,0 +1,464 @@
+/*-
+ * Copyright (c) 2026 Dag-Erling Smørgrav
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "cryb/impl.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <cryb/oath.h>
+#include <cryb/otp.h>
+
+#include "cryb_otp_impl.h"
+
+/*
+ * Instrumentation.  Every thread that records an event gets its own
+ * block of counters, which only that thread ever writes to, so events
+ * are recorded with plain relaxed stores rather than atomic read-
+ * modify-write operations and threads never contend with each other.
+ * A snapshot sums up the blocks of all live threads, plus whatever
+ * threads that have since exited left behind.
+ *
+ * Recording is off until otp_stats_enable() is called, so programs
+ * which do not care pay for a single predictable branch per event.
+ */
+
+int otp_stats_enabled;
+
+struct otp_stats_thread {
+	struct otp_stats	 st;
+	struct otp_stats_thread	*prev, *next;
+};
+
+static pthread_mutex_t otp_stats_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t otp_stats_once = PTHREAD_ONCE_INIT;
+static pthread_key_t otp_stats_key;
+static struct otp_stats_thread *otp_stats_threads;
+static struct otp_stats otp_stats_retired;
+static __thread struct otp_stats_thread *otp_stats_self;
+
+/*
+ * Add one block of counters to another.
+ */
+static void
+otp_stats_sum(struct otp_stats *dst, const struct otp_stats *src)
+{
+	const uint64_t *s;
+	uint64_t *d;
+	size_t i;
+
+	d = (uint64_t *)dst;
+	s = (const uint64_t *)src;
+	for (i = 0; i < sizeof *dst / sizeof *d; ++i)
+		d[i] += __atomic_load_n(&s[i], __ATOMIC_RELAXED);
+}
+
+/*
+ * Thread exit: fold the thread's counters into the retired block.
+ */
+static void
+otp_stats_exit(void *arg)
+{
+	struct otp_stats_thread *ot = arg;
+
+	pthread_mutex_lock(&otp_stats_mtx);
+	otp_stats_sum(&otp_stats_retired, &ot->st);
+	if (ot->prev != NULL)
+		ot->prev->next = ot->next;
+	else
+		otp_stats_threads = ot->next;
+	if (ot->next != NULL)
+		ot->next->prev = ot->prev;
+	pthread_mutex_unlock(&otp_stats_mtx);
+	/* in case the thread records anything after this */
+	otp_stats_self = NULL;
+	free(ot);
+}
+
+static void
+otp_stats_init(void)
+{
+
+	pthread_key_create(&otp_stats_key, otp_stats_exit);
+}
+
+/*
+ * Return the calling thread's block, allocating it on first use.
+ * Returns NULL if we are out of memory, in which case the event is
+ * simply not recorded.
+ */
+static struct otp_stats *
+otp_stats_get(void)
+{
+	struct otp_stats_thread *ot;
+
+	if ((ot = otp_stats_self) != NULL)
+		return (&ot->st);
+	pthread_once(&otp_stats_once, otp_stats_init);
+	if ((ot = calloc(1, sizeof *ot)) == NULL)
+		return (NULL);
+	pthread_mutex_lock(&otp_stats_mtx);
+	if ((ot->next = otp_stats_threads) != NULL)
+		ot->next->prev = ot;
+	otp_stats_threads = ot;
+	pthread_mutex_unlock(&otp_stats_mtx);
+	pthread_setspecific(otp_stats_key, ot);
+	otp_stats_self = ot;
+	return (&ot->st);
+}
+
+static inline void
+otp_stats_inc(uint64_t *p, uint64_t n)
+{
+
+	__atomic_store_n(p, __atomic_load_n(p, __ATOMIC_RELAXED) + n,
+	    __ATOMIC_RELAXED);
+}
+
+/*
+ * Map a value to a histogram bucket.  Values below 4 have a bucket
+ * each; above that, each power of two is split into four buckets, so
+ * the relative error is at most 25% over the entire range.
+ */
+static unsigned int
+otp_stats_bucket(uint64_t v)
+{
+	unsigned int msb;
+
+	if (v < 4)
+		return (v);
+	msb = 63 - __builtin_clzll(v);
+	return (4 * (msb - 1) + ((v >> (msb - 2)) & 3));
+}
+
+/*
+ * Return the largest value that falls into a bucket.
+ */
+static uint64_t
+otp_stats_bucket_max(unsigned int b)
+{
+	unsigned int msb;
+
+	if (b < 4)
+		return (b);
+	msb = b / 4 + 1;
+	return (((uint64_t)(4 + b % 4 + 1) << (msb - 2)) - 1);
+}
+
+/*
+ * Out-of-line halves of the recording hooks in cryb_otp_impl.h, which
+ * are only called when recording is on.
+ */
+void
+otp_stats_do_count(unsigned int c)
+{
+	struct otp_stats *st;
+
+	if ((st = otp_stats_get()) == NULL)
+		return;
+	otp_stats_inc(&st->counter[c], 1);
+}
+
+void
+otp_stats_do_offset(oath_mode mode, int64_t offset)
+{
+	struct otp_stats *st;
+	uint64_t *off;
+
+	if ((st = otp_stats_get()) == NULL)
+		return;
+	if (offset < -OTP_STATS_MAXOFFSET)
+		offset = -OTP_STATS_MAXOFFSET;
+	if (offset > OTP_STATS_MAXOFFSET)
+		offset = OTP_STATS_MAXOFFSET;
+	off = mode == om_hotp ? st->hotp_offset : st->totp_offset;
+	otp_stats_inc(&off[offset + OTP_STATS_MAXOFFSET], 1);
+}
+
+void
+otp_stats_do_record(unsigned int h, uint64_t value)
+{
+	struct otp_stats_hist *hist;
+	struct otp_stats *st;
+
+	if ((st = otp_stats_get()) == NULL)
+		return;
+	hist = &st->hist[h];
+	otp_stats_inc(&hist->count, 1);
+	otp_stats_inc(&hist->sum, value);
+	otp_stats_inc(&hist->bucket[otp_stats_bucket(value)], 1);
+}
+
+/*
+ * Return a timestamp in nanoseconds.  Never 0, which otp_stats_clock()
+ * returns when recording is off.
+ */
+uint64_t
+otp_stats_do_clock(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec + 1);
+}
+
+/*
+ * Record the time elapsed since a timestamp from otp_stats_clock().
+ */
+void
+otp_stats_do_elapsed(unsigned int h, uint64_t start)
+{
+	uint64_t now;
+
+	if ((now = otp_stats_clock()) == 0)
+		return;
+	otp_stats_record(h, now - start);
+}
+
+/*
+ * Turn recording on or off.  Counters are not reset.
+ */
+void
+otp_stats_enable(int on)
+{
+
+	__atomic_store_n(&otp_stats_enabled, !!on, __ATOMIC_RELAXED);
+}
+
+/*
+ * Take a snapshot of all counters.  The snapshot is consistent per
+ * counter, but not across counters, as threads keep recording while
+ * we read.
+ */
+otp_stats *
+otp_stats_snapshot(void)
+{
+	struct otp_stats_thread *ot;
+	otp_stats *st;
+
+	if ((st = calloc(1, sizeof *st)) == NULL)
+		return (NULL);
+	pthread_mutex_lock(&otp_stats_mtx);
+	otp_stats_sum(st, &otp_stats_retired);
+	for (ot = otp_stats_threads; ot != NULL; ot = ot->next)
+		otp_stats_sum(st, &ot->st);
+	pthread_mutex_unlock(&otp_stats_mtx);
+	return (st);
+}
+
+void
+otp_stats_free(otp_stats *st)
+{
+
+	free(st);
+}
+
+/*
+ * Prometheus names and labels for each counter and histogram.
+ */
+static const struct {
+	const char	*name;
+	const char	*labels;
+} otp_stats_counters[OTP_STAT_NCOUNTERS] = {
+	[OTP_STAT_HOTP_HIT] =
+	    { "verify", "mode=\"hotp\",result=\"hit\"" },
+	[OTP_STAT_HOTP_MISS] =
+	    { "verify", "mode=\"hotp\",result=\"miss\"" },
+	[OTP_STAT_HOTP_ERROR] =
+	    { "verify", "mode=\"hotp\",result=\"error\"" },
+	[OTP_STAT_TOTP_HIT] =
+	    { "verify", "mode=\"totp\",result=\"hit\"" },
+	[OTP_STAT_TOTP_MISS] =
+	    { "verify", "mode=\"totp\",result=\"miss\"" },
+	[OTP_STAT_TOTP_ERROR] =
+	    { "verify", "mode=\"totp\",result=\"error\"" },
+	[OTP_STAT_RESYNC_HIT] =
+	    { "resync", "result=\"hit\"" },
+	[OTP_STAT_RESYNC_MISS] =
+	    { "resync", "result=\"miss\"" },
+	[OTP_STAT_HMAC_HIT] =
+	    { "cache", "cache=\"hmac\",result=\"hit\"" },
+	[OTP_STAT_HMAC_MISS] =
+	    { "cache", "cache=\"hmac\",result=\"miss\"" },
+	[OTP_STAT_REPLAY_HIT] =
+	    { "cache", "cache=\"replay\",result=\"hit\"" },
+	[OTP_STAT_REPLAY_MISS] =
+	    { "cache", "cache=\"replay\",result=\"miss\"" },
+	[OTP_STAT_THROTTLED] =
+	    { "throttled", "" },
+};
+
+static const struct {
+	const char	*name;
+	const char	*labels;
+	const char	*help;
+	int		 ns;		/* value is a duration */
+} otp_stats_hists[OTP_HIST_NHISTS] = {
+	[OTP_HIST_VERIFY_HOTP] =
+	    { "verify_seconds", "mode=\"hotp\"",
+	      "Time spent checking a response", 1 },
+	[OTP_HIST_VERIFY_TOTP] =
+	    { "verify_seconds", "mode=\"totp\"", NULL, 1 },
+	[OTP_HIST_RESYNC] =
+	    { "resync_seconds", NULL,
+	      "Time spent resynchronizing a key", 1 },
+	[OTP_HIST_RESYNC_DEPTH] =
+	    { "resync_depth", NULL,
+	      "Codes searched before a successful resync", 0 },
+	[OTP_HIST_KEY_LOAD] =
+	    { "key_load_seconds", NULL,
+	      "Time spent reading a key from the store", 1 },
+	[OTP_HIST_KEY_SAVE] =
+	    { "key_save_seconds", NULL,
+	      "Time spent writing a key to the store", 1 },
+	[OTP_HIST_WAL] =
+	    { "wal_commit_seconds", NULL,
+	      "Time spent waiting for the write-ahead log", 1 },
+};
+
+static void
+otp_stats_put_hist(FILE *f, unsigned int h, const struct otp_stats_hist *hist)
+{
+	const char *name, *labels;
+	uint64_t cum, max;
+	unsigned int b;
+	int ns;
+
+	name = otp_stats_hists[h].name;
+	labels = otp_stats_hists[h].labels;
+	ns = otp_stats_hists[h].ns;
+	if (otp_stats_hists[h].help != NULL) {
+		fprintf(f, "# HELP cryb_otp_%s %s\n", name,
+		    otp_stats_hists[h].help);
+		fprintf(f, "# TYPE cryb_otp_%s histogram\n", name);
+	}
+	/* only non-empty buckets; Prometheus does not need the rest */
+	for (b = cum = 0; b < OTP_STATS_NBUCKETS; ++b) {
+		if (hist->bucket[b] == 0)
+			continue;
+		cum += hist->bucket[b];
+		max = otp_stats_bucket_max(b);
+		fprintf(f, "cryb_otp_%s_bucket{%s%sle=\"", name,
+		    labels ? labels : "", labels ? "," : "");
+		if (ns)
+			fprintf(f, "%.9g", max / 1e9);
+		else
+			fprintf(f, "%llu", (unsigned long long)max);
+		fprintf(f, "\"} %llu\n", (unsigned long long)cum);
+	}
+	fprintf(f, "cryb_otp_%s_bucket{%s%sle=\"+Inf\"} %llu\n", name,
+	    labels ? labels : "", labels ? "," : "",
+	    (unsigned long long)hist->count);
+	if (ns)
+		fprintf(f, "cryb_otp_%s_sum%s%s%s %.9g\n", name,
+		    labels ? "{" : "", labels ? labels : "", labels ? "}" : "",
+		    hist->sum / 1e9);
+	else
+		fprintf(f, "cryb_otp_%s_sum%s%s%s %llu\n", name,
+		    labels ? "{" : "", labels ? labels : "", labels ? "}" : "",
+		    (unsigned long long)hist->sum);
+	fprintf(f, "cryb_otp_%s_count%s%s%s %llu\n", name,
+	    labels ? "{" : "", labels ? labels : "", labels ? "}" : "",
+	    (unsigned long long)hist->count);
+}
+
+static void
+otp_stats_put_offsets(FILE *f, const char *mode, const uint64_t *off)
+{
+	int i;
+
+	for (i = 0; i < 2 * OTP_STATS_MAXOFFSET + 1; ++i) {
+		if (off[i] == 0)
+			continue;
+		fprintf(f, "cryb_otp_window_offset_total"
+		    "{mode=\"%s\",offset=\"%d\"} %llu\n", mode,
+		    i - OTP_STATS_MAXOFFSET, (unsigned long long)off[i]);
+	}
+}
+
+/*
+ * Write a snapshot to a file descriptor in the Prometheus text
+ * exposition format.  Returns 0 on success and -1 on error.
+ */
+int
+otp_stats_export(const otp_stats *st, int fd)
+{
+	const char *prev;
+	char *buf, *p;
+	size_t len;
+	ssize_t wlen;
+	unsigned int i;
+	FILE *f;
+	int serrno;
+
+	if ((f = open_memstream(&buf, &len)) == NULL)
+		return (-1);
+	for (i = 0, prev = NULL; i < OTP_STAT_NCOUNTERS; ++i) {
+		if (prev == NULL || strcmp(prev, otp_stats_counters[i].name))
+			fprintf(f, "# TYPE cryb_otp_%s_total counter\n",
+			    otp_stats_counters[i].name);
+		prev = otp_stats_counters[i].name;
+		fprintf(f, "cryb_otp_%s_total%s%s%s %llu\n",
+		    otp_stats_counters[i].name,
+		    *otp_stats_counters[i].labels ? "{" : "",
+		    otp_stats_counters[i].labels,
+		    *otp_stats_counters[i].labels ? "}" : "",
+		    (unsigned long long)st->counter[i]);
+	}
+	fprintf(f, "# HELP cryb_otp_window_offset_total "
+	    "Position of matching codes relative to the expected one\n");
+	fprintf(f, "# TYPE cryb_otp_window_offset_total counter\n");
+	otp_stats_put_offsets(f, "hotp", st->hotp_offset);
+	otp_stats_put_offsets(f, "totp", st->totp_offset);
+	for (i = 0; i < OTP_HIST_NHISTS; ++i)
+		otp_stats_put_hist(f, i, &st->hist[i]);
+	if (fclose(f) != 0)
+		return (-1);
+	for (p = buf; len > 0; p += wlen, len -= wlen) {
+		if ((wlen = write(fd, p, len)) < 0) {
+			if (errno == EINTR) {
+				wlen = 0;
+				continue;
+			}
+			serrno = errno;
+			free(buf);
+			errno = serrno;
+			return (-1);
+		}
+	}
+	free(buf);
+	return (0);
+}
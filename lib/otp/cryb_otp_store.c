@@ -0,0 +1,1114 @@
+/*-
+ * Copyright (c) 2026 Dag-Erling Smørgrav
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "cryb/impl.h"
+
+#include <sys/types.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <cryb/oath.h>
+#include <cryb/otp.h>
+
+#include "cryb_otp_impl.h"
+
+/*
+ * Size of a store file with the given number of records.
+ */
+static size_t
+otp_store_size(uint32_t nrecs)
+{
+
+	return (sizeof(struct otp_store_header) +
+	    2 * (size_t)nrecs * sizeof(struct otp_store_slot) +
+	    (size_t)nrecs * sizeof(struct otp_store_record));
+}
+
+/*
+ * Map an open store file and validate its header.
+ */
+static int
+otp_store_map(otp_store *st)
+{
+	struct otp_store_header *hdr;
+	struct stat sb;
+	int prot;
+
+	if (fstat(st->fd, &sb) != 0)
+		return (-1);
+	if ((size_t)sb.st_size < sizeof *hdr) {
+		errno = EINVAL;
+		return (-1);
+	}
+	prot = PROT_READ;
+	if ((st->oflags & O_ACCMODE) != O_RDONLY)
+		prot |= PROT_WRITE;
+	st->size = sb.st_size;
+	st->base = mmap(NULL, st->size, prot, MAP_SHARED, st->fd, 0);
+	if (st->base == MAP_FAILED) {
+		st->base = NULL;
+		return (-1);
+	}
+	hdr = st->base;
+	if (hdr->magic != OTP_STORE_MAGIC ||
+	    hdr->version != OTP_STORE_VERSION ||
+	    hdr->recsize != sizeof(struct otp_store_record) ||
+	    hdr->nrecs == 0 || (hdr->nrecs & (hdr->nrecs - 1)) != 0 ||
+	    hdr->nslots != 2 * hdr->nrecs || hdr->nused > hdr->nrecs ||
+	    otp_store_size(hdr->nrecs) != st->size) {
+		munmap(st->base, st->size);
+		st->base = NULL;
+		errno = EINVAL;
+		return (-1);
+	}
+	st->hdr = hdr;
+	st->slots = (struct otp_store_slot *)(hdr + 1);
+	st->recs = (struct otp_store_record *)(st->slots + hdr->nslots);
+	return (0);
+}
+
+/*
+ * Unmap and close the store file.
+ */
+static void
+otp_store_unmap(otp_store *st)
+{
+
+	if (st->base != NULL)
+		munmap(st->base, st->size);
+	st->base = NULL;
+	st->hdr = NULL;
+	st->slots = NULL;
+	st->recs = NULL;
+	if (st->fd >= 0)
+		close(st->fd);
+	st->fd = -1;
+}
+
+/*
+ * Initialize an empty store file.
+ */
+static int
+otp_store_init(int fd, uint32_t nrecs)
+{
+	struct otp_store_header hdr;
+
+	if (ftruncate(fd, otp_store_size(nrecs)) != 0)
+		return (-1);
+	memset(&hdr, 0, sizeof hdr);
+	hdr.magic = OTP_STORE_MAGIC;
+	hdr.version = OTP_STORE_VERSION;
+	hdr.recsize = sizeof(struct otp_store_record);
+	hdr.nslots = 2 * nrecs;
+	hdr.nrecs = nrecs;
+	if (pwrite(fd, &hdr, sizeof hdr, 0) != (ssize_t)sizeof hdr)
+		return (-1);
+	return (0);
+}
+
+/*
+ * Open and map the store file, creating it if necessary and allowed.
+ */
+static int
+otp_store_attach(otp_store *st)
+{
+	struct stat sb;
+
+	if ((st->fd = open(st->path, st->oflags, 0600)) < 0)
+		return (-1);
+	if (st->oflags & O_CREAT) {
+		if (flock(st->fd, LOCK_EX) != 0 || fstat(st->fd, &sb) != 0 ||
+		    (sb.st_size == 0 &&
+			otp_store_init(st->fd, OTP_STORE_MINRECS) != 0)) {
+			otp_store_unmap(st);
+			return (-1);
+		}
+		flock(st->fd, LOCK_UN);
+	}
+	if (otp_store_map(st) != 0) {
+		otp_store_unmap(st);
+		return (-1);
+	}
+	return (0);
+}
+
+/*
+ * Switch to a fresh mapping if the file has been replaced.
+ */
+static int
+otp_store_refresh(otp_store *st)
+{
+
+	if (st->hdr != NULL &&
+	    !(__atomic_load_n(&st->hdr->flags, __ATOMIC_ACQUIRE) &
+		OTP_STORE_STALE))
+		return (0);
+	otp_store_unmap(st);
+	return (otp_store_attach(st));
+}
+
+/*
+ * Look up a user in the index.  Returns the matching slot, or the empty
+ * slot where the user would be inserted.
+ */
+static struct otp_store_slot *
+otp_store_find(otp_store *st, const char *user, uint32_t hashval)
+{
+	struct otp_store_slot *slot;
+	uint32_t i, mask, n, recno;
+
+	mask = st->hdr->nslots - 1;
+	for (i = hashval & mask, n = 0; n < st->hdr->nslots;
+	     i = (i + 1) & mask, ++n) {
+		slot = &st->slots[i];
+		recno = __atomic_load_n(&slot->recno, __ATOMIC_ACQUIRE);
+		if (recno == 0)
+			return (slot);
+		if (slot->hashval == hashval && recno <= st->hdr->nrecs &&
+		    strncmp(st->recs[recno - 1].user, user,
+			sizeof st->recs[recno - 1].user) == 0)
+			return (slot);
+	}
+	return (NULL);
+}
+
+/*
+ * Begin and end a write to data protected by a sequence counter.  The
+ * caller must hold the write lock.
+ */
+static uint32_t
+otp_store_begin(uint32_t *seqp)
+{
+	uint32_t seq;
+
+	/* an odd sequence number means a previous writer died */
+	if ((seq = *seqp) & 1)
+		seq++;
+	__atomic_store_n(seqp, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	return (seq);
+}
+
+static void
+otp_store_end(uint32_t *seqp, uint32_t seq)
+{
+
+	__atomic_store_n(seqp, seq + 2, __ATOMIC_RELEASE);
+}
+
+/*
+ * Take a consistent snapshot of data protected by a sequence counter.
+ * If a write is in progress, wait for the writer to finish; if there
+ * is no writer, it died, and we give up.
+ */
+static int
+otp_store_snapshot(otp_store *st, uint32_t *seqp, const void *src,
+    void *dst, size_t len)
+{
+	uint32_t seq;
+
+	for (;;) {
+		seq = __atomic_load_n(seqp, __ATOMIC_ACQUIRE);
+		if (seq & 1) {
+			if (flock(st->fd, LOCK_SH) != 0)
+				return (-1);
+			flock(st->fd, LOCK_UN);
+			if (__atomic_load_n(seqp, __ATOMIC_ACQUIRE) == seq) {
+				errno = EIO;
+				return (-1);
+			}
+			continue;
+		}
+		memcpy(dst, src, len);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(seqp, __ATOMIC_RELAXED) == seq)
+			return (0);
+	}
+}
+
+/*
+ * Take a snapshot of a user's record.  Returns 0 on success and -1 with
+ * errno set to ENOENT if the user does not have a key.
+ */
+static int
+otp_store_get(otp_store *st, const char *user, struct otp_store_record *rec)
+{
+	struct otp_store_record *src;
+	struct otp_store_slot *slot;
+	uint32_t hashval, recno;
+	uint64_t t0;
+
+	t0 = otp_stats_clock();
+	if (otp_store_refresh(st) != 0)
+		return (-1);
+	hashval = otp_strhash(user);
+	if ((slot = otp_store_find(st, user, hashval)) == NULL ||
+	    (recno = __atomic_load_n(&slot->recno, __ATOMIC_ACQUIRE)) == 0) {
+		errno = ENOENT;
+		return (-1);
+	}
+	src = &st->recs[recno - 1];
+	do {
+		if (otp_store_snapshot(st, &src->seq, src, rec, sizeof *rec) != 0)
+			return (-1);
+		/* these are advanced in place, see otp_store_advance() */
+		rec->counter = __atomic_load_n(&src->counter, __ATOMIC_ACQUIRE);
+		rec->lastused = __atomic_load_n(&src->lastused, __ATOMIC_ACQUIRE);
+	} while (__atomic_load_n(&src->seq, __ATOMIC_ACQUIRE) != rec->seq);
+	/* removed, see otp_store_remove() */
+	if (rec->mode == om_undef) {
+		otp_wipe(rec, sizeof *rec);
+		errno = ENOENT;
+		return (-1);
+	}
+	otp_stats_elapsed(OTP_HIST_KEY_LOAD, t0);
+	return (0);
+}
+
+/*
+ * Copy a record into a key.
+ */
+static void
+otp_store_read(const struct otp_store_record *rec, oath_key *key)
+{
+
+	memset(key, 0, sizeof *key);
+	key->mode = (oath_mode)rec->mode;
+	key->hash = (oath_hash)rec->hash;
+	key->digits = rec->digits;
+	key->timestep = rec->timestep;
+	key->counter = rec->counter;
+	key->lastused = rec->lastused;
+	key->labellen = strnlen(rec->label, sizeof rec->label);
+	if (key->labellen >= sizeof key->label)
+		key->labellen = sizeof key->label - 1;
+	memcpy(key->label, rec->label, key->labellen);
+	key->issuerlen = strnlen(rec->issuer, sizeof rec->issuer);
+	if (key->issuerlen >= sizeof key->issuer)
+		key->issuerlen = sizeof key->issuer - 1;
+	memcpy(key->issuer, rec->issuer, key->issuerlen);
+	key->keylen = rec->keylen;
+	if (key->keylen > sizeof key->key)
+		key->keylen = sizeof key->key;
+	memcpy(key->key, rec->key, key->keylen);
+}
+
+/*
+ * Copy a key into a record.  The caller must hold the write lock.
+ */
+static void
+otp_store_write(struct otp_store_record *rec, const char *user,
+    uint32_t hashval, const oath_key *key)
+{
+	uint32_t seq;
+	size_t len;
+
+	seq = otp_store_begin(&rec->seq);
+	rec->hashval = hashval;
+	rec->mode = key->mode;
+	rec->hash = key->hash;
+	rec->digits = key->digits;
+	rec->keylen = key->keylen;
+	rec->timestep = key->timestep;
+	rec->counter = key->counter;
+	rec->lastused = key->lastused;
+	memset(rec->user, 0, sizeof rec->user);
+	memcpy(rec->user, user, strlen(user));
+	memset(rec->label, 0, sizeof rec->label);
+	len = key->labellen < sizeof rec->label ?
+	    key->labellen : sizeof rec->label;
+	memcpy(rec->label, key->label, len);
+	memset(rec->issuer, 0, sizeof rec->issuer);
+	len = key->issuerlen < sizeof rec->issuer ?
+	    key->issuerlen : sizeof rec->issuer;
+	memcpy(rec->issuer, key->issuer, len);
+	memset(rec->key, 0, sizeof rec->key);
+	memcpy(rec->key, key->key, key->keylen);
+	otp_store_end(&rec->seq, seq);
+}
+
+/*
+ * Convert between the public and on-disk policy representations.
+ */
+static void
+otp_store_policy_get(const struct otp_store_polrec *sp, otp_policy *pol)
+{
+
+	pol->hotp_lookahead = sp->hotp_lookahead;
+	pol->totp_lookahead = sp->totp_lookahead;
+	pol->totp_lookbehind = sp->totp_lookbehind;
+	pol->totp_skew = sp->totp_skew;
+	pol->resync_window = sp->resync_window;
+	pol->flags = (sp->flags & OTP_STORE_CONSTTIME) ?
+	    OTP_POLICY_CONSTTIME : 0;
+}
+
+static void
+otp_store_policy_put(struct otp_store_polrec *sp, const otp_policy *pol)
+{
+
+	if (pol == NULL) {
+		memset(sp, 0, sizeof *sp);
+		return;
+	}
+	sp->flags = OTP_STORE_POLICY;
+	if (pol->flags & OTP_POLICY_CONSTTIME)
+		sp->flags |= OTP_STORE_CONSTTIME;
+	sp->hotp_lookahead = pol->hotp_lookahead;
+	sp->totp_lookahead = pol->totp_lookahead;
+	sp->totp_lookbehind = pol->totp_lookbehind;
+	sp->totp_skew = pol->totp_skew;
+	sp->resync_window = pol->resync_window;
+}
+
+/*
+ * Take the write lock on the current store file.
+ */
+static int
+otp_store_lock(otp_store *st)
+{
+
+	if ((st->oflags & O_ACCMODE) == O_RDONLY) {
+		errno = EBADF;
+		return (-1);
+	}
+	for (;;) {
+		if (otp_store_refresh(st) != 0)
+			return (-1);
+		if (flock(st->fd, LOCK_EX) != 0)
+			return (-1);
+		if (!(__atomic_load_n(&st->hdr->flags, __ATOMIC_ACQUIRE) &
+			OTP_STORE_STALE))
+			return (0);
+		flock(st->fd, LOCK_UN);
+	}
+}
+
+/*
+ * Take a shared lock on the current store file.  This excludes writers
+ * holding the write lock, but not other holders of a shared lock.
+ */
+static int
+otp_store_lock_shared(otp_store *st)
+{
+
+	if ((st->oflags & O_ACCMODE) == O_RDONLY) {
+		errno = EBADF;
+		return (-1);
+	}
+	for (;;) {
+		if (otp_store_refresh(st) != 0)
+			return (-1);
+		if (flock(st->fd, LOCK_SH) != 0)
+			return (-1);
+		if (!(__atomic_load_n(&st->hdr->flags, __ATOMIC_ACQUIRE) &
+			OTP_STORE_STALE))
+			return (0);
+		flock(st->fd, LOCK_UN);
+	}
+}
+
+/*
+ * Double the capacity of the store.  We build a new file next to the
+ * old one, rename it into place, then mark the old one stale so other
+ * users of the store know to reopen it.  The caller must hold the
+ * write lock, and will still hold it (on the new file) on return.
+ */
+static int
+otp_store_grow(otp_store *st)
+{
+	otp_store nst;
+	struct otp_store_slot *slot;
+	struct otp_store_record *rec;
+	char *npath;
+	uint32_t i, nrecs;
+
+	if (st->hdr->nrecs >= UINT32_MAX / 4) {
+		errno = ENOSPC;
+		return (-1);
+	}
+	nrecs = st->hdr->nrecs * 2;
+	if (asprintf(&npath, "%s.new", st->path) < 0)
+		return (-1);
+	memset(&nst, 0, sizeof nst);
+	nst.path = st->path;
+	nst.oflags = st->oflags;
+	if ((nst.fd = open(npath, O_RDWR|O_CREAT|O_TRUNC, 0600)) < 0)
+		goto fail;
+	if (flock(nst.fd, LOCK_EX) != 0 || otp_store_init(nst.fd, nrecs) != 0 ||
+	    otp_store_map(&nst) != 0)
+		goto fail;
+	nst.hdr->policy = st->hdr->policy;
+	memcpy(nst.recs, st->recs, st->hdr->nused * sizeof *rec);
+	for (i = 0; i < st->hdr->nused; ++i) {
+		rec = &nst.recs[i];
+		slot = otp_store_find(&nst, rec->user, rec->hashval);
+		slot->hashval = rec->hashval;
+		slot->recno = i + 1;
+	}
+	nst.hdr->nused = st->hdr->nused;
+	if (fsync(nst.fd) != 0 || rename(npath, st->path) != 0)
+		goto fail;
+	__atomic_fetch_or(&st->hdr->flags, OTP_STORE_STALE, __ATOMIC_RELEASE);
+	otp_store_unmap(st);
+	st->fd = nst.fd;
+	st->base = nst.base;
+	st->size = nst.size;
+	st->hdr = nst.hdr;
+	st->slots = nst.slots;
+	st->recs = nst.recs;
+	free(npath);
+	return (0);
+fail:
+	otp_store_unmap(&nst);
+	unlink(npath);
+	free(npath);
+	return (-1);
+}
+
+/*
+ * Open a key store.  The flags are those accepted by open(2); only
+ * O_RDONLY, O_RDWR and O_CREAT are meaningful.
+ */
+otp_store *
+otp_store_open(const char *path, int flags)
+{
+	otp_store *st;
+
+	if ((st = calloc(1, sizeof *st)) == NULL)
+		return (NULL);
+	if ((st->path = strdup(path)) == NULL) {
+		free(st);
+		return (NULL);
+	}
+	st->fd = -1;
+	st->oflags = flags & (O_ACCMODE|O_CREAT);
+	if (st->oflags & O_CREAT)
+		st->oflags = (st->oflags & ~O_ACCMODE) | O_RDWR;
+	st->oflags |= O_CLOEXEC;
+	if (otp_store_attach(st) != 0) {
+		free(st->path);
+		free(st);
+		return (NULL);
+	}
+	return (st);
+}
+
+/*
+ * Look up a user's key.  Returns 0 on success and -1 with errno set to
+ * ENOENT if the user does not have a key.
+ */
+int
+otp_store_lookup(otp_store *st, const char *user, oath_key *key)
+{
+	struct otp_store_record rec;
+
+	if (otp_store_get(st, user, &rec) != 0)
+		return (-1);
+	otp_store_read(&rec, key);
+	otp_wipe(&rec, sizeof rec);
+	return (0);
+}
+
+/*
+ * Insert or replace a user's key.  The caller must hold the write lock.
+ */
+static int
+otp_store_put(otp_store *st, const char *user, const oath_key *key)
+{
+	struct otp_store_slot *slot;
+	uint32_t hashval, recno;
+
+	hashval = otp_strhash(user);
+	slot = otp_store_find(st, user, hashval);
+	if ((recno = slot->recno) == 0) {
+		if (st->hdr->nused == st->hdr->nrecs) {
+			if (otp_store_grow(st) != 0)
+				return (-1);
+			slot = otp_store_find(st, user, hashval);
+		}
+		recno = st->hdr->nused + 1;
+		otp_store_write(&st->recs[recno - 1], user, hashval, key);
+		slot->hashval = hashval;
+		__atomic_store_n(&slot->recno, recno, __ATOMIC_RELEASE);
+		st->hdr->nused = recno;
+	} else {
+		otp_store_write(&st->recs[recno - 1], user, hashval, key);
+	}
+	return (0);
+}
+
+/*
+ * Check that a user name and key will fit in a record.
+ */
+static int
+otp_store_valid(otp_store *st, const char *user, const oath_key *key)
+{
+
+	if (*user == '\0' || strlen(user) >= sizeof st->recs->user ||
+	    key->keylen > sizeof st->recs->key) {
+		errno = EINVAL;
+		return (-1);
+	}
+	return (0);
+}
+
+/*
+ * Insert or replace a user's key.
+ */
+int
+otp_store_update(otp_store *st, const char *user, const oath_key *key)
+{
+
+	return (otp_store_update_batch(st, &user, &key, 1));
+}
+
+/*
+ * Insert or replace multiple keys under a single acquisition of the
+ * write lock.  Either all of the entries are valid and are written, or
+ * none of them are.  If the store needs to grow partway through and
+ * fails to, the entries written so far remain in place.
+ */
+int
+otp_store_update_batch(otp_store *st, const char *const *users,
+    const oath_key *const *keys, size_t n)
+{
+	uint64_t t0;
+	size_t i;
+	int serrno;
+
+	for (i = 0; i < n; ++i)
+		if (otp_store_valid(st, users[i], keys[i]) != 0)
+			return (-1);
+	t0 = otp_stats_clock();
+	if (otp_store_lock(st) != 0)
+		return (-1);
+	for (i = 0; i < n; ++i)
+		if (otp_store_put(st, users[i], keys[i]) != 0)
+			goto fail;
+	flock(st->fd, LOCK_UN);
+	otp_stats_elapsed(OTP_HIST_KEY_SAVE, t0);
+	return (0);
+fail:
+	serrno = errno;
+	flock(st->fd, LOCK_UN);
+	errno = serrno;
+	return (-1);
+}
+
+/*
+ * Remove a user's key.  If key is not NULL, the key is only removed if
+ * it is still the one passed in, with the same secret, counter and
+ * last used time step; otherwise, we fail with EAGAIN.  This allows a
+ * key to be copied elsewhere and then removed without losing an
+ * advance made in the meantime.  The record is left behind as a
+ * tombstone, which keeps the index intact for lock-free readers; it is
+ * reused if the user is given a new key, but its space is otherwise
+ * not reclaimed.
+ */
+int
+otp_store_remove(otp_store *st, const char *user, const oath_key *key)
+{
+	struct otp_store_record *rec;
+	struct otp_store_slot *slot;
+	uint32_t recno, seq;
+
+	if (otp_store_lock(st) != 0)
+		return (-1);
+	if ((slot = otp_store_find(st, user, otp_strhash(user))) == NULL ||
+	    (recno = slot->recno) == 0 ||
+	    (rec = &st->recs[recno - 1])->mode == om_undef) {
+		flock(st->fd, LOCK_UN);
+		errno = ENOENT;
+		return (-1);
+	}
+	/* advances are made under the shared lock, so these are stable */
+	if (key != NULL && (rec->mode != key->mode ||
+	    rec->counter != key->counter || rec->lastused != key->lastused ||
+	    rec->keylen != key->keylen ||
+	    memcmp(rec->key, key->key, key->keylen) != 0)) {
+		flock(st->fd, LOCK_UN);
+		errno = EAGAIN;
+		return (-1);
+	}
+	seq = otp_store_begin(&rec->seq);
+	rec->mode = om_undef;
+	rec->keylen = 0;
+	rec->counter = rec->lastused = 0;
+	otp_wipe(rec->key, sizeof rec->key);
+	memset(&rec->policy, 0, sizeof rec->policy);
+	otp_store_end(&rec->seq, seq);
+	flock(st->fd, LOCK_UN);
+	return (0);
+}
+
+/*
+ * Iterate over the users who have a key.  The cursor should be zero
+ * for the first call, and is advanced past the user returned.  Returns
+ * 1 and the user's name if there is one, 0 if there are no more users,
+ * and -1 on error.  Users added or removed while the iteration is in
+ * progress may or may not be seen, but every other user is seen
+ * exactly once, even if the store grows.
+ */
+int
+otp_store_next(otp_store *st, uint32_t *cursor, char *user, size_t size)
+{
+	struct otp_store_record rec;
+	size_t len;
+	uint32_t i;
+
+	if (otp_store_refresh(st) != 0)
+		return (-1);
+	for (i = *cursor; i < __atomic_load_n(&st->hdr->nused,
+	    __ATOMIC_ACQUIRE); ++i) {
+		if (otp_store_snapshot(st, &st->recs[i].seq, &st->recs[i],
+		    &rec, sizeof rec) != 0)
+			return (-1);
+		if (rec.mode == om_undef)
+			continue;
+		*cursor = i + 1;
+		len = strnlen(rec.user, sizeof rec.user);
+		otp_wipe(&rec.key, sizeof rec.key);
+		if (len >= size) {
+			errno = ENOSPC;
+			return (-1);
+		}
+		memcpy(user, rec.user, len);
+		user[len] = '\0';
+		return (1);
+	}
+	*cursor = i;
+	return (0);
+}
+
+/*
+ * Compute the verification policy in effect for a record, or the
+ * store's default policy if rec is NULL.  A per-user policy takes
+ * precedence over the store's default policy, which takes precedence
+ * over the built-in default.
+ */
+static int
+otp_store_policy_rec(otp_store *st, const struct otp_store_record *rec,
+    otp_policy *pol)
+{
+	struct otp_store_polrec sp;
+
+	otp_policy_init(pol);
+	if (otp_store_snapshot(st, &st->hdr->polseq, &st->hdr->policy,
+	    &sp, sizeof sp) != 0)
+		return (-1);
+	if (sp.flags & OTP_STORE_POLICY)
+		otp_store_policy_get(&sp, pol);
+	if (rec != NULL && (rec->policy.flags & OTP_STORE_POLICY))
+		otp_store_policy_get(&rec->policy, pol);
+	return (0);
+}
+
+/*
+ * Retrieve the verification policy in effect for a user, or the
+ * store's default policy if user is NULL.  Returns -1 with errno set
+ * to ENOENT if the user does not have a key.
+ */
+int
+otp_store_policy(otp_store *st, const char *user, otp_policy *pol)
+{
+	struct otp_store_record rec;
+	int ret;
+
+	if (user == NULL) {
+		if (otp_store_refresh(st) != 0)
+			return (-1);
+		return (otp_store_policy_rec(st, NULL, pol));
+	}
+	if (otp_store_get(st, user, &rec) != 0)
+		return (-1);
+	ret = otp_store_policy_rec(st, &rec, pol);
+	otp_wipe(&rec, sizeof rec);
+	return (ret);
+}
+
+/*
+ * Set the verification policy for a user, or the store's default
+ * policy if user is NULL.  If pol is NULL, the policy is cleared, so
+ * the user falls back to the store's default policy, and the store
+ * falls back to the built-in default.
+ */
+int
+otp_store_set_policy(otp_store *st, const char *user, const otp_policy *pol)
+{
+	struct otp_store_record *rec;
+	struct otp_store_slot *slot;
+	uint32_t recno, seq;
+
+	if (pol != NULL && otp_policy_check(pol) != 0)
+		return (-1);
+	if (otp_store_lock(st) != 0)
+		return (-1);
+	if (user == NULL) {
+		seq = otp_store_begin(&st->hdr->polseq);
+		otp_store_policy_put(&st->hdr->policy, pol);
+		otp_store_end(&st->hdr->polseq, seq);
+	} else {
+		if ((slot = otp_store_find(st, user, otp_strhash(user))) == NULL ||
+		    (recno = slot->recno) == 0 ||
+		    st->recs[recno - 1].mode == om_undef) {
+			flock(st->fd, LOCK_UN);
+			errno = ENOENT;
+			return (-1);
+		}
+		rec = &st->recs[recno - 1];
+		seq = otp_store_begin(&rec->seq);
+		otp_store_policy_put(&rec->policy, pol);
+		otp_store_end(&rec->seq, seq);
+	}
+	flock(st->fd, LOCK_UN);
+	return (0);
+}
+
+/*
+ * Publish the outcome of a successful verification.  We hold a shared
+ * lock, which excludes otp_store_update() and otp_store_grow() but not
+ * other verifiers, and advance the counter or last used time step with
+ * a compare-and-swap against the value we verified against.  Returns
+ * 0 on success, 1 if the record changed since our snapshot and the
+ * caller should try again, and -1 on error.
+ */
+static int
+otp_store_advance(otp_store *st, const char *user,
+    const struct otp_store_record *rec, const oath_key *key)
+{
+	struct otp_store_record *dst;
+	struct otp_store_slot *slot;
+	uint64_t old, *field, t0, val;
+	uint32_t recno;
+	int ret;
+
+	t0 = otp_stats_clock();
+	if (key->mode == om_hotp) {
+		old = rec->counter;
+		val = key->counter;
+	} else {
+		old = rec->lastused;
+		val = key->lastused;
+	}
+	if (otp_store_lock_shared(st) != 0)
+		return (-1);
+	ret = 1;
+	if ((slot = otp_store_find(st, user, otp_strhash(user))) != NULL &&
+	    (recno = slot->recno) != 0) {
+		dst = &st->recs[recno - 1];
+		field = key->mode == om_hotp ? &dst->counter : &dst->lastused;
+		if (__atomic_load_n(&dst->seq, __ATOMIC_ACQUIRE) == rec->seq &&
+		    __atomic_compare_exchange_n(field, &old, val, 0,
+			__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+			ret = 0;
+	}
+	flock(st->fd, LOCK_UN);
+	otp_stats_elapsed(OTP_HIST_KEY_SAVE, t0);
+	return (ret);
+}
+
+/*
+ * Check one or more responses for a user and advance the user's key
+ * in the store if they match.  With resync unset, this is a single
+ * verification; otherwise, it is a resynchronization.  If the store
+ * has a failure tracker, it is consulted before any HMAC work is done,
+ * and told the outcome afterwards.  If the store has a replay cache, a
+ * TOTP success is recorded there instead of in the write-ahead log.
+ */
+static int
+otp_store_check(otp_store *st, const char *user,
+    const unsigned long *response, unsigned int n, int resync)
+{
+	struct otp_store_record rec;
+	const unsigned long *tresp;
+	otp_policy pol;
+	oath_key key;
+	uint64_t tstate;
+	int adv, cached, checked, ret, serrno;
+
+	tresp = resync ? NULL : response;
+	tstate = 0;
+	checked = 0;
+	cached = 0;
+	otp_user_lock(user);
+	for (;;) {
+		if (otp_store_get(st, user, &rec) != 0 ||
+		    otp_store_policy_rec(st, &rec, &pol) != 0) {
+			ret = -1;
+			break;
+		}
+		otp_store_read(&rec, &key);
+		if (st->throttle != NULL) {
+			tstate = otp_throttle_state(&key, time(NULL));
+			if (!checked) {
+				ret = otp_throttle_check(st->throttle, user,
+				    tresp, tstate);
+				/* throttled; the attempt is not counted */
+				if (ret < 0)
+					break;
+				checked = 1;
+				/* already rejected; count it again */
+				if (ret > 0) {
+					ret = 0;
+					break;
+				}
+			}
+		}
+		/* a window too wide for the cache bypasses it */
+		if (st->replay != NULL && !resync && key.mode == om_totp)
+			cached = otp_replay_apply(st->replay, user, &key, &pol,
+			    time(NULL)) == 0;
+		ret = resync ? otp_resync_policy(&key, response, n, &pol) :
+		    otp_verify_policy(&key, *response, &pol);
+		if (ret <= 0)
+			break;
+		if ((adv = otp_store_advance(st, user, &rec, &key)) <= 0) {
+			if (adv < 0)
+				ret = -1;
+			break;
+		}
+	}
+	if (ret > 0 && cached) {
+		switch (otp_replay_insert(st->replay, user, key.lastused)) {
+		case 0:
+			break;
+		case 1:
+			/* already used, though the store did not know */
+			ret = 0;
+			break;
+		default:
+			/* cache full, fall back to the log */
+			cached = 0;
+		}
+	}
+	if (ret > 0 && !cached && st->wal != NULL &&
+	    otp_wal_append(st->wal, user, key.mode,
+		key.mode == om_hotp ? key.counter : key.lastused) != 0)
+		ret = -1;
+	/* replicas learn of the advance asynchronously */
+	if (ret > 0 && st->repl != NULL)
+		otp_repl_publish(st->repl, user, key.mode,
+		    key.mode == om_hotp ? key.counter : key.lastused);
+	serrno = errno;
+	if (checked && ret >= 0)
+		otp_throttle_record(st->throttle, user, tresp, tstate, ret > 0);
+	otp_user_unlock(user);
+	otp_wipe(&key, sizeof key);
+	otp_wipe(&rec, sizeof rec);
+	errno = serrno;
+	return (ret);
+}
+
+/*
+ * Check a response for a user and, if it matches, advance the user's
+ * counter or last used time step in the store.  This is safe against
+ * concurrent verifications for the same user by other threads or
+ * processes: a code is accepted at most once.  Within a process,
+ * verifications for the same user are also serialized on the user's
+ * lock, so they do not waste effort on conflicting attempts.  Returns
+ * the same as otp_verify(), with errno set to ENOENT if the user does
+ * not have a key.
+ */
+int
+otp_store_verify(otp_store *st, const char *user, unsigned long response)
+{
+
+	return (otp_store_check(st, user, &response, 1, 0));
+}
+
+/*
+ * Resynchronize a user's key in the store, with the same guarantees
+ * as otp_store_verify().  Returns the same as otp_resync().
+ */
+int
+otp_store_resync(otp_store *st, const char *user,
+    const unsigned long *response, unsigned int n)
+{
+
+	return (otp_store_check(st, user, response, n, 1));
+}
+
+/*
+ * The highest value an advance received from a peer may raise a record
+ * to.  A peer can move an HOTP counter no further than the deepest
+ * resynchronization, and a TOTP time step no further ahead of the
+ * current one than the user's skew and lookahead, plus one step for
+ * the difference between the peers' clocks.  The caller must hold a
+ * lock, so nothing but the counters can change under us.
+ */
+static uint64_t
+otp_store_merge_limit(otp_store *st, const struct otp_store_record *dst,
+    uint64_t cur)
+{
+	otp_policy pol;
+	int64_t seq;
+
+	if (dst->mode == om_hotp)
+		return (cur > UINT64_MAX - OTP_RESYNC_MAXDEPTH ? UINT64_MAX :
+		    cur + OTP_RESYNC_MAXDEPTH);
+	if (dst->timestep == 0 || otp_store_policy_rec(st, dst, &pol) != 0)
+		return (0);
+	seq = (int64_t)time(NULL) / dst->timestep + pol.totp_skew +
+	    pol.totp_lookahead + 1;
+	return (seq > 0 ? (uint64_t)seq : 0);
+}
+
+/*
+ * Raise a user's counter or last used time step to at least the given
+ * value.  This is how the write-ahead log is replayed, so it must be
+ * idempotent.  If the user's key has since been replaced with one of a
+ * different mode, the value no longer applies and is ignored.  With
+ * OTP_STORE_MERGE_PEER, the value comes from a peer, and is refused
+ * with ERANGE if it is further ahead than the peer could have got by
+ * verifying or resynchronizing.
+ */
+int
+otp_store_merge(otp_store *st, const char *user, oath_mode mode,
+    uint64_t value, int flags)
+{
+	struct otp_store_record *dst;
+	struct otp_store_slot *slot;
+	uint64_t cur, *field;
+	uint32_t recno;
+	int ret;
+
+	if (otp_store_lock_shared(st) != 0)
+		return (-1);
+	if ((slot = otp_store_find(st, user, otp_strhash(user))) == NULL ||
+	    (recno = slot->recno) == 0) {
+		flock(st->fd, LOCK_UN);
+		errno = ENOENT;
+		return (-1);
+	}
+	dst = &st->recs[recno - 1];
+	ret = 0;
+	if (dst->mode == mode && (mode == om_hotp || mode == om_totp)) {
+		field = mode == om_hotp ? &dst->counter : &dst->lastused;
+		cur = __atomic_load_n(field, __ATOMIC_ACQUIRE);
+		if (cur < value && (flags & OTP_STORE_MERGE_PEER) &&
+		    value > otp_store_merge_limit(st, dst, cur)) {
+			errno = ERANGE;
+			ret = -1;
+		} else {
+			while (cur < value && !__atomic_compare_exchange_n(field,
+			    &cur, value, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+				/* nothing */ ;
+		}
+	}
+	flock(st->fd, LOCK_UN);
+	return (ret);
+}
+
+/*
+ * Log counter advances made through this handle to the given
+ * write-ahead log before reporting success, or stop logging if wal is
+ * NULL.
+ */
+int
+otp_store_set_wal(otp_store *st, otp_wal *wal)
+{
+
+	if (wal != NULL && (st->oflags & O_ACCMODE) == O_RDONLY) {
+		errno = EBADF;
+		return (-1);
+	}
+	st->wal = wal;
+	return (0);
+}
+
+/*
+ * Consult the given failure tracker before verifications made through
+ * this handle, or stop doing so if thr is NULL.  The tracker may be
+ * shared by any number of handles.
+ */
+int
+otp_store_set_throttle(otp_store *st, otp_throttle *thr)
+{
+
+	st->throttle = thr;
+	return (0);
+}
+
+/*
+ * Record TOTP successes made through this handle in the given replay
+ * cache rather than in the write-ahead log, or stop doing so if rc is
+ * NULL.  The advance is still published in the store, but only reaches
+ * stable storage the next time the store is flushed.  The cache may
+ * be shared by any number of handles.
+ */
+int
+otp_store_set_replay(otp_store *st, otp_replay *rc)
+{
+
+	st->replay = rc;
+	return (0);
+}
+
+/*
+ * Send counter advances made through this handle to the replicator's
+ * peers, or stop doing so if repl is NULL.  Advances are published
+ * after they have been made and logged, and are not waited for.
+ */
+int
+otp_store_set_repl(otp_store *st, otp_repl *repl)
+{
+
+	if (repl != NULL && (st->oflags & O_ACCMODE) == O_RDONLY) {
+		errno = EBADF;
+		return (-1);
+	}
+	st->repl = repl;
+	return (0);
+}
+
+/*
+ * Close a key store.
+ */
+void
+otp_store_close(otp_store *st)
+{
+
+	if (st == NULL)
+		return;
+	otp_store_unmap(st);
+	free(st->path);
+	free(st);
+}
@@ -0,0 +1,364 @@
+/*-
+ * Copyright (c) 2026 Dag-Erling Smørgrav
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "cryb/impl.h"
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <cryb/oath.h>
+#include <cryb/otp.h>
+
+#include "cryb_otp_impl.h"
+
+/*
+ * The failure tracker sits in front of verification and refuses to do
+ * any HMAC work for a user who has failed too often, or for a code we
+ * have already rejected against the same key state.
+ *
+ * After maxfail consecutive failures, a user is refused for backoff
+ * milliseconds, doubling with every further failure up to a limit.  A
+ * success clears the user's record, and so does a quiet period as long
+ * as the longest backoff.
+ *
+ * The table is shared by all threads and updated without locks.  Two
+ * users whose names hash to the same value share an entry, and when
+ * every entry in a probe sequence is in use, the one with the oldest
+ * failure among those which are not currently refusing their user is
+ * taken over.  Neither is a problem for a rate limiter: the worst
+ * outcome is that a user is throttled a little early or a little
+ * late.  If every entry in the sequence is refusing its user, there
+ * is nowhere to record failures for anyone else, so anyone else whose
+ * name leads to the same sequence is refused as well until one of the
+ * entries expires.
+ */
+
+static uint64_t
+otp_throttle_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+static uint32_t
+otp_throttle_hash(const char *user)
+{
+	uint32_t h;
+
+	/* 0 marks an unused entry */
+	return ((h = otp_strhash(user)) != 0 ? h : 1);
+}
+
+/*
+ * Fingerprint a response and the state it was checked against.  The
+ * multiplier is odd, so for a given state, distinct responses always
+ * have distinct fingerprints.
+ */
+static uint64_t
+otp_throttle_fp(unsigned long response, uint64_t state)
+{
+	uint64_t fp;
+
+	fp = state ^ ((uint64_t)response * 0x9e3779b97f4a7c15ULL);
+	return (fp != 0 ? fp : 1);
+}
+
+/*
+ * Summarize everything that determines whether a response matches a
+ * key: the key itself, and its counter or the current time step.  A
+ * response rejected for one state may only be rejected again without
+ * checking if the state is the same; if the key has been replaced or
+ * its counter has moved, the state will differ.
+ */
+uint64_t
+otp_throttle_state(const oath_key *key, time_t now)
+{
+	uint64_t h;
+	unsigned int i;
+
+	h = 0xcbf29ce484222325ULL;
+	for (i = 0; i < key->keylen; ++i)
+		h = (h ^ key->key[i]) * 0x100000001b3ULL;
+	h = (h ^ (uint64_t)key->hash) * 0x100000001b3ULL;
+	h = (h ^ (uint64_t)key->digits) * 0x100000001b3ULL;
+	h = (h ^ (uint64_t)key->mode) * 0x100000001b3ULL;
+	if (key->mode == om_totp && key->timestep > 0)
+		h ^= (uint64_t)now / key->timestep;
+	else
+		h ^= key->counter;
+	return (h);
+}
+
+/*
+ * Find the entry for a user, or NULL if there is none.
+ */
+static struct otp_throttle_entry *
+otp_throttle_find(otp_throttle *thr, uint32_t hashval)
+{
+	struct otp_throttle_entry *e;
+	unsigned int i;
+
+	for (i = 0; i < OTP_THROTTLE_PROBE; ++i) {
+		e = &thr->ents[(hashval + i) & thr->mask];
+		if (__atomic_load_n(&e->hashval, __ATOMIC_ACQUIRE) == hashval)
+			return (e);
+	}
+	return (NULL);
+}
+
+/*
+ * Check whether every entry in a user's probe sequence is in use and
+ * refusing its user, leaving no room for another.
+ */
+static int
+otp_throttle_full(otp_throttle *thr, uint32_t hashval, uint64_t now)
+{
+	struct otp_throttle_entry *e;
+	unsigned int i;
+
+	for (i = 0; i < OTP_THROTTLE_PROBE; ++i) {
+		e = &thr->ents[(hashval + i) & thr->mask];
+		if (__atomic_load_n(&e->hashval, __ATOMIC_ACQUIRE) == 0 ||
+		    __atomic_load_n(&e->deadline, __ATOMIC_ACQUIRE) <= now)
+			return (0);
+	}
+	return (1);
+}
+
+/*
+ * Find or claim the entry for a user.  An entry which is refusing its
+ * user is never taken over; returns NULL if there is no other.
+ */
+static struct otp_throttle_entry *
+otp_throttle_claim(otp_throttle *thr, uint32_t hashval, uint64_t now)
+{
+	struct otp_throttle_entry *e, *oldest;
+	uint32_t cur;
+	unsigned int i;
+
+	for (;;) {
+		oldest = NULL;
+		for (i = 0; i < OTP_THROTTLE_PROBE; ++i) {
+			e = &thr->ents[(hashval + i) & thr->mask];
+			cur = __atomic_load_n(&e->hashval, __ATOMIC_ACQUIRE);
+			if (cur == hashval)
+				return (e);
+			if (cur == 0 && __atomic_compare_exchange_n(&e->hashval,
+			    &cur, hashval, 0, __ATOMIC_ACQ_REL,
+			    __ATOMIC_ACQUIRE))
+				return (e);
+			if (__atomic_load_n(&e->deadline,
+			    __ATOMIC_ACQUIRE) > now)
+				continue;
+			if (oldest == NULL || __atomic_load_n(&e->last,
+			    __ATOMIC_RELAXED) < __atomic_load_n(&oldest->last,
+			    __ATOMIC_RELAXED))
+				oldest = e;
+		}
+		if (oldest == NULL)
+			return (NULL);
+		/* take over the entry with the oldest failure */
+		cur = __atomic_load_n(&oldest->hashval, __ATOMIC_ACQUIRE);
+		if (cur != 0 && __atomic_compare_exchange_n(&oldest->hashval,
+		    &cur, hashval, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+			__atomic_store_n(&oldest->failures, 0, __ATOMIC_RELAXED);
+			__atomic_store_n(&oldest->deadline, 0, __ATOMIC_RELAXED);
+			for (i = 0; i < OTP_THROTTLE_NREJECT; ++i)
+				__atomic_store_n(&oldest->rejected[i], 0,
+				    __ATOMIC_RELAXED);
+			return (oldest);
+		}
+	}
+}
+
+/*
+ * Check whether to go ahead with a verification.  Returns 0 if so, 1
+ * if the response is one we have already rejected for the same state,
+ * and -1 with errno set to EAGAIN if the user is being throttled.  For
+ * a resynchronization, pass NULL for the response.
+ */
+int
+otp_throttle_check(otp_throttle *thr, const char *user,
+    const unsigned long *response, uint64_t state)
+{
+	struct otp_throttle_entry *e;
+	uint64_t fp, now;
+	uint32_t hashval;
+	unsigned int i;
+
+	hashval = otp_throttle_hash(user);
+	now = otp_throttle_now();
+	if ((e = otp_throttle_find(thr, hashval)) == NULL) {
+		/* a failure could not be recorded */
+		if (otp_throttle_full(thr, hashval, now)) {
+			otp_stats_count(OTP_STAT_THROTTLED);
+			errno = EAGAIN;
+			return (-1);
+		}
+		return (0);
+	}
+	if (now < __atomic_load_n(&e->deadline, __ATOMIC_ACQUIRE)) {
+		otp_stats_count(OTP_STAT_THROTTLED);
+		errno = EAGAIN;
+		return (-1);
+	}
+	if (response != NULL) {
+		fp = otp_throttle_fp(*response, state);
+		for (i = 0; i < OTP_THROTTLE_NREJECT; ++i)
+			if (__atomic_load_n(&e->rejected[i],
+			    __ATOMIC_RELAXED) == fp)
+				return (1);
+	}
+	return (0);
+}
+
+/*
+ * Record the outcome of a verification.
+ */
+void
+otp_throttle_record(otp_throttle *thr, const char *user,
+    const unsigned long *response, uint64_t state, int matched)
+{
+	struct otp_throttle_entry *e;
+	uint64_t fp, maxbackoff, now;
+	uint32_t hashval, n;
+	unsigned int i;
+
+	hashval = otp_throttle_hash(user);
+	if (matched) {
+		if ((e = otp_throttle_find(thr, hashval)) == NULL)
+			return;
+		__atomic_store_n(&e->failures, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&e->deadline, 0, __ATOMIC_RELEASE);
+		for (i = 0; i < OTP_THROTTLE_NREJECT; ++i)
+			__atomic_store_n(&e->rejected[i], 0, __ATOMIC_RELAXED);
+		return;
+	}
+	now = otp_throttle_now();
+	if ((e = otp_throttle_claim(thr, hashval, now)) == NULL)
+		return;
+	maxbackoff = thr->backoff << OTP_THROTTLE_MAXSHIFT;
+	if (now - __atomic_load_n(&e->last, __ATOMIC_RELAXED) > maxbackoff)
+		__atomic_store_n(&e->failures, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&e->last, now, __ATOMIC_RELAXED);
+	n = __atomic_add_fetch(&e->failures, 1, __ATOMIC_RELAXED);
+	if (n >= thr->maxfail) {
+		n -= thr->maxfail;
+		if (n > OTP_THROTTLE_MAXSHIFT)
+			n = OTP_THROTTLE_MAXSHIFT;
+		__atomic_store_n(&e->deadline, now + (thr->backoff << n),
+		    __ATOMIC_RELEASE);
+	}
+	if (response != NULL) {
+		fp = otp_throttle_fp(*response, state);
+		for (i = 0; i < OTP_THROTTLE_NREJECT; ++i)
+			if (__atomic_load_n(&e->rejected[i],
+			    __ATOMIC_RELAXED) == fp)
+				return;
+		i = __atomic_fetch_add(&e->next, 1, __ATOMIC_RELAXED);
+		__atomic_store_n(&e->rejected[i % OTP_THROTTLE_NREJECT], fp,
+		    __ATOMIC_RELAXED);
+	}
+}
+
+/*
+ * Create a failure tracker with room for at least size users (or a
+ * default number if size is 0), which starts refusing a user after
+ * maxfail consecutive failures, initially for backoff milliseconds.
+ */
+otp_throttle *
+otp_throttle_create(unsigned int size, unsigned int maxfail,
+    unsigned int backoff)
+{
+	otp_throttle *thr;
+	uint32_t n;
+
+	if (size == 0)
+		size = OTP_THROTTLE_SIZE;
+	if (size > (1U << 30) || maxfail < 1) {
+		errno = EINVAL;
+		return (NULL);
+	}
+	for (n = OTP_THROTTLE_PROBE; n < size; n *= 2)
+		/* nothing */ ;
+	if ((thr = calloc(1, sizeof *thr)) == NULL)
+		return (NULL);
+	if ((thr->ents = calloc(n, sizeof *thr->ents)) == NULL) {
+		free(thr);
+		return (NULL);
+	}
+	thr->mask = n - 1;
+	thr->maxfail = maxfail;
+	thr->backoff = backoff;
+	return (thr);
+}
+
+/*
+ * Destroy a failure tracker.
+ */
+void
+otp_throttle_destroy(otp_throttle *thr)
+{
+
+	if (thr == NULL)
+		return;
+	free(thr->ents);
+	free(thr);
+}
+
+/*
+ * Check a response for a user like otp_verify_policy(), but consult
+ * and update the given failure tracker.  Returns -1 with errno set to
+ * EAGAIN without doing any work if the user is being throttled, and 0
+ * without doing any work if the response has already been rejected
+ * for the key in its current state.
+ */
+int
+otp_verify_throttle(oath_key *key, unsigned long response,
+    const otp_policy *pol, otp_throttle *thr, const char *user)
+{
+	uint64_t state;
+	int ret;
+
+	state = otp_throttle_state(key, time(NULL));
+	if ((ret = otp_throttle_check(thr, user, &response, state)) == 0)
+		ret = otp_verify_policy(key, response, pol);
+	else if (ret > 0)
+		ret = 0;
+	else
+		return (-1);
+	if (ret >= 0)
+		otp_throttle_record(thr, user, &response, state, ret > 0);
+	return (ret);
+}
@@ -0,0 +1,445 @@
+/*-
+ * Copyright (c) 2026 Dag-Erling Smørgrav
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "cryb/impl.h"
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <cryb/ctype.h>
+#include <cryb/oath.h>
+#include <cryb/otp.h>
+
+#include "cryb_otp_impl.h"
+
+/*
+ * Single-pass otpauth URI parser.  The URI is parsed in place, straight
+ * out of the caller's buffer or a mapping of the key file, and decoded
+ * directly into the key: there are no intermediate copies and nothing
+ * is allocated.  On failure, the caller is told where in the buffer
+ * the problem lies and what it is.
+ */
+
+/* base32 alphabet, offset by one so that zero means invalid */
+#define B32(c, v)	[c] = (v) + 1
+static const uint8_t otp_uri_b32[256] = {
+	B32('A',  0), B32('B',  1), B32('C',  2), B32('D',  3),
+	B32('E',  4), B32('F',  5), B32('G',  6), B32('H',  7),
+	B32('I',  8), B32('J',  9), B32('K', 10), B32('L', 11),
+	B32('M', 12), B32('N', 13), B32('O', 14), B32('P', 15),
+	B32('Q', 16), B32('R', 17), B32('S', 18), B32('T', 19),
+	B32('U', 20), B32('V', 21), B32('W', 22), B32('X', 23),
+	B32('Y', 24), B32('Z', 25), B32('2', 26), B32('3', 27),
+	B32('4', 28), B32('5', 29), B32('6', 30), B32('7', 31),
+};
+#undef B32
+
+enum otp_uri_param {
+	OTP_URI_SECRET,
+	OTP_URI_ALGORITHM,
+	OTP_URI_DIGITS,
+	OTP_URI_COUNTER,
+	OTP_URI_LASTUSED,
+	OTP_URI_PERIOD,
+	OTP_URI_ISSUER,
+	OTP_URI_NPARAMS
+};
+
+static const char *const otp_uri_params[OTP_URI_NPARAMS] = {
+	[OTP_URI_SECRET] = "secret",
+	[OTP_URI_ALGORITHM] = "algorithm",
+	[OTP_URI_DIGITS] = "digits",
+	[OTP_URI_COUNTER] = "counter",
+	[OTP_URI_LASTUSED] = "lastused",
+	[OTP_URI_PERIOD] = "period",
+	[OTP_URI_ISSUER] = "issuer",
+};
+
+static const struct {
+	const char	*name;
+	oath_hash	 hash;
+} otp_uri_hashes[] = {
+	{ "sha1", oh_sha1 },
+	{ "sha256", oh_sha256 },
+	{ "sha512", oh_sha512 },
+	{ "md5", oh_md5 },
+};
+#define OTP_URI_NHASHES	(sizeof otp_uri_hashes / sizeof *otp_uri_hashes)
+
+/*
+ * Compare the string between p and end with str, which is lower-case.
+ */
+static int
+otp_uri_eq(const char *p, const char *end, const char *str, int icase)
+{
+
+	for (; p < end && *str != '\0'; ++p, ++str)
+		if ((icase && is_upper(*p) ? *p - 'A' + 'a' : *p) != *str)
+			return (0);
+	return (p == end && *str == '\0');
+}
+
+static int
+otp_uri_hex(char c)
+{
+
+	if (c >= '0' && c <= '9')
+		return (c - '0');
+	if (c >= 'A' && c <= 'F')
+		return (c - 'A' + 10);
+	if (c >= 'a' && c <= 'f')
+		return (c - 'a' + 10);
+	return (-1);
+}
+
+/*
+ * Percent-decode the string between p and end into a buffer of the
+ * given size, leaving room for a terminating NUL.  Returns NULL on
+ * success, or a pointer to the offending character.
+ */
+static const char *
+otp_uri_unescape(const char *p, const char *end, char *out, size_t size,
+    size_t *outlen)
+{
+	size_t n;
+	int hi, lo;
+
+	for (n = 0; p < end; ++n) {
+		if (n + 1 >= size)
+			return (p);
+		if (*p == '%') {
+			if (end - p < 3 || (hi = otp_uri_hex(p[1])) < 0 ||
+			    (lo = otp_uri_hex(p[2])) < 0)
+				return (p);
+			out[n] = hi << 4 | lo;
+			p += 3;
+		} else {
+			out[n] = *p++;
+		}
+	}
+	out[n] = '\0';
+	*outlen = n;
+	return (NULL);
+}
+
+/*
+ * Parse a decimal number.  Returns NULL on success, or a pointer to
+ * the offending character.
+ */
+static const char *
+otp_uri_number(const char *p, const char *end, uint64_t *np)
+{
+	uint64_t n;
+
+	if (p == end)
+		return (p);
+	for (n = 0; p < end; ++p) {
+		if (!is_digit(*p) || n > (UINT64_MAX - (*p - '0')) / 10)
+			return (p);
+		n = n * 10 + (*p - '0');
+	}
+	*np = n;
+	return (NULL);
+}
+
+/*
+ * Decode a base32 secret into the key, eight characters (five bytes)
+ * at a time.  Trailing padding is allowed but not required.  Returns
+ * NULL on success, or a pointer to the offending character, in which
+ * case *msg explains.
+ */
+static const char *
+otp_uri_secret(const char *p, const char *end, oath_key *key,
+    const char **msg)
+{
+	uint64_t acc;
+	unsigned int i, r;
+	uint8_t c;
+	size_t n;
+
+	while (end > p && end[-1] == '=')
+		--end;
+	if (p == end) {
+		*msg = "empty secret";
+		return (p);
+	}
+	/* 1, 3 or 6 trailing characters cannot be produced by an encoder */
+	r = (end - p) % 8;
+	if (r == 1 || r == 3 || r == 6) {
+		*msg = "invalid secret length";
+		return (end);
+	}
+	if ((size_t)(end - p) * 5 / 8 > sizeof key->key) {
+		*msg = "secret too long";
+		return (p);
+	}
+	*msg = "invalid base32 character";
+	for (n = 0; end - p >= 8; p += 8, n += 5) {
+		for (acc = i = 0; i < 8; ++i) {
+			if ((c = otp_uri_b32[(uint8_t)p[i]]) == 0)
+				return (p + i);
+			acc = acc << 5 | (c - 1);
+		}
+		key->key[n + 0] = acc >> 32;
+		key->key[n + 1] = acc >> 24;
+		key->key[n + 2] = acc >> 16;
+		key->key[n + 3] = acc >> 8;
+		key->key[n + 4] = acc;
+	}
+	for (acc = i = 0; i < r; ++i) {
+		if ((c = otp_uri_b32[(uint8_t)p[i]]) == 0)
+			return (p + i);
+		acc = acc << 5 | (c - 1);
+	}
+	/* discard the bits that do not make up a whole byte */
+	acc >>= r * 5 % 8;
+	for (i = r * 5 / 8; i > 0; --i)
+		key->key[n++] = acc >> (8 * (i - 1));
+	key->keylen = n;
+	otp_wipe(&acc, sizeof acc);
+	return (NULL);
+}
+
+/*
+ * Parse a key from a buffer, which holds either a binary key record or
+ * an otpauth URI.  A URI need not be NUL-terminated; anything past the
+ * first newline is ignored, as is trailing whitespace.  Unknown URI
+ * parameters, and parameters which do not apply to the key's mode, are
+ * ignored, but must still be well-formed if they are ones we know.
+ * Returns the format (OTP_KEYFMT_URI or OTP_KEYFMT_BINARY) on success.
+ * On failure, returns -1 with errno set to EINVAL and, if err is not
+ * NULL, fills it in with the offset of the problem within the buffer
+ * and a description of it.
+ */
+int
+otp_key_parse(oath_key *key, const char *buf, size_t len, otp_uri_error *err)
+{
+	const char *end, *name, *p, *q, *v, *epos, *emsg;
+	unsigned int i, seen;
+	uint64_t n;
+
+	if (otp_keyrec_magic(buf, len))
+		return (otp_keyrec_parse(key, buf, len, err));
+	if ((end = memchr(buf, '\n', len)) == NULL)
+		end = buf + len;
+	while (end > buf && is_ws(end[-1]))
+		--end;
+	memset(key, 0, sizeof *key);
+	p = buf;
+	if (end - p < 10 || memcmp(p, "otpauth://", 10) != 0) {
+		epos = p;
+		emsg = "not an otpauth URI";
+		goto fail;
+	}
+	p += 10;
+
+	/* mode */
+	for (q = p; q < end && *q != '/'; ++q)
+		/* nothing */ ;
+	if (otp_uri_eq(p, q, "hotp", 1)) {
+		key->mode = om_hotp;
+	} else if (otp_uri_eq(p, q, "totp", 1)) {
+		key->mode = om_totp;
+		key->timestep = 30;
+	} else {
+		epos = p;
+		emsg = "unknown mode";
+		goto fail;
+	}
+	if (q == end) {
+		epos = end;
+		emsg = "missing label";
+		goto fail;
+	}
+
+	/* label */
+	p = q + 1;
+	for (q = p; q < end && *q != '?'; ++q)
+		/* nothing */ ;
+	if (q == end) {
+		epos = end;
+		emsg = "missing parameters";
+		goto fail;
+	}
+	if ((epos = otp_uri_unescape(p, q, key->label, sizeof key->label,
+	    &key->labellen)) != NULL) {
+		emsg = *epos == '%' ? "invalid escape" : "label too long";
+		goto fail;
+	}
+
+	/* parameters */
+	key->hash = oh_sha1;
+	key->digits = 6;
+	seen = 0;
+	for (p = q + 1; p < end; p = q + 1) {
+		for (q = p; q < end && *q != '&'; ++q)
+			/* nothing */ ;
+		for (v = p; v < q && *v != '='; ++v)
+			/* nothing */ ;
+		name = p;
+		for (i = 0; i < OTP_URI_NPARAMS; ++i)
+			if (otp_uri_eq(name, v, otp_uri_params[i], 0))
+				break;
+		/* provisioning URIs often carry others, such as image */
+		if (i == OTP_URI_NPARAMS)
+			goto next;
+		if (v == q) {
+			epos = p;
+			emsg = "parameter without a value";
+			goto fail;
+		}
+		if (seen & (1U << i)) {
+			epos = name;
+			emsg = "duplicate parameter";
+			goto fail;
+		}
+		seen |= 1U << i;
+		++v;
+		switch (i) {
+		case OTP_URI_SECRET:
+			if ((epos = otp_uri_secret(v, q, key, &emsg)) != NULL)
+				goto fail;
+			break;
+		case OTP_URI_ALGORITHM:
+			for (i = 0; i < OTP_URI_NHASHES; ++i)
+				if (otp_uri_eq(v, q, otp_uri_hashes[i].name, 1))
+					break;
+			if (i == OTP_URI_NHASHES) {
+				epos = v;
+				emsg = "unknown algorithm";
+				goto fail;
+			}
+			key->hash = otp_uri_hashes[i].hash;
+			break;
+		case OTP_URI_DIGITS:
+			if ((epos = otp_uri_number(v, q, &n)) == NULL &&
+			    (n < 6 || n > 9))
+				epos = v;
+			if (epos != NULL) {
+				emsg = "digits must be between 6 and 9";
+				goto fail;
+			}
+			key->digits = n;
+			break;
+		case OTP_URI_COUNTER:
+		case OTP_URI_LASTUSED:
+		case OTP_URI_PERIOD:
+			if ((epos = otp_uri_number(v, q, &n)) == NULL &&
+			    i == OTP_URI_PERIOD && (n == 0 || n > UINT32_MAX))
+				epos = v;
+			if (epos != NULL) {
+				emsg = "invalid number";
+				goto fail;
+			}
+			/* ignore those which do not apply to this mode */
+			if ((i == OTP_URI_COUNTER) != (key->mode == om_hotp))
+				break;
+			if (i == OTP_URI_COUNTER)
+				key->counter = n;
+			else if (i == OTP_URI_LASTUSED)
+				key->lastused = n;
+			else
+				key->timestep = n;
+			break;
+		case OTP_URI_ISSUER:
+			if ((epos = otp_uri_unescape(v, q, key->issuer,
+			    sizeof key->issuer, &key->issuerlen)) != NULL) {
+				emsg = *epos == '%' ? "invalid escape" :
+				    "issuer too long";
+				goto fail;
+			}
+			break;
+		}
+next:
+		if (q == end)
+			break;
+	}
+	if (!(seen & (1U << OTP_URI_SECRET))) {
+		epos = end;
+		emsg = "missing secret";
+		goto fail;
+	}
+	return (OTP_KEYFMT_URI);
+fail:
+	otp_wipe(key, sizeof *key);
+	if (err != NULL) {
+		err->offset = epos - buf;
+		err->msg = emsg;
+	}
+	errno = EINVAL;
+	return (-1);
+}
+
+/*
+ * Load a key from an open key file.  A regular file is mapped and
+ * parsed in place; key files are replaced by renaming, never truncated,
+ * so the mapping cannot shrink under us.  Anything else is read into
+ * a buffer on the stack.  Returns the same as otp_key_parse(), except
+ * that I/O errors leave err untouched.
+ */
+int
+otp_key_load(oath_key *key, int fd, otp_uri_error *err)
+{
+	char buf[OTP_MAX_KEYURI_SIZE];
+	struct stat sb;
+	ssize_t rlen;
+	size_t len;
+	void *map;
+	int ret, serrno;
+
+	if (fstat(fd, &sb) != 0)
+		return (-1);
+	if (S_ISREG(sb.st_mode) && sb.st_size > 0) {
+		len = sb.st_size < OTP_MAX_KEYURI_SIZE ?
+		    (size_t)sb.st_size : OTP_MAX_KEYURI_SIZE;
+		map = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (map == MAP_FAILED)
+			return (-1);
+		ret = otp_key_parse(key, map, len, err);
+		serrno = errno;
+		munmap(map, len);
+		errno = serrno;
+		return (ret);
+	}
+	if ((rlen = pread(fd, buf, sizeof buf, 0)) < 0 &&
+	    (errno != ESPIPE || (rlen = read(fd, buf, sizeof buf)) < 0))
+		return (-1);
+	ret = otp_key_parse(key, buf, rlen, err);
+	serrno = errno;
+	otp_wipe(buf, rlen);
+	errno = serrno;
+	return (ret);
+}
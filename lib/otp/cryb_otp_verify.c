@@ -32,6 +32,7 @@
 
 #include <stddef.h>
 #include <stdint.h>
+#include <time.h>
 
 #include <cryb/assert.h>
 #include <cryb/oath.h>
@@ -40,36 +41,103 @@
 #include "cryb_otp_impl.h"
 
 /*
- * Check whether a given response is correct for the given keyfile.
+ * Check a response against a key for which the HMAC state has already
+ * been computed.  Shared between otp_verify_policy() and
+ * otp_verify_batch().  The policy must already have been checked.
  */
 int
-otp_verify(oath_key *key, unsigned long response)
+otp_verify_hmac(const struct otp_hmac *hm, oath_key *key,
+    unsigned long response, const otp_policy *pol, time_t now)
 {
-	uint64_t prev;
+	uint64_t prev, t0;
+	int64_t first, seq;
 	int ret;
 
+	t0 = otp_stats_clock();
 	switch (key->mode) {
 	case om_hotp:
 		prev = key->counter;
-		ret = oath_hotp_match(key, response, HOTP_WINDOW);
+		if (pol->flags & OTP_POLICY_CONSTTIME)
+			ret = otp_hotp_match_ct(hm, key, response,
+			    pol->hotp_lookahead);
+		else
+			ret = otp_hotp_match(hm, key, response,
+			    pol->hotp_lookahead);
 		assertf(key->counter >= prev, "counter went backwads");
 		if (ret > 0) {
 			assertf(key->counter > prev, "counter did not advance");
-			ret = key->counter - prev - 1;
+			ret = key->counter - prev;
+			otp_stats_offset(om_hotp, ret - 1);
 		}
+		otp_stats_count(ret > 0 ? OTP_STAT_HOTP_HIT :
+		    ret == 0 ? OTP_STAT_HOTP_MISS : OTP_STAT_HOTP_ERROR);
+		otp_stats_elapsed(OTP_HIST_VERIFY_HOTP, t0);
 		break;
 	case om_totp:
 		prev = key->lastused;
-		ret = oath_totp_match(key, response, TOTP_WINDOW);
+		if (pol->flags & OTP_POLICY_CONSTTIME)
+			ret = otp_totp_match_ct(hm, key, response,
+			    pol->totp_lookbehind, pol->totp_lookahead,
+			    pol->totp_skew, now);
+		else
+			ret = otp_totp_match(hm, key, response,
+			    pol->totp_lookbehind, pol->totp_lookahead,
+			    pol->totp_skew, now);
 		assertf(key->lastused >= prev, "lastused went backwards");
 		if (ret > 0) {
 			assertf(key->lastused > prev, "lastused did not advance");
-			ret = key->lastused - prev / key->timestep;
+			/* relative to the time step we expected */
+			seq = (int64_t)now / key->timestep + pol->totp_skew;
+			otp_stats_offset(om_totp, (int64_t)key->lastused - seq);
+			/* one more than the position within the window */
+			first = seq > (int64_t)pol->totp_lookbehind ?
+			    seq - (int64_t)pol->totp_lookbehind : 0;
+			ret = (int64_t)key->lastused - first + 1;
 		}
+		otp_stats_count(ret > 0 ? OTP_STAT_TOTP_HIT :
+		    ret == 0 ? OTP_STAT_TOTP_MISS : OTP_STAT_TOTP_ERROR);
+		otp_stats_elapsed(OTP_HIST_VERIFY_TOTP, t0);
 		break;
 	default:
 		ret = -1;
 	}
-	/* oath_*_ret() return -1 on error, 0 on failure, 1 on success */
+	/* otp_*_match() return -1 on error, 0 on failure, 1 on success */
 	return (ret);
 }
+
+/*
+ * Check whether a given response is correct for the given key under
+ * the given policy, or the default policy if pol is NULL.  Returns -1
+ * on error, 0 on failure, and a positive number on success; for HOTP
+ * keys, that number is one more than the number of codes that were
+ * skipped, and for TOTP keys, it is one more than the number of time
+ * steps between the start of the window and the one that matched.
+ */
+int
+otp_verify_policy(oath_key *key, unsigned long response,
+    const otp_policy *pol)
+{
+	const struct otp_hmac *hm;
+	otp_policy defpol;
+
+	if (pol == NULL) {
+		otp_policy_init(&defpol);
+		pol = &defpol;
+	} else if (otp_policy_check(pol) != 0) {
+		return (-1);
+	}
+	if ((hm = otp_hmac_get(key)) == NULL)
+		return (-1);
+	return (otp_verify_hmac(hm, key, response, pol, time(NULL)));
+}
+
+/*
+ * Check whether a given response is correct for the given key under
+ * the default policy.
+ */
+int
+otp_verify(oath_key *key, unsigned long response)
+{
+
+	return (otp_verify_policy(key, response, NULL));
+}
@@ -0,0 +1,91 @@
+/*-
+ * Copyright (c) 2026 Dag-Erling Smørgrav
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "cryb/impl.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#include <cryb/oath.h>
+#include <cryb/otp.h>
+
+#include "cryb_otp_impl.h"
+
+/*
+ * Verify a batch of responses.  Entries are processed grouped by mode,
+ * HOTP first, then TOTP, with the clock sampled once for the entire
+ * batch, and entries that share a key also share its cached HMAC
+ * state.  Each result is what otp_verify() would have returned for
+ * that entry under the default policy.  Returns the number of entries
+ * that matched.
+ */
+int
+otp_verify_batch(oath_key **keys, const unsigned long *responses,
+    int *results, size_t n)
+{
+	const struct otp_hmac *hm;
+	otp_policy pol;
+	oath_mode mode;
+	time_t now;
+	size_t i;
+	int matched, pass;
+
+	if (n > INT_MAX) {
+		errno = EINVAL;
+		return (-1);
+	}
+	otp_policy_init(&pol);
+	now = time(NULL);
+	matched = 0;
+	for (pass = 0; pass < 2; ++pass) {
+		mode = pass == 0 ? om_hotp : om_totp;
+		for (i = 0; i < n; ++i) {
+			if (keys[i] == NULL ||
+			    (keys[i]->mode != om_hotp &&
+				keys[i]->mode != om_totp)) {
+				results[i] = -1;
+				continue;
+			}
+			if (keys[i]->mode != mode)
+				continue;
+			if ((hm = otp_hmac_get(keys[i])) == NULL) {
+				results[i] = -1;
+				continue;
+			}
+			results[i] = otp_verify_hmac(hm, keys[i],
+			    responses[i], &pol, now);
+			if (results[i] > 0)
+				matched++;
+		}
+	}
+	return (matched);
+}
@@ -0,0 +1,92 @@
+/*-
+ * Copyright (c) 2026 Dag-Erling Smørgrav
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "cryb/impl.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#include <cryb/oath.h>
+#include <cryb/otp.h>
+
+#include "cryb_otp_impl.h"
+
+/*
+ * Check a response against a key which may be shared with other
+ * threads.  The counter and last used time step are read atomically,
+ * the response is checked against a private copy, and the result is
+ * published with a compare-and-swap.  If another thread advanced the
+ * key in the meantime, we start over from its new state, so a code
+ * can be accepted at most once no matter how many threads try it.
+ * Returns the same as otp_verify_policy().
+ */
+int
+otp_verify_shared(oath_key *key, unsigned long response,
+    const otp_policy *pol)
+{
+	const struct otp_hmac *hm;
+	otp_policy defpol;
+	oath_key tmp;
+	uint64_t *field, old;
+	time_t now;
+	int ret;
+
+	if (pol == NULL) {
+		otp_policy_init(&defpol);
+		pol = &defpol;
+	} else if (otp_policy_check(pol) != 0) {
+		return (-1);
+	}
+	switch (key->mode) {
+	case om_hotp:
+		field = &key->counter;
+		break;
+	case om_totp:
+		field = &key->lastused;
+		break;
+	default:
+		return (-1);
+	}
+	if ((hm = otp_hmac_get(key)) == NULL)
+		return (-1);
+	now = time(NULL);
+	tmp.mode = key->mode;
+	tmp.timestep = key->timestep;
+	do {
+		tmp.counter = __atomic_load_n(&key->counter, __ATOMIC_ACQUIRE);
+		tmp.lastused = __atomic_load_n(&key->lastused, __ATOMIC_ACQUIRE);
+		old = key->mode == om_hotp ? tmp.counter : tmp.lastused;
+		if ((ret = otp_verify_hmac(hm, &tmp, response, pol, now)) <= 0)
+			break;
+	} while (!__atomic_compare_exchange_n(field, &old,
+	    key->mode == om_hotp ? tmp.counter : tmp.lastused, 0,
+	    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+	return (ret);
+}
@@ -0,0 +1,303 @@
+/*-
+ * Copyright (c) 2026 Dag-Erling Smørgrav
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "cryb/impl.h"
+
+#include <sys/types.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <cryb/oath.h>
+#include <cryb/otp.h>
+
+#include "cryb_otp_impl.h"
+
+/*
+ * The write-ahead log makes counter advances in a memory-mapped store
+ * durable without flushing the store itself on every verification.
+ *
+ * A successful otp_store_verify() appends a record to an in-memory
+ * buffer and waits until the record is on disk.  The first waiter to
+ * find no write in progress becomes the leader: it takes the whole
+ * buffer, writes it out and calls fdatasync() once, then wakes
+ * everyone whose record it covered.  Meanwhile, new records accumulate
+ * in a second buffer for the next leader, so under load a single
+ * fdatasync() commits many verifications.
+ *
+ * Since every advance is applied to the store before it is logged,
+ * flushing the store makes every record already written to the log
+ * redundant.  This is a checkpoint; it happens whenever the log grows
+ * past OTP_WAL_MAXSIZE, on request, and on close.  When the log is
+ * opened, any records it contains are replayed into the store and a
+ * checkpoint is taken.  Replay takes the maximum of the logged and
+ * stored values, so it is harmless to replay a record twice.
+ */
+
+static uint32_t
+otp_wal_check(const struct otp_wal_record *rec)
+{
+	const uint8_t *p, *end;
+	uint32_t h;
+
+	p = (const uint8_t *)rec + offsetof(struct otp_wal_record, value);
+	end = (const uint8_t *)(rec + 1);
+	for (h = 0x811c9dc5; p < end; ++p)
+		h = (h ^ *p) * 0x01000193;
+	return (h);
+}
+
+/*
+ * Flush the store and discard the contents of the log.  The caller must
+ * be the leader.
+ */
+static int
+otp_wal_compact(otp_wal *wal)
+{
+	int fd, ret;
+
+	if ((fd = open(wal->storepath, O_RDWR|O_CLOEXEC)) < 0)
+		return (-1);
+	ret = fsync(fd);
+	close(fd);
+	if (ret != 0 || ftruncate(wal->fd, 0) != 0)
+		return (-1);
+	wal->size = 0;
+	return (0);
+}
+
+/*
+ * Apply the contents of the log to the store.  Reading stops at the
+ * first incomplete or corrupt record, which can only be the result of
+ * a crash in the middle of a write.
+ */
+static int
+otp_wal_replay(otp_wal *wal)
+{
+	struct otp_wal_record rec;
+	otp_store *st;
+	off_t off;
+
+	if ((st = otp_store_open(wal->storepath, O_RDWR)) == NULL)
+		return (-1);
+	for (off = 0; pread(wal->fd, &rec, sizeof rec, off) ==
+	    (ssize_t)sizeof rec; off += sizeof rec) {
+		if (rec.magic != OTP_WAL_MAGIC || rec.check != otp_wal_check(&rec))
+			break;
+		rec.user[sizeof rec.user - 1] = '\0';
+		if (otp_store_merge(st, rec.user, (oath_mode)rec.mode,
+		    rec.value, 0) != 0 && errno != ENOENT) {
+			otp_store_close(st);
+			return (-1);
+		}
+	}
+	otp_store_close(st);
+	return (otp_wal_compact(wal));
+}
+
+/*
+ * Open the write-ahead log for a store, replaying it if it is not
+ * empty.  Only one process may have a store's log open at a time.
+ */
+otp_wal *
+otp_wal_open(const char *path, const char *storepath)
+{
+	struct stat sb;
+	otp_wal *wal;
+	int serrno;
+
+	if ((wal = calloc(1, sizeof *wal)) == NULL)
+		return (NULL);
+	wal->fd = -1;
+	pthread_mutex_init(&wal->mtx, NULL);
+	pthread_cond_init(&wal->cv, NULL);
+	wal->bufsize = wal->sparesize = OTP_WAL_BUFRECS;
+	if ((wal->path = strdup(path)) == NULL ||
+	    (wal->storepath = strdup(storepath)) == NULL ||
+	    (wal->buf = calloc(wal->bufsize, sizeof *wal->buf)) == NULL ||
+	    (wal->spare = calloc(wal->sparesize, sizeof *wal->spare)) == NULL)
+		goto fail;
+	if ((wal->fd = open(path, O_RDWR|O_CREAT|O_APPEND|O_CLOEXEC,
+	    0600)) < 0)
+		goto fail;
+	if (flock(wal->fd, LOCK_EX|LOCK_NB) != 0 || fstat(wal->fd, &sb) != 0)
+		goto fail;
+	wal->size = sb.st_size;
+	if (wal->size > 0 && otp_wal_replay(wal) != 0)
+		goto fail;
+	return (wal);
+fail:
+	serrno = errno;
+	/* don't let otp_wal_close() touch a log we don't own */
+	if (wal->fd >= 0)
+		close(wal->fd);
+	wal->fd = -1;
+	otp_wal_close(wal);
+	errno = serrno;
+	return (NULL);
+}
+
+/*
+ * Append a record and wait until it is durable, either in the log or,
+ * after a checkpoint, in the store.
+ */
+int
+otp_wal_append(otp_wal *wal, const char *user, oath_mode mode,
+    uint64_t value)
+{
+	struct otp_wal_record *rec, *tmp;
+	uint64_t lsn, t0, target;
+	size_t len, n, off;
+	ssize_t wlen;
+	int ret;
+
+	t0 = otp_stats_clock();
+	pthread_mutex_lock(&wal->mtx);
+	if (wal->failed) {
+		pthread_mutex_unlock(&wal->mtx);
+		errno = EIO;
+		return (-1);
+	}
+	if (wal->nbuf == wal->bufsize) {
+		if ((tmp = realloc(wal->buf, 2 * wal->bufsize *
+		    sizeof *tmp)) == NULL) {
+			pthread_mutex_unlock(&wal->mtx);
+			return (-1);
+		}
+		wal->buf = tmp;
+		wal->bufsize *= 2;
+	}
+	rec = &wal->buf[wal->nbuf++];
+	memset(rec, 0, sizeof *rec);
+	rec->magic = OTP_WAL_MAGIC;
+	rec->value = value;
+	rec->mode = mode;
+	memcpy(rec->user, user, strnlen(user, sizeof rec->user - 1));
+	rec->check = otp_wal_check(rec);
+	lsn = ++wal->appended;
+	ret = 0;
+	while (wal->synced < lsn) {
+		if (wal->failed) {
+			/* our record may never have been written */
+			errno = EIO;
+			ret = -1;
+			break;
+		}
+		if (wal->busy) {
+			pthread_cond_wait(&wal->cv, &wal->mtx);
+			continue;
+		}
+		/* become the leader and write out everything so far */
+		wal->busy = 1;
+		tmp = wal->spare;
+		wal->spare = wal->buf;
+		wal->buf = tmp;
+		n = wal->bufsize;
+		wal->bufsize = wal->sparesize;
+		wal->sparesize = n;
+		n = wal->nbuf;
+		wal->nbuf = 0;
+		target = wal->appended;
+		pthread_mutex_unlock(&wal->mtx);
+		len = n * sizeof *wal->spare;
+		for (off = 0; off < len; off += wlen)
+			if ((wlen = write(wal->fd, (char *)wal->spare + off,
+			    len - off)) < 0)
+				break;
+		if (off < len || fdatasync(wal->fd) != 0)
+			ret = -1;
+		else if ((wal->size += len) >= OTP_WAL_MAXSIZE)
+			(void)otp_wal_compact(wal); /* try again next time */
+		pthread_mutex_lock(&wal->mtx);
+		wal->busy = 0;
+		if (ret == 0)
+			wal->synced = target;
+		else
+			wal->failed = 1;
+		pthread_cond_broadcast(&wal->cv);
+	}
+	pthread_mutex_unlock(&wal->mtx);
+	otp_stats_elapsed(OTP_HIST_WAL, t0);
+	return (ret);
+}
+
+/*
+ * Take a checkpoint: flush the store and empty the log.
+ */
+int
+otp_wal_checkpoint(otp_wal *wal)
+{
+	int ret, serrno;
+
+	pthread_mutex_lock(&wal->mtx);
+	while (wal->busy)
+		pthread_cond_wait(&wal->cv, &wal->mtx);
+	wal->busy = 1;
+	pthread_mutex_unlock(&wal->mtx);
+	ret = otp_wal_compact(wal);
+	serrno = errno;
+	pthread_mutex_lock(&wal->mtx);
+	wal->busy = 0;
+	pthread_cond_broadcast(&wal->cv);
+	pthread_mutex_unlock(&wal->mtx);
+	errno = serrno;
+	return (ret);
+}
+
+/*
+ * Take a final checkpoint and close the log.  There must be no
+ * verifications in progress against stores that use it.
+ */
+void
+otp_wal_close(otp_wal *wal)
+{
+
+	if (wal == NULL)
+		return;
+	if (wal->fd >= 0) {
+		if (wal->size > 0)
+			(void)otp_wal_compact(wal);
+		close(wal->fd);
+	}
+	pthread_cond_destroy(&wal->cv);
+	pthread_mutex_destroy(&wal->mtx);
+	free(wal->spare);
+	free(wal->buf);
+	free(wal->storepath);
+	free(wal->path);
+	free(wal);
+}
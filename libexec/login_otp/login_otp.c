@@ -29,35 +29,129 @@
 
 #include "cryb/impl.h"
 
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
+#if HAVE_READPASSPHRASE_H
+#include <readpassphrase.h>
+#endif
 
 #include <cryb/oath.h>
 #include <cryb/otp.h>
 
+/* BSD Authentication back channel */
+#define BI_AUTH			"authorize"
+#define BI_REJECT		"reject"
+#define BI_SILENT		"reject silent"
+#define BI_BACKFD		3
+
+#define LOGIN_OTP_PROMPT	"Verification code: "
+#define LOGIN_OTP_MAXINPUT	1024
+
+/*
+ * Parse a code.  Returns 0 on success and -1 if the string is not a
+ * plausible code.
+ */
+static int
+login_otp_code(const char *str, unsigned long *response)
+{
+	size_t i, len;
+
+	len = strlen(str);
+	if (len < 1 || len > 9)
+		return (-1);
+	for (i = 0, *response = 0; i < len; ++i) {
+		if (str[i] < '0' || str[i] > '9')
+			return (-1);
+		*response = *response * 10 + str[i] - '0';
+	}
+	return (0);
+}
+
+/*
+ * Prompt the user for a code on the terminal.
+ */
+static int
+login_otp_prompt(char *buf, size_t size)
+{
+#if HAVE_READPASSPHRASE_H
+	return (readpassphrase(LOGIN_OTP_PROMPT, buf, size, RPP_ECHO_OFF) ==
+	    NULL ? -1 : 0);
+#else
+	char *p;
+
+	if ((p = getpass(LOGIN_OTP_PROMPT)) == NULL || strlen(p) >= size)
+		return (-1);
+	strcpy(buf, p);
+	memset(p, 0, strlen(p));
+	return (0);
+#endif
+}
+
+/*
+ * Read the challenge and response from the back channel.  Both are
+ * NUL-terminated; we only care about the response.
+ */
+static int
+login_otp_response(int fd, char *buf, size_t size)
+{
+	char input[LOGIN_OTP_MAXINPUT];
+	size_t len, off;
+	ssize_t rlen;
+	char *p;
+
+	for (len = 0; len < sizeof input; len += rlen)
+		if ((rlen = read(fd, input + len, sizeof input - len)) <= 0)
+			break;
+	if ((p = memchr(input, '\0', len)) == NULL)
+		return (-1);
+	off = p + 1 - input;
+	if ((p = memchr(input + off, '\0', len - off)) == NULL ||
+	    (size_t)(p - input) - off >= size)
+		return (-1);
+	memcpy(buf, input + off, p - input - off + 1);
+	memset(input, 0, sizeof input);
+	return (0);
+}
+
 static void
 usage(void)
 {
 
 	fprintf(stderr, "usage: "
-	    "login_otp [-d] [-s service] [-o key=value ...] [class] user\n");
+	    "login_otp [-d] [-s service] [-v key=value ...] [class] user\n");
 	exit(1);
 }
 
 int
 main(int argc, char *argv[])
 {
-	int opt;
+	char code[LOGIN_OTP_MAXINPUT];
+	const char *service, *sockpath, *user;
+	unsigned long response;
+	otp_client *cl;
+	FILE *back;
+	int dflag, opt, ret;
 
+	dflag = 0;
+	service = "login";
+	sockpath = NULL;
 	while ((opt = getopt(argc, argv, "ds:v:")) != -1)
 		switch (opt) {
 		case 'd':
+			dflag = 1;
 			break;
 		case 's':
+			service = optarg;
 			break;
 		case 'v':
+			if (strncmp(optarg, "otpd=", 5) == 0)
+				sockpath = optarg + 5;
 			break;
 		default:
 			usage();
@@ -68,12 +162,50 @@ main(int argc, char *argv[])
 
 	switch (argc) {
 	case 2:
+		/* class is ignored */
 		/* fall through */
 	case 1:
+		user = argv[argc - 1];
 		break;
 	default:
 		usage();
 	}
 
-	exit(0);
+	if (dflag)
+		back = stdout;
+	else if ((back = fdopen(BI_BACKFD, "r+")) == NULL)
+		err(1, "back channel");
+
+	if (strcmp(service, "login") == 0) {
+		ret = login_otp_prompt(code, sizeof code);
+	} else if (strcmp(service, "response") == 0) {
+		ret = login_otp_response(dflag ? STDIN_FILENO : BI_BACKFD,
+		    code, sizeof code);
+	} else if (strcmp(service, "challenge") == 0) {
+		/* no challenge, just a prompt for the code */
+		fprintf(back, BI_SILENT "\n");
+		exit(0);
+	} else {
+		errx(1, "%s: unknown service", service);
+	}
+
+	if (ret == 0 && login_otp_code(code, &response) == 0) {
+		/* let otpd do the work */
+		if ((cl = otp_client_open(sockpath)) != NULL) {
+			ret = otp_client_verify(cl, user, response);
+			otp_client_close(cl);
+		} else {
+			warn("otpd");
+			ret = -1;
+		}
+	} else {
+		ret = -1;
+	}
+	memset(code, 0, sizeof code);
+	if (ret > 0) {
+		fprintf(back, BI_AUTH "\n");
+		exit(0);
+	}
+	fprintf(back, BI_REJECT "\n");
+	exit(1);
 }
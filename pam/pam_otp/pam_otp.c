@@ -31,25 +31,473 @@
 
 #define PAM_SM_AUTH
 
+#include <sys/types.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
 #include <security/pam_modules.h>
 #include <security/pam_appl.h>
+#if HAVE_SECURITY_OPENPAM_H
+#include <security/openpam.h>
+#elif HAVE_SECURITY_PAM_EXT_H
+#include <security/pam_ext.h>
+#endif
 
 #include <cryb/oath.h>
 #include <cryb/otp.h>
 
+#define PAM_OTP_PROMPT		"Verification code: "
+#define PAM_OTP_KEYFILE		"/var/oath/%s.otpauth"
+#define PAM_OTP_MAXURI		4096
+#define PAM_OTP_NCACHE		256	/* key cache entries */
+
+enum pam_otp_nokey { nokey_fail, nokey_fake, nokey_ignore };
+
+/*
+ * Key cache.  Long-running applications authenticate the same users
+ * over and over; there is no need to parse their key files every time
+ * unless they have changed.  An entry is valid as long as the file it
+ * was loaded from is still in place and has not been modified.  Since
+ * key files are replaced rather than rewritten, a new inode is the
+ * usual sign of a new key, and the modification time and size catch
+ * most of the rest.  The exception is a binary key file whose counter
+ * is updated in place: the size stays the same, and the modification
+ * time may not change if the file system's clock is coarse, so the
+ * counter and last used time step of a binary key are always read
+ * back from the file.  Entries are wiped when evicted and when the
+ * module is unloaded.
+ */
+struct pam_otp_cached {
+	char		*path;
+	dev_t		 dev;
+	ino_t		 ino;
+	off_t		 size;
+	struct timespec	 mtime;
+	oath_key	 key;
+	int		 fmt;
+};
+
+static struct pam_otp_cached pam_otp_cache[PAM_OTP_NCACHE];
+static pthread_mutex_t pam_otp_cache_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+static struct pam_otp_cached *
+pam_otp_cache_slot(const char *path)
+{
+	uint32_t h;
+
+	for (h = 2166136261U; *path != '\0'; ++path)
+		h = (h ^ (uint8_t)*path) * 16777619U;
+	return (&pam_otp_cache[h % PAM_OTP_NCACHE]);
+}
+
+/*
+ * Look up a key in the cache, refreshing the mutable fields of a
+ * binary key from the locked descriptor.  Returns 0 if a valid entry
+ * was found.
+ */
+static int
+pam_otp_cache_get(const char *path, const struct stat *sb, int fd,
+    oath_key *key, int *fmt)
+{
+	struct pam_otp_cached *ce;
+	int ret;
+
+	ret = -1;
+	pthread_mutex_lock(&pam_otp_cache_mtx);
+	ce = pam_otp_cache_slot(path);
+	if (ce->path != NULL && strcmp(ce->path, path) == 0 &&
+	    ce->dev == sb->st_dev && ce->ino == sb->st_ino &&
+	    ce->size == sb->st_size &&
+	    ce->mtime.tv_sec == sb->st_mtim.tv_sec &&
+	    ce->mtime.tv_nsec == sb->st_mtim.tv_nsec) {
+		*key = ce->key;
+		*fmt = ce->fmt;
+		ret = 0;
+	}
+	pthread_mutex_unlock(&pam_otp_cache_mtx);
+	if (ret == 0 && *fmt == OTP_KEYFMT_BINARY &&
+	    otp_key_refresh(key, fd) != 0) {
+		otp_key_destroy(key);
+		ret = -1;
+	}
+	return (ret);
+}
+
+/*
+ * Enter a key in the cache, evicting whatever was there.
+ */
+static void
+pam_otp_cache_put(const char *path, const struct stat *sb,
+    const oath_key *key, int fmt)
+{
+	struct pam_otp_cached *ce;
+	char *p;
+
+	pthread_mutex_lock(&pam_otp_cache_mtx);
+	ce = pam_otp_cache_slot(path);
+	if (ce->path == NULL || strcmp(ce->path, path) != 0) {
+		if ((p = strdup(path)) == NULL) {
+			pthread_mutex_unlock(&pam_otp_cache_mtx);
+			return;
+		}
+		free(ce->path);
+		ce->path = p;
+	}
+	otp_wipe(&ce->key, sizeof ce->key);
+	ce->dev = sb->st_dev;
+	ce->ino = sb->st_ino;
+	ce->size = sb->st_size;
+	ce->mtime = sb->st_mtim;
+	ce->key = *key;
+	ce->fmt = fmt;
+	pthread_mutex_unlock(&pam_otp_cache_mtx);
+}
+
+/*
+ * Wipe the cache when the module is unloaded.
+ */
+static void __attribute__((__destructor__))
+pam_otp_cache_fini(void)
+{
+	struct pam_otp_cached *ce;
+
+	pthread_mutex_lock(&pam_otp_cache_mtx);
+	for (ce = pam_otp_cache; ce < pam_otp_cache + PAM_OTP_NCACHE; ++ce) {
+		free(ce->path);
+		ce->path = NULL;
+		otp_wipe(&ce->key, sizeof ce->key);
+	}
+	pthread_mutex_unlock(&pam_otp_cache_mtx);
+}
+
+/*
+ * Open and lock a key file, making sure that the file we locked is
+ * still the one in place.  The file is opened for writing if possible
+ * so binary key files can be updated in place.  Returns a descriptor,
+ * or -1 with errno set.
+ */
+static int
+pam_otp_lock(const char *path, struct stat *sb)
+{
+	struct stat psb;
+	int fd, serrno;
+
+	for (;;) {
+		if ((fd = open(path, O_RDWR|O_CLOEXEC)) < 0 &&
+		    (fd = open(path, O_RDONLY|O_CLOEXEC)) < 0)
+			return (-1);
+		if (flock(fd, LOCK_EX) != 0 || fstat(fd, sb) != 0) {
+			serrno = errno;
+			close(fd);
+			errno = serrno;
+			return (-1);
+		}
+		if (stat(path, &psb) == 0 && psb.st_dev == sb->st_dev &&
+		    psb.st_ino == sb->st_ino)
+			return (fd);
+		close(fd);
+	}
+}
+
+/*
+ * Save a key in the given format by writing it to a temporary file and
+ * renaming it into place.  On success, sb describes the new file.
+ */
+static int
+pam_otp_save(const char *path, const struct stat *osb, const oath_key *key,
+    int fmt, struct stat *sb)
+{
+	char keyuri[PAM_OTP_MAXURI], *tmpfile;
+	size_t len;
+	int fd, ret;
+
+	len = sizeof keyuri;
+	if (fmt == OTP_KEYFMT_BINARY) {
+		if (otp_key_to_binary(key, keyuri, &len) != 0)
+			return (-1);
+	} else {
+		if (oath_key_to_uri(key, keyuri, &len) != 0)
+			return (-1);
+		keyuri[len - 1] = '\n';
+	}
+	if (asprintf(&tmpfile, "%s.XXXXXX", path) < 0)
+		return (-1);
+	ret = -1;
+	if ((fd = mkstemp(tmpfile)) >= 0) {
+		/* failure to preserve the owner is not fatal */
+		(void)fchown(fd, osb->st_uid, osb->st_gid);
+		if (fchmod(fd, osb->st_mode & 0777) == 0 &&
+		    write(fd, keyuri, len) == (ssize_t)len &&
+		    fsync(fd) == 0 && fstat(fd, sb) == 0)
+			ret = 0;
+		if (close(fd) != 0 || (ret == 0 && rename(tmpfile, path) != 0))
+			ret = -1;
+		if (ret != 0)
+			unlink(tmpfile);
+	}
+	memset(keyuri, 0, sizeof keyuri);
+	free(tmpfile);
+	return (ret);
+}
+
+/*
+ * Verify a response against the key in the given file, and save the
+ * key if the response was accepted.  Returns a PAM error code.
+ */
+static int
+pam_otp_verify_file(const char *path, unsigned long response)
+{
+	struct stat sb, nsb;
+	oath_key key;
+	int fd, fmt, pam_err;
+
+	/* serialize against other threads and processes */
+	otp_user_lock(path);
+	if ((fd = pam_otp_lock(path, &sb)) < 0) {
+		otp_user_unlock(path);
+		return (PAM_AUTHINFO_UNAVAIL);
+	}
+	memset(&key, 0, sizeof key);
+	if (pam_otp_cache_get(path, &sb, fd, &key, &fmt) != 0) {
+		if ((fmt = otp_key_load(&key, fd, NULL)) < 0) {
+			pam_err = PAM_AUTHINFO_UNAVAIL;
+			goto done;
+		}
+		pam_otp_cache_put(path, &sb, &key, fmt);
+	}
+	switch (otp_verify(&key, response)) {
+	case 0:
+		pam_err = PAM_AUTH_ERR;
+		break;
+	case -1:
+		pam_err = PAM_AUTHINFO_UNAVAIL;
+		break;
+	default:
+		/* never accept the same code twice */
+		if (fmt == OTP_KEYFMT_BINARY &&
+		    otp_key_update(&key, fd) == 0 && fstat(fd, &nsb) == 0) {
+			pam_otp_cache_put(path, &nsb, &key, fmt);
+			pam_err = PAM_SUCCESS;
+			break;
+		}
+		if (pam_otp_save(path, &sb, &key, fmt, &nsb) != 0) {
+			pam_err = PAM_AUTHINFO_UNAVAIL;
+			break;
+		}
+		pam_otp_cache_put(path, &nsb, &key, fmt);
+		pam_err = PAM_SUCCESS;
+	}
+done:
+	close(fd);
+	otp_user_unlock(path);
+	otp_key_destroy(&key);
+	return (pam_err);
+}
+
+/*
+ * Pretend to verify a response for a user who has no key, at the same
+ * cost as a real verification that fails.  We go through the same
+ * system calls that pam_otp_verify_file() goes through, taking the
+ * same exclusive lock on the key directory that it would take on the
+ * key file, and scan the window of a dummy key of the configured mode
+ * with the same defaults as a newly generated key, which costs the
+ * same as a failed scan of a real key with those parameters.
+ */
+static oath_key pam_otp_dummy[om_max];
+static pthread_once_t pam_otp_dummy_once = PTHREAD_ONCE_INIT;
+
+static void
+pam_otp_dummy_init(void)
+{
+
+	(void)oath_key_create(&pam_otp_dummy[om_hotp], om_hotp, oh_undef, 0,
+	    "", "dummy", NULL, 0);
+	(void)oath_key_create(&pam_otp_dummy[om_totp], om_totp, oh_undef, 0,
+	    "", "dummy", NULL, 0);
+}
+
+static void
+pam_otp_fake(const char *path, oath_mode mode, unsigned long response)
+{
+	struct stat sb, psb;
+	oath_key key;
+	char *dir, *p;
+	int fd, fmt;
+
+	pthread_once(&pam_otp_dummy_once, pam_otp_dummy_init);
+	memset(&sb, 0, sizeof sb);
+	otp_user_lock(path);
+	/* this is expected to fail */
+	if ((fd = open(path, O_RDWR|O_CLOEXEC)) < 0 &&
+	    (dir = strdup(path)) != NULL) {
+		if ((p = strrchr(dir, '/')) != NULL && p > dir)
+			*p = '\0';
+		fd = open(dir, O_RDONLY|O_CLOEXEC);
+		free(dir);
+	}
+	if (fd >= 0) {
+		(void)flock(fd, LOCK_EX);
+		(void)fstat(fd, &sb);
+		(void)stat(path, &psb);
+	}
+	if (pam_otp_cache_get(path, &sb, fd, &key, &fmt) == 0)
+		otp_key_destroy(&key);
+	key = pam_otp_dummy[mode];
+	(void)otp_verify(&key, response);
+	if (fd >= 0)
+		close(fd);
+	otp_user_unlock(path);
+	otp_key_destroy(&key);
+}
+
+/*
+ * Parse a code.  Returns 0 on success and -1 if the string is not a
+ * plausible code.
+ */
+static int
+pam_otp_code(const char *str, unsigned long *response)
+{
+	size_t i, len;
+
+	len = strlen(str);
+	if (len < 1 || len > 9)
+		return (-1);
+	for (i = 0, *response = 0; i < len; ++i) {
+		if (str[i] < '0' || str[i] > '9')
+			return (-1);
+		*response = *response * 10 + str[i] - '0';
+	}
+	return (0);
+}
+
+/*
+ * Expand the key file template.  The first %s is replaced with the
+ * user name; the template is not a format string.
+ */
+static char *
+pam_otp_keyfile(const char *template, const char *user)
+{
+	const char *p;
+	char *path;
+
+	if (*user == '\0' || strchr(user, '/') != NULL ||
+	    strcmp(user, "..") == 0)
+		return (NULL);
+	if ((p = strstr(template, "%s")) == NULL)
+		return (strdup(template));
+	if (asprintf(&path, "%.*s%s%s", (int)(p - template), template, user,
+	    p + 2) < 0)
+		return (NULL);
+	return (path);
+}
+
 int
 pam_sm_authenticate(pam_handle_t *pamh, int flags,
     int argc, const char *argv[])
 {
+	enum pam_otp_nokey nokey;
+	const char *keyfile, *secretfile, *sockpath, *token, *user;
+	oath_mode fakemode;
+	unsigned long response;
+	struct stat sb;
+	otp_secret *secret;
+	otp_client *cl;
+	char *path;
+	int haskey, i, pam_err, ret;
 
-	/* unused */
-	(void)pamh;
 	(void)flags;
-	(void)argc;
-	(void)argv;
+	nokey = nokey_fail;
+	fakemode = om_hotp;
+	keyfile = secretfile = sockpath = NULL;
+	for (i = 0; i < argc; ++i) {
+		if (strcmp(argv[i], "nokey=fail") == 0)
+			nokey = nokey_fail;
+		else if (strcmp(argv[i], "nokey=fake") == 0)
+			nokey = nokey_fake;
+		else if (strcmp(argv[i], "nokey=ignore") == 0)
+			nokey = nokey_ignore;
+		else if (strcmp(argv[i], "fake=hotp") == 0)
+			fakemode = om_hotp;
+		else if (strcmp(argv[i], "fake=totp") == 0)
+			fakemode = om_totp;
+		else if (strcmp(argv[i], "keyfile") == 0)
+			keyfile = PAM_OTP_KEYFILE;
+		else if (strncmp(argv[i], "keyfile=", 8) == 0)
+			keyfile = argv[i] + 8;
+		else if (strncmp(argv[i], "secret=", 7) == 0)
+			secretfile = argv[i] + 7;
+		else if (strncmp(argv[i], "socket=", 7) == 0)
+			sockpath = argv[i] + 7;
+	}
+	if ((pam_err = pam_get_user(pamh, &user, NULL)) != PAM_SUCCESS)
+		return (pam_err);
+
+	/* with local key files, we can tell up front if there is a key */
+	path = NULL;
+	haskey = 1;
+	if (keyfile != NULL) {
+		if ((path = pam_otp_keyfile(keyfile, user)) == NULL)
+			return (PAM_AUTH_ERR);
+		haskey = stat(path, &sb) == 0;
+		if (!haskey && nokey != nokey_fake) {
+			free(path);
+			return (nokey == nokey_ignore ? PAM_IGNORE :
+			    PAM_AUTH_ERR);
+		}
+	}
+
+	if ((pam_err = pam_get_authtok(pamh, PAM_AUTHTOK, &token,
+	    PAM_OTP_PROMPT)) != PAM_SUCCESS) {
+		free(path);
+		return (pam_err);
+	}
+	/* an implausible code still goes through the motions */
+	if (pam_otp_code(token, &response) != 0)
+		response = ULONG_MAX;
+
+	if (path != NULL) {
+		if (haskey) {
+			pam_err = pam_otp_verify_file(path, response);
+		} else {
+			pam_otp_fake(path, fakemode, response);
+			pam_err = PAM_AUTH_ERR;
+		}
+		free(path);
+		return (pam_err);
+	}
+
+	/* let otpd do the work */
+	secret = NULL;
+	if (secretfile != NULL &&
+	    (secret = otp_secret_load(secretfile)) == NULL)
+		return (PAM_AUTHINFO_UNAVAIL);
+	cl = otp_client_open(sockpath);
+	if (cl != NULL && secret != NULL && otp_client_auth(cl, secret) != 0) {
+		otp_client_close(cl);
+		cl = NULL;
+	}
+	otp_secret_free(secret);
+	if (cl == NULL)
+		return (PAM_AUTHINFO_UNAVAIL);
+	ret = otp_client_verify(cl, user, response);
+	otp_client_close(cl);
+	if (ret > 0)
+		return (PAM_SUCCESS);
+	if (ret < 0 && errno == ENOENT && nokey == nokey_ignore)
+		return (PAM_IGNORE);
+	if (ret < 0 && errno != ENOENT && errno != EINVAL)
+		return (PAM_AUTHINFO_UNAVAIL);
 	return (PAM_AUTH_ERR);
 }
 
@@ -0,0 +1,386 @@
+/*-
+ * Copyright (c) 2026 Dag-Erling Smørgrav
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "cryb/impl.h"
+
+#include <sys/types.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <grp.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <cryb/oath.h>
+#include <cryb/otp.h>
+
+#include "otpd.h"
+
+#define OTPD_BACKOFF	1000		/* ms */
+#define OTPD_METRICS	15		/* seconds */
+#define OTPD_STORE		"/var/db/otp/store"
+
+static struct otpd od;
+
+/*
+ * Create the listening socket.  A stale socket left behind by a
+ * previous instance is removed, but only if nobody is listening on it.
+ */
+static void
+otpd_listen(const char *path, const char *group)
+{
+	struct sockaddr_un sun;
+	struct group *gr;
+	struct stat sb;
+	mode_t omask;
+	int fd;
+
+	memset(&sun, 0, sizeof sun);
+	sun.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof sun.sun_path)
+		errx(1, "%s: path too long", path);
+	strcpy(sun.sun_path, path);
+	if (lstat(path, &sb) == 0) {
+		if (!S_ISSOCK(sb.st_mode))
+			errx(1, "%s: file exists", path);
+		if ((fd = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0)) < 0)
+			err(1, "socket()");
+		if (connect(fd, (struct sockaddr *)&sun, sizeof sun) == 0)
+			errx(1, "%s: already in use", path);
+		close(fd);
+		if (unlink(path) != 0)
+			err(1, "%s", path);
+	}
+	if ((od.lsock = socket(AF_UNIX,
+	    SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0)) < 0)
+		err(1, "socket()");
+	omask = umask(0177);
+	if (bind(od.lsock, (struct sockaddr *)&sun, sizeof sun) != 0)
+		err(1, "%s", path);
+	umask(omask);
+	if (group != NULL) {
+		if ((gr = getgrnam(group)) == NULL)
+			errx(1, "%s: no such group", group);
+		if (chown(path, (uid_t)-1, gr->gr_gid) != 0 ||
+		    chmod(path, 0660) != 0)
+			err(1, "%s", path);
+	}
+	if (listen(od.lsock, SOMAXCONN) != 0)
+		err(1, "%s", path);
+}
+
+/*
+ * Create a listening TCP socket for an address of the form host:port,
+ * where the host may be enclosed in brackets, and is the wildcard
+ * address if omitted.
+ */
+static void
+otpd_listen_tcp(const char *addr)
+{
+	struct addrinfo hints, *ai;
+	char host[256];
+	const char *port, *p;
+	size_t len;
+	int one, ret;
+
+	p = addr;
+	if (*p == '[') {
+		if ((port = strchr(p, ']')) == NULL || port[1] != ':')
+			errx(1, "%s: invalid address", addr);
+		len = port++ - ++p;
+	} else if ((port = strrchr(p, ':')) != NULL) {
+		len = port - p;
+	} else {
+		errx(1, "%s: invalid address", addr);
+	}
+	if (len >= sizeof host || *++port == '\0')
+		errx(1, "%s: invalid address", addr);
+	memcpy(host, p, len);
+	host[len] = '\0';
+	memset(&hints, 0, sizeof hints);
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE;
+	if ((ret = getaddrinfo(len > 0 ? host : NULL, port, &hints, &ai)) != 0)
+		errx(1, "%s: %s", addr, gai_strerror(ret));
+	if ((od.lsock = socket(ai->ai_family,
+	    SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, ai->ai_protocol)) < 0)
+		err(1, "socket()");
+	one = 1;
+	if (setsockopt(od.lsock, SOL_SOCKET, SO_REUSEADDR,
+	    &one, sizeof one) != 0)
+		err(1, "setsockopt()");
+	if (bind(od.lsock, ai->ai_addr, ai->ai_addrlen) != 0 ||
+	    listen(od.lsock, SOMAXCONN) != 0)
+		err(1, "%s", addr);
+	freeaddrinfo(ai);
+	od.tcp = 1;
+}
+
+/*
+ * Write a snapshot of the library's metrics to a file, for a
+ * Prometheus textfile collector.  The file is replaced atomically so
+ * the collector never sees a partial snapshot.
+ */
+static void
+otpd_metrics(const char *path)
+{
+	char tmp[1024];
+	otp_stats *st;
+	int fd, ret;
+
+	if ((st = otp_stats_snapshot()) == NULL) {
+		syslog(LOG_ERR, "otp_stats_snapshot(): %m");
+		return;
+	}
+	ret = -1;
+	if (snprintf(tmp, sizeof tmp, "%s.tmp", path) < (int)sizeof tmp &&
+	    (fd = open(tmp, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0644)) >= 0) {
+		ret = otp_stats_export(st, fd);
+		if (close(fd) != 0 || ret != 0 || rename(tmp, path) != 0) {
+			(void)unlink(tmp);
+			ret = -1;
+		}
+	}
+	if (ret != 0)
+		syslog(LOG_ERR, "%s: %m", path);
+	otp_stats_free(st);
+}
+
+static void
+usage(void)
+{
+
+	fprintf(stderr, "usage: otpd [-fmv] [-b backoff] [-g group] "
+	    "[-K secretfile] [-k store]\n"
+	    "            [-l maxfail] [-s socket] [-t threads] [-w logfile]\n"
+	    "            [-x metricsfile]\n");
+	exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct otpd_worker *w;
+	const char *group, *metrics, *secretfile, *sockpath, *walfile;
+	unsigned long total[5];
+	unsigned long ul;
+	unsigned int backoff, i, maxfail;
+	struct timespec interval;
+	sigset_t sigs;
+	long ncpu;
+	char *end;
+	int fflag, opt, sig;
+
+	group = NULL;
+	secretfile = NULL;
+	sockpath = OTPD_SOCKET;
+	walfile = NULL;
+	metrics = NULL;
+	od.storepath = OTPD_STORE;
+	maxfail = 0;
+	backoff = OTPD_BACKOFF;
+	fflag = 0;
+	while ((opt = getopt(argc, argv, "b:fg:K:k:l:ms:t:vw:x:")) != -1)
+		switch (opt) {
+		case 'b':
+			ul = strtoul(optarg, &end, 10);
+			if (end == optarg || *end != '\0' || ul > 3600000)
+				usage();
+			backoff = ul;
+			break;
+		case 'f':
+			fflag = 1;
+			break;
+		case 'g':
+			group = optarg;
+			break;
+		case 'K':
+			secretfile = optarg;
+			break;
+		case 'k':
+			od.storepath = optarg;
+			break;
+		case 'l':
+			ul = strtoul(optarg, &end, 10);
+			if (end == optarg || *end != '\0' || ul < 1 ||
+			    ul > 1000)
+				usage();
+			maxfail = ul;
+			break;
+		case 'm':
+			od.migrate = 1;
+			break;
+		case 's':
+			sockpath = optarg;
+			break;
+		case 't':
+			ul = strtoul(optarg, &end, 10);
+			if (end == optarg || *end != '\0' || ul < 1 || ul > 1024)
+				usage();
+			od.nworkers = ul;
+			break;
+		case 'v':
+			od.verbose = 1;
+			break;
+		case 'w':
+			walfile = optarg;
+			break;
+		case 'x':
+			metrics = optarg;
+			break;
+		default:
+			usage();
+		}
+
+	argc -= optind;
+	argv += optind;
+
+	if (argc > 0)
+		usage();
+
+	/* nobody may talk to us over the network without the secret */
+	if (strchr(sockpath, '/') == NULL && secretfile == NULL)
+		errx(1, "a secret is required to listen on %s", sockpath);
+	if (secretfile != NULL &&
+	    (od.secret = otp_secret_load(secretfile)) == NULL)
+		err(1, "%s", secretfile);
+
+	/* one worker per core unless told otherwise */
+	if (od.nworkers == 0) {
+		ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+		od.nworkers = ncpu > 0 ? ncpu : 1;
+	}
+
+	if (metrics != NULL)
+		otp_stats_enable(1);
+
+	/* set up the workers before detaching so errors are visible */
+	if (walfile != NULL &&
+	    (od.wal = otp_wal_open(walfile, od.storepath)) == NULL)
+		err(1, "%s", walfile);
+	if (walfile != NULL && (od.replay = otp_replay_create(0)) == NULL)
+		err(1, "otp_replay_create()");
+	if (maxfail > 0 &&
+	    (od.throttle = otp_throttle_create(0, maxfail, backoff)) == NULL)
+		err(1, "otp_throttle_create()");
+	if (strchr(sockpath, '/') != NULL)
+		otpd_listen(sockpath, group);
+	else
+		otpd_listen_tcp(sockpath);
+	if ((od.stopfd = eventfd(0, EFD_CLOEXEC)) < 0)
+		err(1, "eventfd()");
+	if ((od.workers = calloc(od.nworkers, sizeof *od.workers)) == NULL)
+		err(1, "calloc()");
+	for (i = 0; i < od.nworkers; ++i) {
+		w = &od.workers[i];
+		w->od = &od;
+		w->idx = i;
+		if (otpd_worker_init(w) != 0)
+			err(1, "worker %u", i);
+	}
+
+	if (!fflag && daemon(0, 0) != 0)
+		err(1, "daemon()");
+	openlog("otpd", LOG_PID | (fflag ? LOG_PERROR : 0), LOG_AUTH);
+
+	/* signals are handled synchronously by the main thread */
+	sigemptyset(&sigs);
+	sigaddset(&sigs, SIGHUP);
+	sigaddset(&sigs, SIGINT);
+	sigaddset(&sigs, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &sigs, NULL);
+	for (i = 0; i < od.nworkers; ++i) {
+		w = &od.workers[i];
+		if ((errno = pthread_create(&w->thr, NULL,
+		    otpd_worker_run, w)) != 0) {
+			syslog(LOG_ERR, "pthread_create(): %m");
+			exit(1);
+		}
+	}
+	syslog(LOG_INFO, "started %u workers", od.nworkers);
+	interval.tv_sec = OTPD_METRICS;
+	interval.tv_nsec = 0;
+	for (;;) {
+		if (metrics != NULL) {
+			sig = sigtimedwait(&sigs, NULL, &interval);
+			if (sig < 0 && (errno == EAGAIN || errno == EINTR)) {
+				otpd_metrics(metrics);
+				continue;
+			}
+		} else if (sigwait(&sigs, &sig) != 0) {
+			sig = -1;
+		}
+		if (sig != SIGHUP)
+			break;
+		if (od.wal != NULL && otp_wal_checkpoint(od.wal) != 0)
+			syslog(LOG_ERR, "%s: checkpoint failed: %m", walfile);
+	}
+
+	eventfd_write(od.stopfd, 1);
+	memset(total, 0, sizeof total);
+	for (i = 0; i < od.nworkers; ++i) {
+		w = &od.workers[i];
+		pthread_join(w->thr, NULL);
+		total[0] += w->nconn;
+		total[1] += w->nreq;
+		total[2] += w->naccept;
+		total[3] += w->nreject;
+		total[4] += w->nerror;
+		otpd_worker_fini(w);
+	}
+	syslog(LOG_INFO, "%lu connections, %lu requests, %lu accepted, "
+	    "%lu rejected, %lu errors",
+	    total[0], total[1], total[2], total[3], total[4]);
+	free(od.workers);
+	if (metrics != NULL)
+		otpd_metrics(metrics);
+	if (!od.tcp)
+		unlink(sockpath);
+	close(od.lsock);
+	otp_wal_close(od.wal);
+	otp_throttle_destroy(od.throttle);
+	otp_replay_destroy(od.replay);
+	otp_secret_free(od.secret);
+	close(od.stopfd);
+	exit(0);
+}
@@ -0,0 +1,87 @@
+/*-
+ * Copyright (c) 2026 Dag-Erling Smørgrav
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef OTPD_H_INCLUDED
+#define OTPD_H_INCLUDED
+
+#define OTPD_CONNBUF		16384	/* per-connection buffer size */
+#define OTPD_NEVENTS		64	/* events per epoll_wait() */
+
+/*
+ * A client connection.  Requests are read into the input buffer and
+ * answered into the output buffer.  While the output buffer cannot be
+ * flushed, we stop reading, so a client which does not read its
+ * responses cannot make us queue an unbounded amount of data.  If we
+ * have a secret, no request is answered until the client has sent its
+ * nonce in response to ours.
+ */
+struct otpd_conn {
+	struct otpd_conn	*prev, *next;
+	int			 fd;
+	uint32_t		 events;	/* what we are waiting for */
+	otp_auth		*auth;
+	uint8_t			 nonce[OTP_AUTH_NONCELEN];
+	size_t			 inlen;
+	size_t			 outoff, outlen;
+	uint8_t			 in[OTPD_CONNBUF];
+	uint8_t			 out[OTPD_CONNBUF];
+};
+
+struct otpd;
+
+struct otpd_worker {
+	struct otpd		*od;
+	unsigned int		 idx;
+	pthread_t		 thr;
+	int			 epfd;
+	otp_store		*store;
+	struct otpd_conn	*conns;
+	unsigned long		 nconn, nreq, naccept, nreject, nerror;
+};
+
+struct otpd {
+	const char		*storepath;
+	otp_wal			*wal;
+	otp_throttle		*throttle;
+	otp_replay		*replay;
+	int			 lsock;
+	int			 tcp;		/* lsock is a TCP socket */
+	int			 stopfd;
+	int			 migrate;	/* accept migration requests */
+	otp_secret		*secret;	/* authenticate clients */
+	int			 verbose;
+	unsigned int		 nworkers;
+	struct otpd_worker	*workers;
+};
+
+int otpd_worker_init(struct otpd_worker *);
+void *otpd_worker_run(void *);
+void otpd_worker_fini(struct otpd_worker *);
+
+#endif
@@ -0,0 +1,510 @@
+/*-
+ * Copyright (c) 2026 Dag-Erling Smørgrav
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "cryb/impl.h"
+
+#include <sys/types.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include <cryb/endian.h>
+#include <cryb/oath.h>
+#include <cryb/otp.h>
+
+#include "otpd.h"
+
+/*
+ * Set up a worker: an epoll instance watching the listening socket
+ * and the shutdown event, and a handle on the key store.  Every worker
+ * watches the listening socket with EPOLLEXCLUSIVE, so a new
+ * connection wakes one of them, which then owns the connection for its
+ * entire lifetime.
+ */
+int
+otpd_worker_init(struct otpd_worker *w)
+{
+	struct epoll_event ev;
+
+	if ((w->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+		goto fail;
+	memset(&ev, 0, sizeof ev);
+	ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+	ev.data.ptr = &w->od->lsock;
+	if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, w->od->lsock, &ev) != 0)
+		goto fail;
+	ev.events = EPOLLIN;
+	ev.data.ptr = &w->od->stopfd;
+	if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, w->od->stopfd, &ev) != 0)
+		goto fail;
+	if ((w->store = otp_store_open(w->od->storepath, O_RDWR)) == NULL ||
+	    otp_store_set_wal(w->store, w->od->wal) != 0 ||
+	    otp_store_set_throttle(w->store, w->od->throttle) != 0 ||
+	    otp_store_set_replay(w->store, w->od->replay) != 0)
+		goto fail;
+	return (0);
+fail:
+	otpd_worker_fini(w);
+	return (-1);
+}
+
+/*
+ * Close a connection.
+ */
+static void
+otpd_conn_close(struct otpd_worker *w, struct otpd_conn *c)
+{
+
+	if (c->prev != NULL)
+		c->prev->next = c->next;
+	else
+		w->conns = c->next;
+	if (c->next != NULL)
+		c->next->prev = c->prev;
+	close(c->fd);
+	otp_auth_destroy(c->auth);
+	free(c);
+}
+
+/*
+ * Release a worker's resources, including any open connections.
+ */
+void
+otpd_worker_fini(struct otpd_worker *w)
+{
+
+	while (w->conns != NULL)
+		otpd_conn_close(w, w->conns);
+	otp_store_close(w->store);
+	w->store = NULL;
+	if (w->epfd >= 0)
+		close(w->epfd);
+	w->epfd = -1;
+}
+
+/*
+ * Accept as many pending connections as we can.
+ */
+static void
+otpd_accept(struct otpd_worker *w)
+{
+	struct epoll_event ev;
+	struct otpd_conn *c;
+	int fd, one;
+
+	one = 1;
+	while ((fd = accept4(w->od->lsock, NULL, NULL,
+	    SOCK_NONBLOCK|SOCK_CLOEXEC)) >= 0) {
+		/* responses are small and clients wait for them */
+		if (w->od->tcp)
+			(void)setsockopt(fd, IPPROTO_TCP, TCP_NODELAY,
+			    &one, sizeof one);
+		if ((c = calloc(1, sizeof *c)) == NULL) {
+			syslog(LOG_ERR, "worker %u: %m", w->idx);
+			close(fd);
+			continue;
+		}
+		c->fd = fd;
+		c->events = EPOLLIN;
+		/* our nonce goes out first */
+		if (w->od->secret != NULL) {
+			if (otp_auth_nonce(c->nonce) != 0) {
+				syslog(LOG_ERR, "worker %u: %m", w->idx);
+				close(fd);
+				free(c);
+				continue;
+			}
+			memcpy(c->out, c->nonce, sizeof c->nonce);
+			c->outlen = sizeof c->nonce;
+			c->events = EPOLLOUT;
+		}
+		memset(&ev, 0, sizeof ev);
+		ev.events = c->events;
+		ev.data.ptr = c;
+		if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+			syslog(LOG_ERR, "worker %u: epoll_ctl(): %m", w->idx);
+			close(fd);
+			free(c);
+			continue;
+		}
+		if ((c->next = w->conns) != NULL)
+			c->next->prev = c;
+		w->conns = c;
+		w->nconn++;
+	}
+	/* another worker may have beaten us to it */
+	if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR &&
+	    errno != ECONNABORTED)
+		syslog(LOG_ERR, "worker %u: accept(): %m", w->idx);
+}
+
+/*
+ * Decide a request with a well-formed header.  Returns the status.
+ */
+static uint8_t
+otpd_decide(struct otpd_worker *w, uint8_t op, const uint8_t *p,
+    size_t len)
+{
+	unsigned long response[OTPD_MAXRESPONSES];
+	char user[OTPD_MAXUSERLEN + 1];
+	unsigned int i, n;
+	size_t userlen;
+	int ret;
+
+	/* user name */
+	if (len < 1 || (userlen = p[0]) == 0 || userlen > OTPD_MAXUSERLEN ||
+	    len < 1 + userlen + 1 || memchr(p + 1, '\0', userlen) != NULL)
+		return (OTPD_INVALID);
+	memcpy(user, p + 1, userlen);
+	user[userlen] = '\0';
+	p += 1 + userlen;
+	len -= 1 + userlen;
+
+	/* responses */
+	n = *p++;
+	len--;
+	if (n < 1 || n > OTPD_MAXRESPONSES || len != 4 * n ||
+	    (op == OTPD_VERIFY && n != 1))
+		return (OTPD_INVALID);
+	for (i = 0; i < n; ++i, p += 4)
+		response[i] = be32dec(p);
+
+	switch (op) {
+	case OTPD_VERIFY:
+		ret = otp_store_verify(w->store, user, response[0]);
+		break;
+	case OTPD_RESYNC:
+		ret = otp_store_resync(w->store, user, response, n);
+		break;
+	default:
+		return (OTPD_INVALID);
+	}
+	memset(response, 0, sizeof response);
+	if (ret < 0 && errno != ENOENT && errno != EAGAIN)
+		syslog(LOG_ERR, "%s: %s failed: %m", user,
+		    op == OTPD_VERIFY ? "verification" : "resync");
+	if (w->od->verbose) {
+		syslog(LOG_INFO, "%s: %s %s", user,
+		    op == OTPD_VERIFY ? "verification" : "resync",
+		    ret > 0 ? "accepted" : ret < 0 && errno == EAGAIN ?
+		    "throttled" : "rejected");
+	}
+	if (ret > 0)
+		return (OTPD_ACCEPT);
+	/* a throttled client is not told so */
+	if (ret == 0 || errno == EAGAIN)
+		return (OTPD_REJECT);
+	return (errno == ENOENT ? OTPD_NOKEY : OTPD_ERROR);
+}
+
+/*
+ * Decode the user name at the start of a key migration request, and
+ * the key which follows it, if key is not NULL.  Returns 0 on success
+ * and -1 if the request is malformed.
+ */
+static int
+otpd_migrate_decode(const uint8_t *p, size_t len, char *user,
+    oath_key *key)
+{
+	size_t userlen;
+
+	if (len < 1 || (userlen = p[0]) == 0 || userlen > OTPD_MAXUSERLEN ||
+	    len < 1 + userlen || memchr(p + 1, '\0', userlen) != NULL)
+		return (-1);
+	memcpy(user, p + 1, userlen);
+	user[userlen] = '\0';
+	p += 1 + userlen;
+	len -= 1 + userlen;
+	if (key == NULL)
+		return (len == 0 ? 0 : -1);
+	return (otp_key_from_wire(key, p, len));
+}
+
+/*
+ * Carry out a key migration request, if we were told to accept them.
+ * The payload of the response, if any, is written to out, which has
+ * room for OTPD_MAXBODY bytes, and its length to *outlen.  Returns the
+ * status.
+ */
+static uint8_t
+otpd_migrate(struct otpd_worker *w, uint8_t op, const uint8_t *p,
+    size_t len, uint8_t *out, size_t *outlen)
+{
+	char user[OTPD_MAXUSERLEN + 1];
+	uint32_t cursor;
+	oath_key key;
+	size_t n;
+	int ret;
+
+	*outlen = 0;
+	if (!w->od->migrate)
+		return (OTPD_INVALID);
+	switch (op) {
+	case OTPD_LIST:
+		if (len != 4)
+			return (OTPD_INVALID);
+		cursor = be32dec(p);
+		/* stop while there is still room for the longest name */
+		for (n = 4, ret = 0; n + 1 + OTPD_MAXUSERLEN <= OTPD_MAXBODY &&
+		    (ret = otp_store_next(w->store, &cursor, user,
+			sizeof user)) > 0; n += 1 + out[n]) {
+			out[n] = strlen(user);
+			memcpy(out + n + 1, user, out[n]);
+		}
+		if (ret < 0)
+			break;
+		be32enc(out, cursor);
+		*outlen = n;
+		return (OTPD_ACCEPT);
+	case OTPD_EXPORT:
+		if (otpd_migrate_decode(p, len, user, NULL) != 0)
+			return (OTPD_INVALID);
+		if ((ret = otp_store_lookup(w->store, user, &key)) == 0) {
+			*outlen = OTPD_MAXBODY;
+			ret = otp_key_to_wire(&key, out, outlen);
+			otp_key_destroy(&key);
+		}
+		break;
+	case OTPD_IMPORT:
+	case OTPD_REMOVE:
+		if (otpd_migrate_decode(p, len, user, &key) != 0)
+			return (OTPD_INVALID);
+		if (op == OTPD_IMPORT)
+			ret = otp_store_update(w->store, user, &key);
+		else
+			ret = otp_store_remove(w->store, user, &key);
+		otp_key_destroy(&key);
+		break;
+	default:
+		return (OTPD_INVALID);
+	}
+	if (ret == 0) {
+		if (w->od->verbose)
+			syslog(LOG_INFO, "%s: key %s", user,
+			    op == OTPD_EXPORT ? "exported" :
+			    op == OTPD_IMPORT ? "imported" : "removed");
+		return (OTPD_ACCEPT);
+	}
+	*outlen = 0;
+	if (errno == ENOENT)
+		return (OTPD_NOKEY);
+	if (errno == EAGAIN)
+		return (OTPD_CHANGED);
+	syslog(LOG_ERR, "%s: migration failed: %m",
+	    op == OTPD_LIST ? "list" : user);
+	return (OTPD_ERROR);
+}
+
+/*
+ * Answer every complete request in the input buffer, as long as there
+ * is room in the output buffer.  Returns -1 if the client has violated
+ * the protocol so badly that we cannot find the next request, or has
+ * failed to authenticate.
+ */
+static int
+otpd_conn_process(struct otpd_worker *w, struct otpd_conn *c)
+{
+	uint8_t *p, *q, status;
+	size_t len, off, rlen, taglen;
+	int migrate;
+
+	off = 0;
+	if (w->od->secret != NULL && c->auth == NULL) {
+		if (c->inlen < OTP_AUTH_NONCELEN)
+			return (0);
+		if ((c->auth = otp_auth_create(w->od->secret, c->nonce,
+		    c->in, OTP_AUTH_ACCEPTOR)) == NULL) {
+			syslog(LOG_ERR, "worker %u: %m", w->idx);
+			return (-1);
+		}
+		off = OTP_AUTH_NONCELEN;
+	}
+	taglen = c->auth != NULL ? OTP_AUTH_TAGLEN : 0;
+	for (; c->inlen - off >= OTPD_HDRLEN;
+	    off += OTPD_HDRLEN + len + taglen) {
+		p = c->in + off;
+		len = be16dec(p + 2);
+		migrate = p[1] >= OTPD_LIST && p[1] <= OTPD_REMOVE;
+		if (p[0] != OTPD_VERSION ||
+		    len > (migrate ? OTPD_MAXBODY : OTPD_MAXLEN - OTPD_HDRLEN))
+			return (-1);
+		if (c->inlen - off < OTPD_HDRLEN + len + taglen ||
+		    c->outlen + OTPD_HDRLEN + (migrate ? OTPD_MAXBODY : 0) +
+		    taglen > sizeof c->out)
+			break;
+		if (c->auth != NULL && otp_auth_check(c->auth, p,
+		    OTPD_HDRLEN + len, p + OTPD_HDRLEN + len) != 0) {
+			syslog(LOG_WARNING, "worker %u: bad request tag",
+			    w->idx);
+			return (-1);
+		}
+		w->nreq++;
+		q = c->out + c->outlen;
+		rlen = 0;
+		if (migrate) {
+			status = otpd_migrate(w, p[1], p + OTPD_HDRLEN, len,
+			    q + OTPD_HDRLEN, &rlen);
+			if (status != OTPD_ACCEPT)
+				w->nerror++;
+		} else {
+			status = otpd_decide(w, p[1], p + OTPD_HDRLEN, len);
+			if (status == OTPD_ACCEPT)
+				w->naccept++;
+			else if (status == OTPD_REJECT)
+				w->nreject++;
+			else
+				w->nerror++;
+		}
+		q[0] = OTPD_VERSION;
+		q[1] = status;
+		be16enc(q + 2, rlen);
+		memcpy(q + 4, p + 4, 4);
+		if (c->auth != NULL)
+			otp_auth_sign(c->auth, q, OTPD_HDRLEN + rlen,
+			    q + OTPD_HDRLEN + rlen);
+		c->outlen += OTPD_HDRLEN + rlen + taglen;
+	}
+	memset(c->in, 0, off);
+	memmove(c->in, c->in + off, c->inlen - off);
+	c->inlen -= off;
+	return (0);
+}
+
+/*
+ * Write out as much of the output buffer as the socket will take.
+ */
+static int
+otpd_conn_flush(struct otpd_conn *c)
+{
+	ssize_t wlen;
+
+	while (c->outoff < c->outlen) {
+		wlen = send(c->fd, c->out + c->outoff, c->outlen - c->outoff,
+		    MSG_NOSIGNAL);
+		if (wlen < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return (0);
+			return (-1);
+		}
+		c->outoff += wlen;
+	}
+	/* exported keys pass through here */
+	memset(c->out, 0, c->outlen);
+	c->outoff = c->outlen = 0;
+	return (0);
+}
+
+/*
+ * Service a connection: alternately answer what we have, flush the
+ * answers, and read more, until the client runs out of requests or
+ * stops reading responses.  Returns -1 if the connection should be
+ * closed.
+ */
+static int
+otpd_conn_run(struct otpd_worker *w, struct otpd_conn *c)
+{
+	struct epoll_event ev;
+	ssize_t rlen;
+	uint32_t want;
+
+	for (;;) {
+		if (otpd_conn_process(w, c) != 0 || otpd_conn_flush(c) != 0)
+			return (-1);
+		if (c->outlen > 0)
+			break;
+		rlen = recv(c->fd, c->in + c->inlen, sizeof c->in - c->inlen, 0);
+		if (rlen < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			return (-1);
+		}
+		if (rlen == 0)
+			return (-1);
+		c->inlen += rlen;
+	}
+	want = c->outlen > 0 ? EPOLLOUT : EPOLLIN;
+	if (want != c->events) {
+		memset(&ev, 0, sizeof ev);
+		ev.events = want;
+		ev.data.ptr = c;
+		if (epoll_ctl(w->epfd, EPOLL_CTL_MOD, c->fd, &ev) != 0)
+			return (-1);
+		c->events = want;
+	}
+	return (0);
+}
+
+/*
+ * Worker thread: service the connections we own and accept new ones
+ * until the shutdown event fires.
+ */
+void *
+otpd_worker_run(void *arg)
+{
+	struct otpd_worker *w = arg;
+	struct epoll_event evs[OTPD_NEVENTS];
+	struct otpd_conn *c;
+	int i, nev;
+
+	for (;;) {
+		if ((nev = epoll_wait(w->epfd, evs, OTPD_NEVENTS, -1)) < 0) {
+			if (errno == EINTR)
+				continue;
+			syslog(LOG_ERR, "worker %u: epoll_wait(): %m", w->idx);
+			break;
+		}
+		for (i = 0; i < nev; ++i) {
+			if (evs[i].data.ptr == &w->od->stopfd)
+				return (NULL);
+			if (evs[i].data.ptr == &w->od->lsock) {
+				otpd_accept(w);
+				continue;
+			}
+			c = evs[i].data.ptr;
+			if (otpd_conn_run(w, c) != 0)
+				otpd_conn_close(w, c);
+		}
+	}
+	return (NULL);
+}
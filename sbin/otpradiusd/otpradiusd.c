@@ -29,29 +29,194 @@
 
 #include "cryb/impl.h"
 
+#include <sys/types.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <cryb/oath.h>
 #include <cryb/otp.h>
 
+#include "otpradiusd.h"
+
+#define OTPRADIUSD_PORT		"1812"
+#define OTPRADIUSD_SECRET	"/etc/otpradiusd.secret"
+#define OTPRADIUSD_BACKOFF	1000		/* ms */
+#define OTPRADIUSD_METRICS	15		/* seconds */
+#define OTPRADIUSD_STORE	"/var/db/otp/store"
+
+static struct radiusd rd;
+
+/*
+ * Read the shared secret from a file.  Trailing newlines are ignored.
+ */
+static void
+otpradiusd_secret(const char *fn)
+{
+	uint8_t buf[RADIUS_MAXSECRETLEN + 2];
+	ssize_t len;
+	int fd;
+
+	if ((fd = open(fn, O_RDONLY|O_CLOEXEC)) < 0)
+		err(1, "%s", fn);
+	if ((len = read(fd, buf, sizeof buf)) < 0)
+		err(1, "%s", fn);
+	close(fd);
+	while (len > 0 && (buf[len - 1] == '\n' || buf[len - 1] == '\r'))
+		len--;
+	if (len == 0)
+		errx(1, "%s: empty secret", fn);
+	if ((size_t)len > sizeof rd.secret)
+		errx(1, "%s: secret too long", fn);
+	memcpy(rd.secret, buf, len);
+	rd.secretlen = len;
+	otp_wipe(buf, sizeof buf);
+}
+
+/*
+ * Write a snapshot of the library's metrics to a file, for a
+ * Prometheus textfile collector.  The file is replaced atomically so
+ * the collector never sees a partial snapshot.
+ */
+static void
+otpradiusd_metrics(const char *path)
+{
+	char tmp[1024];
+	otp_stats *st;
+	int fd, ret;
+
+	if ((st = otp_stats_snapshot()) == NULL) {
+		syslog(LOG_ERR, "otp_stats_snapshot(): %m");
+		return;
+	}
+	ret = -1;
+	if (snprintf(tmp, sizeof tmp, "%s.tmp", path) < (int)sizeof tmp &&
+	    (fd = open(tmp, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0644)) >= 0) {
+		ret = otp_stats_export(st, fd);
+		if (close(fd) != 0 || ret != 0 || rename(tmp, path) != 0) {
+			(void)unlink(tmp);
+			ret = -1;
+		}
+	}
+	if (ret != 0)
+		syslog(LOG_ERR, "%s: %m", path);
+	otp_stats_free(st);
+}
+
 static void
 usage(void)
 {
 
-	fprintf(stderr, "usage: otpradiusd\n");
+	fprintf(stderr, "usage: otpradiusd [-fLv] [-a address] [-b backoff] "
+	    "[-K replsecretfile]\n"
+	    "                  [-k store] [-l maxfail] [-P peer] [-p port] "
+	    "[-r address]\n"
+	    "                  [-s secretfile] [-t threads] [-w logfile] "
+	    "[-x metricsfile]\n");
 	exit(1);
 }
 
 int
 main(int argc, char *argv[])
 {
-	int opt;
+	struct addrinfo hints, *ai;
+	struct radiusd_worker *w;
+	const char *addr, *metrics, *port, *repladdr, *secretfile, *walfile;
+	const char *peers[OTP_REPL_MAXPEERS], *replsecretfile;
+	otp_secret *replsecret;
+	unsigned long total[5];
+	unsigned long ul;
+	unsigned int backoff, i, maxfail, npeers;
+	struct timespec interval;
+	sigset_t sigs;
+	long ncpu;
+	char *end;
+	int fflag, opt, sig;
 
-	while ((opt = getopt(argc, argv, "")) != -1)
+	addr = NULL;
+	port = OTPRADIUSD_PORT;
+	secretfile = OTPRADIUSD_SECRET;
+	walfile = NULL;
+	metrics = NULL;
+	repladdr = replsecretfile = NULL;
+	replsecret = NULL;
+	npeers = 0;
+	rd.storepath = OTPRADIUSD_STORE;
+	maxfail = 0;
+	backoff = OTPRADIUSD_BACKOFF;
+	fflag = 0;
+	while ((opt = getopt(argc, argv, "a:b:fK:k:Ll:P:p:r:s:t:vw:x:")) != -1)
 		switch (opt) {
+		case 'a':
+			addr = optarg;
+			break;
+		case 'b':
+			ul = strtoul(optarg, &end, 10);
+			if (end == optarg || *end != '\0' || ul > 3600000)
+				usage();
+			backoff = ul;
+			break;
+		case 'f':
+			fflag = 1;
+			break;
+		case 'K':
+			replsecretfile = optarg;
+			break;
+		case 'k':
+			rd.storepath = optarg;
+			break;
+		case 'l':
+			ul = strtoul(optarg, &end, 10);
+			if (end == optarg || *end != '\0' || ul < 1 ||
+			    ul > 1000)
+				usage();
+			maxfail = ul;
+			break;
+		case 'L':
+			rd.legacy = 1;
+			break;
+		case 'P':
+			if (npeers == OTP_REPL_MAXPEERS)
+				usage();
+			peers[npeers++] = optarg;
+			break;
+		case 'p':
+			port = optarg;
+			break;
+		case 'r':
+			repladdr = optarg;
+			break;
+		case 's':
+			secretfile = optarg;
+			break;
+		case 't':
+			ul = strtoul(optarg, &end, 10);
+			if (end == optarg || *end != '\0' || ul < 1 || ul > 1024)
+				usage();
+			rd.nworkers = ul;
+			break;
+		case 'v':
+			rd.verbose = 1;
+			break;
+		case 'w':
+			walfile = optarg;
+			break;
+		case 'x':
+			metrics = optarg;
+			break;
 		default:
 			usage();
 		}
@@ -62,5 +227,119 @@ main(int argc, char *argv[])
 	if (argc > 0)
 		usage();
 
+	/* one worker per core unless told otherwise */
+	if (rd.nworkers == 0) {
+		ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+		rd.nworkers = ncpu > 0 ? ncpu : 1;
+	}
+	otpradiusd_secret(secretfile);
+
+	if (metrics != NULL)
+		otp_stats_enable(1);
+
+	/* set up the workers before detaching so errors are visible */
+	memset(&hints, 0, sizeof hints);
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_DGRAM;
+	hints.ai_flags = AI_PASSIVE;
+	if ((opt = getaddrinfo(addr, port, &hints, &ai)) != 0)
+		errx(1, "%s: %s", addr ? addr : "*", gai_strerror(opt));
+	if (walfile != NULL &&
+	    (rd.wal = otp_wal_open(walfile, rd.storepath)) == NULL)
+		err(1, "%s", walfile);
+	if (walfile != NULL && (rd.replay = otp_replay_create(0)) == NULL)
+		err(1, "otp_replay_create()");
+	if (repladdr != NULL || npeers > 0) {
+		if (replsecretfile == NULL)
+			errx(1, "replication requires a secret");
+		if ((replsecret = otp_secret_load(replsecretfile)) == NULL)
+			err(1, "%s", replsecretfile);
+		if ((rd.repl = otp_repl_create(rd.storepath, replsecret,
+		    repladdr, peers, npeers)) == NULL)
+			err(1, "%s", repladdr != NULL ? repladdr :
+			    "otp_repl_create()");
+	}
+	if (maxfail > 0 &&
+	    (rd.throttle = otp_throttle_create(0, maxfail, backoff)) == NULL)
+		err(1, "otp_throttle_create()");
+	if ((rd.stopfd = eventfd(0, EFD_CLOEXEC)) < 0)
+		err(1, "eventfd()");
+	if ((rd.workers = calloc(rd.nworkers, sizeof *rd.workers)) == NULL)
+		err(1, "calloc()");
+	for (i = 0; i < rd.nworkers; ++i) {
+		w = &rd.workers[i];
+		w->rd = &rd;
+		w->idx = i;
+		if (radiusd_worker_init(w, ai) != 0)
+			err(1, "worker %u", i);
+	}
+	freeaddrinfo(ai);
+
+	if (!fflag && daemon(0, 0) != 0)
+		err(1, "daemon()");
+	openlog("otpradiusd", LOG_PID | (fflag ? LOG_PERROR : 0), LOG_AUTH);
+
+	/* signals are handled synchronously by the main thread */
+	sigemptyset(&sigs);
+	sigaddset(&sigs, SIGHUP);
+	sigaddset(&sigs, SIGINT);
+	sigaddset(&sigs, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &sigs, NULL);
+	if (rd.repl != NULL && otp_repl_start(rd.repl) != 0) {
+		syslog(LOG_ERR, "otp_repl_start(): %m");
+		exit(1);
+	}
+	for (i = 0; i < rd.nworkers; ++i) {
+		w = &rd.workers[i];
+		if ((errno = pthread_create(&w->thr, NULL,
+		    radiusd_worker_run, w)) != 0) {
+			syslog(LOG_ERR, "pthread_create(): %m");
+			exit(1);
+		}
+	}
+	syslog(LOG_INFO, "started %u workers", rd.nworkers);
+	interval.tv_sec = OTPRADIUSD_METRICS;
+	interval.tv_nsec = 0;
+	for (;;) {
+		if (metrics != NULL) {
+			sig = sigtimedwait(&sigs, NULL, &interval);
+			if (sig < 0 && (errno == EAGAIN || errno == EINTR)) {
+				otpradiusd_metrics(metrics);
+				continue;
+			}
+		} else if (sigwait(&sigs, &sig) != 0) {
+			sig = -1;
+		}
+		if (sig != SIGHUP)
+			break;
+		if (rd.wal != NULL && otp_wal_checkpoint(rd.wal) != 0)
+			syslog(LOG_ERR, "%s: checkpoint failed: %m", walfile);
+	}
+
+	eventfd_write(rd.stopfd, 1);
+	memset(total, 0, sizeof total);
+	for (i = 0; i < rd.nworkers; ++i) {
+		w = &rd.workers[i];
+		pthread_join(w->thr, NULL);
+		total[0] += w->nreq;
+		total[1] += w->naccept;
+		total[2] += w->nreject;
+		total[3] += w->ndup;
+		total[4] += w->ndrop;
+		radiusd_worker_fini(w);
+	}
+	syslog(LOG_INFO, "%lu requests, %lu accepted, %lu rejected, "
+	    "%lu duplicates, %lu dropped",
+	    total[0], total[1], total[2], total[3], total[4]);
+	free(rd.workers);
+	if (metrics != NULL)
+		otpradiusd_metrics(metrics);
+	otp_repl_destroy(rd.repl);
+	otp_secret_free(replsecret);
+	otp_wal_close(rd.wal);
+	otp_throttle_destroy(rd.throttle);
+	otp_replay_destroy(rd.replay);
+	close(rd.stopfd);
+	otp_wipe(rd.secret, sizeof rd.secret);
 	exit(0);
 }
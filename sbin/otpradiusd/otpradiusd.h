@@ -0,0 +1,128 @@
+/*-
+ * Copyright (c) 2026 Dag-Erling Smørgrav
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef OTPRADIUSD_H_INCLUDED
+#define OTPRADIUSD_H_INCLUDED
+
+/*
+ * RADIUS protocol (RFC 2865, RFC 3579)
+ */
+#define RADIUS_HDRLEN		20
+#define RADIUS_AUTHLEN		16
+#define RADIUS_MINLEN		RADIUS_HDRLEN
+#define RADIUS_MAXLEN		4096
+
+#define RADIUS_ACCESS_REQUEST	1
+#define RADIUS_ACCESS_ACCEPT	2
+#define RADIUS_ACCESS_REJECT	3
+
+#define RADIUS_USER_NAME	1
+#define RADIUS_USER_PASSWORD	2
+#define RADIUS_MESSAGE_AUTH	80
+
+#define RADIUS_MAXPASSLEN	128
+#define RADIUS_MAXSECRETLEN	128
+
+/*
+ * A parsed request.  All pointers point into the packet buffer.
+ */
+struct radius_request {
+	uint8_t			*pkt;
+	size_t			 len;
+	uint8_t			 code;
+	uint8_t			 id;
+	const uint8_t		*auth;
+	const uint8_t		*user;
+	size_t			 userlen;
+	const uint8_t		*pass;
+	size_t			 passlen;
+	uint8_t			*msgauth;	/* Message-Authenticator */
+};
+
+int radius_parse(struct radius_request *, uint8_t *, size_t);
+void radius_hmac_md5(const uint8_t *, size_t, const uint8_t *, size_t,
+    uint8_t *);
+int radius_check_msgauth(const struct radius_request *, const uint8_t *,
+    size_t);
+int radius_unhide(const struct radius_request *, const uint8_t *, size_t,
+    char *, size_t);
+size_t radius_response(const struct radius_request *, uint8_t, uint8_t *,
+    const uint8_t *, size_t);
+
+/*
+ * Server
+ */
+#define RADIUSD_BATCH		64	/* datagrams per system call */
+#define RADIUSD_NDUPS		1024	/* duplicate cache entries per worker */
+#define RADIUSD_DUPTTL		30	/* seconds */
+#define RADIUSD_MAXRESP		64	/* largest response we cache */
+
+struct radiusd_dup {
+	struct sockaddr_storage	 addr;
+	socklen_t		 addrlen;
+	uint8_t			 id;
+	uint8_t			 auth[RADIUS_AUTHLEN];
+	time_t			 when;
+	size_t			 resplen;
+	uint8_t			 resp[RADIUSD_MAXRESP];
+};
+
+struct radiusd;
+
+struct radiusd_worker {
+	struct radiusd		*rd;
+	unsigned int		 idx;
+	pthread_t		 thr;
+	int			 sock;
+	int			 epfd;
+	otp_store		*store;
+	struct radiusd_dup	*dups;
+	unsigned long		 nreq, naccept, nreject, ndup, ndrop;
+};
+
+struct radiusd {
+	const char		*storepath;
+	otp_wal			*wal;
+	otp_throttle		*throttle;
+	otp_replay		*replay;
+	otp_repl		*repl;
+	uint8_t			 secret[RADIUS_MAXSECRETLEN];
+	size_t			 secretlen;
+	int			 legacy;	/* Message-Authenticator optional */
+	int			 verbose;
+	int			 stopfd;
+	unsigned int		 nworkers;
+	struct radiusd_worker	*workers;
+};
+
+int radiusd_worker_init(struct radiusd_worker *, const struct addrinfo *);
+void *radiusd_worker_run(void *);
+void radiusd_worker_fini(struct radiusd_worker *);
+
+#endif
@@ -0,0 +1,224 @@
+/*-
+ * Copyright (c) 2026 Dag-Erling Smørgrav
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "cryb/impl.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <netdb.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include <cryb/endian.h>
+#include <cryb/md5.h>
+#include <cryb/oath.h>
+#include <cryb/otp.h>
+
+#include "otpradiusd.h"
+
+/*
+ * Parse and validate a RADIUS packet.  The packet may be followed by
+ * padding, which is ignored, but the attributes must exactly fill the
+ * length given in the header.  Returns 0 on success and -1 if the
+ * packet is malformed and should be silently discarded.
+ */
+int
+radius_parse(struct radius_request *req, uint8_t *pkt, size_t len)
+{
+	const uint8_t *attr, *end;
+	size_t alen;
+
+	memset(req, 0, sizeof *req);
+	if (len < RADIUS_MINLEN)
+		return (-1);
+	req->len = be16dec(pkt + 2);
+	if (req->len < RADIUS_MINLEN || req->len > RADIUS_MAXLEN ||
+	    req->len > len)
+		return (-1);
+	req->pkt = pkt;
+	req->code = pkt[0];
+	req->id = pkt[1];
+	req->auth = pkt + 4;
+	end = pkt + req->len;
+	for (attr = pkt + RADIUS_HDRLEN; attr < end; attr += alen) {
+		if (end - attr < 2 || (alen = attr[1]) < 2 ||
+		    (size_t)(end - attr) < alen)
+			return (-1);
+		switch (attr[0]) {
+		case RADIUS_USER_NAME:
+			if (req->user != NULL)
+				return (-1);
+			req->user = attr + 2;
+			req->userlen = alen - 2;
+			break;
+		case RADIUS_USER_PASSWORD:
+			if (req->pass != NULL || alen - 2 < 16 ||
+			    alen - 2 > RADIUS_MAXPASSLEN || (alen - 2) % 16 != 0)
+				return (-1);
+			req->pass = attr + 2;
+			req->passlen = alen - 2;
+			break;
+		case RADIUS_MESSAGE_AUTH:
+			if (req->msgauth != NULL || alen - 2 != MD5_DIGEST_LEN)
+				return (-1);
+			req->msgauth = pkt + (attr - pkt) + 2;
+			break;
+		default:
+			break;
+		}
+	}
+	return (0);
+}
+
+/*
+ * HMAC-MD5, as used by the Message-Authenticator attribute.
+ */
+void
+radius_hmac_md5(const uint8_t *key, size_t keylen, const uint8_t *msg,
+    size_t msglen, uint8_t *mac)
+{
+	uint8_t pad[MD5_BLOCK_LEN], ikey[MD5_DIGEST_LEN];
+	md5_ctx ctx;
+	unsigned int i;
+
+	if (keylen > MD5_BLOCK_LEN) {
+		md5_complete(key, keylen, ikey);
+		key = ikey;
+		keylen = sizeof ikey;
+	}
+	memset(pad, 0x36, sizeof pad);
+	for (i = 0; i < keylen; ++i)
+		pad[i] ^= key[i];
+	md5_init(&ctx);
+	md5_update(&ctx, pad, sizeof pad);
+	md5_update(&ctx, msg, msglen);
+	md5_final(&ctx, mac);
+	memset(pad, 0x5c, sizeof pad);
+	for (i = 0; i < keylen; ++i)
+		pad[i] ^= key[i];
+	md5_init(&ctx);
+	md5_update(&ctx, pad, sizeof pad);
+	md5_update(&ctx, mac, MD5_DIGEST_LEN);
+	md5_final(&ctx, mac);
+	otp_wipe(pad, sizeof pad);
+	otp_wipe(ikey, sizeof ikey);
+}
+
+/*
+ * Verify the Message-Authenticator attribute of a request, which is an
+ * HMAC-MD5 of the entire packet with the attribute's value zeroed.
+ * Returns 0 if it matches and -1 if it does not.
+ */
+int
+radius_check_msgauth(const struct radius_request *req,
+    const uint8_t *secret, size_t secretlen)
+{
+	uint8_t expected[MD5_DIGEST_LEN], mac[MD5_DIGEST_LEN];
+	unsigned int diff, i;
+
+	memcpy(expected, req->msgauth, sizeof expected);
+	memset(req->msgauth, 0, MD5_DIGEST_LEN);
+	radius_hmac_md5(secret, secretlen, req->pkt, req->len, mac);
+	memcpy(req->msgauth, expected, sizeof expected);
+	for (i = diff = 0; i < sizeof mac; ++i)
+		diff |= mac[i] ^ expected[i];
+	return (diff == 0 ? 0 : -1);
+}
+
+/*
+ * Recover the User-Password attribute of a request into a
+ * NUL-terminated string.  Each 16-byte block was XORed with the MD5
+ * digest of the secret followed by the previous ciphertext block, or
+ * the request authenticator for the first block.  Returns the length
+ * of the password, or -1 if it does not fit.
+ */
+int
+radius_unhide(const struct radius_request *req, const uint8_t *secret,
+    size_t secretlen, char *buf, size_t size)
+{
+	uint8_t b[MD5_DIGEST_LEN];
+	const uint8_t *prev;
+	md5_ctx ctx;
+	size_t i, j, len;
+
+	if (req->pass == NULL || req->passlen >= size)
+		return (-1);
+	prev = req->auth;
+	for (i = 0; i < req->passlen; i += 16) {
+		md5_init(&ctx);
+		md5_update(&ctx, secret, secretlen);
+		md5_update(&ctx, prev, 16);
+		md5_final(&ctx, b);
+		for (j = 0; j < 16; ++j)
+			buf[i + j] = req->pass[i + j] ^ b[j];
+		prev = req->pass + i;
+	}
+	otp_wipe(b, sizeof b);
+	len = strnlen(buf, req->passlen);
+	memset(buf + len, 0, size - len);
+	return ((int)len);
+}
+
+/*
+ * Build a response to a request.  If the request carried a
+ * Message-Authenticator, so does the response.  The response
+ * authenticator is the MD5 digest of the response, with the request
+ * authenticator in place of its own, followed by the secret.  Returns
+ * the length of the response.
+ */
+size_t
+radius_response(const struct radius_request *req, uint8_t code,
+    uint8_t *resp, const uint8_t *secret, size_t secretlen)
+{
+	md5_ctx ctx;
+	size_t len;
+
+	len = RADIUS_HDRLEN;
+	resp[0] = code;
+	resp[1] = req->id;
+	memcpy(resp + 4, req->auth, RADIUS_AUTHLEN);
+	if (req->msgauth != NULL) {
+		resp[len++] = RADIUS_MESSAGE_AUTH;
+		resp[len++] = 2 + MD5_DIGEST_LEN;
+		memset(resp + len, 0, MD5_DIGEST_LEN);
+		be16enc(resp + 2, len + MD5_DIGEST_LEN);
+		radius_hmac_md5(secret, secretlen, resp, len + MD5_DIGEST_LEN,
+		    resp + len);
+		len += MD5_DIGEST_LEN;
+	}
+	be16enc(resp + 2, len);
+	md5_init(&ctx);
+	md5_update(&ctx, resp, len);
+	md5_update(&ctx, secret, secretlen);
+	md5_final(&ctx, resp + 4);
+	return (len);
+}
@@ -0,0 +1,308 @@
+/*-
+ * Copyright (c) 2026 Dag-Erling Smørgrav
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "cryb/impl.h"
+
+#include <sys/types.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <cryb/oath.h>
+#include <cryb/otp.h>
+
+#include "otpradiusd.h"
+
+/*
+ * FNV-1a, used to index the duplicate cache.
+ */
+static uint32_t
+radiusd_hash(uint32_t h, const void *data, size_t len)
+{
+	const uint8_t *p = data;
+
+	while (len--)
+		h = (h ^ *p++) * 16777619U;
+	return (h);
+}
+
+#define RADIUSD_HASHINIT	2166136261U
+
+/*
+ * Set up a worker: a socket bound to the service address with
+ * SO_REUSEPORT, so the kernel spreads incoming requests across workers
+ * by flow, an epoll instance watching it and the shutdown event, a
+ * handle on the key store, and a duplicate cache.  Since a client's
+ * retransmissions always arrive at the same socket, each worker can
+ * keep its own duplicate cache without any locking.
+ */
+int
+radiusd_worker_init(struct radiusd_worker *w, const struct addrinfo *ai)
+{
+	struct epoll_event ev;
+	int one = 1;
+
+	w->sock = w->epfd = -1;
+	if ((w->sock = socket(ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK |
+	    SOCK_CLOEXEC, ai->ai_protocol)) < 0 ||
+	    setsockopt(w->sock, SOL_SOCKET, SO_REUSEPORT, &one,
+		sizeof one) != 0 ||
+	    bind(w->sock, ai->ai_addr, ai->ai_addrlen) != 0)
+		goto fail;
+	if ((w->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+		goto fail;
+	memset(&ev, 0, sizeof ev);
+	ev.events = EPOLLIN;
+	ev.data.fd = w->sock;
+	if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, w->sock, &ev) != 0)
+		goto fail;
+	ev.data.fd = w->rd->stopfd;
+	if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, w->rd->stopfd, &ev) != 0)
+		goto fail;
+	if ((w->store = otp_store_open(w->rd->storepath, O_RDWR)) == NULL ||
+	    otp_store_set_wal(w->store, w->rd->wal) != 0 ||
+	    otp_store_set_throttle(w->store, w->rd->throttle) != 0 ||
+	    otp_store_set_replay(w->store, w->rd->replay) != 0 ||
+	    otp_store_set_repl(w->store, w->rd->repl) != 0)
+		goto fail;
+	if ((w->dups = calloc(RADIUSD_NDUPS, sizeof *w->dups)) == NULL)
+		goto fail;
+	return (0);
+fail:
+	radiusd_worker_fini(w);
+	return (-1);
+}
+
+/*
+ * Release a worker's resources.
+ */
+void
+radiusd_worker_fini(struct radiusd_worker *w)
+{
+
+	free(w->dups);
+	w->dups = NULL;
+	otp_store_close(w->store);
+	w->store = NULL;
+	if (w->epfd >= 0)
+		close(w->epfd);
+	w->epfd = -1;
+	if (w->sock >= 0)
+		close(w->sock);
+	w->sock = -1;
+}
+
+/*
+ * Decide an Access-Request.  Returns the response code.
+ */
+static uint8_t
+radiusd_decide(struct radiusd_worker *w, const struct radius_request *req)
+{
+	char user[64], pass[RADIUS_MAXPASSLEN + 1];
+	unsigned long response;
+	int i, len, ret;
+
+	if (req->user == NULL || req->userlen == 0 ||
+	    req->userlen >= sizeof user ||
+	    memchr(req->user, '\0', req->userlen) != NULL)
+		return (RADIUS_ACCESS_REJECT);
+	memcpy(user, req->user, req->userlen);
+	user[req->userlen] = '\0';
+	len = radius_unhide(req, w->rd->secret, w->rd->secretlen,
+	    pass, sizeof pass);
+	ret = -1;
+	if (len >= 1 && len <= 9) {
+		for (i = 0, response = 0; i < len; ++i) {
+			if (pass[i] < '0' || pass[i] > '9')
+				break;
+			response = response * 10 + pass[i] - '0';
+		}
+		if (i == len &&
+		    (ret = otp_store_verify(w->store, user, response)) < 0 &&
+		    errno != ENOENT && errno != EAGAIN)
+			syslog(LOG_ERR, "%s: verification failed: %m", user);
+	}
+	otp_wipe(pass, sizeof pass);
+	if (w->rd->verbose) {
+		syslog(LOG_INFO, "%s: %s", user, ret > 0 ? "accepted" :
+		    ret < 0 && errno == EAGAIN ? "throttled" : "rejected");
+	}
+	return (ret > 0 ? RADIUS_ACCESS_ACCEPT : RADIUS_ACCESS_REJECT);
+}
+
+/*
+ * Handle one datagram.  Returns the length of the response, or 0 if
+ * the datagram should be silently discarded.
+ */
+static size_t
+radiusd_handle(struct radiusd_worker *w, const struct sockaddr *sa,
+    socklen_t salen, uint8_t *pkt, size_t len, uint8_t *resp, time_t now)
+{
+	struct radius_request req;
+	struct radiusd_dup *dup;
+	uint32_t h;
+	uint8_t code;
+	size_t resplen;
+
+	w->nreq++;
+	if (radius_parse(&req, pkt, len) != 0 ||
+	    req.code != RADIUS_ACCESS_REQUEST || req.pass == NULL ||
+	    (req.msgauth == NULL && !w->rd->legacy)) {
+		w->ndrop++;
+		return (0);
+	}
+
+	/* retransmission of a request we have already answered? */
+	h = radiusd_hash(RADIUSD_HASHINIT, sa, salen);
+	h = radiusd_hash(h, &req.id, 1);
+	h = radiusd_hash(h, req.auth, RADIUS_AUTHLEN);
+	dup = &w->dups[h % RADIUSD_NDUPS];
+	if (dup->resplen > 0 && now - dup->when < RADIUSD_DUPTTL &&
+	    dup->id == req.id && dup->addrlen == salen &&
+	    memcmp(dup->auth, req.auth, RADIUS_AUTHLEN) == 0 &&
+	    memcmp(&dup->addr, sa, salen) == 0) {
+		w->ndup++;
+		memcpy(resp, dup->resp, dup->resplen);
+		return (dup->resplen);
+	}
+
+	if (req.msgauth != NULL &&
+	    radius_check_msgauth(&req, w->rd->secret, w->rd->secretlen) != 0) {
+		w->ndrop++;
+		return (0);
+	}
+	code = radiusd_decide(w, &req);
+	if (code == RADIUS_ACCESS_ACCEPT)
+		w->naccept++;
+	else
+		w->nreject++;
+	resplen = radius_response(&req, code, resp, w->rd->secret,
+	    w->rd->secretlen);
+
+	/* remember the response in case the client retransmits */
+	memcpy(&dup->addr, sa, salen);
+	dup->addrlen = salen;
+	dup->id = req.id;
+	memcpy(dup->auth, req.auth, RADIUS_AUTHLEN);
+	dup->when = now;
+	memcpy(dup->resp, resp, resplen);
+	dup->resplen = resplen;
+	return (resplen);
+}
+
+/*
+ * Worker thread: wait for the socket to become readable, then receive,
+ * process and answer as many datagrams as possible in batches of up to
+ * RADIUSD_BATCH per system call, until the shutdown event fires.
+ */
+void *
+radiusd_worker_run(void *arg)
+{
+	struct radiusd_worker *w = arg;
+	struct mmsghdr in[RADIUSD_BATCH], out[RADIUSD_BATCH];
+	struct sockaddr_storage addrs[RADIUSD_BATCH];
+	struct iovec iniov[RADIUSD_BATCH], outiov[RADIUSD_BATCH];
+	uint8_t resps[RADIUSD_BATCH][RADIUSD_MAXRESP];
+	uint8_t (*bufs)[RADIUS_MAXLEN];
+	struct epoll_event evs[2];
+	time_t now;
+	size_t len;
+	int i, m, n, nev, nout;
+
+	if ((bufs = malloc(RADIUSD_BATCH * sizeof *bufs)) == NULL) {
+		syslog(LOG_ERR, "worker %u: %m", w->idx);
+		return (NULL);
+	}
+	for (;;) {
+		if ((nev = epoll_wait(w->epfd, evs, 2, -1)) < 0) {
+			if (errno == EINTR)
+				continue;
+			syslog(LOG_ERR, "worker %u: epoll_wait(): %m", w->idx);
+			break;
+		}
+		for (i = 0; i < nev; ++i)
+			if (evs[i].data.fd == w->rd->stopfd)
+				goto done;
+		for (;;) {
+			memset(in, 0, sizeof in);
+			for (i = 0; i < RADIUSD_BATCH; ++i) {
+				iniov[i].iov_base = bufs[i];
+				iniov[i].iov_len = sizeof bufs[i];
+				in[i].msg_hdr.msg_iov = &iniov[i];
+				in[i].msg_hdr.msg_iovlen = 1;
+				in[i].msg_hdr.msg_name = &addrs[i];
+				in[i].msg_hdr.msg_namelen = sizeof addrs[i];
+			}
+			n = recvmmsg(w->sock, in, RADIUSD_BATCH, MSG_DONTWAIT,
+			    NULL);
+			if (n <= 0)
+				break;
+			now = time(NULL);
+			memset(out, 0, sizeof out);
+			for (i = nout = 0; i < n; ++i) {
+				len = radiusd_handle(w, in[i].msg_hdr.msg_name,
+				    in[i].msg_hdr.msg_namelen, bufs[i],
+				    in[i].msg_len, resps[nout], now);
+				if (len == 0)
+					continue;
+				outiov[nout].iov_base = resps[nout];
+				outiov[nout].iov_len = len;
+				out[nout].msg_hdr.msg_iov = &outiov[nout];
+				out[nout].msg_hdr.msg_iovlen = 1;
+				out[nout].msg_hdr.msg_name = &addrs[i];
+				out[nout].msg_hdr.msg_namelen =
+				    in[i].msg_hdr.msg_namelen;
+				nout++;
+			}
+			/* best effort; the client will retransmit */
+			for (i = 0; i < nout; i += m)
+				if ((m = sendmmsg(w->sock, out + i, nout - i,
+				    0)) <= 0)
+					break;
+		}
+		if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK &&
+		    errno != EINTR) {
+			syslog(LOG_ERR, "worker %u: recvmmsg(): %m", w->idx);
+			break;
+		}
+	}
+done:
+	free(bufs);
+	return (NULL);
+}
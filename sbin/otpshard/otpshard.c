@@ -0,0 +1,156 @@
+/*-
+ * Copyright (c) 2026 Dag-Erling Smørgrav
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "cryb/impl.h"
+
+#include <err.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <cryb/oath.h>
+#include <cryb/otp.h>
+
+static otp_secret *secret;
+static int nflag;
+static int verbose;
+
+/*
+ * Load a shard map or die trying.
+ */
+static otp_shardmap *
+otpshard_load(const char *path)
+{
+	otp_shardmap *map;
+	unsigned long lineno;
+
+	lineno = 0;
+	if ((map = otp_shardmap_load(path, &lineno)) == NULL) {
+		if (errno == EINVAL && lineno > 0)
+			errx(1, "%s:%lu: invalid shard entry", path, lineno);
+		err(1, "%s", path);
+	}
+	if (secret != NULL)
+		otp_shardmap_set_secret(map, secret);
+	return (map);
+}
+
+/*
+ * Print the shard which owns each of the given users.
+ */
+static int
+otpshard_owner(int argc, char *argv[])
+{
+	otp_shardmap *map;
+	int i, shard;
+
+	map = otpshard_load(argv[0]);
+	for (i = 1; i < argc; ++i) {
+		if ((shard = otp_shardmap_owner(map, argv[i])) < 0)
+			err(1, "%s", argv[i]);
+		printf("%s\t%s\t%s\n", argv[i],
+		    otp_shardmap_name(map, shard),
+		    otp_shardmap_addr(map, shard));
+	}
+	otp_shardmap_destroy(map);
+	return (0);
+}
+
+/*
+ * Move keys from the shards which own them according to one map to
+ * those which own them according to another.
+ */
+static int
+otpshard_rebalance(int argc, char *argv[])
+{
+	otp_shardmap *from, *to;
+	long moved;
+
+	(void)argc;
+	from = otpshard_load(argv[0]);
+	to = otpshard_load(argv[1]);
+	moved = otp_shard_rebalance(from, to, nflag ? OTP_SHARD_DRYRUN : 0);
+	if (moved < 0)
+		err(1, "rebalance");
+	if (nflag || verbose)
+		printf("%ld keys %s\n", moved,
+		    nflag ? "would be moved" : "moved");
+	otp_shardmap_destroy(to);
+	otp_shardmap_destroy(from);
+	return (0);
+}
+
+static void
+usage(void)
+{
+
+	fprintf(stderr, "usage: otpshard [-v] owner map user ...\n"
+	    "       otpshard [-nv] [-K secretfile] rebalance oldmap newmap\n");
+	exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+	const char *cmd;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "K:nv")) != -1)
+		switch (opt) {
+		case 'K':
+			if ((secret = otp_secret_load(optarg)) == NULL)
+				err(1, "%s", optarg);
+			break;
+		case 'n':
+			nflag = 1;
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		default:
+			usage();
+		}
+
+	argc -= optind;
+	argv += optind;
+
+	if (argc < 1)
+		usage();
+	cmd = *argv;
+	argc--;
+	argv++;
+
+	if (strcmp(cmd, "owner") == 0 && argc >= 2)
+		exit(otpshard_owner(argc, argv));
+	if (strcmp(cmd, "rebalance") == 0 && argc == 2)
+		exit(otpshard_rebalance(argc, argv));
+	usage();
+}
@@ -0,0 +1,394 @@
+/*-
+ * Copyright (c) 2026 Dag-Erling Smørgrav
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "cryb/impl.h"
+
+#include <err.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <cryb/oath.h>
+#include <cryb/otp.h>
+
+/*
+ * Microbenchmarks for the library's hot paths.  Every case is run for
+ * every combination of hash and digits, and the result is reported as
+ * the best of several rounds, each of which lasts at least the minimum
+ * time.  Build and run with "make bench"; pass options to the program
+ * with e.g. "make bench BENCHFLAGS='-f json'".
+ */
+
+#define B_MINTIME	200	/* ms */
+#define B_ROUNDS	3
+#define B_COUNTER	1000
+#define B_SKIP		90	/* inside the default two-code window */
+
+struct bench {
+	oath_key	 key;
+	oath_key	 tmpl;
+	otp_policy	 pol;
+	unsigned long	 codes[3];
+	char		 uri[1024];
+};
+
+struct bench_case {
+	const char	*name;
+	oath_mode	 mode;
+	int		 expect;	/* result of run() */
+	int		(*prep)(struct bench *);
+	int		(*run)(struct bench *);
+};
+
+static const struct {
+	oath_hash	 hash;
+	const char	*name;
+	const char	*secret;
+	size_t		 secretlen;
+} b_hashes[] = {
+	{ oh_sha1, "sha1", "12345678901234567890", 20 },
+	{ oh_sha256, "sha256", "12345678901234567890123456789012", 32 },
+	{ oh_sha512, "sha512", "1234567890123456789012345678901234567890"
+	  "123456789012345678901234", 64 },
+};
+
+static const unsigned int b_digits[] = { 6, 8 };
+
+/*
+ * Compute the HOTP code for a given counter value.  Note that
+ * oath_hotp() only does SHA-1.
+ */
+static unsigned int
+b_code(struct bench *b, uint64_t counter)
+{
+	oath_key key;
+	unsigned int code;
+
+	key = b->tmpl;
+	key.counter = counter;
+	code = otp_calc(&key);
+	otp_key_destroy(&key);
+	return (code);
+}
+
+/*
+ * HOTP
+ */
+
+static int
+b_hotp_hit_prep(struct bench *b)
+{
+
+	b->codes[0] = b_code(b, B_COUNTER);
+	return (0);
+}
+
+static int
+b_hotp_edge_prep(struct bench *b)
+{
+
+	b->codes[0] = b_code(b, B_COUNTER + b->pol.hotp_lookahead - 1);
+	return (0);
+}
+
+static int
+b_hotp_miss_prep(struct bench *b)
+{
+	unsigned int i;
+
+	/* find a code that does not appear anywhere in the window */
+	for (b->codes[0] = 0; ; ++b->codes[0]) {
+		for (i = 0; i < b->pol.hotp_lookahead; ++i)
+			if (b->codes[0] == b_code(b, B_COUNTER + i))
+				break;
+		if (i == b->pol.hotp_lookahead)
+			return (0);
+	}
+}
+
+static int
+b_verify_run(struct bench *b)
+{
+
+	b->key.counter = b->tmpl.counter;
+	b->key.lastused = b->tmpl.lastused;
+	return (otp_verify(&b->key, b->codes[0]));
+}
+
+/*
+ * TOTP
+ */
+
+static int
+b_totp_hit_prep(struct bench *b)
+{
+	oath_key key;
+
+	/* a code from the previous step remains valid */
+	key = b->tmpl;
+	b->codes[0] = otp_calc(&key);
+	otp_key_destroy(&key);
+	return (b->codes[0] == UINT_MAX ? -1 : 0);
+}
+
+/*
+ * Resynchronization
+ */
+
+static int
+b_resync_prep(struct bench *b)
+{
+	unsigned int i;
+
+	for (i = 0; i < 3; ++i)
+		b->codes[i] = b_code(b, B_COUNTER + B_SKIP + i);
+	return (0);
+}
+
+static int
+b_resync2_run(struct bench *b)
+{
+
+	b->key.counter = b->tmpl.counter;
+	return (otp_resync(&b->key, b->codes, 2));
+}
+
+static int
+b_resync3_run(struct bench *b)
+{
+
+	b->key.counter = b->tmpl.counter;
+	return (otp_resync(&b->key, b->codes, 3));
+}
+
+/*
+ * Key URIs
+ */
+
+static int
+b_uri_prep(struct bench *b)
+{
+	size_t len;
+
+	len = sizeof b->uri;
+	return (oath_key_to_uri(&b->tmpl, b->uri, &len));
+}
+
+static int
+b_uri_parse_run(struct bench *b)
+{
+
+	return (oath_key_from_uri(&b->key, b->uri) == 0 ? 1 : -1);
+}
+
+static int
+b_uri_format_run(struct bench *b)
+{
+	size_t len;
+
+	len = sizeof b->uri;
+	return (oath_key_to_uri(&b->key, b->uri, &len) == 0 ? 1 : -1);
+}
+
+static const struct bench_case b_cases[] = {
+	{ "hotp_hit",	om_hotp, 1, b_hotp_hit_prep,	b_verify_run },
+	{ "hotp_edge",	om_hotp, 1, b_hotp_edge_prep,	b_verify_run },
+	{ "hotp_miss",	om_hotp, 0, b_hotp_miss_prep,	b_verify_run },
+	{ "totp_hit",	om_totp, 1, b_totp_hit_prep,	b_verify_run },
+	{ "resync_2",	om_hotp, 1, b_resync_prep,	b_resync2_run },
+	{ "resync_3",	om_hotp, 1, b_resync_prep,	b_resync3_run },
+	{ "uri_parse",	om_totp, 1, b_uri_prep,		b_uri_parse_run },
+	{ "uri_format",	om_totp, 1, b_uri_prep,		b_uri_format_run },
+};
+
+static enum { f_text, f_json, f_csv } format;
+static unsigned int mintime = B_MINTIME;
+static unsigned int rounds = B_ROUNDS;
+static unsigned int nresults;
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec * 1e9 + ts.tv_nsec);
+}
+
+/*
+ * Run a case n times and return the elapsed time in nanoseconds.
+ */
+static double
+b_time(const struct bench_case *bc, struct bench *b, unsigned long n)
+{
+	unsigned long i;
+	double t0;
+
+	t0 = now();
+	for (i = 0; i < n; ++i)
+		if (bc->run(b) < 0)
+			errx(1, "%s failed", bc->name);
+	return (now() - t0);
+}
+
+static void
+b_report(const struct bench_case *bc, const char *hash,
+    unsigned int digits, unsigned long n, double ns)
+{
+	double nsop, opss;
+
+	nsop = ns / n;
+	opss = n * 1e9 / ns;
+	switch (format) {
+	case f_text:
+		printf("%-12s %-7s %2u %12lu %10.1f ns/op %12.0f ops/s\n",
+		    bc->name, hash, digits, n, nsop, opss);
+		break;
+	case f_json:
+		printf("%s\n    { \"name\": \"%s\", \"hash\": \"%s\", "
+		    "\"digits\": %u, \"iterations\": %lu, "
+		    "\"ns_per_op\": %.1f, \"ops_per_sec\": %.0f }",
+		    nresults > 0 ? "," : "", bc->name, hash, digits, n,
+		    nsop, opss);
+		break;
+	case f_csv:
+		printf("%s,%s,%u,%lu,%.1f,%.0f\n",
+		    bc->name, hash, digits, n, nsop, opss);
+		break;
+	}
+	nresults++;
+}
+
+static void
+b_run(const struct bench_case *bc, unsigned int h, unsigned int d)
+{
+	struct bench b;
+	unsigned long n;
+	unsigned int i;
+	double best, ns;
+	int ret;
+
+	memset(&b, 0, sizeof b);
+	otp_policy_init(&b.pol);
+	if (oath_key_create(&b.tmpl, bc->mode, b_hashes[h].hash,
+	    b_digits[d], "cryb.to", "bench", b_hashes[h].secret,
+	    b_hashes[h].secretlen) != 0)
+		errx(1, "oath_key_create()");
+	if (bc->mode == om_hotp)
+		b.tmpl.counter = B_COUNTER;
+	b.key = b.tmpl;
+	if (bc->prep(&b) != 0)
+		errx(1, "%s: setup failed", bc->name);
+	/* check that the case does what it says on the tin */
+	if ((ret = bc->run(&b)) < 0 || (ret > 0) != (bc->expect > 0))
+		errx(1, "%s: unexpected result %d", bc->name, ret);
+	/* find an iteration count which takes at least mintime */
+	for (n = 1; (ns = b_time(bc, &b, n)) < mintime * 1e6; n *= 2)
+		if (ns > mintime * 1e5)
+			n = n * (mintime * 1e6 / ns) / 2 + 1;
+	for (best = ns, i = 1; i < rounds; ++i)
+		if ((ns = b_time(bc, &b, n)) < best)
+			best = ns;
+	b_report(bc, b_hashes[h].name, b_digits[d], n, best);
+	otp_key_destroy(&b.key);
+	otp_key_destroy(&b.tmpl);
+}
+
+static void
+usage(void)
+{
+
+	fprintf(stderr, "usage: b_otp [-f text|json|csv] [-r rounds] "
+	    "[-t msec] [case ...]\n");
+	exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+	unsigned int c, d, h;
+	int i, opt;
+
+	while ((opt = getopt(argc, argv, "f:r:t:")) != -1)
+		switch (opt) {
+		case 'f':
+			if (strcmp(optarg, "text") == 0)
+				format = f_text;
+			else if (strcmp(optarg, "json") == 0)
+				format = f_json;
+			else if (strcmp(optarg, "csv") == 0)
+				format = f_csv;
+			else
+				usage();
+			break;
+		case 'r':
+			if ((rounds = strtoul(optarg, NULL, 10)) == 0)
+				usage();
+			break;
+		case 't':
+			if ((mintime = strtoul(optarg, NULL, 10)) == 0)
+				usage();
+			break;
+		default:
+			usage();
+		}
+	argc -= optind;
+	argv += optind;
+
+	switch (format) {
+	case f_text:
+		printf("# cryb-otp %s, simd %s\n", cryb_otp_version(),
+		    otp_simd_name());
+		break;
+	case f_json:
+		printf("{\n  \"version\": \"%s\",\n  \"simd\": \"%s\",\n"
+		    "  \"results\": [", cryb_otp_version(), otp_simd_name());
+		break;
+	case f_csv:
+		printf("name,hash,digits,iterations,ns_per_op,ops_per_sec\n");
+		break;
+	}
+	for (c = 0; c < sizeof b_cases / sizeof *b_cases; ++c) {
+		for (i = 0; i < argc; ++i)
+			if (strcmp(argv[i], b_cases[c].name) == 0)
+				break;
+		if (argc > 0 && i == argc)
+			continue;
+		for (h = 0; h < sizeof b_hashes / sizeof *b_hashes; ++h)
+			for (d = 0; d < sizeof b_digits / sizeof *b_digits; ++d)
+				b_run(&b_cases[c], h, d);
+	}
+	if (format == f_json)
+		printf("\n  ]\n}\n");
+	exit(0);
+}
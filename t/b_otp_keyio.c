@@ -0,0 +1,223 @@
+/*-
+ * Copyright (c) 2026 Dag-Erling Smørgrav
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "cryb/impl.h"
+
+#include <err.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <cryb/oath.h>
+#include <cryb/otp.h>
+
+/*
+ * Compare the per-key cost of loading and advancing per-user key files
+ * the way otpkey and pam_otp do it, one key at a time with ordinary
+ * system calls, with batched key I/O, both with cold key files and
+ * with registered ones.  Each advance includes an fdatasync(), so the
+ * update figures depend heavily on the file system the key files are
+ * on; set TMPDIR to choose it.
+ */
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec * 1e9 + ts.tv_nsec);
+}
+
+static void
+report(const char *name, double ns, unsigned int n)
+{
+
+	printf("%-28s %10.1f ns/op %12.0f ops/s\n", name, ns / n,
+	    n * 1e9 / ns);
+}
+
+static char **paths;
+static oath_key *keys;
+static int *results;
+static unsigned int n;
+
+/*
+ * What otpkey_load() does.
+ */
+static void
+b_load_single(void)
+{
+	unsigned int i;
+	int fd;
+
+	for (i = 0; i < n; ++i) {
+		if ((fd = open(paths[i], O_RDONLY|O_CLOEXEC)) < 0 ||
+		    otp_key_load(&keys[i], fd, NULL) < 0)
+			err(1, "%s", paths[i]);
+		close(fd);
+	}
+}
+
+/*
+ * What otpkey_advance() does.
+ */
+static void
+b_update_single(void)
+{
+	unsigned int i;
+	int fd;
+
+	for (i = 0; i < n; ++i) {
+		if ((fd = open(paths[i], O_WRONLY|O_CLOEXEC)) < 0 ||
+		    otp_key_update(&keys[i], fd) != 0)
+			err(1, "%s", paths[i]);
+		close(fd);
+	}
+}
+
+/*
+ * What otpkey_save() and pam_otp_save() do with a URI key file.
+ */
+static void
+b_save_single(void)
+{
+	char tmp[1024], uri[1024];
+	unsigned int i;
+	size_t len;
+	int fd;
+
+	for (i = 0; i < n; ++i) {
+		len = sizeof uri;
+		if (oath_key_to_uri(&keys[i], uri, &len) != 0)
+			errx(1, "oath_key_to_uri()");
+		snprintf(tmp, sizeof tmp, "%s.tmp", paths[i]);
+		if ((fd = open(tmp, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC,
+		    0600)) < 0 || write(fd, uri, len - 1) != (ssize_t)len - 1 ||
+		    fsync(fd) != 0 || close(fd) != 0 || rename(tmp, paths[i]) != 0)
+			err(1, "%s", paths[i]);
+	}
+}
+
+static void
+b_keyio(otp_keyio *kio, const char *what)
+{
+	char name[64];
+	double t0, t1, t2;
+
+	t0 = now();
+	if (otp_keyio_load(kio, (const char *const *)paths, keys, results,
+	    n) != (int)n)
+		errx(1, "otp_keyio_load()");
+	t1 = now();
+	if (otp_keyio_update(kio, (const char *const *)paths, keys, results,
+	    n) != (int)n)
+		errx(1, "otp_keyio_update()");
+	t2 = now();
+	snprintf(name, sizeof name, "load %s %s", otp_keyio_backend(kio),
+	    what);
+	report(name, t1 - t0, n);
+	snprintf(name, sizeof name, "update %s %s", otp_keyio_backend(kio),
+	    what);
+	report(name, t2 - t1, n);
+}
+
+int
+main(int argc, char *argv[])
+{
+	char dir[256], buf[1024], label[32];
+	const char *tmpdir;
+	otp_keyio *kio;
+	unsigned int i;
+	size_t len;
+	double t0, t1, t2, t3;
+	int fd, flags;
+
+	n = argc > 1 ? (unsigned int)strtoul(argv[1], NULL, 10) : 1000;
+	if (n == 0)
+		errx(1, "usage: b_otp_keyio [count]");
+	if ((tmpdir = getenv("TMPDIR")) == NULL)
+		tmpdir = "/tmp";
+	snprintf(dir, sizeof dir, "%s/b_otp_keyio.XXXXXX", tmpdir);
+	if (mkdtemp(dir) == NULL)
+		err(1, "mkdtemp()");
+	if ((paths = calloc(n, sizeof *paths)) == NULL ||
+	    (keys = calloc(n, sizeof *keys)) == NULL ||
+	    (results = calloc(n, sizeof *results)) == NULL)
+		err(1, "calloc()");
+	for (i = 0; i < n; ++i) {
+		snprintf(label, sizeof label, "user%u", i);
+		if (asprintf(&paths[i], "%s/%s", dir, label) < 0)
+			err(1, "asprintf()");
+		if (oath_key_create(&keys[i], om_hotp, oh_sha1, 6, "cryb.to",
+		    label, "12345678901234567890", 20) != 0)
+			errx(1, "oath_key_create()");
+		len = sizeof buf;
+		if (otp_key_to_binary(&keys[i], buf, &len) != 0 ||
+		    (fd = open(paths[i], O_RDWR|O_CREAT|O_TRUNC, 0600)) < 0 ||
+		    write(fd, buf, len) != (ssize_t)len || close(fd) != 0)
+			err(1, "%s", paths[i]);
+	}
+	t0 = now();
+	b_load_single();
+	t1 = now();
+	b_update_single();
+	t2 = now();
+	report("load single", t1 - t0, n);
+	report("update single", t2 - t1, n);
+	for (flags = OTP_KEYIO_POSIX; flags >= 0; flags -= OTP_KEYIO_POSIX) {
+		if ((kio = otp_keyio_create(0, n, flags)) == NULL)
+			err(1, "otp_keyio_create()");
+		b_keyio(kio, "cold");
+		for (i = 0; i < n; ++i)
+			if (otp_keyio_register(kio, paths[i]) != 0)
+				err(1, "otp_keyio_register()");
+		b_keyio(kio, "hot");
+		otp_keyio_destroy(kio);
+	}
+	/* last, since it turns the key files into URIs */
+	t2 = now();
+	b_save_single();
+	t3 = now();
+	report("save single (uri, rename)", t3 - t2, n);
+	for (i = 0; i < n; ++i) {
+		unlink(paths[i]);
+		free(paths[i]);
+		oath_key_destroy(&keys[i]);
+	}
+	rmdir(dir);
+	free(results);
+	free(keys);
+	free(paths);
+	exit(0);
+}
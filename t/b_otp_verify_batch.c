@@ -0,0 +1,112 @@
+/*-
+ * Copyright (c) 2026 Dag-Erling Smørgrav
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "cryb/impl.h"
+
+#include <err.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <cryb/oath.h>
+#include <cryb/otp.h>
+
+/*
+ * Compare the per-verification cost of oath_hotp_match() in a loop,
+ * otp_verify() in a loop, and otp_verify_batch().  Every response is
+ * wrong, so each verification scans the entire window.
+ */
+
+#define HOTP_WINDOW	9
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec * 1e9 + ts.tv_nsec);
+}
+
+static void
+report(const char *name, double ns, unsigned int n)
+{
+
+	printf("%-24s %10.1f ns/op %12.0f ops/s\n", name, ns / n,
+	    n * 1e9 / ns);
+}
+
+int
+main(int argc, char *argv[])
+{
+	oath_key *keys, **kp;
+	unsigned long *responses;
+	int *results;
+	unsigned int i, n;
+	double t0, t1, t2, t3;
+
+	n = argc > 1 ? (unsigned int)strtoul(argv[1], NULL, 10) : 10000;
+	if (n == 0)
+		errx(1, "usage: b_otp_verify_batch [count]");
+	if ((keys = calloc(n, sizeof *keys)) == NULL ||
+	    (kp = calloc(n, sizeof *kp)) == NULL ||
+	    (responses = calloc(n, sizeof *responses)) == NULL ||
+	    (results = calloc(n, sizeof *results)) == NULL)
+		err(1, "calloc()");
+	for (i = 0; i < n; ++i) {
+		if (oath_key_create(&keys[i], om_hotp, oh_undef, 0, "",
+			"user", NULL, 0) != 0)
+			errx(1, "oath_key_create()");
+		kp[i] = &keys[i];
+		responses[i] = 1000000; /* never valid */
+	}
+	t0 = now();
+	for (i = 0; i < n; ++i)
+		(void)oath_hotp_match(&keys[i], responses[i], HOTP_WINDOW);
+	t1 = now();
+	for (i = 0; i < n; ++i)
+		results[i] = otp_verify(&keys[i], responses[i]);
+	t2 = now();
+	(void)otp_verify_batch(kp, responses, results, n);
+	t3 = now();
+	report("oath_hotp_match loop", t1 - t0, n);
+	report("otp_verify loop", t2 - t1, n);
+	report("otp_verify_batch", t3 - t2, n);
+	printf("batch speedup: %.2fx over otp_verify, %.2fx over "
+	    "oath_hotp_match\n", (t2 - t1) / (t3 - t2), (t1 - t0) / (t3 - t2));
+	for (i = 0; i < n; ++i)
+		oath_key_destroy(&keys[i]);
+	free(results);
+	free(responses);
+	free(kp);
+	free(keys);
+	exit(0);
+}
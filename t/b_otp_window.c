@@ -0,0 +1,146 @@
+/*-
+ * Copyright (c) 2026 Dag-Erling Smørgrav
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "cryb/impl.h"
+
+#include <err.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <cryb/oath.h>
+#include <cryb/otp.h>
+
+/*
+ * Show how the cost of an HOTP verification depends on where in the
+ * window the response matches, with and without constant-time
+ * matching.  Each verification is timed individually, cycling through
+ * the cases so that noise from the rest of the system is spread evenly
+ * across them.  For a spread of offsets across the window, and for a
+ * response which does not match at all, we report the median and the
+ * 99th percentile, and then the same for a uniform mix of all the
+ * cases, which is what a server under load would see.  Windows larger
+ * than the SIMD lane count make the difference more visible, since
+ * the default matcher then skips entire batches of codes.
+ */
+
+#define B_NCASES	9	/* offsets, plus a miss */
+#define B_COUNTER	1000
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec * 1e9 + ts.tv_nsec);
+}
+
+static int
+cmp(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return (x < y ? -1 : x > y);
+}
+
+static void
+report(const char *name, double *ns, unsigned int n)
+{
+
+	qsort(ns, n, sizeof *ns, cmp);
+	printf("%8s %10.1f %10.1f\n", name, ns[n / 2], ns[n * 99 / 100]);
+}
+
+int
+main(int argc, char *argv[])
+{
+	unsigned long codes[B_NCASES];
+	unsigned int offsets[B_NCASES];
+	char name[16];
+	otp_policy pol;
+	oath_key key;
+	double *ns, t0;
+	unsigned int c, ct, i, n, window;
+
+	n = argc > 1 ? (unsigned int)strtoul(argv[1], NULL, 10) : 20000;
+	window = argc > 2 ? (unsigned int)strtoul(argv[2], NULL, 10) : 9;
+	if (argc > 3 || n == 0 || window < B_NCASES - 1)
+		errx(1, "usage: b_otp_window [count [window]]");
+	if ((ns = calloc(B_NCASES * n, sizeof *ns)) == NULL)
+		err(1, "calloc()");
+	if (oath_key_create(&key, om_hotp, oh_sha1, 6, "cryb.to", "bench",
+	    "12345678901234567890", 20) != 0)
+		errx(1, "oath_key_create()");
+	for (c = 0; c < B_NCASES - 1; ++c) {
+		offsets[c] = c * (window - 1) / (B_NCASES - 2);
+		key.counter = B_COUNTER + offsets[c];
+		codes[c] = otp_calc(&key);
+	}
+	/* a code that does not appear anywhere in the window */
+	for (codes[c] = 0; ; ++codes[c]) {
+		for (i = 0; i < window; ++i) {
+			key.counter = B_COUNTER + i;
+			if (otp_calc(&key) == codes[c])
+				break;
+		}
+		if (i == window)
+			break;
+	}
+	otp_policy_init(&pol);
+	pol.hotp_lookahead = window;
+	printf("# window %u, %u verifications per case\n", window, n);
+	for (ct = 0; ct < 2; ++ct) {
+		pol.flags = ct ? OTP_POLICY_CONSTTIME : 0;
+		for (i = 0; i < n; ++i) {
+			for (c = 0; c < B_NCASES; ++c) {
+				key.counter = B_COUNTER;
+				t0 = now();
+				if (otp_verify_policy(&key, codes[c], &pol) < 0)
+					errx(1, "otp_verify_policy()");
+				ns[c * n + i] = now() - t0;
+			}
+		}
+		printf("%s matching\n", ct ? "constant-time" : "default");
+		printf("%8s %10s %10s\n", "offset", "p50 ns", "p99 ns");
+		for (c = 0; c < B_NCASES; ++c) {
+			if (c < B_NCASES - 1)
+				snprintf(name, sizeof name, "%u", offsets[c]);
+			else
+				snprintf(name, sizeof name, "miss");
+			report(name, ns + c * n, n);
+		}
+		report("mixed", ns, B_NCASES * n);
+		printf("\n");
+	}
+	oath_key_destroy(&key);
+	free(ns);
+	exit(0);
+}
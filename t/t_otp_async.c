@@ -0,0 +1,380 @@
+/*-
+ * Copyright (c) 2026 Dag-Erling Smørgrav
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "cryb/impl.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <cryb/oath.h>
+#include <cryb/otp.h>
+
+#include <cryb/test.h>
+
+#define T_NUSERS	64
+#define T_NTHREADS	4
+#define T_NGROW		2048	/* enough users to make the store grow */
+
+static char t_dir[] = "/tmp/t_otp_async.XXXXXX";
+static char t_path[64];
+
+struct t_result {
+	int		 called;
+	int		 result;
+	int		 error;
+};
+
+static struct t_result t_results[T_NUSERS];
+static unsigned int t_ncalled;
+
+static void
+t_callback(void *arg, int result, int error)
+{
+	struct t_result *res = arg;
+
+	res->called++;
+	res->result = result;
+	res->error = error;
+	__atomic_add_fetch(&t_ncalled, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Create a store with T_NUSERS HOTP keys, and compute the next code
+ * for each of them.
+ */
+static otp_store *
+t_store(unsigned int *codes)
+{
+	char user[32];
+	oath_key key;
+	otp_store *st;
+	unsigned int i;
+
+	unlink(t_path);
+	if ((st = otp_store_open(t_path, O_RDWR|O_CREAT)) == NULL)
+		return (NULL);
+	for (i = 0; i < T_NUSERS; ++i) {
+		snprintf(user, sizeof user, "user%u", i);
+		oath_key_create(&key, om_hotp, oh_sha1, 6, "cryb.to", user,
+		    "12345678901234567890", 20);
+		key.counter = i;
+		if (otp_store_update(st, user, &key) != 0 ||
+		    otp_generate_range(&key, i, 1, &codes[i]) != 0) {
+			otp_store_close(st);
+			return (NULL);
+		}
+	}
+	return (st);
+}
+
+/*
+ * Open a separate handle on the store for each worker.
+ */
+static int
+t_handles(otp_store **sts, unsigned int n)
+{
+	unsigned int i;
+
+	for (i = 0; i < n; ++i) {
+		if ((sts[i] = otp_store_open(t_path, O_RDWR)) == NULL) {
+			while (i > 0)
+				otp_store_close(sts[--i]);
+			return (-1);
+		}
+	}
+	return (0);
+}
+
+static void
+t_close(otp_store **sts, unsigned int n)
+{
+	unsigned int i;
+
+	for (i = 0; i < n; ++i)
+		otp_store_close(sts[i]);
+}
+
+/*
+ * Submit a correct code for even users and a wrong one for odd users,
+ * the way an event loop would.
+ */
+static int
+t_submit(otp_async *as, const unsigned int *codes)
+{
+	char user[32];
+	unsigned int i;
+	int ret;
+
+	memset(t_results, 0, sizeof t_results);
+	t_ncalled = 0;
+	ret = 1;
+	for (i = 0; i < T_NUSERS; ++i) {
+		snprintf(user, sizeof user, "user%u", i);
+		ret &= t_compare_i(0, otp_async_verify(as, user,
+		    (i & 1) ? (codes[i] + 1) % 1000000 : codes[i],
+		    t_callback, &t_results[i]));
+	}
+	return (ret);
+}
+
+static int
+t_check(void)
+{
+	unsigned int i;
+	int ret;
+
+	ret = t_compare_u(T_NUSERS, t_ncalled);
+	for (i = 0; i < T_NUSERS; ++i) {
+		ret &= t_compare_i(1, t_results[i].called);
+		ret &= t_compare_i((i & 1) ? 0 : 1, t_results[i].result);
+	}
+	return (ret);
+}
+
+/*
+ * Callbacks run in our thread when we call otp_async_complete() after
+ * the descriptor becomes readable.
+ */
+static int
+t_otp_async_poll(char **desc, void *arg)
+{
+	unsigned int codes[T_NUSERS];
+	struct pollfd pfd;
+	otp_store *st, *sts[T_NTHREADS];
+	otp_async *as;
+	int n, ret;
+
+	(void)desc;
+	(void)arg;
+	if ((st = t_store(codes)) == NULL)
+		return (0);
+	otp_store_close(st);
+	if (t_handles(sts, T_NTHREADS) != 0)
+		return (0);
+	if ((as = otp_async_create(sts, T_NTHREADS, 0, 0)) == NULL) {
+		t_close(sts, T_NTHREADS);
+		return (0);
+	}
+	ret = t_submit(as, codes);
+	pfd.fd = otp_async_fd(as);
+	pfd.events = POLLIN;
+	while (ret && t_ncalled < T_NUSERS) {
+		if (!t_compare_i(1, poll(&pfd, 1, 10000))) {
+			ret = 0;
+			break;
+		}
+		n = otp_async_complete(as);
+		ret &= n > 0;
+	}
+	ret &= t_check();
+	/* nothing is left */
+	ret &= t_compare_i(0, otp_async_complete(as));
+	otp_async_destroy(as);
+	t_close(sts, T_NTHREADS);
+	return (ret);
+}
+
+/*
+ * Callbacks run on the worker threads, and destroying the verifier
+ * waits for all of them.
+ */
+static int
+t_otp_async_worker(char **desc, void *arg)
+{
+	unsigned int codes[T_NUSERS];
+	otp_store *st, *sts[T_NTHREADS];
+	otp_async *as;
+	int ret;
+
+	(void)desc;
+	(void)arg;
+	if ((st = t_store(codes)) == NULL)
+		return (0);
+	otp_store_close(st);
+	if (t_handles(sts, T_NTHREADS) != 0)
+		return (0);
+	if ((as = otp_async_create(sts, T_NTHREADS, 0,
+	    OTP_ASYNC_WORKER)) == NULL) {
+		t_close(sts, T_NTHREADS);
+		return (0);
+	}
+	ret = t_submit(as, codes);
+	otp_async_destroy(as);
+	ret &= t_check();
+	t_close(sts, T_NTHREADS);
+	return (ret);
+}
+
+/*
+ * Requests beyond the queue limit are refused until earlier ones have
+ * been completed, and so are requests for impossible user names.
+ */
+static int
+t_otp_async_limit(char **desc, void *arg)
+{
+	char user[128];
+	unsigned int codes[T_NUSERS];
+	otp_async *as;
+	otp_store *st;
+	int ret;
+
+	(void)desc;
+	(void)arg;
+	if ((st = t_store(codes)) == NULL)
+		return (0);
+	if ((as = otp_async_create(&st, 1, 1, 0)) == NULL) {
+		otp_store_close(st);
+		return (0);
+	}
+	memset(t_results, 0, sizeof t_results);
+	t_ncalled = 0;
+	ret = t_compare_i(0, otp_async_verify(as, "user0", codes[0],
+	    t_callback, &t_results[0]));
+	ret &= t_compare_i(-1, otp_async_verify(as, "user1", codes[1],
+	    t_callback, &t_results[1]));
+	ret &= t_compare_i(EAGAIN, errno);
+	memset(user, 'x', sizeof user - 1);
+	user[sizeof user - 1] = '\0';
+	ret &= t_compare_i(-1, otp_async_verify(as, user, 0,
+	    t_callback, NULL));
+	ret &= t_compare_i(EINVAL, errno);
+	/* destroying the verifier delivers the outstanding completion */
+	otp_async_destroy(as);
+	ret &= t_compare_u(1, t_ncalled);
+	ret &= t_compare_i(1, t_results[0].result);
+	otp_store_close(st);
+	return (ret);
+}
+
+/*
+ * Workers verify through their own handles while we resynchronize
+ * other users and grow the store, which remaps it, through ours.
+ */
+static int
+t_otp_async_concurrent(char **desc, void *arg)
+{
+	char user[32];
+	unsigned int codes[T_NUSERS];
+	unsigned long resp[2];
+	unsigned int i, more[2];
+	otp_store *st, *sts[T_NTHREADS];
+	oath_key key;
+	otp_async *as;
+	int ret;
+
+	(void)desc;
+	(void)arg;
+	if ((st = t_store(codes)) == NULL)
+		return (0);
+	if (t_handles(sts, T_NTHREADS) != 0) {
+		otp_store_close(st);
+		return (0);
+	}
+	if ((as = otp_async_create(sts, T_NTHREADS, 0,
+	    OTP_ASYNC_WORKER)) == NULL) {
+		t_close(sts, T_NTHREADS);
+		otp_store_close(st);
+		return (0);
+	}
+	memset(t_results, 0, sizeof t_results);
+	t_ncalled = 0;
+	ret = 1;
+	for (i = 0; i < T_NUSERS; i += 2) {
+		snprintf(user, sizeof user, "user%u", i);
+		ret &= t_compare_i(0, otp_async_verify(as, user, codes[i],
+		    t_callback, &t_results[i]));
+	}
+	for (i = 1; i < T_NUSERS; i += 2) {
+		snprintf(user, sizeof user, "user%u", i);
+		ret &= t_compare_i(0, otp_store_lookup(st, user, &key));
+		ret &= t_compare_i(0,
+		    otp_generate_range(&key, i + 20, 2, more));
+		resp[0] = more[0];
+		resp[1] = more[1];
+		ret &= t_compare_i(21, otp_store_resync(st, user, resp, 2));
+	}
+	for (i = T_NUSERS; i < T_NGROW; ++i) {
+		snprintf(user, sizeof user, "user%u", i);
+		oath_key_create(&key, om_hotp, oh_sha1, 6, "cryb.to", user,
+		    "12345678901234567890", 20);
+		ret &= t_compare_i(0, otp_store_update(st, user, &key));
+	}
+	otp_async_destroy(as);
+	ret &= t_compare_u(T_NUSERS / 2, t_ncalled);
+	for (i = 0; i < T_NUSERS; ++i) {
+		snprintf(user, sizeof user, "user%u", i);
+		ret &= t_compare_i(0, otp_store_lookup(st, user, &key));
+		if (i & 1) {
+			ret &= t_compare_u64(i + 22, key.counter);
+		} else {
+			ret &= t_compare_i(1, t_results[i].result);
+			ret &= t_compare_u64(i + 1, key.counter);
+		}
+	}
+	t_close(sts, T_NTHREADS);
+	otp_store_close(st);
+	return (ret);
+}
+
+static int
+t_prepare(int argc, char *argv[])
+{
+
+	(void)argc;
+	(void)argv;
+	if (mkdtemp(t_dir) == NULL)
+		return (-1);
+	snprintf(t_path, sizeof t_path, "%s/store", t_dir);
+	t_add_test(t_otp_async_poll, NULL, "poll");
+	t_add_test(t_otp_async_worker, NULL, "worker");
+	t_add_test(t_otp_async_limit, NULL, "limit");
+	t_add_test(t_otp_async_concurrent, NULL, "concurrent");
+	return (0);
+}
+
+static void
+t_cleanup(void)
+{
+
+	unlink(t_path);
+	rmdir(t_dir);
+}
+
+int
+main(int argc, char *argv[])
+{
+
+	t_main(t_prepare, t_cleanup, argc, argv);
+}
@@ -0,0 +1,193 @@
+/*-
+ * Copyright (c) 2026 Dag-Erling Smørgrav
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "cryb/impl.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <cryb/oath.h>
+#include <cryb/otp.h>
+
+#include <cryb/test.h>
+
+static char t_dir[] = "/tmp/t_otp_auth.XXXXXX";
+static char t_path[4][64];
+static otp_secret *t_secret, *t_other;
+
+static const char t_msg[] = "the quick brown fox";
+
+/*
+ * Set up both ends of a session.
+ */
+static int
+t_session(const otp_secret *is, const otp_secret *as, otp_auth **ini,
+    otp_auth **acc)
+{
+	uint8_t anonce[OTP_AUTH_NONCELEN], inonce[OTP_AUTH_NONCELEN];
+
+	*ini = *acc = NULL;
+	if (otp_auth_nonce(anonce) != 0 || otp_auth_nonce(inonce) != 0 ||
+	    (*ini = otp_auth_create(is, anonce, inonce,
+		OTP_AUTH_INITIATOR)) == NULL ||
+	    (*acc = otp_auth_create(as, anonce, inonce,
+		OTP_AUTH_ACCEPTOR)) == NULL) {
+		otp_auth_destroy(*ini);
+		return (-1);
+	}
+	return (0);
+}
+
+/*
+ * Secrets which are too short are refused, and a trailing newline is
+ * not part of the secret.
+ */
+static int
+t_load(char **desc, void *arg)
+{
+	otp_secret *secret;
+	otp_auth *ini, *acc;
+	uint8_t tag[OTP_AUTH_TAGLEN];
+	int ret;
+
+	(void)desc;
+	(void)arg;
+	secret = otp_secret_load(t_path[2]);
+	ret = t_compare_i(EINVAL, secret == NULL ? errno : 0);
+	otp_secret_free(secret);
+	if ((secret = otp_secret_load(t_path[1])) == NULL)
+		return (0);
+	if (t_session(t_secret, secret, &ini, &acc) != 0) {
+		otp_secret_free(secret);
+		return (0);
+	}
+	otp_auth_sign(ini, t_msg, sizeof t_msg, tag);
+	ret &= t_compare_i(0, otp_auth_check(acc, t_msg, sizeof t_msg, tag));
+	otp_auth_destroy(acc);
+	otp_auth_destroy(ini);
+	otp_secret_free(secret);
+	return (ret);
+}
+
+/*
+ * Messages pass in both directions, but are not accepted if altered,
+ * replayed, reflected back to their sender, or signed with another
+ * secret.
+ */
+static int
+t_sign(char **desc, void *arg)
+{
+	otp_auth *ini, *acc;
+	uint8_t msg[sizeof t_msg], tag[OTP_AUTH_TAGLEN];
+	int ret;
+
+	(void)desc;
+	(void)arg;
+	if (t_session(t_secret, t_secret, &ini, &acc) != 0)
+		return (0);
+	memcpy(msg, t_msg, sizeof msg);
+	otp_auth_sign(ini, msg, sizeof msg, tag);
+	ret = t_compare_i(0, otp_auth_check(acc, msg, sizeof msg, tag));
+	ret &= t_compare_i(-1, otp_auth_check(acc, msg, sizeof msg, tag));
+	ret &= t_compare_i(EBADMSG, errno);
+	otp_auth_sign(acc, msg, sizeof msg, tag);
+	ret &= t_compare_i(-1, otp_auth_check(acc, msg, sizeof msg, tag));
+	ret &= t_compare_i(0, otp_auth_check(ini, msg, sizeof msg, tag));
+	otp_auth_sign(ini, msg, sizeof msg, tag);
+	msg[0] ^= 1;
+	ret &= t_compare_i(-1, otp_auth_check(acc, msg, sizeof msg, tag));
+	msg[0] ^= 1;
+	ret &= t_compare_i(0, otp_auth_check(acc, msg, sizeof msg, tag));
+	otp_auth_destroy(acc);
+	otp_auth_destroy(ini);
+	if (t_session(t_secret, t_other, &ini, &acc) != 0)
+		return (0);
+	otp_auth_sign(ini, msg, sizeof msg, tag);
+	ret &= t_compare_i(-1, otp_auth_check(acc, msg, sizeof msg, tag));
+	otp_auth_destroy(acc);
+	otp_auth_destroy(ini);
+	return (ret);
+}
+
+static int
+t_write(const char *path, const char *str)
+{
+	FILE *f;
+
+	if ((f = fopen(path, "w")) == NULL)
+		return (-1);
+	fputs(str, f);
+	return (fclose(f));
+}
+
+static int
+t_prepare(int argc, char *argv[])
+{
+	unsigned int i;
+
+	(void)argc;
+	(void)argv;
+	if (mkdtemp(t_dir) == NULL)
+		return (-1);
+	for (i = 0; i < 4; ++i)
+		snprintf(t_path[i], sizeof t_path[i], "%s/secret%u", t_dir, i);
+	if (t_write(t_path[0], "0123456789abcdef") != 0 ||
+	    t_write(t_path[1], "0123456789abcdef\n") != 0 ||
+	    t_write(t_path[2], "0123456789abcde\n") != 0 ||
+	    t_write(t_path[3], "fedcba9876543210") != 0 ||
+	    (t_secret = otp_secret_load(t_path[0])) == NULL ||
+	    (t_other = otp_secret_load(t_path[3])) == NULL)
+		return (-1);
+	t_add_test(t_load, NULL, "load");
+	t_add_test(t_sign, NULL, "sign");
+	return (0);
+}
+
+static void
+t_cleanup(void)
+{
+	unsigned int i;
+
+	otp_secret_free(t_secret);
+	otp_secret_free(t_other);
+	for (i = 0; i < 4; ++i)
+		unlink(t_path[i]);
+	rmdir(t_dir);
+}
+
+int
+main(int argc, char *argv[])
+{
+
+	t_main(t_prepare, t_cleanup, argc, argv);
+}
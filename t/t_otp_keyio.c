@@ -0,0 +1,199 @@
+/*-
+ * Copyright (c) 2026 Dag-Erling Smørgrav
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "cryb/impl.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <cryb/oath.h>
+#include <cryb/otp.h>
+
+#include <cryb/test.h>
+
+#define T_NKEYS		24
+#define T_DEPTH		4	/* force several rounds per batch */
+
+static char t_dir[] = "/tmp/t_otp_keyio.XXXXXX";
+static char t_paths[T_NKEYS + 1][64];
+static const char *t_pathv[T_NKEYS + 1];
+
+/*
+ * Write a binary key file for each key, with the counter or last used
+ * time step set to its index.  The extra path does not exist.
+ */
+static int
+t_keys(void)
+{
+	char buf[1024];
+	oath_key key;
+	unsigned int i;
+	size_t len;
+	int fd, ret;
+
+	for (i = 0; i < T_NKEYS; ++i) {
+		oath_key_create(&key, (i & 1) ? om_totp : om_hotp, oh_sha1, 6,
+		    "cryb.to", t_paths[i] + strlen(t_dir) + 1,
+		    "12345678901234567890", 20);
+		key.counter = key.lastused = i;
+		len = sizeof buf;
+		if (otp_key_to_binary(&key, buf, &len) != 0)
+			return (0);
+		if ((fd = open(t_paths[i], O_RDWR|O_CREAT|O_TRUNC, 0600)) < 0)
+			return (0);
+		ret = write(fd, buf, len) == (ssize_t)len;
+		close(fd);
+		if (!ret)
+			return (0);
+	}
+	return (1);
+}
+
+/*
+ * Load everything, advance everything, and load it again.
+ */
+static int
+t_otp_keyio_roundtrip(otp_keyio *kio)
+{
+	oath_key keys[T_NKEYS + 1];
+	int results[T_NKEYS + 1];
+	unsigned int i;
+	int ret;
+
+	t_printv("backend %s\n", otp_keyio_backend(kio));
+	ret = t_compare_i(T_NKEYS, otp_keyio_load(kio, t_pathv, keys,
+	    results, T_NKEYS + 1));
+	for (i = 0; i < T_NKEYS; ++i) {
+		ret &= t_compare_i(OTP_KEYFMT_BINARY, results[i]);
+		ret &= t_compare_u64(i, (i & 1) ? keys[i].lastused :
+		    keys[i].counter);
+		keys[i].counter += 100;
+		keys[i].lastused += 100;
+	}
+	ret &= t_compare_i(-1, results[T_NKEYS]);
+	ret &= t_compare_i(ENOENT, errno);
+	if (!ret)
+		return (0);
+	ret &= t_compare_i(T_NKEYS, otp_keyio_update(kio, t_pathv, keys,
+	    results, T_NKEYS));
+	for (i = 0; i < T_NKEYS; ++i)
+		ret &= t_compare_i(0, results[i]);
+	ret &= t_compare_i(T_NKEYS, otp_keyio_load(kio, t_pathv, keys,
+	    results, T_NKEYS));
+	for (i = 0; i < T_NKEYS; ++i)
+		ret &= t_compare_u64(i + 100, (i & 1) ? keys[i].lastused :
+		    keys[i].counter);
+	return (ret);
+}
+
+static int
+t_otp_keyio_cold(char **desc, void *arg)
+{
+	otp_keyio *kio;
+	int ret;
+
+	(void)desc;
+	if (!t_keys() ||
+	    (kio = otp_keyio_create(T_DEPTH, 0, *(int *)arg)) == NULL)
+		return (0);
+	ret = t_otp_keyio_roundtrip(kio);
+	otp_keyio_destroy(kio);
+	return (ret);
+}
+
+/*
+ * Same, with every other key file registered.
+ */
+static int
+t_otp_keyio_hot(char **desc, void *arg)
+{
+	otp_keyio *kio;
+	unsigned int i;
+	int ret;
+
+	(void)desc;
+	if (!t_keys() ||
+	    (kio = otp_keyio_create(T_DEPTH, T_NKEYS / 2, *(int *)arg)) == NULL)
+		return (0);
+	ret = 1;
+	for (i = 0; i < T_NKEYS; i += 2)
+		ret &= t_compare_i(0, otp_keyio_register(kio, t_paths[i]));
+	/* registering twice is harmless, but there is no more room */
+	ret &= t_compare_i(0, otp_keyio_register(kio, t_paths[0]));
+	ret &= t_compare_i(-1, otp_keyio_register(kio, t_paths[1]));
+	ret &= t_compare_i(ENOSPC, errno);
+	ret &= t_otp_keyio_roundtrip(kio);
+	otp_keyio_destroy(kio);
+	return (ret);
+}
+
+static int t_uring = 0;
+static int t_posix = OTP_KEYIO_POSIX;
+
+static int
+t_prepare(int argc, char *argv[])
+{
+	unsigned int i;
+
+	(void)argc;
+	(void)argv;
+	if (mkdtemp(t_dir) == NULL)
+		return (-1);
+	for (i = 0; i <= T_NKEYS; ++i) {
+		snprintf(t_paths[i], sizeof t_paths[i], "%s/user%u", t_dir, i);
+		t_pathv[i] = t_paths[i];
+	}
+	t_add_test(t_otp_keyio_cold, &t_uring, "cold (default)");
+	t_add_test(t_otp_keyio_hot, &t_uring, "hot (default)");
+	t_add_test(t_otp_keyio_cold, &t_posix, "cold (posix)");
+	t_add_test(t_otp_keyio_hot, &t_posix, "hot (posix)");
+	return (0);
+}
+
+static void
+t_cleanup(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < T_NKEYS; ++i)
+		unlink(t_paths[i]);
+	rmdir(t_dir);
+}
+
+int
+main(int argc, char *argv[])
+{
+
+	t_main(t_prepare, t_cleanup, argc, argv);
+}
@@ -0,0 +1,461 @@
+/*-
+ * Copyright (c) 2026 Dag-Erling Smørgrav
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "cryb/impl.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <cryb/endian.h>
+#include <cryb/oath.h>
+#include <cryb/otp.h>
+
+#include <cryb/test.h>
+
+/*
+ * These tests run three replicating nodes in the same process, each
+ * with its own key store in a temporary directory and a replication
+ * listener on a loopback port.  Every node has every other node as a
+ * peer, and they all share a secret.  Every user has the RFC 4226 test
+ * key, for which the first few codes are known.
+ */
+
+#define T_NNODES	3
+#define T_NUSERS	4
+#define T_WAIT		100	/* polls, 100 ms apart */
+
+/* the replication protocol, for tests which pose as a peer */
+#define T_MAGIC		0x4f545052
+#define T_VERSION	2
+#define T_TIMEOUT	5	/* s before a quiet connection is closed */
+
+static const unsigned long t_codes[] = {
+	755224, 287082, 359152, 969429, 338314,
+};
+
+static char t_dir[] = "/tmp/t_otp_repl.XXXXXX";
+static char t_store[T_NNODES][64], t_addr[T_NNODES][32];
+static char t_secretpath[64], t_otherpath[64];
+static otp_secret *t_secret, *t_other;
+static otp_repl *t_repl[T_NNODES];
+static otp_store *t_st[T_NNODES];
+
+static void
+t_user(char *buf, size_t size, unsigned int i)
+{
+
+	snprintf(buf, size, "user%u", i);
+}
+
+/*
+ * Start a node: its replicator, and a store handle which publishes
+ * advances through it.
+ */
+static int
+t_node_start(unsigned int n)
+{
+	const char *peers[T_NNODES - 1];
+	unsigned int i, j;
+
+	for (i = j = 0; i < T_NNODES; ++i)
+		if (i != n)
+			peers[j++] = t_addr[i];
+	if ((t_repl[n] = otp_repl_create(t_store[n], t_secret, t_addr[n],
+	    peers, j)) == NULL ||
+	    (t_st[n] = otp_store_open(t_store[n], O_RDWR)) == NULL ||
+	    otp_store_set_repl(t_st[n], t_repl[n]) != 0 ||
+	    otp_repl_start(t_repl[n]) != 0)
+		return (-1);
+	return (0);
+}
+
+static void
+t_node_stop(unsigned int n)
+{
+
+	otp_store_close(t_st[n]);
+	t_st[n] = NULL;
+	otp_repl_destroy(t_repl[n]);
+	t_repl[n] = NULL;
+}
+
+/*
+ * Return a user's counter on a node, or UINT64_MAX on error.
+ */
+static uint64_t
+t_counter(unsigned int n, const char *user)
+{
+	otp_store *st;
+	oath_key key;
+	uint64_t counter;
+
+	if ((st = otp_store_open(t_store[n], O_RDONLY)) == NULL)
+		return (UINT64_MAX);
+	counter = UINT64_MAX;
+	if (otp_store_lookup(st, user, &key) == 0) {
+		counter = key.counter;
+		oath_key_destroy(&key);
+	}
+	otp_store_close(st);
+	return (counter);
+}
+
+/*
+ * Wait for a user's counter to reach the expected value on every node.
+ */
+static int
+t_converge(const char *user, uint64_t counter)
+{
+	unsigned int i, n;
+
+	for (i = 0; i < T_WAIT; ++i) {
+		for (n = 0; n < T_NNODES; ++n)
+			if (t_counter(n, user) != counter)
+				break;
+		if (n == T_NNODES) {
+			t_printv("%s converged after %u ms\n", user, i * 100);
+			return (1);
+		}
+		usleep(100000);
+	}
+	for (n = 0; n < T_NNODES; ++n)
+		t_compare_u64(counter, t_counter(n, user));
+	return (0);
+}
+
+/*
+ * An advance on one node reaches the others, after which the code it
+ * consumed is rejected everywhere.
+ */
+static int
+t_replicate(char **desc, void *arg)
+{
+	int ret;
+
+	(void)desc;
+	(void)arg;
+	ret = t_compare_i(1, otp_store_verify(t_st[0], "user0",
+	    t_codes[0]));
+	ret &= t_converge("user0", 1);
+	ret &= t_compare_i(0, otp_store_verify(t_st[1], "user0",
+	    t_codes[0]));
+	ret &= t_compare_i(0, otp_store_verify(t_st[2], "user0",
+	    t_codes[0]));
+	ret &= t_compare_i(1, otp_store_verify(t_st[1], "user0",
+	    t_codes[1]));
+	ret &= t_converge("user0", 2);
+	return (ret);
+}
+
+/*
+ * Concurrent advances on different nodes converge on the highest
+ * counter, regardless of the order in which they arrive.
+ */
+static int
+t_maxmerge(char **desc, void *arg)
+{
+	int ret;
+
+	(void)desc;
+	(void)arg;
+	ret = t_compare_i(4, otp_store_verify(t_st[0], "user1",
+	    t_codes[3]));
+	ret &= t_compare_i(2, otp_store_verify(t_st[2], "user1",
+	    t_codes[1]));
+	ret &= t_converge("user1", 4);
+	usleep(200000);
+	ret &= t_converge("user1", 4);
+	return (ret);
+}
+
+/*
+ * A node which was down catches up with the advances it missed when
+ * it comes back.
+ */
+static int
+t_catchup(char **desc, void *arg)
+{
+	int ret;
+
+	(void)desc;
+	(void)arg;
+	t_node_stop(2);
+	ret = t_compare_i(1, otp_store_verify(t_st[0], "user2",
+	    t_codes[0]));
+	ret &= t_compare_i(3, otp_store_verify(t_st[1], "user3",
+	    t_codes[2]));
+	usleep(200000);
+	ret &= t_compare_u64(0, t_counter(2, "user2"));
+	ret &= t_compare_u64(0, t_counter(2, "user3"));
+	if (t_node_start(2) != 0)
+		return (0);
+	ret &= t_converge("user2", 1);
+	ret &= t_converge("user3", 3);
+	ret &= t_converge("user0", 2);
+	return (ret);
+}
+
+/*
+ * Connect to a node's replication listener and receive its nonce.
+ */
+static int
+t_dial(unsigned int n, uint8_t *nonce)
+{
+	struct sockaddr_in sin;
+	struct timeval tv;
+	int fd;
+
+	memset(&sin, 0, sizeof sin);
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(atoi(strrchr(t_addr[n], ':') + 1));
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	tv.tv_sec = 2 * T_TIMEOUT;
+	tv.tv_usec = 0;
+	if ((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+		return (-1);
+	if (setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof tv) != 0 ||
+	    connect(fd, (struct sockaddr *)&sin, sizeof sin) != 0 ||
+	    recv(fd, nonce, OTP_AUTH_NONCELEN, MSG_WAITALL) !=
+	    OTP_AUTH_NONCELEN) {
+		close(fd);
+		return (-1);
+	}
+	return (fd);
+}
+
+/*
+ * Pose as a peer of a node, authenticating with the given secret.
+ */
+static int
+t_peer(unsigned int n, const otp_secret *secret, otp_auth **auth)
+{
+	uint8_t buf[OTP_AUTH_NONCELEN + 8 + OTP_AUTH_TAGLEN];
+	uint8_t nonce[OTP_AUTH_NONCELEN];
+	int fd;
+
+	if ((fd = t_dial(n, nonce)) < 0)
+		return (-1);
+	if (otp_auth_nonce(buf) != 0 ||
+	    (*auth = otp_auth_create(secret, nonce, buf,
+		OTP_AUTH_INITIATOR)) == NULL) {
+		close(fd);
+		return (-1);
+	}
+	be32enc(buf + OTP_AUTH_NONCELEN, T_MAGIC);
+	be32enc(buf + OTP_AUTH_NONCELEN + 4, T_VERSION);
+	otp_auth_sign(*auth, buf + OTP_AUTH_NONCELEN, 8,
+	    buf + OTP_AUTH_NONCELEN + 8);
+	if (send(fd, buf, sizeof buf, 0) != sizeof buf) {
+		otp_auth_destroy(*auth);
+		close(fd);
+		return (-1);
+	}
+	return (fd);
+}
+
+/*
+ * Send a frame with a single HOTP record.
+ */
+static int
+t_advance(int fd, otp_auth *auth, const char *user, uint64_t value)
+{
+	uint8_t buf[4 + 10 + 16 + OTP_AUTH_TAGLEN];
+	size_t len, userlen;
+
+	if ((userlen = strlen(user)) > 16)
+		return (-1);
+	len = 10 + userlen;
+	be32enc(buf, len);
+	buf[4] = om_hotp;
+	buf[5] = userlen;
+	be64enc(buf + 6, value);
+	memcpy(buf + 14, user, userlen);
+	otp_auth_sign(auth, buf, 4 + len, buf + 4 + len);
+	len += 4 + OTP_AUTH_TAGLEN;
+	return (send(fd, buf, len, 0) == (ssize_t)len ? 0 : -1);
+}
+
+/*
+ * Advances from a stranger are not merged, and neither is an advance
+ * from a peer which is further ahead than a peer could be.
+ */
+static int
+t_forged(char **desc, void *arg)
+{
+	otp_auth *auth;
+	uint8_t b;
+	unsigned int i;
+	int fd, ret;
+
+	(void)desc;
+	(void)arg;
+	if ((fd = t_peer(0, t_other, &auth)) < 0)
+		return (0);
+	ret = t_compare_i(0, t_advance(fd, auth, "user2", 3));
+	ret &= t_compare_i(0, recv(fd, &b, 1, 0));
+	otp_auth_destroy(auth);
+	close(fd);
+	ret &= t_compare_u64(1, t_counter(0, "user2"));
+	if ((fd = t_peer(0, t_secret, &auth)) < 0)
+		return (0);
+	ret &= t_compare_i(0, t_advance(fd, auth, "user2", UINT64_MAX));
+	ret &= t_compare_i(0, t_advance(fd, auth, "user2", 5));
+	for (i = 0; i < T_WAIT && t_counter(0, "user2") == 1; ++i)
+		usleep(100000);
+	ret &= t_compare_u64(5, t_counter(0, "user2"));
+	otp_auth_destroy(auth);
+	close(fd);
+	return (ret);
+}
+
+/*
+ * A connection which never completes the handshake is closed.
+ */
+static int
+t_idle(char **desc, void *arg)
+{
+	uint8_t nonce[OTP_AUTH_NONCELEN];
+	int fd, ret;
+
+	(void)desc;
+	(void)arg;
+	if ((fd = t_dial(1, nonce)) < 0)
+		return (0);
+	ret = t_compare_i(0, recv(fd, nonce, 1, 0));
+	close(fd);
+	return (ret);
+}
+
+static int
+t_write(const char *path, const char *str)
+{
+	FILE *f;
+
+	if ((f = fopen(path, "w")) == NULL)
+		return (-1);
+	fputs(str, f);
+	return (fclose(f));
+}
+
+static int
+t_start(void)
+{
+	char user[16];
+	otp_store *st;
+	oath_key key;
+	unsigned int i, n;
+	int ret;
+
+	if (mkdtemp(t_dir) == NULL)
+		return (-1);
+	snprintf(t_secretpath, sizeof t_secretpath, "%s/secret", t_dir);
+	snprintf(t_otherpath, sizeof t_otherpath, "%s/other", t_dir);
+	if (t_write(t_secretpath, "0123456789abcdef\n") != 0 ||
+	    t_write(t_otherpath, "fedcba9876543210\n") != 0 ||
+	    (t_secret = otp_secret_load(t_secretpath)) == NULL ||
+	    (t_other = otp_secret_load(t_otherpath)) == NULL)
+		return (-1);
+	oath_key_create(&key, om_hotp, oh_sha1, 6, "cryb.to", "user",
+	    "12345678901234567890", 20);
+	for (n = 0, ret = 0; ret == 0 && n < T_NNODES; ++n) {
+		snprintf(t_store[n], sizeof t_store[n], "%s/store%u",
+		    t_dir, n);
+		snprintf(t_addr[n], sizeof t_addr[n], "127.0.0.1:%u",
+		    20000 + ((unsigned int)getpid() * T_NNODES + n) % 20000);
+		if ((st = otp_store_open(t_store[n], O_RDWR|O_CREAT)) == NULL)
+			ret = -1;
+		for (i = 0; ret == 0 && i < T_NUSERS; ++i) {
+			t_user(user, sizeof user, i);
+			ret = otp_store_update(st, user, &key);
+		}
+		otp_store_close(st);
+	}
+	oath_key_destroy(&key);
+	for (n = 0; ret == 0 && n < T_NNODES; ++n)
+		ret = t_node_start(n);
+	return (ret);
+}
+
+static void t_cleanup(void);
+
+static int
+t_prepare(int argc, char *argv[])
+{
+
+	(void)argc;
+	(void)argv;
+	if (t_start() != 0) {
+		t_cleanup();
+		return (-1);
+	}
+	t_add_test(t_replicate, NULL, "replicate");
+	t_add_test(t_maxmerge, NULL, "max-merge");
+	t_add_test(t_catchup, NULL, "catch-up");
+	t_add_test(t_forged, NULL, "forged");
+	t_add_test(t_idle, NULL, "idle");
+	return (0);
+}
+
+static void
+t_cleanup(void)
+{
+	unsigned int n;
+
+	for (n = 0; n < T_NNODES; ++n) {
+		t_node_stop(n);
+		if (t_store[n][0] != '\0')
+			unlink(t_store[n]);
+	}
+	otp_secret_free(t_secret);
+	otp_secret_free(t_other);
+	if (t_secretpath[0] != '\0')
+		unlink(t_secretpath);
+	if (t_otherpath[0] != '\0')
+		unlink(t_otherpath);
+	rmdir(t_dir);
+}
+
+int
+main(int argc, char *argv[])
+{
+
+	t_main(t_prepare, t_cleanup, argc, argv);
+}
@@ -0,0 +1,227 @@
+/*-
+ * Copyright (c) 2026 Dag-Erling Smørgrav
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "cryb/impl.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <cryb/oath.h>
+#include <cryb/otp.h>
+
+#include <cryb/test.h>
+
+#define T_THREADS	8
+
+static char t_dir[] = "/tmp/t_otp_replay.XXXXXX";
+static char t_path[64];
+static char t_walpath[64];
+
+static oath_key t_totp, t_hotp;
+
+static unsigned int
+t_current(void)
+{
+	unsigned int code;
+
+	otp_generate_range(&t_totp, (uint64_t)time(NULL) / t_totp.timestep,
+	    1, &code);
+	return (code);
+}
+
+/*
+ * Verify the current code against two copies of the same key, as if
+ * the first success had never been saved, and check that the second
+ * attempt is rejected.  Then check that HOTP keys are unaffected.
+ */
+static int
+t_otp_replay_basic(char **desc, void *arg)
+{
+	otp_replay *rc;
+	oath_key key;
+	unsigned int code;
+	int ret;
+
+	(void)desc;
+	(void)arg;
+	if ((rc = otp_replay_create(0)) == NULL)
+		return (0);
+	code = t_current();
+	key = t_totp;
+	ret = t_compare_i(1,
+	    otp_verify_replay(&key, code, NULL, rc, "alice") > 0);
+	ret &= t_compare_i(1, key.lastused > 0);
+	key = t_totp;
+	ret &= t_compare_i(0, otp_verify_replay(&key, code, NULL, rc, "alice"));
+	ret &= t_compare_u64(0, key.lastused);
+	key = t_totp;
+	ret &= t_compare_i(1,
+	    otp_verify_replay(&key, code, NULL, rc, "bob") > 0);
+	key = t_hotp;
+	ret &= t_compare_i(1,
+	    otp_verify_replay(&key, 755224, NULL, rc, "carol"));
+	ret &= t_compare_u64(1, key.counter);
+	otp_replay_destroy(rc);
+	return (ret);
+}
+
+struct t_race {
+	otp_replay	*rc;
+	unsigned int	 code;
+	int		 accepted;
+};
+
+static void *
+t_otp_replay_racer(void *arg)
+{
+	struct t_race *tr = arg;
+	oath_key key;
+
+	key = t_totp;
+	if (otp_verify_replay(&key, tr->code, NULL, tr->rc, "alice") > 0)
+		__atomic_fetch_add(&tr->accepted, 1, __ATOMIC_RELAXED);
+	return (NULL);
+}
+
+/*
+ * Have several threads try the same code at once, each with its own
+ * copy of the key, and check that exactly one of them succeeds.
+ */
+static int
+t_otp_replay_race(char **desc, void *arg)
+{
+	pthread_t thr[T_THREADS];
+	struct t_race tr;
+	unsigned int i;
+
+	(void)desc;
+	(void)arg;
+	if ((tr.rc = otp_replay_create(0)) == NULL)
+		return (0);
+	tr.code = t_current();
+	tr.accepted = 0;
+	for (i = 0; i < T_THREADS; ++i)
+		pthread_create(&thr[i], NULL, t_otp_replay_racer, &tr);
+	for (i = 0; i < T_THREADS; ++i)
+		pthread_join(thr[i], NULL);
+	otp_replay_destroy(tr.rc);
+	return (t_compare_i(1, tr.accepted));
+}
+
+/*
+ * Attach a replay cache and a write-ahead log to a key store, and
+ * check that TOTP successes bypass the log while HOTP successes do
+ * not.
+ */
+static int
+t_otp_replay_store(char **desc, void *arg)
+{
+	struct stat sb;
+	otp_replay *rc;
+	otp_store *st;
+	otp_wal *wal;
+	unsigned int code;
+	int ret;
+
+	(void)desc;
+	(void)arg;
+	unlink(t_walpath);
+	unlink(t_path);
+	if ((rc = otp_replay_create(0)) == NULL)
+		return (0);
+	if ((st = otp_store_open(t_path, O_RDWR|O_CREAT)) == NULL ||
+	    (wal = otp_wal_open(t_walpath, t_path)) == NULL) {
+		otp_store_close(st);
+		otp_replay_destroy(rc);
+		return (0);
+	}
+	ret = t_compare_i(0, otp_store_update(st, "alice", &t_totp));
+	ret &= t_compare_i(0, otp_store_update(st, "bob", &t_hotp));
+	ret &= t_compare_i(0, otp_store_set_wal(st, wal));
+	ret &= t_compare_i(0, otp_store_set_replay(st, rc));
+	code = t_current();
+	ret &= t_compare_i(1, otp_store_verify(st, "alice", code) > 0);
+	ret &= t_compare_i(0, otp_store_verify(st, "alice", code));
+	ret &= t_compare_i(0, stat(t_walpath, &sb));
+	ret &= t_compare_i(0, sb.st_size);
+	ret &= t_compare_i(1, otp_store_verify(st, "bob", 755224));
+	ret &= t_compare_i(0, stat(t_walpath, &sb));
+	ret &= t_compare_i(1, sb.st_size > 0);
+	otp_store_close(st);
+	otp_wal_close(wal);
+	otp_replay_destroy(rc);
+	return (ret);
+}
+
+static int
+t_prepare(int argc, char *argv[])
+{
+
+	(void)argc;
+	(void)argv;
+	if (mkdtemp(t_dir) == NULL)
+		return (-1);
+	snprintf(t_path, sizeof t_path, "%s/store", t_dir);
+	snprintf(t_walpath, sizeof t_walpath, "%s/wal", t_dir);
+	oath_key_create(&t_totp, om_totp, oh_sha1, 6, "cryb.to", "alice",
+	    "12345678901234567890", 20);
+	oath_key_create(&t_hotp, om_hotp, oh_sha1, 6, "cryb.to", "bob",
+	    "12345678901234567890", 20);
+	t_add_test(t_otp_replay_basic, NULL, "basic");
+	t_add_test(t_otp_replay_race, NULL, "race");
+	t_add_test(t_otp_replay_store, NULL, "store");
+	return (0);
+}
+
+static void
+t_cleanup(void)
+{
+
+	otp_key_destroy(&t_totp);
+	otp_key_destroy(&t_hotp);
+	unlink(t_walpath);
+	unlink(t_path);
+	rmdir(t_dir);
+}
+
+int
+main(int argc, char *argv[])
+{
+
+	t_main(t_prepare, t_cleanup, argc, argv);
+}
@@ -0,0 +1,289 @@
+/*-
+ * Copyright (c) 2026 Dag-Erling Smørgrav
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "cryb/impl.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#include <cryb/oath.h>
+#include <cryb/otp.h>
+
+#include <cryb/test.h>
+
+static const char t_keydata[] = "12345678901234567890";
+
+#define T_START		1000
+
+static void
+t_key(oath_key *key)
+{
+
+	oath_key_create(key, om_hotp, oh_sha1, 6, "", "user",
+	    t_keydata, sizeof t_keydata - 1);
+	key->counter = T_START;
+}
+
+static unsigned long
+t_code(uint64_t counter)
+{
+
+	return (oath_hotp((const uint8_t *)t_keydata, sizeof t_keydata - 1,
+	    counter, 6));
+}
+
+/*
+ * Both otp_resync() and otp_resync_deep() require the codes to be
+ * consecutive, and leave the counter untouched on failure, so they
+ * should give the same result in every case.
+ */
+struct t_case {
+	const char	*desc;
+	unsigned int	 n;		/* number of codes */
+	unsigned int	 offset[3];	/* counter offsets of the codes */
+	int		 result;	/* expected return value */
+};
+
+static struct t_case t_cases[] = {
+	/* next codes */
+	{ "1 code, offset 0",		1, { 0 },		1 },
+	{ "2 codes, offset 0",		2, { 0, 1 },		1 },
+	{ "3 codes, offset 0",		3, { 0, 1, 2 },		1 },
+	/* somewhere in the window */
+	{ "2 codes, offset 37",		2, { 37, 38 },		38 },
+	{ "3 codes, offset 512",	3, { 512, 513, 514 },	513 },
+	/* last counter in the window */
+	{ "1 code, end of window",	1, { 9 },		10 },
+	{ "2 codes, end of window",	2, { 98, 99 },		99 },
+	{ "3 codes, end of window",	3, { 997, 998, 999 },	998 },
+	/* one past the end of the window */
+	{ "1 code, past window",	1, { 10 },		0 },
+	{ "2 codes, past window",	2, { 99, 100 },		0 },
+	{ "3 codes, past window",	3, { 998, 999, 1000 },	0 },
+	/* not consecutive, or in the wrong order */
+	{ "2 codes, gap",		2, { 10, 12 },		0 },
+	{ "3 codes, gap",		3, { 10, 11, 13 },	0 },
+	{ "2 codes, reversed",		2, { 11, 10 },		0 },
+	{ "2 codes, repeated",		2, { 10, 10 },		0 },
+	/* already used */
+	{ "2 codes, in the past",	2, { -2U, -1U },	0 },
+};
+
+static int
+t_otp_resync(char **desc, void *arg)
+{
+	struct t_case *tc = arg;
+	unsigned long response[3];
+	oath_key key;
+	unsigned int i;
+	int ret;
+
+	(void)desc;
+	t_key(&key);
+	for (i = 0; i < tc->n; ++i)
+		response[i] = t_code(T_START + (int)tc->offset[i]);
+	ret = t_compare_i(tc->result, otp_resync(&key, response, tc->n));
+	if (tc->result > 0)
+		ret &= t_compare_u64(T_START + tc->offset[tc->n - 1] + 1,
+		    key.counter);
+	else
+		ret &= t_compare_u64(T_START, key.counter);
+	otp_key_destroy(&key);
+	return (ret);
+}
+
+/*
+ * Check that a deep search with the default window as its depth finds
+ * the same thing as a normal resynchronization.
+ */
+static int
+t_otp_resync_deep(char **desc, void *arg)
+{
+	static const unsigned int depth[] = { 0, 10, 100, 1000 };
+	struct t_case *tc = arg;
+	unsigned long response[3];
+	oath_key key;
+	unsigned int i;
+	int ret;
+
+	(void)desc;
+	t_key(&key);
+	for (i = 0; i < tc->n; ++i)
+		response[i] = t_code(T_START + (int)tc->offset[i]);
+	ret = t_compare_i(tc->result, otp_resync_deep(&key, response, tc->n,
+	    depth[tc->n], 3));
+	if (tc->result > 0)
+		ret &= t_compare_u64(T_START + tc->offset[tc->n - 1] + 1,
+		    key.counter);
+	else
+		ret &= t_compare_u64(T_START, key.counter);
+	otp_key_destroy(&key);
+	return (ret);
+}
+
+/*
+ * Find a sequence far beyond any normal window, straddling the
+ * boundary between two blocks of work, and a little too far away.
+ */
+static int
+t_otp_resync_far(char **desc, void *arg)
+{
+	unsigned long response[3];
+	oath_key key;
+	unsigned int i;
+	int ret;
+
+	(void)desc;
+	(void)arg;
+	t_key(&key);
+	for (i = 0; i < 3; ++i)
+		response[i] = t_code(T_START + 12287 + i);
+	ret = t_compare_i(12288, otp_resync_deep(&key, response, 3, 20000,
+	    4));
+	ret &= t_compare_u64(T_START + 12290, key.counter);
+	key.counter = T_START;
+	ret &= t_compare_i(12288, otp_resync_deep(&key, response, 3, 12290,
+	    2));
+	key.counter = T_START;
+	ret &= t_compare_i(0, otp_resync_deep(&key, response, 3, 12289, 2));
+	ret &= t_compare_u64(T_START, key.counter);
+	ret &= t_compare_i(-1, otp_resync_deep(&key, response, 3, 2, 2));
+	/* too deep for fewer than three codes */
+	ret &= t_compare_i(-1, otp_resync_deep(&key, response, 2, 1000001,
+	    2));
+	ret &= t_compare_i(-1, otp_resync_deep(&key, response, 1, 11, 2));
+	ret &= t_compare_u64(T_START, key.counter);
+	otp_key_destroy(&key);
+	return (ret);
+}
+
+/*
+ * Check that the window can be narrowed.
+ */
+static int
+t_otp_resync_range(char **desc, void *arg)
+{
+	unsigned long response[2];
+	oath_key key;
+	int ret;
+
+	(void)desc;
+	(void)arg;
+	t_key(&key);
+	response[0] = t_code(T_START + 18);
+	response[1] = t_code(T_START + 19);
+	ret = t_compare_i(0, otp_resync_range(&key, response, 2, 19));
+	ret &= t_compare_u64(T_START, key.counter);
+	ret &= t_compare_i(19, otp_resync_range(&key, response, 2, 20));
+	ret &= t_compare_u64(T_START + 20, key.counter);
+	ret &= t_compare_i(0, otp_resync_range(&key, response, 2, 1));
+	ret &= t_compare_i(0, otp_resync_range(&key, response, 2, 0));
+	otp_key_destroy(&key);
+	return (ret);
+}
+
+/*
+ * Check that a large lookahead does not overflow the window size:
+ * 65536 squared is 2^32, which must be capped at the resync window,
+ * not wrap around to zero.
+ */
+static int
+t_otp_resync_lookahead(char **desc, void *arg)
+{
+	unsigned long response[2];
+	otp_policy pol;
+	oath_key key;
+	int ret;
+
+	(void)desc;
+	(void)arg;
+	otp_policy_init(&pol);
+	pol.hotp_lookahead = 65535;
+	pol.resync_window = 100000;
+	t_key(&key);
+	response[0] = t_code(T_START + 99998);
+	response[1] = t_code(T_START + 99999);
+	ret = t_compare_i(99999,
+	    otp_resync_policy(&key, response, 2, &pol));
+	ret &= t_compare_u64(T_START + 100000, key.counter);
+	otp_key_destroy(&key);
+	return (ret);
+}
+
+/*
+ * Check that invalid requests are rejected.
+ */
+static int
+t_otp_resync_invalid(char **desc, void *arg)
+{
+	unsigned long response[2];
+	oath_key key;
+	int ret;
+
+	(void)desc;
+	(void)arg;
+	t_key(&key);
+	response[0] = t_code(T_START);
+	response[1] = t_code(T_START + 1);
+	ret = t_compare_i(-1, otp_resync(&key, response, 0));
+	key.counter = UINT64_MAX - 50;
+	ret &= t_compare_i(-1, otp_resync(&key, response, 2));
+	key.counter = T_START;
+	key.mode = om_totp;
+	key.timestep = 30;
+	ret &= t_compare_i(-1, otp_resync(&key, response, 2));
+	otp_key_destroy(&key);
+	return (ret);
+}
+
+static int
+t_prepare(int argc, char *argv[])
+{
+	unsigned int i;
+
+	(void)argc;
+	(void)argv;
+	for (i = 0; i < sizeof t_cases / sizeof t_cases[0]; ++i)
+		t_add_test(t_otp_resync, &t_cases[i], "%s", t_cases[i].desc);
+	for (i = 0; i < sizeof t_cases / sizeof t_cases[0]; ++i)
+		t_add_test(t_otp_resync_deep, &t_cases[i], "deep, %s",
+		    t_cases[i].desc);
+	t_add_test(t_otp_resync_far, NULL, "deep, far");
+	t_add_test(t_otp_resync_range, NULL, "narrow window");
+	t_add_test(t_otp_resync_lookahead, NULL, "large lookahead");
+	t_add_test(t_otp_resync_invalid, NULL, "invalid");
+	return (0);
+}
+
+int
+main(int argc, char *argv[])
+{
+
+	t_main(t_prepare, NULL, argc, argv);
+}
@@ -0,0 +1,446 @@
+/*-
+ * Copyright (c) 2026 Dag-Erling Smørgrav
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "cryb/impl.h"
+
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <cryb/oath.h>
+#include <cryb/otp.h>
+
+#include <cryb/test.h>
+
+#ifndef OTPD
+#define OTPD "../sbin/otpd/otpd"
+#endif
+
+/*
+ * These tests run three shards, two on Unix sockets and one on a TCP
+ * socket, each with a key store in a temporary directory, and all
+ * requiring authentication with the same secret.  Keys are
+ * initially spread across the first two according to a two-shard map;
+ * the third is then added and the keys rebalanced.  The key is the RFC
+ * 4226 test key, for which the first few codes are known.
+ */
+
+#define T_NSHARDS	3
+#define T_NUSERS	300
+#define T_NRING		3000
+
+static const unsigned long t_codes[] = {
+	755224, 287082, 359152, 969429, 338314,
+};
+
+static const char *t_names[T_NSHARDS] = { "alpha", "bravo", "charlie" };
+
+static char t_dir[] = "/tmp/t_otp_shard.XXXXXX";
+static char t_store[T_NSHARDS][64], t_addr[T_NSHARDS][64];
+static char t_map2[64], t_map3[64], t_secretpath[64];
+static otp_secret *t_secret;
+static pid_t t_pid[T_NSHARDS];
+static otp_shardmap *t_old, *t_new;
+
+static void
+t_user(char *buf, size_t size, unsigned int i)
+{
+
+	snprintf(buf, size, "user%u", i);
+}
+
+/*
+ * The ring is balanced, does not depend on the order in which shards
+ * were added, and when a shard is added, users only move to it.
+ */
+static int
+t_ring(char **desc, void *arg)
+{
+	otp_shardmap *fwd, *rev;
+	unsigned int count[T_NSHARDS + 1];
+	char user[16];
+	unsigned int i;
+	int j, k, ret;
+
+	(void)desc;
+	(void)arg;
+	fwd = otp_shardmap_create();
+	rev = otp_shardmap_create();
+	if (fwd == NULL || rev == NULL)
+		return (0);
+	ret = 1;
+	for (i = 0; i < T_NSHARDS; ++i) {
+		ret &= t_compare_i(0, otp_shardmap_add(fwd, t_names[i],
+		    t_addr[i], 1));
+		ret &= t_compare_i(0, otp_shardmap_add(rev,
+		    t_names[T_NSHARDS - 1 - i], t_addr[T_NSHARDS - 1 - i], 1));
+	}
+	ret &= t_compare_i(-1, otp_shardmap_add(fwd, "alpha", "x:1", 1));
+	ret &= t_compare_i(EEXIST, errno);
+	ret &= t_compare_i(-1, otp_shardmap_add(fwd, "delta", "x:1", 0));
+	ret &= t_compare_i(EINVAL, errno);
+	memset(count, 0, sizeof count);
+	for (i = 0; i < T_NRING; ++i) {
+		t_user(user, sizeof user, i);
+		j = otp_shardmap_owner(fwd, user);
+		k = otp_shardmap_owner(rev, user);
+		ret &= t_compare_str(otp_shardmap_name(fwd, j),
+		    otp_shardmap_name(rev, k));
+		count[j]++;
+	}
+	for (i = 0; i < T_NSHARDS; ++i) {
+		t_printv("%s: %u\n", t_names[i], count[i]);
+		ret &= t_compare_i(1, count[i] > T_NRING / T_NSHARDS * 7 / 10 &&
+		    count[i] < T_NRING / T_NSHARDS * 13 / 10);
+	}
+	ret &= t_compare_i(0, otp_shardmap_add(fwd, "delta", "x:1", 1));
+	for (i = 0; i < T_NRING; ++i) {
+		t_user(user, sizeof user, i);
+		j = otp_shardmap_owner(fwd, user);
+		k = otp_shardmap_owner(rev, user);
+		if (j != T_NSHARDS)
+			ret &= t_compare_str(otp_shardmap_name(rev, k),
+			    otp_shardmap_name(fwd, j));
+		count[j]++;
+	}
+	ret &= t_compare_i(1, count[T_NSHARDS] > 0);
+	otp_shardmap_destroy(fwd);
+	otp_shardmap_destroy(rev);
+	return (ret);
+}
+
+/*
+ * Parse a map file with comments, blank lines and weights, and report
+ * the line number of a malformed entry.
+ */
+static int
+t_load(char **desc, void *arg)
+{
+	char path[80];
+	unsigned long lineno;
+	otp_shardmap *map;
+	FILE *f;
+	int ret;
+
+	(void)desc;
+	(void)arg;
+	snprintf(path, sizeof path, "%s/bad", t_dir);
+	if ((f = fopen(path, "w")) == NULL)
+		return (0);
+	fprintf(f, "# name\taddress\n\nalpha /tmp/a 2 # comment\n"
+	    "bravo\n");
+	fclose(f);
+	lineno = 0;
+	map = otp_shardmap_load(path, &lineno);
+	ret = t_compare_i(EINVAL, errno);
+	ret &= t_compare_ul(4, lineno);
+	otp_shardmap_destroy(map);
+	unlink(path);
+	ret &= t_compare_i(T_NSHARDS - 1, otp_shardmap_count(t_old));
+	ret &= t_compare_i(T_NSHARDS, otp_shardmap_count(t_new));
+	ret &= t_compare_str(t_addr[2], otp_shardmap_addr(t_new, 2));
+	return (ret);
+}
+
+/*
+ * Every user's requests go to the shard that has the user's key.
+ */
+static int
+t_route(char **desc, void *arg)
+{
+	unsigned long codes[2] = { t_codes[1], t_codes[2] };
+	otp_shard *sh;
+	char user[16];
+	unsigned int i;
+	int ret;
+
+	(void)desc;
+	(void)arg;
+	if ((sh = otp_shard_open(t_old)) == NULL)
+		return (0);
+	ret = 1;
+	for (i = 0; i < T_NUSERS; ++i) {
+		t_user(user, sizeof user, i);
+		ret &= t_compare_i(1, otp_shard_verify(sh, user, t_codes[0]));
+		ret &= t_compare_i(0, otp_shard_verify(sh, user, t_codes[0]));
+	}
+	ret &= t_compare_i(-1, otp_shard_verify(sh, "nobody", t_codes[0]));
+	ret &= t_compare_i(ENOENT, errno);
+	ret &= t_compare_i(1, otp_shard_resync(sh, "user0", codes, 2));
+	otp_shard_close(sh);
+	return (ret);
+}
+
+/*
+ * Clients which do not know the secret get nowhere, and in particular
+ * do not consume the codes they send.
+ */
+static int
+t_auth(char **desc, void *arg)
+{
+	otp_secret *other;
+	otp_client *cl;
+	unsigned int i;
+	int ret;
+
+	(void)desc;
+	(void)arg;
+	if ((other = otp_secret_load(t_map2)) == NULL)
+		return (0);
+	i = otp_shardmap_owner(t_old, "user1");
+	ret = 1;
+	if ((cl = otp_client_open(t_addr[i])) != NULL) {
+		ret &= t_compare_i(-1, otp_client_verify(cl, "user1",
+		    t_codes[1]));
+		otp_client_close(cl);
+	}
+	if ((cl = otp_client_open(t_addr[i])) != NULL) {
+		ret &= t_compare_i(0, otp_client_auth(cl, other));
+		ret &= t_compare_i(-1, otp_client_verify(cl, "user1",
+		    t_codes[1]));
+		otp_client_close(cl);
+	}
+	if ((cl = otp_client_open(t_addr[T_NSHARDS - 1])) != NULL) {
+		ret &= t_compare_i(-1, otp_client_verify(cl, "user1",
+		    t_codes[1]));
+		otp_client_close(cl);
+	}
+	otp_secret_free(other);
+	return (ret);
+}
+
+/*
+ * Add the third shard and move the keys that now belong to it.  Only
+ * those keys move, they keep their counters, and only clients that use
+ * the new map find them afterwards.
+ */
+static int
+t_rebalance(char **desc, void *arg)
+{
+	otp_shard *osh, *nsh;
+	char user[16];
+	unsigned int i, moved;
+	int o, n, ret;
+
+	(void)desc;
+	(void)arg;
+	for (i = moved = 0; i < T_NUSERS; ++i) {
+		t_user(user, sizeof user, i);
+		o = otp_shardmap_owner(t_old, user);
+		n = otp_shardmap_owner(t_new, user);
+		if (strcmp(otp_shardmap_name(t_old, o),
+		    otp_shardmap_name(t_new, n)) != 0)
+			moved++;
+	}
+	t_printv("%u of %u users move\n", moved, T_NUSERS);
+	ret = t_compare_i(1, moved > 0);
+	ret &= t_compare_i(moved, otp_shard_rebalance(t_old, t_new,
+	    OTP_SHARD_DRYRUN));
+	ret &= t_compare_i(moved, otp_shard_rebalance(t_old, t_new, 0));
+	ret &= t_compare_i(0, otp_shard_rebalance(t_old, t_new, 0));
+	if ((osh = otp_shard_open(t_old)) == NULL)
+		return (0);
+	if ((nsh = otp_shard_open(t_new)) == NULL) {
+		otp_shard_close(osh);
+		return (0);
+	}
+	for (i = 1; i < T_NUSERS; ++i) {
+		t_user(user, sizeof user, i);
+		o = otp_shardmap_owner(t_old, user);
+		n = otp_shardmap_owner(t_new, user);
+		ret &= t_compare_i(0, otp_shard_verify(nsh, user, t_codes[0]));
+		if (strcmp(otp_shardmap_name(t_old, o),
+		    otp_shardmap_name(t_new, n)) != 0) {
+			ret &= t_compare_i(-1,
+			    otp_shard_verify(osh, user, t_codes[1]));
+			ret &= t_compare_i(ENOENT, errno);
+		}
+		ret &= t_compare_i(1, otp_shard_verify(nsh, user, t_codes[1]));
+	}
+	ret &= t_compare_i(1, otp_shard_verify(nsh, "user0", t_codes[3]));
+	otp_shard_close(nsh);
+	otp_shard_close(osh);
+	return (ret);
+}
+
+/*
+ * Write a map file listing the first n shards.
+ */
+static int
+t_writemap(const char *path, unsigned int n)
+{
+	unsigned int i;
+	FILE *f;
+
+	if ((f = fopen(path, "w")) == NULL)
+		return (-1);
+	for (i = 0; i < n; ++i)
+		fprintf(f, "%s\t%s\n", t_names[i], t_addr[i]);
+	return (fclose(f));
+}
+
+static int
+t_start(void)
+{
+	otp_store *st[T_NSHARDS];
+	otp_client *cl;
+	char user[16];
+	oath_key key;
+	unsigned int i, j;
+	FILE *f;
+	int ret;
+
+	if (mkdtemp(t_dir) == NULL)
+		return (-1);
+	for (i = 0; i < T_NSHARDS; ++i) {
+		snprintf(t_store[i], sizeof t_store[i], "%s/store%u", t_dir, i);
+		if (i < T_NSHARDS - 1)
+			snprintf(t_addr[i], sizeof t_addr[i], "%s/sock%u",
+			    t_dir, i);
+		else
+			snprintf(t_addr[i], sizeof t_addr[i], "127.0.0.1:%u",
+			    20000 + (unsigned int)getpid() % 20000);
+	}
+	snprintf(t_map2, sizeof t_map2, "%s/map2", t_dir);
+	snprintf(t_map3, sizeof t_map3, "%s/map3", t_dir);
+	snprintf(t_secretpath, sizeof t_secretpath, "%s/secret", t_dir);
+	if (t_writemap(t_map2, T_NSHARDS - 1) != 0 ||
+	    t_writemap(t_map3, T_NSHARDS) != 0 ||
+	    (t_old = otp_shardmap_load(t_map2, NULL)) == NULL ||
+	    (t_new = otp_shardmap_load(t_map3, NULL)) == NULL ||
+	    (f = fopen(t_secretpath, "w")) == NULL)
+		return (-1);
+	fprintf(f, "%s\n", t_dir);
+	if (fclose(f) != 0 ||
+	    (t_secret = otp_secret_load(t_secretpath)) == NULL)
+		return (-1);
+	otp_shardmap_set_secret(t_old, t_secret);
+	otp_shardmap_set_secret(t_new, t_secret);
+
+	/* distribute keys according to the old map */
+	for (i = 0; i < T_NSHARDS; ++i)
+		st[i] = otp_store_open(t_store[i], O_RDWR|O_CREAT);
+	oath_key_create(&key, om_hotp, oh_sha1, 6, "cryb.to", "user",
+	    "12345678901234567890", 20);
+	for (i = 0, ret = 0; ret == 0 && i < T_NUSERS; ++i) {
+		t_user(user, sizeof user, i);
+		j = otp_shardmap_owner(t_old, user);
+		ret = st[j] == NULL ? -1 : otp_store_update(st[j], user, &key);
+	}
+	oath_key_destroy(&key);
+	for (i = 0; i < T_NSHARDS; ++i) {
+		if (st[i] == NULL)
+			ret = -1;
+		otp_store_close(st[i]);
+	}
+	if (ret != 0)
+		return (-1);
+
+	for (i = 0; i < T_NSHARDS; ++i) {
+		if ((t_pid[i] = fork()) < 0)
+			return (-1);
+		if (t_pid[i] == 0) {
+			execl(OTPD, "otpd", "-fm", "-t", "2", "-K",
+			    t_secretpath, "-k", t_store[i], "-s", t_addr[i],
+			    (char *)NULL);
+			_exit(1);
+		}
+	}
+
+	/* wait for the shards to start listening */
+	for (i = j = 0; i < T_NSHARDS && j < 25; ) {
+		if ((cl = otp_client_open(t_addr[i])) != NULL) {
+			otp_client_close(cl);
+			++i;
+			continue;
+		}
+		usleep(200000);
+		++j;
+	}
+	return (i == T_NSHARDS ? 0 : -1);
+}
+
+static void t_cleanup(void);
+
+static int
+t_prepare(int argc, char *argv[])
+{
+
+	(void)argc;
+	(void)argv;
+	if (t_start() != 0) {
+		t_cleanup();
+		return (-1);
+	}
+	t_add_test(t_ring, NULL, "ring");
+	t_add_test(t_load, NULL, "load");
+	t_add_test(t_route, NULL, "route");
+	t_add_test(t_auth, NULL, "auth");
+	t_add_test(t_rebalance, NULL, "rebalance");
+	return (0);
+}
+
+static void
+t_cleanup(void)
+{
+	unsigned int i;
+	int status;
+
+	otp_shardmap_destroy(t_old);
+	otp_shardmap_destroy(t_new);
+	otp_secret_free(t_secret);
+	for (i = 0; i < T_NSHARDS; ++i) {
+		if (t_pid[i] > 0) {
+			kill(t_pid[i], SIGTERM);
+			waitpid(t_pid[i], &status, 0);
+		}
+		if (i < T_NSHARDS - 1)
+			unlink(t_addr[i]);
+		unlink(t_store[i]);
+	}
+	unlink(t_map2);
+	unlink(t_map3);
+	unlink(t_secretpath);
+	rmdir(t_dir);
+}
+
+int
+main(int argc, char *argv[])
+{
+
+	t_main(t_prepare, t_cleanup, argc, argv);
+}
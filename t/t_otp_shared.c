@@ -0,0 +1,200 @@
+/*-
+ * Copyright (c) 2026 Dag-Erling Smørgrav
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "cryb/impl.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <cryb/oath.h>
+#include <cryb/otp.h>
+
+#include <cryb/test.h>
+
+#define T_THREADS	8
+#define T_CODES		64
+
+static char t_dir[] = "/tmp/t_otp_shared.XXXXXX";
+static char t_path[64];
+
+static oath_key t_key;
+static unsigned int t_codes[T_CODES];
+static unsigned int t_accepted[T_CODES];
+
+static pthread_barrier_t t_barrier;
+
+/*
+ * Each thread tries every code in order, so at any time several
+ * threads are racing to use the same code.
+ */
+static void *
+t_shared_thread(void *arg)
+{
+	unsigned int i;
+
+	(void)arg;
+	pthread_barrier_wait(&t_barrier);
+	for (i = 0; i < T_CODES; ++i)
+		if (otp_verify_shared(&t_key, t_codes[i], NULL) > 0)
+			__atomic_fetch_add(&t_accepted[i], 1, __ATOMIC_RELAXED);
+	return (NULL);
+}
+
+static void *
+t_store_thread(void *arg)
+{
+	otp_store *st;
+	unsigned int i;
+
+	(void)arg;
+	st = otp_store_open(t_path, O_RDWR);
+	pthread_barrier_wait(&t_barrier);
+	for (i = 0; st != NULL && i < T_CODES; ++i)
+		if (otp_store_verify(st, "alice", t_codes[i]) > 0)
+			__atomic_fetch_add(&t_accepted[i], 1, __ATOMIC_RELAXED);
+	otp_store_close(st);
+	return (NULL);
+}
+
+/*
+ * Run the given thread function in several threads at once, then
+ * check that no code was accepted more than once and that the last
+ * code was accepted.  On return, *last is the counter value just past
+ * the last code that was accepted.
+ */
+static int
+t_race(void *(*func)(void *), unsigned int *last)
+{
+	pthread_t thr[T_THREADS];
+	unsigned int i;
+	int ret;
+
+	memset(t_accepted, 0, sizeof t_accepted);
+	pthread_barrier_init(&t_barrier, NULL, T_THREADS);
+	for (i = 0; i < T_THREADS; ++i)
+		if (pthread_create(&thr[i], NULL, func, NULL) != 0)
+			return (0);
+	for (i = 0; i < T_THREADS; ++i)
+		pthread_join(thr[i], NULL);
+	pthread_barrier_destroy(&t_barrier);
+	ret = 1;
+	for (i = *last = 0; i < T_CODES; ++i) {
+		ret &= t_compare_u(t_accepted[i] > 0, t_accepted[i]);
+		if (t_accepted[i] > 0)
+			*last = i + 1;
+	}
+	ret &= t_compare_u(1, t_accepted[T_CODES - 1]);
+	return (ret);
+}
+
+static void
+t_init(void)
+{
+	unsigned int i;
+
+	oath_key_create(&t_key, om_hotp, oh_sha1, 6, "cryb.to", "alice",
+	    "12345678901234567890", 20);
+	for (i = 0; i < T_CODES; ++i)
+		t_codes[i] = oath_hotp(t_key.key, t_key.keylen, i, t_key.digits);
+}
+
+static int
+t_otp_shared_key(char **desc, void *arg)
+{
+	unsigned int last;
+	int ret;
+
+	(void)desc;
+	(void)arg;
+	t_init();
+	ret = t_race(t_shared_thread, &last);
+	ret &= t_compare_u64(last, t_key.counter);
+	otp_key_destroy(&t_key);
+	return (ret);
+}
+
+static int
+t_otp_shared_store(char **desc, void *arg)
+{
+	unsigned int last;
+	oath_key key;
+	otp_store *st;
+	int ret;
+
+	(void)desc;
+	(void)arg;
+	t_init();
+	unlink(t_path);
+	if ((st = otp_store_open(t_path, O_RDWR|O_CREAT)) == NULL)
+		return (0);
+	ret = t_compare_i(0, otp_store_update(st, "alice", &t_key));
+	ret &= t_compare_i(-1, otp_store_verify(st, "bob", t_codes[0]));
+	ret &= t_compare_i(ENOENT, errno);
+	ret &= t_race(t_store_thread, &last);
+	ret &= t_compare_i(0, otp_store_lookup(st, "alice", &key));
+	ret &= t_compare_u64(last, key.counter);
+	otp_store_close(st);
+	otp_key_destroy(&t_key);
+	return (ret);
+}
+
+static int
+t_prepare(int argc, char *argv[])
+{
+
+	(void)argc;
+	(void)argv;
+	if (mkdtemp(t_dir) == NULL)
+		return (-1);
+	snprintf(t_path, sizeof t_path, "%s/store", t_dir);
+	t_add_test(t_otp_shared_key, NULL, "shared key");
+	t_add_test(t_otp_shared_store, NULL, "shared store");
+	return (0);
+}
+
+static void
+t_cleanup(void)
+{
+
+	unlink(t_path);
+	rmdir(t_dir);
+}
+
+int
+main(int argc, char *argv[])
+{
+
+	t_main(t_prepare, t_cleanup, argc, argv);
+}
@@ -0,0 +1,259 @@
+/*-
+ * Copyright (c) 2026 Dag-Erling Smørgrav
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "cryb/impl.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <cryb/oath.h>
+#include <cryb/otp.h>
+
+#include <cryb/test.h>
+
+static char t_buf[65536];
+
+/*
+ * Export a snapshot into t_buf.
+ */
+static int
+t_export(void)
+{
+	char path[] = "/tmp/t_otp_stats.XXXXXX";
+	otp_stats *st;
+	ssize_t len;
+	int fd, ret;
+
+	if ((st = otp_stats_snapshot()) == NULL)
+		return (-1);
+	ret = -1;
+	if ((fd = mkstemp(path)) >= 0) {
+		unlink(path);
+		if (otp_stats_export(st, fd) == 0 &&
+		    (len = pread(fd, t_buf, sizeof t_buf - 1, 0)) >= 0) {
+			t_buf[len] = '\0';
+			ret = 0;
+		}
+		close(fd);
+	}
+	otp_stats_free(st);
+	return (ret);
+}
+
+static int
+t_has(const char *line)
+{
+
+	if (strstr(t_buf, line) != NULL)
+		return (1);
+	t_printv("missing: %s\n", line);
+	return (0);
+}
+
+/*
+ * Return the value of a line in t_buf, or -1 if it is missing.
+ */
+static long long
+t_value(const char *line)
+{
+	const char *p;
+
+	if ((p = strstr(t_buf, line)) == NULL) {
+		t_printv("missing: %s\n", line);
+		return (-1);
+	}
+	return (strtoll(p + strlen(line), NULL, 10));
+}
+
+/*
+ * Nothing is recorded until recording is enabled.
+ */
+static int
+t_otp_stats_disabled(char **desc, void *arg)
+{
+	oath_key key;
+	int ret;
+
+	(void)desc;
+	(void)arg;
+	oath_key_create(&key, om_hotp, oh_sha1, 6, "cryb.to", "alice",
+	    "12345678901234567890", 20);
+	ret = t_compare_i(1, otp_verify(&key, 755224));
+	otp_key_destroy(&key);
+	ret &= t_compare_i(0, t_export());
+	ret &= t_has("cryb_otp_verify_total"
+	    "{mode=\"hotp\",result=\"hit\"} 0\n");
+	return (ret);
+}
+
+/*
+ * Verify a code which skips one, then a wrong one, and check that
+ * both are counted and the skip shows up in the offsets.
+ */
+static int
+t_otp_stats_verify(char **desc, void *arg)
+{
+	oath_key key;
+	int ret;
+
+	(void)desc;
+	(void)arg;
+	otp_stats_enable(1);
+	oath_key_create(&key, om_hotp, oh_sha1, 6, "cryb.to", "alice",
+	    "12345678901234567890", 20);
+	ret = t_compare_i(2, otp_verify(&key, 287082));
+	ret &= t_compare_i(0, otp_verify(&key, 287082));
+	otp_key_destroy(&key);
+	otp_stats_enable(0);
+	ret &= t_compare_i(0, t_export());
+	ret &= t_has("cryb_otp_verify_total"
+	    "{mode=\"hotp\",result=\"hit\"} 1\n");
+	ret &= t_has("cryb_otp_verify_total"
+	    "{mode=\"hotp\",result=\"miss\"} 1\n");
+	ret &= t_has("cryb_otp_window_offset_total"
+	    "{mode=\"hotp\",offset=\"1\"} 1\n");
+	ret &= t_has("cryb_otp_verify_seconds_count{mode=\"hotp\"} 2\n");
+	ret &= t_has("cryb_otp_verify_seconds_bucket"
+	    "{mode=\"hotp\",le=\"+Inf\"} 2\n");
+	ret &= t_has("cryb_otp_cache_total"
+	    "{cache=\"hmac\",result=\"hit\"} 1\n");
+	return (ret);
+}
+
+/*
+ * Resynchronize with codes 5 and 6, and check the recorded depth.
+ */
+static int
+t_otp_stats_resync(char **desc, void *arg)
+{
+	unsigned long resp[2] = { 254676, 287922 };
+	oath_key key;
+	int ret;
+
+	(void)desc;
+	(void)arg;
+	otp_stats_enable(1);
+	oath_key_create(&key, om_hotp, oh_sha1, 6, "cryb.to", "alice",
+	    "12345678901234567890", 20);
+	ret = t_compare_i(1, otp_resync(&key, resp, 2) > 0);
+	otp_key_destroy(&key);
+	otp_stats_enable(0);
+	ret &= t_compare_i(0, t_export());
+	ret &= t_has("cryb_otp_resync_total{result=\"hit\"} 1\n");
+	ret &= t_has("cryb_otp_resync_depth_bucket{le=\"7\"} 1\n");
+	ret &= t_has("cryb_otp_resync_depth_sum 7\n");
+	return (ret);
+}
+
+/*
+ * Destroying a key must wipe the HMAC state that another thread has
+ * cached for it, so a new key with the same secret in the same place
+ * misses in that thread's cache.
+ */
+static oath_key t_key;
+static pthread_barrier_t t_barrier;
+static int t_result[2];
+
+static void *
+t_otp_stats_hmac_thread(void *arg)
+{
+
+	(void)arg;
+	t_result[0] = otp_verify(&t_key, 755224);
+	pthread_barrier_wait(&t_barrier);
+	pthread_barrier_wait(&t_barrier);
+	t_result[1] = otp_verify(&t_key, 755224);
+	return (NULL);
+}
+
+static int
+t_otp_stats_hmac(char **desc, void *arg)
+{
+	static const char hits[] = "cryb_otp_cache_total"
+	    "{cache=\"hmac\",result=\"hit\"} ";
+	static const char misses[] = "cryb_otp_cache_total"
+	    "{cache=\"hmac\",result=\"miss\"} ";
+	long long hit, miss;
+	pthread_t thr;
+	int ret;
+
+	(void)desc;
+	(void)arg;
+	if (t_export() != 0)
+		return (0);
+	hit = t_value(hits);
+	miss = t_value(misses);
+	otp_stats_enable(1);
+	pthread_barrier_init(&t_barrier, NULL, 2);
+	oath_key_create(&t_key, om_hotp, oh_sha1, 6, "cryb.to", "alice",
+	    "12345678901234567890", 20);
+	if (pthread_create(&thr, NULL, t_otp_stats_hmac_thread, NULL) != 0) {
+		otp_stats_enable(0);
+		return (0);
+	}
+	pthread_barrier_wait(&t_barrier);
+	otp_key_destroy(&t_key);
+	oath_key_create(&t_key, om_hotp, oh_sha1, 6, "cryb.to", "alice",
+	    "12345678901234567890", 20);
+	pthread_barrier_wait(&t_barrier);
+	pthread_join(thr, NULL);
+	pthread_barrier_destroy(&t_barrier);
+	otp_key_destroy(&t_key);
+	otp_stats_enable(0);
+	ret = t_compare_i(1, t_result[0]);
+	ret &= t_compare_i(1, t_result[1]);
+	ret &= t_compare_i(0, t_export());
+	ret &= t_compare_i(1, t_value(hits) == hit);
+	ret &= t_compare_i(1, t_value(misses) == miss + 2);
+	return (ret);
+}
+
+static int
+t_prepare(int argc, char *argv[])
+{
+
+	(void)argc;
+	(void)argv;
+	t_add_test(t_otp_stats_disabled, NULL, "disabled");
+	t_add_test(t_otp_stats_verify, NULL, "verify");
+	t_add_test(t_otp_stats_resync, NULL, "resync");
+	t_add_test(t_otp_stats_hmac, NULL, "hmac cache");
+	return (0);
+}
+
+int
+main(int argc, char *argv[])
+{
+
+	t_main(t_prepare, NULL, argc, argv);
+}
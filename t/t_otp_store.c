@@ -0,0 +1,323 @@
+/*-
+ * Copyright (c) 2026 Dag-Erling Smørgrav
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "cryb/impl.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <cryb/oath.h>
+#include <cryb/otp.h>
+
+#include <cryb/test.h>
+
+static char t_dir[] = "/tmp/t_otp_store.XXXXXX";
+static char t_path[64];
+
+static void
+t_key(oath_key *key, unsigned int i)
+{
+	char label[32];
+
+	snprintf(label, sizeof label, "user%u", i);
+	oath_key_create(key, (i & 1) ? om_totp : om_hotp, oh_sha1, 6,
+	    "cryb.to", label, "12345678901234567890", 20);
+	key->counter = i;
+	key->lastused = i * 2;
+}
+
+static int
+t_key_compare(const oath_key *expected, const oath_key *received)
+{
+	int ret = 1;
+
+	ret &= t_compare_i(expected->mode, received->mode);
+	ret &= t_compare_i(expected->hash, received->hash);
+	ret &= t_compare_u(expected->digits, received->digits);
+	ret &= t_compare_u(expected->timestep, received->timestep);
+	ret &= t_compare_u64(expected->counter, received->counter);
+	ret &= t_compare_u64(expected->lastused, received->lastused);
+	ret &= t_compare_sz(expected->labellen, received->labellen);
+	ret &= t_compare_mem(expected->label, received->label,
+	    expected->labellen);
+	ret &= t_compare_sz(expected->issuerlen, received->issuerlen);
+	ret &= t_compare_mem(expected->issuer, received->issuer,
+	    expected->issuerlen);
+	ret &= t_compare_sz(expected->keylen, received->keylen);
+	ret &= t_compare_mem(expected->key, received->key, expected->keylen);
+	return (ret);
+}
+
+/*
+ * Insert a key, look it up, update it and look it up again.
+ */
+static int
+t_otp_store_roundtrip(char **desc, void *arg)
+{
+	oath_key key, rkey;
+	otp_store *st;
+	int ret;
+
+	(void)desc;
+	(void)arg;
+	unlink(t_path);
+	if ((st = otp_store_open(t_path, O_RDWR|O_CREAT)) == NULL)
+		return (0);
+	t_key(&key, 1);
+	ret = t_compare_i(-1, otp_store_lookup(st, "alice", &rkey));
+	ret &= t_compare_i(ENOENT, errno);
+	ret &= t_compare_i(0, otp_store_update(st, "alice", &key));
+	ret &= t_compare_i(0, otp_store_lookup(st, "alice", &rkey));
+	ret &= t_key_compare(&key, &rkey);
+	key.counter += 10;
+	ret &= t_compare_i(0, otp_store_update(st, "alice", &key));
+	ret &= t_compare_i(0, otp_store_lookup(st, "alice", &rkey));
+	ret &= t_key_compare(&key, &rkey);
+	otp_store_close(st);
+	return (ret);
+}
+
+/*
+ * Insert enough keys to force the store to grow, then close and reopen
+ * it read-only and check that they are all still there.
+ */
+static int
+t_otp_store_grow(char **desc, void *arg)
+{
+	char user[32];
+	oath_key key, rkey;
+	otp_store *st;
+	unsigned int i, n;
+	int ret;
+
+	(void)desc;
+	n = *(unsigned int *)arg;
+	unlink(t_path);
+	if ((st = otp_store_open(t_path, O_RDWR|O_CREAT)) == NULL)
+		return (0);
+	ret = 1;
+	for (i = 0; i < n && ret; ++i) {
+		snprintf(user, sizeof user, "user%u", i);
+		t_key(&key, i);
+		ret &= t_compare_i(0, otp_store_update(st, user, &key));
+	}
+	otp_store_close(st);
+	if ((st = otp_store_open(t_path, O_RDONLY)) == NULL)
+		return (0);
+	for (i = 0; i < n && ret; ++i) {
+		snprintf(user, sizeof user, "user%u", i);
+		t_key(&key, i);
+		ret &= t_compare_i(0, otp_store_lookup(st, user, &rkey));
+		ret &= t_key_compare(&key, &rkey);
+	}
+	ret &= t_compare_i(-1, otp_store_update(st, user, &key));
+	otp_store_close(st);
+	return (ret);
+}
+
+/*
+ * Insert keys in batches large enough to force the store to grow
+ * partway through a batch, and check that a batch containing an
+ * invalid entry is rejected as a whole.
+ */
+static int
+t_otp_store_batch(char **desc, void *arg)
+{
+	static char users[3000][32];
+	static oath_key keys[3000];
+	const char *up[1000];
+	const oath_key *kp[1000];
+	oath_key rkey;
+	otp_store *st;
+	unsigned int i, j;
+	int ret;
+
+	(void)desc;
+	(void)arg;
+	unlink(t_path);
+	if ((st = otp_store_open(t_path, O_RDWR|O_CREAT)) == NULL)
+		return (0);
+	ret = 1;
+	for (i = 0; i < 3000; ++i) {
+		snprintf(users[i], sizeof users[i], "user%u", i);
+		t_key(&keys[i], i);
+	}
+	for (i = 0; i < 3000 && ret; i += 1000) {
+		for (j = 0; j < 1000; ++j) {
+			up[j] = users[i + j];
+			kp[j] = &keys[i + j];
+		}
+		if (i == 2000) {
+			/* poison the last batch */
+			up[500] = "";
+			ret &= t_compare_i(-1,
+			    otp_store_update_batch(st, up, kp, 1000));
+			ret &= t_compare_i(EINVAL, errno);
+			ret &= t_compare_i(-1,
+			    otp_store_lookup(st, users[i], &rkey));
+			up[500] = users[i + 500];
+		}
+		ret &= t_compare_i(0, otp_store_update_batch(st, up, kp, 1000));
+	}
+	for (i = 0; i < 3000 && ret; ++i) {
+		ret &= t_compare_i(0, otp_store_lookup(st, users[i], &rkey));
+		ret &= t_key_compare(&keys[i], &rkey);
+	}
+	otp_store_close(st);
+	return (ret);
+}
+
+/*
+ * Import a key from an otpauth URI file.
+ */
+static int
+t_otp_store_import(char **desc, void *arg)
+{
+	static const char uri[] = "otpauth://hotp/user1?"
+	    "secret=GEZDGNBVGY3TQOJQGEZDGNBVGY3TQOJQ&digits=6&counter=42\n";
+	char path[64];
+	oath_key key;
+	otp_store *st;
+	FILE *f;
+	int ret;
+
+	(void)desc;
+	(void)arg;
+	snprintf(path, sizeof path, "%s/user1.otpauth", t_dir);
+	if ((f = fopen(path, "w")) == NULL)
+		return (0);
+	fputs(uri, f);
+	fclose(f);
+	unlink(t_path);
+	if ((st = otp_store_open(t_path, O_RDWR|O_CREAT)) == NULL)
+		return (0);
+	ret = t_compare_i(0, otp_store_import(st, "user1", path));
+	ret &= t_compare_i(0, otp_store_lookup(st, "user1", &key));
+	ret &= t_compare_i(om_hotp, key.mode);
+	ret &= t_compare_u64(42, key.counter);
+	ret &= t_compare_sz(20, key.keylen);
+	ret &= t_compare_mem("12345678901234567890", key.key, 20);
+	otp_store_close(st);
+	unlink(path);
+	return (ret);
+}
+
+/*
+ * Set and clear store and per-user policies, and check that they are
+ * layered correctly and survive key updates.
+ */
+static int
+t_otp_store_policy(char **desc, void *arg)
+{
+	otp_policy def, pol, spol, upol;
+	oath_key key;
+	otp_store *st;
+	int ret;
+
+	(void)desc;
+	(void)arg;
+	unlink(t_path);
+	if ((st = otp_store_open(t_path, O_RDWR|O_CREAT)) == NULL)
+		return (0);
+	otp_policy_init(&def);
+	spol = def;
+	spol.hotp_lookahead = 3;
+	upol = def;
+	upol.totp_skew = -1;
+	upol.totp_lookahead = 0;
+	upol.flags = OTP_POLICY_CONSTTIME;
+	t_key(&key, 1);
+	ret = t_compare_i(0, otp_store_update(st, "alice", &key));
+	ret &= t_compare_i(0, otp_store_policy(st, "alice", &pol));
+	ret &= t_compare_mem(&def, &pol, sizeof pol);
+	ret &= t_compare_i(0, otp_store_set_policy(st, NULL, &spol));
+	ret &= t_compare_i(0, otp_store_policy(st, "alice", &pol));
+	ret &= t_compare_mem(&spol, &pol, sizeof pol);
+	ret &= t_compare_i(0, otp_store_set_policy(st, "alice", &upol));
+	key.counter += 10;
+	ret &= t_compare_i(0, otp_store_update(st, "alice", &key));
+	ret &= t_compare_i(0, otp_store_policy(st, "alice", &pol));
+	ret &= t_compare_mem(&upol, &pol, sizeof pol);
+	ret &= t_compare_i(0, otp_store_policy(st, NULL, &pol));
+	ret &= t_compare_mem(&spol, &pol, sizeof pol);
+	ret &= t_compare_i(-1, otp_store_set_policy(st, "bob", &upol));
+	ret &= t_compare_i(ENOENT, errno);
+	upol.hotp_lookahead = 0;
+	ret &= t_compare_i(-1, otp_store_set_policy(st, "alice", &upol));
+	ret &= t_compare_i(EINVAL, errno);
+	ret &= t_compare_i(0, otp_store_set_policy(st, "alice", NULL));
+	ret &= t_compare_i(0, otp_store_policy(st, "alice", &pol));
+	ret &= t_compare_mem(&spol, &pol, sizeof pol);
+	ret &= t_compare_i(0, otp_store_set_policy(st, NULL, NULL));
+	ret &= t_compare_i(0, otp_store_policy(st, "alice", &pol));
+	ret &= t_compare_mem(&def, &pol, sizeof pol);
+	otp_store_close(st);
+	return (ret);
+}
+
+static unsigned int t_small = 100;
+static unsigned int t_large = 5000;
+
+static int
+t_prepare(int argc, char *argv[])
+{
+
+	(void)argc;
+	(void)argv;
+	if (mkdtemp(t_dir) == NULL)
+		return (-1);
+	snprintf(t_path, sizeof t_path, "%s/store", t_dir);
+	t_add_test(t_otp_store_roundtrip, NULL, "round trip");
+	t_add_test(t_otp_store_grow, &t_small, "%u keys", t_small);
+	t_add_test(t_otp_store_grow, &t_large, "%u keys", t_large);
+	t_add_test(t_otp_store_batch, NULL, "batch");
+	t_add_test(t_otp_store_import, NULL, "import");
+	t_add_test(t_otp_store_policy, NULL, "policy");
+	return (0);
+}
+
+static void
+t_cleanup(void)
+{
+
+	unlink(t_path);
+	rmdir(t_dir);
+}
+
+int
+main(int argc, char *argv[])
+{
+
+	t_main(t_prepare, t_cleanup, argc, argv);
+}
@@ -0,0 +1,256 @@
+/*-
+ * Copyright (c) 2026 Dag-Erling Smørgrav
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "cryb/impl.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <cryb/oath.h>
+#include <cryb/otp.h>
+
+#include <cryb/test.h>
+
+static char t_dir[] = "/tmp/t_otp_throttle.XXXXXX";
+static char t_path[64];
+
+static oath_key t_key;
+static unsigned int t_codes[16];
+
+/*
+ * Fail until throttled, check that even the correct code is refused,
+ * and check that other users are not affected.
+ */
+static int
+t_otp_throttle_backoff(char **desc, void *arg)
+{
+	otp_throttle *thr;
+	oath_key key;
+	unsigned int i;
+	int ret;
+
+	(void)desc;
+	(void)arg;
+	if ((thr = otp_throttle_create(0, 3, 60000)) == NULL)
+		return (0);
+	key = t_key;
+	ret = 1;
+	for (i = 0; i < 3; ++i)
+		ret &= t_compare_i(0, otp_verify_throttle(&key, 1000000 + i,
+		    NULL, thr, "alice"));
+	ret &= t_compare_i(-1, otp_verify_throttle(&key, t_codes[0], NULL,
+	    thr, "alice"));
+	ret &= t_compare_i(EAGAIN, errno);
+	ret &= t_compare_u64(0, key.counter);
+	ret &= t_compare_i(1, otp_verify_throttle(&key, t_codes[0], NULL,
+	    thr, "bob"));
+	otp_throttle_destroy(thr);
+	return (ret);
+}
+
+/*
+ * Check that a success clears the failure count.
+ */
+static int
+t_otp_throttle_reset(char **desc, void *arg)
+{
+	otp_throttle *thr;
+	oath_key key;
+	unsigned int i;
+	int ret;
+
+	(void)desc;
+	(void)arg;
+	if ((thr = otp_throttle_create(0, 3, 60000)) == NULL)
+		return (0);
+	key = t_key;
+	ret = 1;
+	for (i = 0; i < 2; ++i)
+		ret &= t_compare_i(0, otp_verify_throttle(&key, 1000000 + i,
+		    NULL, thr, "alice"));
+	ret &= t_compare_i(1, otp_verify_throttle(&key, t_codes[0], NULL,
+	    thr, "alice"));
+	for (i = 0; i < 2; ++i)
+		ret &= t_compare_i(0, otp_verify_throttle(&key, 1000000 + i,
+		    NULL, thr, "alice"));
+	ret &= t_compare_i(1, otp_verify_throttle(&key, t_codes[1], NULL,
+	    thr, "alice"));
+	otp_throttle_destroy(thr);
+	return (ret);
+}
+
+/*
+ * Reject a code with a narrow window, then check that it is rejected
+ * again without being checked, even with a window that would accept
+ * it, until the key's state changes.
+ */
+static int
+t_otp_throttle_rejected(char **desc, void *arg)
+{
+	otp_throttle *thr;
+	otp_policy pol;
+	oath_key key;
+	int ret;
+
+	(void)desc;
+	(void)arg;
+	if ((thr = otp_throttle_create(0, 10, 60000)) == NULL)
+		return (0);
+	otp_policy_init(&pol);
+	pol.hotp_lookahead = 1;
+	key = t_key;
+	ret = t_compare_i(0, otp_verify_throttle(&key, t_codes[1], &pol,
+	    thr, "alice"));
+	pol.hotp_lookahead = 2;
+	ret &= t_compare_i(0, otp_verify_throttle(&key, t_codes[1], &pol,
+	    thr, "alice"));
+	ret &= t_compare_i(1, otp_verify_throttle(&key, t_codes[0], &pol,
+	    thr, "alice"));
+	ret &= t_compare_i(1, otp_verify_throttle(&key, t_codes[1], &pol,
+	    thr, "alice"));
+	otp_throttle_destroy(thr);
+	return (ret);
+}
+
+/*
+ * Fill a table which is a single probe sequence with throttled users,
+ * then check that a failure by someone else does not take over the
+ * oldest user's entry, and that the newcomer is refused instead.
+ */
+static int
+t_otp_throttle_full(char **desc, void *arg)
+{
+	char user[32];
+	otp_throttle *thr;
+	oath_key key;
+	unsigned int i;
+	int ret;
+
+	(void)desc;
+	(void)arg;
+	if ((thr = otp_throttle_create(8, 1, 60000)) == NULL)
+		return (0);
+	key = t_key;
+	ret = 1;
+	for (i = 0; i < 8; ++i) {
+		snprintf(user, sizeof user, "user%u", i);
+		ret &= t_compare_i(0, otp_verify_throttle(&key, 1000000,
+		    NULL, thr, user));
+	}
+	ret &= t_compare_i(-1, otp_verify_throttle(&key, 1000000, NULL,
+	    thr, "mallory"));
+	ret &= t_compare_i(EAGAIN, errno);
+	ret &= t_compare_i(-1, otp_verify_throttle(&key, t_codes[0], NULL,
+	    thr, "user0"));
+	ret &= t_compare_i(EAGAIN, errno);
+	ret &= t_compare_u64(0, key.counter);
+	otp_throttle_destroy(thr);
+	return (ret);
+}
+
+/*
+ * Attach a tracker to a key store and check that otp_store_verify()
+ * honors it.
+ */
+static int
+t_otp_throttle_store(char **desc, void *arg)
+{
+	otp_throttle *thr;
+	otp_store *st;
+	oath_key key;
+	unsigned int i;
+	int ret;
+
+	(void)desc;
+	(void)arg;
+	unlink(t_path);
+	if ((thr = otp_throttle_create(0, 3, 60000)) == NULL)
+		return (0);
+	if ((st = otp_store_open(t_path, O_RDWR|O_CREAT)) == NULL) {
+		otp_throttle_destroy(thr);
+		return (0);
+	}
+	ret = t_compare_i(0, otp_store_update(st, "alice", &t_key));
+	ret &= t_compare_i(0, otp_store_set_throttle(st, thr));
+	for (i = 0; i < 3; ++i)
+		ret &= t_compare_i(0,
+		    otp_store_verify(st, "alice", 1000000 + i));
+	ret &= t_compare_i(-1, otp_store_verify(st, "alice", t_codes[0]));
+	ret &= t_compare_i(EAGAIN, errno);
+	ret &= t_compare_i(0, otp_store_lookup(st, "alice", &key));
+	ret &= t_compare_u64(0, key.counter);
+	ret &= t_compare_i(0, otp_store_set_throttle(st, NULL));
+	ret &= t_compare_i(1, otp_store_verify(st, "alice", t_codes[0]));
+	otp_store_close(st);
+	otp_throttle_destroy(thr);
+	return (ret);
+}
+
+static int
+t_prepare(int argc, char *argv[])
+{
+	unsigned int i;
+
+	(void)argc;
+	(void)argv;
+	if (mkdtemp(t_dir) == NULL)
+		return (-1);
+	snprintf(t_path, sizeof t_path, "%s/store", t_dir);
+	oath_key_create(&t_key, om_hotp, oh_sha1, 6, "cryb.to", "alice",
+	    "12345678901234567890", 20);
+	for (i = 0; i < 16; ++i)
+		t_codes[i] = oath_hotp(t_key.key, t_key.keylen, i, t_key.digits);
+	t_add_test(t_otp_throttle_backoff, NULL, "backoff");
+	t_add_test(t_otp_throttle_reset, NULL, "reset");
+	t_add_test(t_otp_throttle_rejected, NULL, "rejected");
+	t_add_test(t_otp_throttle_full, NULL, "full");
+	t_add_test(t_otp_throttle_store, NULL, "store");
+	return (0);
+}
+
+static void
+t_cleanup(void)
+{
+
+	otp_key_destroy(&t_key);
+	unlink(t_path);
+	rmdir(t_dir);
+}
+
+int
+main(int argc, char *argv[])
+{
+
+	t_main(t_prepare, t_cleanup, argc, argv);
+}
@@ -0,0 +1,391 @@
+/*-
+ * Copyright (c) 2026 Dag-Erling Smørgrav
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "cryb/impl.h"
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <cryb/oath.h>
+#include <cryb/otp.h>
+
+#include <cryb/test.h>
+
+#define T_SECRET	"GEZDGNBVGY3TQOJQGEZDGNBVGY3TQOJQ"
+static const char t_key[] = "12345678901234567890";
+
+struct t_bad {
+	const char	*desc;
+	const char	*uri;
+	size_t		 offset;
+	const char	*msg;
+};
+
+static struct t_bad t_bad[] = {
+	{ "scheme", "http://hotp/x?secret=" T_SECRET,
+	  0, "not an otpauth URI" },
+	{ "mode", "otpauth://motp/x?secret=" T_SECRET,
+	  10, "unknown mode" },
+	{ "no label", "otpauth://hotp",
+	  14, "missing label" },
+	{ "no parameters", "otpauth://hotp/x",
+	  16, "missing parameters" },
+	{ "no secret", "otpauth://hotp/x?digits=6",
+	  25, "missing secret" },
+	{ "duplicate parameter", "otpauth://hotp/x?digits=6&digits=8"
+	  "&secret=" T_SECRET, 26, "duplicate parameter" },
+	{ "no value", "otpauth://hotp/x?secret",
+	  17, "parameter without a value" },
+	{ "base32", "otpauth://hotp/x?secret=GEZDGNBV1Y3TQOJQ",
+	  32, "invalid base32 character" },
+	{ "secret length", "otpauth://hotp/x?secret=GEZDGNBVG",
+	  33, "invalid secret length" },
+	{ "algorithm", "otpauth://hotp/x?algorithm=SHA3&secret=" T_SECRET,
+	  27, "unknown algorithm" },
+	{ "digits", "otpauth://hotp/x?digits=5&secret=" T_SECRET,
+	  24, "digits must be between 6 and 9" },
+	{ "counter", "otpauth://hotp/x?counter=18446744073709551616"
+	  "&secret=" T_SECRET, 44, "invalid number" },
+	{ "period", "otpauth://totp/x?period=0&secret=" T_SECRET,
+	  24, "invalid number" },
+	{ "inapplicable", "otpauth://totp/x?counter=x&secret=" T_SECRET,
+	  25, "invalid number" },
+	{ "escape", "otpauth://hotp/a%2x?secret=" T_SECRET,
+	  16, "invalid escape" },
+};
+
+/*
+ * Parse a URI with every parameter, plus some trailing junk.
+ */
+static int
+t_otp_uri_hotp(char **desc, void *arg)
+{
+	static const char uri[] = "otpauth://HOTP/alice%40cryb.to?"
+	    "secret=" T_SECRET "&algorithm=sha256&digits=8&counter=42"
+	    "&issuer=Cryb%20To \r\nignored";
+	otp_uri_error uerr;
+	oath_key key;
+	int ret;
+
+	(void)desc;
+	(void)arg;
+	if (!t_compare_i(OTP_KEYFMT_URI, otp_key_parse(&key, uri, sizeof uri - 1, &uerr)))
+		return (0);
+	ret = t_compare_i(om_hotp, key.mode);
+	ret &= t_compare_i(oh_sha256, key.hash);
+	ret &= t_compare_u(8, key.digits);
+	ret &= t_compare_u64(42, key.counter);
+	ret &= t_compare_str("alice@cryb.to", key.label);
+	ret &= t_compare_sz(13, key.labellen);
+	ret &= t_compare_str("Cryb To", key.issuer);
+	ret &= t_compare_mem(t_key, key.key, sizeof t_key - 1);
+	ret &= t_compare_sz(sizeof t_key - 1, key.keylen);
+	otp_key_destroy(&key);
+	return (ret);
+}
+
+/*
+ * Check defaults, padding and a secret which is not a multiple of
+ * five bytes.
+ */
+static int
+t_otp_uri_totp(char **desc, void *arg)
+{
+	static const char uri[] = "otpauth://totp/bob?secret=MZXW6===";
+	oath_key key;
+	int ret;
+
+	(void)desc;
+	(void)arg;
+	if (!t_compare_i(OTP_KEYFMT_URI, otp_key_parse(&key, uri, sizeof uri - 1, NULL)))
+		return (0);
+	ret = t_compare_i(om_totp, key.mode);
+	ret &= t_compare_i(oh_sha1, key.hash);
+	ret &= t_compare_u(6, key.digits);
+	ret &= t_compare_u(30, key.timestep);
+	ret &= t_compare_u64(0, key.lastused);
+	ret &= t_compare_mem("foo", key.key, 3);
+	ret &= t_compare_sz(3, key.keylen);
+	otp_key_destroy(&key);
+	return (ret);
+}
+
+/*
+ * Ignore parameters we do not know, and parameters which do not apply
+ * to the key's mode, as long as they are well-formed.
+ */
+static int
+t_otp_uri_ignored(char **desc, void *arg)
+{
+	static const char hotp[] = "otpauth://hotp/dave?secret=" T_SECRET
+	    "&image=https%3A%2F%2Fcryb.to%2Flogo.png&period=60&lastused=7"
+	    "&counter=3&foo";
+	static const char totp[] = "otpauth://totp/erin?counter=9"
+	    "&secret=" T_SECRET "&image=x&period=60";
+	oath_key key;
+	int ret;
+
+	(void)desc;
+	(void)arg;
+	if (!t_compare_i(OTP_KEYFMT_URI, otp_key_parse(&key, hotp,
+	    sizeof hotp - 1, NULL)))
+		return (0);
+	ret = t_compare_i(om_hotp, key.mode);
+	ret &= t_compare_u64(3, key.counter);
+	ret &= t_compare_u64(0, key.lastused);
+	otp_key_destroy(&key);
+	if (!t_compare_i(OTP_KEYFMT_URI, otp_key_parse(&key, totp,
+	    sizeof totp - 1, NULL)))
+		return (0);
+	ret &= t_compare_i(om_totp, key.mode);
+	ret &= t_compare_u(60, key.timestep);
+	ret &= t_compare_u64(0, key.counter);
+	otp_key_destroy(&key);
+	return (ret);
+}
+
+/*
+ * Format a key and parse it back.
+ */
+static int
+t_otp_uri_roundtrip(char **desc, void *arg)
+{
+	char uri[4096];
+	oath_key key, key2;
+	size_t len;
+	int ret;
+
+	(void)desc;
+	(void)arg;
+	oath_key_create(&key, om_totp, oh_sha512, 8, "cryb.to", "carol",
+	    t_key, sizeof t_key - 1);
+	key.timestep = 60;
+	key.lastused = 12345;
+	len = sizeof uri;
+	ret = t_compare_i(0, oath_key_to_uri(&key, uri, &len));
+	ret &= t_compare_i(OTP_KEYFMT_URI, otp_key_parse(&key2, uri, len - 1, NULL));
+	if (ret) {
+		ret &= t_compare_i(key.mode, key2.mode);
+		ret &= t_compare_i(key.hash, key2.hash);
+		ret &= t_compare_u(key.digits, key2.digits);
+		ret &= t_compare_u(key.timestep, key2.timestep);
+		ret &= t_compare_u64(key.lastused, key2.lastused);
+		ret &= t_compare_str(key.label, key2.label);
+		ret &= t_compare_sz(key.keylen, key2.keylen);
+		ret &= t_compare_mem(key.key, key2.key, key.keylen);
+	}
+	otp_key_destroy(&key);
+	otp_key_destroy(&key2);
+	return (ret);
+}
+
+static int
+t_otp_uri_bad(char **desc, void *arg)
+{
+	struct t_bad *t = arg;
+	otp_uri_error uerr;
+	oath_key key;
+	int ret;
+
+	(void)desc;
+	ret = t_compare_i(-1, otp_key_parse(&key, t->uri, strlen(t->uri),
+	    &uerr));
+	if (ret) {
+		ret &= t_compare_sz(t->offset, uerr.offset);
+		ret &= t_compare_str(t->msg, uerr.msg);
+	}
+	return (ret);
+}
+
+/*
+ * Load a key from a regular file, which is mapped, and from a pipe,
+ * which is not.
+ */
+static int
+t_otp_uri_load(char **desc, void *arg)
+{
+	static const char uri[] = "otpauth://hotp/dave?secret=" T_SECRET
+	    "&counter=7\n";
+	char path[] = "/tmp/t_otp_uri.XXXXXX";
+	oath_key key;
+	int fd, pfd[2], ret;
+
+	(void)desc;
+	(void)arg;
+	if ((fd = mkstemp(path)) < 0)
+		return (0);
+	unlink(path);
+	ret = t_compare_sz(sizeof uri - 1,
+	    (size_t)write(fd, uri, sizeof uri - 1));
+	ret &= t_compare_i(OTP_KEYFMT_URI, otp_key_load(&key, fd, NULL));
+	close(fd);
+	if (ret) {
+		ret &= t_compare_u64(7, key.counter);
+		ret &= t_compare_str("dave", key.label);
+		otp_key_destroy(&key);
+	}
+	if (pipe(pfd) != 0)
+		return (0);
+	ret &= t_compare_sz(sizeof uri - 1,
+	    (size_t)write(pfd[1], uri, sizeof uri - 1));
+	close(pfd[1]);
+	ret &= t_compare_i(OTP_KEYFMT_URI, otp_key_load(&key, pfd[0], NULL));
+	close(pfd[0]);
+	if (ret) {
+		ret &= t_compare_u64(7, key.counter);
+		otp_key_destroy(&key);
+	}
+	return (ret);
+}
+
+/*
+ * Write a key to a file in binary form, load it, advance it in place,
+ * and load it again.
+ */
+static int
+t_otp_uri_binary(char **desc, void *arg)
+{
+	char path[] = "/tmp/t_otp_uri.XXXXXX";
+	char buf[1024];
+	otp_uri_error uerr;
+	oath_key key, key2;
+	size_t len;
+	int fd, ret;
+
+	(void)desc;
+	(void)arg;
+	oath_key_create(&key, om_hotp, oh_sha256, 8, "cryb.to", "erin",
+	    t_key, sizeof t_key - 1);
+	key.counter = 41;
+	len = sizeof buf;
+	if (!t_compare_i(0, otp_key_to_binary(&key, buf, &len)))
+		return (0);
+	if ((fd = mkstemp(path)) < 0)
+		return (0);
+	unlink(path);
+	ret = t_compare_sz(len, (size_t)write(fd, buf, len));
+	ret &= t_compare_i(OTP_KEYFMT_BINARY, otp_key_load(&key2, fd, NULL));
+	if (ret) {
+		ret &= t_compare_i(key.hash, key2.hash);
+		ret &= t_compare_u(key.digits, key2.digits);
+		ret &= t_compare_u64(41, key2.counter);
+		ret &= t_compare_str("erin", key2.label);
+		ret &= t_compare_str("cryb.to", key2.issuer);
+		ret &= t_compare_mem(key.key, key2.key, key.keylen);
+		otp_key_destroy(&key2);
+	}
+	key.counter = 42;
+	ret &= t_compare_i(0, otp_key_update(&key, fd));
+	ret &= t_compare_i(OTP_KEYFMT_BINARY, otp_key_load(&key2, fd, NULL));
+	if (ret) {
+		ret &= t_compare_u64(42, key2.counter);
+		/* a stale copy picks up the new counter */
+		key2.counter = 41;
+		ret &= t_compare_i(0, otp_key_refresh(&key2, fd));
+		ret &= t_compare_u64(42, key2.counter);
+		otp_key_destroy(&key2);
+	}
+	close(fd);
+	/* a record from a future version */
+	buf[4]++;
+	ret &= t_compare_i(-1, otp_key_parse(&key2, buf, len, &uerr));
+	if (ret) {
+		ret &= t_compare_sz(4, uerr.offset);
+		ret &= t_compare_str("unsupported version", uerr.msg);
+	}
+	otp_key_destroy(&key);
+	return (ret);
+}
+
+/*
+ * The wire encoding is the same on every host: check the counter's
+ * bytes, then decode the record and compare.
+ */
+static int
+t_otp_uri_wire(char **desc, void *arg)
+{
+	static const uint8_t counter[8] = { 0, 0, 0, 0, 0, 0, 0x01, 0x02 };
+	uint8_t buf[1024];
+	oath_key key, key2;
+	size_t len;
+	int ret;
+
+	(void)desc;
+	(void)arg;
+	oath_key_create(&key, om_totp, oh_sha1, 6, "cryb.to", "frank",
+	    t_key, sizeof t_key - 1);
+	key.counter = 0x0102;
+	key.lastused = 12345678;
+	len = sizeof buf;
+	if (!t_compare_i(0, otp_key_to_wire(&key, buf, &len)))
+		return (0);
+	ret = t_compare_mem(counter, buf + 16, sizeof counter);
+	ret &= t_compare_i(0, otp_key_from_wire(&key2, buf, len));
+	if (ret) {
+		ret &= t_compare_i(om_totp, key2.mode);
+		ret &= t_compare_u(30, key2.timestep);
+		ret &= t_compare_u64(12345678, key2.lastused);
+		ret &= t_compare_str("frank", key2.label);
+		ret &= t_compare_mem(key.key, key2.key, key.keylen);
+		otp_key_destroy(&key2);
+	}
+	/* truncated */
+	ret &= t_compare_i(-1, otp_key_from_wire(&key2, buf, len - 1));
+	otp_key_destroy(&key);
+	return (ret);
+}
+
+static int
+t_prepare(int argc, char *argv[])
+{
+	unsigned int i;
+
+	(void)argc;
+	(void)argv;
+	t_add_test(t_otp_uri_hotp, NULL, "hotp");
+	t_add_test(t_otp_uri_totp, NULL, "totp");
+	t_add_test(t_otp_uri_ignored, NULL, "ignored parameters");
+	t_add_test(t_otp_uri_roundtrip, NULL, "round trip");
+	for (i = 0; i < sizeof t_bad / sizeof *t_bad; ++i)
+		t_add_test(t_otp_uri_bad, &t_bad[i], "bad %s", t_bad[i].desc);
+	t_add_test(t_otp_uri_load, NULL, "load");
+	t_add_test(t_otp_uri_binary, NULL, "binary");
+	t_add_test(t_otp_uri_wire, NULL, "wire");
+	return (0);
+}
+
+int
+main(int argc, char *argv[])
+{
+
+	t_main(t_prepare, NULL, argc, argv);
+}
@@ -0,0 +1,424 @@
+/*-
+ * Copyright (c) 2026 Dag-Erling Smørgrav
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "cryb/impl.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <cryb/oath.h>
+#include <cryb/otp.h>
+
+#include <cryb/test.h>
+
+static const char rfc4226_key[] = "12345678901234567890";
+static const char rfc6238_key_sha256[] = "12345678901234567890123456789012";
+static const char rfc6238_key_sha512[] =
+    "1234567890123456789012345678901234567890123456789012345678901234";
+
+struct t_case {
+	const char	*desc;
+	oath_hash	 hash;
+	const char	*key;
+	unsigned int	 digits;
+	uint64_t	 counter;
+	unsigned long	 code;
+};
+
+/*
+ * RFC 4226 appendix D and RFC 6238 appendix B test vectors.  A TOTP
+ * code is simply an HOTP code for the time step, so we run them all as
+ * HOTP; the time steps correspond to T = 59, 1111111109, 1111111111,
+ * 1234567890, 2000000000 and 20000000000.
+ */
+static struct t_case t_cases[] = {
+	{ "RFC 4226 0", oh_sha1, rfc4226_key, 6, 0, 755224 },
+	{ "RFC 4226 1", oh_sha1, rfc4226_key, 6, 1, 287082 },
+	{ "RFC 4226 2", oh_sha1, rfc4226_key, 6, 2, 359152 },
+	{ "RFC 4226 3", oh_sha1, rfc4226_key, 6, 3, 969429 },
+	{ "RFC 4226 4", oh_sha1, rfc4226_key, 6, 4, 338314 },
+	{ "RFC 4226 5", oh_sha1, rfc4226_key, 6, 5, 254676 },
+	{ "RFC 4226 6", oh_sha1, rfc4226_key, 6, 6, 287922 },
+	{ "RFC 4226 7", oh_sha1, rfc4226_key, 6, 7, 162583 },
+	{ "RFC 4226 8", oh_sha1, rfc4226_key, 6, 8, 399871 },
+	{ "RFC 4226 9", oh_sha1, rfc4226_key, 6, 9, 520489 },
+	{ "RFC 6238 SHA1 1", oh_sha1, rfc4226_key, 8, 1, 94287082 },
+	{ "RFC 6238 SHA1 2", oh_sha1, rfc4226_key, 8, 37037036, 7081804 },
+	{ "RFC 6238 SHA1 3", oh_sha1, rfc4226_key, 8, 37037037, 14050471 },
+	{ "RFC 6238 SHA1 4", oh_sha1, rfc4226_key, 8, 41152263, 89005924 },
+	{ "RFC 6238 SHA1 5", oh_sha1, rfc4226_key, 8, 66666666, 69279037 },
+	{ "RFC 6238 SHA1 6", oh_sha1, rfc4226_key, 8, 666666666, 65353130 },
+	{ "RFC 6238 SHA256 1", oh_sha256, rfc6238_key_sha256, 8,
+	  1, 46119246 },
+	{ "RFC 6238 SHA256 2", oh_sha256, rfc6238_key_sha256, 8,
+	  37037036, 68084774 },
+	{ "RFC 6238 SHA256 3", oh_sha256, rfc6238_key_sha256, 8,
+	  37037037, 67062674 },
+	{ "RFC 6238 SHA256 4", oh_sha256, rfc6238_key_sha256, 8,
+	  41152263, 91819424 },
+	{ "RFC 6238 SHA256 5", oh_sha256, rfc6238_key_sha256, 8,
+	  66666666, 90698825 },
+	{ "RFC 6238 SHA256 6", oh_sha256, rfc6238_key_sha256, 8,
+	  666666666, 77737706 },
+	{ "RFC 6238 SHA512 1", oh_sha512, rfc6238_key_sha512, 8,
+	  1, 90693936 },
+	{ "RFC 6238 SHA512 2", oh_sha512, rfc6238_key_sha512, 8,
+	  37037036, 25091201 },
+	{ "RFC 6238 SHA512 3", oh_sha512, rfc6238_key_sha512, 8,
+	  37037037, 99943326 },
+	{ "RFC 6238 SHA512 4", oh_sha512, rfc6238_key_sha512, 8,
+	  41152263, 93441116 },
+	{ "RFC 6238 SHA512 5", oh_sha512, rfc6238_key_sha512, 8,
+	  66666666, 38618901 },
+	{ "RFC 6238 SHA512 6", oh_sha512, rfc6238_key_sha512, 8,
+	  666666666, 47863826 },
+};
+
+static void
+t_key(oath_key *key, const struct t_case *tc, uint64_t counter)
+{
+
+	oath_key_create(key, om_hotp, tc->hash, tc->digits, "", "user",
+	    tc->key, strlen(tc->key));
+	key->counter = counter;
+}
+
+/*
+ * Check that the code is accepted at the start of the window, that it
+ * is accepted at the end of the window, and that it is not accepted
+ * once the counter has moved past it.
+ */
+static int
+t_otp_verify(char **desc, void *arg)
+{
+	struct t_case *tc = arg;
+	oath_key key;
+	int ret;
+
+	(void)desc;
+	t_key(&key, tc, tc->counter);
+	ret = t_compare_i(1, otp_verify(&key, tc->code));
+	ret &= t_compare_u64(tc->counter + 1, key.counter);
+	ret &= t_compare_i(0, otp_verify(&key, tc->code));
+	ret &= t_compare_u64(tc->counter + 1, key.counter);
+	if (tc->counter >= 8) {
+		t_key(&key, tc, tc->counter - 8);
+		ret &= t_compare_i(9, otp_verify(&key, tc->code));
+		ret &= t_compare_u64(tc->counter + 1, key.counter);
+	}
+	if (tc->counter >= 9) {
+		t_key(&key, tc, tc->counter - 9);
+		ret &= t_compare_i(0, otp_verify(&key, tc->code));
+		ret &= t_compare_u64(tc->counter - 9, key.counter);
+	}
+	oath_key_destroy(&key);
+	return (ret);
+}
+
+/*
+ * Check HOTP look-ahead windows smaller and larger than the default,
+ * and TOTP look-behind, look-ahead and skew.
+ */
+static int
+t_otp_verify_policy(char **desc, void *arg)
+{
+	const struct t_case *tc = &t_cases[0];
+	otp_policy pol;
+	oath_key key;
+	uint64_t seq;
+	int ret;
+
+	(void)desc;
+	(void)arg;
+	otp_policy_init(&pol);
+	pol.hotp_lookahead = 3;
+	t_key(&key, tc, 0);
+	ret = t_compare_i(0, otp_verify_policy(&key, t_cases[3].code, &pol));
+	ret &= t_compare_i(3, otp_verify_policy(&key, t_cases[2].code, &pol));
+	pol.hotp_lookahead = 20;
+	t_key(&key, tc, 0);
+	ret &= t_compare_i(10, otp_verify_policy(&key, t_cases[9].code, &pol));
+	pol.hotp_lookahead = 0;
+	ret &= t_compare_i(-1, otp_verify_policy(&key, t_cases[9].code, &pol));
+	ret &= t_compare_i(EINVAL, errno);
+	oath_key_destroy(&key);
+
+	/* accept only the time step three steps ago (or the one after) */
+	otp_policy_init(&pol);
+	pol.totp_lookbehind = 0;
+	pol.totp_lookahead = 1;
+	pol.totp_skew = -3;
+	oath_key_create(&key, om_totp, oh_sha1, 6, "", "user",
+	    tc->key, strlen(tc->key));
+	seq = (uint64_t)time(NULL) / key.timestep;
+	ret &= t_compare_i(0, otp_verify_policy(&key,
+	    oath_hotp(key.key, key.keylen, seq, key.digits), &pol));
+	ret &= t_compare_i(0, otp_verify_policy(&key,
+	    oath_hotp(key.key, key.keylen, seq - 4, key.digits), &pol));
+	ret &= t_compare_i(1, otp_verify_policy(&key,
+	    oath_hotp(key.key, key.keylen, seq - 3, key.digits), &pol));
+	ret &= t_compare_u64(seq - 3, key.lastused);
+	oath_key_destroy(&key);
+
+	/* the result is one more than the position within the window */
+	otp_policy_init(&pol);
+	oath_key_create(&key, om_totp, oh_sha1, 6, "", "user",
+	    tc->key, strlen(tc->key));
+	seq = (uint64_t)time(NULL) / key.timestep;
+	ret &= t_compare_i(pol.totp_lookbehind, otp_verify(&key,
+	    oath_hotp(key.key, key.keylen, seq - 1, key.digits)));
+	ret &= t_compare_i(pol.totp_lookbehind + 1, otp_verify(&key,
+	    oath_hotp(key.key, key.keylen, seq, key.digits)));
+	ret &= t_compare_u64(seq, key.lastused);
+	oath_key_destroy(&key);
+	return (ret);
+}
+
+/*
+ * Check that constant-time matching accepts and rejects the same codes
+ * as the default, at every offset in the HOTP window and at either
+ * side of the last used TOTP time step.
+ */
+static int
+t_otp_verify_ct(char **desc, void *arg)
+{
+	const struct t_case *tc = &t_cases[0];
+	otp_policy pol, ctpol;
+	oath_key key, ctkey;
+	uint64_t seq;
+	unsigned int i;
+	int ret;
+
+	(void)desc;
+	(void)arg;
+	otp_policy_init(&pol);
+	ctpol = pol;
+	ctpol.flags = OTP_POLICY_CONSTTIME;
+	ret = 1;
+	for (i = 0; i < 10; ++i) {
+		t_key(&key, tc, 0);
+		t_key(&ctkey, tc, 0);
+		ret &= t_compare_i(otp_verify_policy(&key, t_cases[i].code,
+		    &pol), otp_verify_policy(&ctkey, t_cases[i].code, &ctpol));
+		ret &= t_compare_u64(key.counter, ctkey.counter);
+		oath_key_destroy(&key);
+		oath_key_destroy(&ctkey);
+	}
+	oath_key_create(&key, om_totp, oh_sha1, 6, "", "user",
+	    tc->key, strlen(tc->key));
+	seq = (uint64_t)time(NULL) / key.timestep;
+	key.lastused = seq;
+	ret &= t_compare_i(0, otp_verify_policy(&key,
+	    oath_hotp(key.key, key.keylen, seq - 1, key.digits), &ctpol));
+	ret &= t_compare_i(0, otp_verify_policy(&key,
+	    oath_hotp(key.key, key.keylen, seq, key.digits), &ctpol));
+	ret &= t_compare_u64(seq, key.lastused);
+	ret &= t_compare_i(1, otp_verify_policy(&key,
+	    oath_hotp(key.key, key.keylen, seq + 1, key.digits), &ctpol) > 0);
+	ret &= t_compare_u64(seq + 1, key.lastused);
+	ctpol.flags = 0x8000;
+	ret &= t_compare_i(-1, otp_verify_policy(&key, 0, &ctpol));
+	ret &= t_compare_i(EINVAL, errno);
+	oath_key_destroy(&key);
+	return (ret);
+}
+
+/*
+ * Run every test case through otp_verify_batch(), including a few
+ * duplicate entries, and check that the results are the same as for
+ * otp_verify().
+ */
+static int
+t_otp_verify_batch(char **desc, void *arg)
+{
+	enum { N = sizeof t_cases / sizeof t_cases[0] };
+	static oath_key bkeys[2 * N], vkeys[2 * N];
+	oath_key *kp[2 * N];
+	unsigned long responses[2 * N];
+	int results[2 * N], expected, matched;
+	unsigned int i, j;
+	int ret;
+
+	(void)desc;
+	(void)arg;
+	for (i = 0; i < 2 * N; ++i) {
+		/* every other entry reuses the previous entry's key */
+		j = i % N;
+		if (i % 2 == 0 || i < N) {
+			t_key(&bkeys[i], &t_cases[j], t_cases[j].counter -
+			    (t_cases[j].counter > 3 ? 3 : 0));
+			kp[i] = &bkeys[i];
+		} else {
+			kp[i] = kp[i - 1];
+		}
+		responses[i] = t_cases[j].code;
+	}
+	for (i = 0; i < 2 * N; ++i)
+		if (kp[i] == &bkeys[i])
+			vkeys[i] = bkeys[i];
+	matched = otp_verify_batch(kp, responses, results, 2 * N);
+	ret = 1;
+	for (i = 0, j = 0; i < 2 * N; ++i) {
+		if (kp[i] != &bkeys[i])
+			expected = otp_verify(&vkeys[i - 1], responses[i]);
+		else
+			expected = otp_verify(&vkeys[i], responses[i]);
+		ret &= t_compare_i(expected, results[i]);
+		if (expected > 0)
+			j++;
+	}
+	for (i = 0; i < 2 * N; ++i)
+		if (kp[i] == &bkeys[i])
+			ret &= t_compare_u64(vkeys[i].counter, bkeys[i].counter);
+	ret &= t_compare_i(j, matched);
+	return (ret);
+}
+
+/*
+ * Replace a key in place with a different one and check that the
+ * cached HMAC state for the old key is not used for the new one.
+ */
+static int
+t_otp_verify_cache(char **desc, void *arg)
+{
+	oath_key key;
+	int ret;
+
+	(void)desc;
+	(void)arg;
+	t_key(&key, &t_cases[16], 1);
+	ret = t_compare_i(1, otp_verify(&key, t_cases[16].code));
+	t_key(&key, &t_cases[10], 1);
+	ret &= t_compare_i(1, otp_verify(&key, t_cases[10].code));
+	t_key(&key, &t_cases[22], 1);
+	ret &= t_compare_i(1, otp_verify(&key, t_cases[22].code));
+	otp_key_destroy(&key);
+	t_key(&key, &t_cases[16], 1);
+	ret &= t_compare_i(1, otp_verify(&key, t_cases[16].code));
+	otp_key_destroy(&key);
+	return (ret);
+}
+
+/*
+ * Generate the RFC 4226 codes as a single range, then each test case as
+ * a range of one, and check that the key is left untouched and that a
+ * range which runs past the end of the counter space is rejected.
+ */
+static int
+t_otp_generate_range(char **desc, void *arg)
+{
+	unsigned int codes[10];
+	unsigned int i;
+	oath_key key;
+	int ret;
+
+	(void)desc;
+	(void)arg;
+	t_key(&key, &t_cases[0], 42);
+	ret = t_compare_i(0, otp_generate_range(&key, 0, 10, codes));
+	for (i = 0; i < 10; ++i)
+		ret &= t_compare_u(t_cases[i].code, codes[i]);
+	ret &= t_compare_u64(42, key.counter);
+	ret &= t_compare_i(-1,
+	    otp_generate_range(&key, UINT64_MAX - 8, 10, codes));
+	ret &= t_compare_i(EINVAL, errno);
+	ret &= t_compare_i(0, otp_generate_range(&key, UINT64_MAX - 9, 10,
+	    codes));
+	otp_key_destroy(&key);
+	for (i = 0; i < sizeof t_cases / sizeof t_cases[0]; ++i) {
+		t_key(&key, &t_cases[i], 0);
+		ret &= t_compare_i(0,
+		    otp_generate_range(&key, t_cases[i].counter, 1, codes));
+		ret &= t_compare_u(t_cases[i].code, codes[0]);
+		otp_key_destroy(&key);
+	}
+	return (ret);
+}
+
+/*
+ * Run all test cases with a specific SIMD implementation, and compare
+ * the codes it produces for an entire range against the scalar code.
+ */
+static int
+t_otp_verify_simd(char **desc, void *arg)
+{
+	const char *name = arg;
+	unsigned int i, n;
+	oath_key key;
+	int ret;
+
+	if (otp_simd_select(name) != 0) {
+		*desc = "skipped (not supported)";
+		otp_simd_select(NULL);
+		return (1);
+	}
+	ret = 1;
+	for (i = 0; i < sizeof t_cases / sizeof t_cases[0]; ++i)
+		ret &= t_otp_verify(desc, &t_cases[i]);
+	/* walk the counter across a lane boundary one code at a time */
+	t_key(&key, &t_cases[0], UINT32_MAX - 20);
+	for (n = 0; n < 40; ++n)
+		ret &= t_compare_i(1, otp_verify(&key,
+		    oath_hotp(key.key, key.keylen, key.counter, key.digits)));
+	ret &= t_compare_u64((uint64_t)UINT32_MAX + 20, key.counter);
+	oath_key_destroy(&key);
+	otp_simd_select(NULL);
+	return (ret);
+}
+
+static int
+t_prepare(int argc, char *argv[])
+{
+	static const char *simd[] = { "scalar", "sse2", "avx2", "avx512" };
+	unsigned int i;
+
+	(void)argc;
+	(void)argv;
+	for (i = 0; i < sizeof t_cases / sizeof t_cases[0]; ++i)
+		t_add_test(t_otp_verify, &t_cases[i], "%s", t_cases[i].desc);
+	t_add_test(t_otp_verify_policy, NULL, "policy");
+	t_add_test(t_otp_verify_ct, NULL, "constant time");
+	t_add_test(t_otp_verify_batch, NULL, "batch");
+	t_add_test(t_otp_verify_cache, NULL, "cache");
+	t_add_test(t_otp_generate_range, NULL, "generate range");
+	for (i = 0; i < sizeof simd / sizeof simd[0]; ++i)
+		t_add_test(t_otp_verify_simd, (void *)(uintptr_t)simd[i],
+		    "simd %s", simd[i]);
+	return (0);
+}
+
+int
+main(int argc, char *argv[])
+{
+
+	t_main(t_prepare, NULL, argc, argv);
+}
@@ -0,0 +1,286 @@
+/*-
+ * Copyright (c) 2026 Dag-Erling Smørgrav
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "cryb/impl.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <cryb/oath.h>
+#include <cryb/otp.h>
+
+#include <cryb/test.h>
+
+#define T_THREADS	8
+#define T_CODES		16
+
+static char t_dir[] = "/tmp/t_otp_wal.XXXXXX";
+static char t_path[64];
+static char t_walpath[64];
+
+static oath_key t_key;
+static unsigned int t_codes[T_CODES];
+
+static otp_wal *t_wal;
+static pthread_barrier_t t_barrier;
+
+static void
+t_user(char *user, size_t size, unsigned int i)
+{
+
+	snprintf(user, size, "user%u", i);
+}
+
+/*
+ * Create a store with one user per thread, all sharing the same key
+ * with the counter at zero.
+ */
+static int
+t_init(void)
+{
+	char user[16];
+	otp_store *st;
+	unsigned int i;
+	int ret;
+
+	unlink(t_path);
+	unlink(t_walpath);
+	if ((st = otp_store_open(t_path, O_RDWR|O_CREAT)) == NULL)
+		return (-1);
+	for (i = ret = 0; ret == 0 && i < T_THREADS; ++i) {
+		t_user(user, sizeof user, i);
+		ret = otp_store_update(st, user, &t_key);
+	}
+	otp_store_close(st);
+	return (ret);
+}
+
+/*
+ * Put every counter back to zero, as if the store had not been
+ * flushed to disk before a crash.
+ */
+static int
+t_revert(void)
+{
+	char user[16];
+	otp_store *st;
+	unsigned int i;
+	int ret;
+
+	if ((st = otp_store_open(t_path, O_RDWR)) == NULL)
+		return (-1);
+	for (i = ret = 0; ret == 0 && i < T_THREADS; ++i) {
+		t_user(user, sizeof user, i);
+		ret = otp_store_update(st, user, &t_key);
+	}
+	otp_store_close(st);
+	return (ret);
+}
+
+/*
+ * Check that the counter for each of the first n users is as expected.
+ */
+static int
+t_check(unsigned int n, uint64_t counter)
+{
+	char user[16];
+	oath_key key;
+	otp_store *st;
+	unsigned int i;
+	int ret;
+
+	if ((st = otp_store_open(t_path, O_RDONLY)) == NULL)
+		return (0);
+	for (i = 0, ret = 1; i < n; ++i) {
+		t_user(user, sizeof user, i);
+		ret &= t_compare_i(0, otp_store_lookup(st, user, &key));
+		ret &= t_compare_u64(counter, key.counter);
+	}
+	otp_store_close(st);
+	return (ret);
+}
+
+static void *
+t_wal_thread(void *arg)
+{
+	char user[16];
+	otp_store *st;
+	unsigned int i;
+	intptr_t ok;
+
+	t_user(user, sizeof user, (uintptr_t)arg);
+	if ((st = otp_store_open(t_path, O_RDWR)) == NULL ||
+	    otp_store_set_wal(st, t_wal) != 0) {
+		pthread_barrier_wait(&t_barrier);
+		otp_store_close(st);
+		return ((void *)0);
+	}
+	pthread_barrier_wait(&t_barrier);
+	for (i = 0, ok = 1; i < T_CODES; ++i)
+		if (otp_store_verify(st, user, t_codes[i]) != 1)
+			ok = 0;
+	otp_store_close(st);
+	return ((void *)ok);
+}
+
+/*
+ * In a child process, open the log and let n threads verify every
+ * code for their respective users, then exit without closing the log
+ * or flushing the store.
+ */
+static int
+t_crash(unsigned int n)
+{
+	pthread_t thr[T_THREADS];
+	unsigned int i;
+	void *ok;
+	pid_t pid;
+	int status;
+
+	if ((pid = fork()) < 0)
+		return (-1);
+	if (pid == 0) {
+		if ((t_wal = otp_wal_open(t_walpath, t_path)) == NULL)
+			_exit(1);
+		pthread_barrier_init(&t_barrier, NULL, n);
+		for (i = 0; i < n; ++i)
+			if (pthread_create(&thr[i], NULL, t_wal_thread,
+			    (void *)(uintptr_t)i) != 0)
+				_exit(1);
+		status = 0;
+		for (i = 0; i < n; ++i)
+			if (pthread_join(thr[i], &ok) != 0 || ok == NULL)
+				status = 1;
+		_exit(status);
+	}
+	if (waitpid(pid, &status, 0) != pid)
+		return (-1);
+	return (WIFEXITED(status) && WEXITSTATUS(status) == 0 ? 0 : -1);
+}
+
+static int
+t_otp_wal_replay(char **desc, void *arg)
+{
+	struct stat sb;
+	otp_wal *wal, *wal2;
+	int ret;
+
+	(void)desc;
+	(void)arg;
+	if (t_init() != 0 || t_crash(T_THREADS) != 0 || t_revert() != 0)
+		return (0);
+	ret = t_check(T_THREADS, 0);
+	if ((wal = otp_wal_open(t_walpath, t_path)) == NULL)
+		return (0);
+	ret &= t_check(T_THREADS, T_CODES);
+	/* the log was emptied after replay */
+	ret &= t_compare_i(0, stat(t_walpath, &sb));
+	ret &= t_compare_sz(0, sb.st_size);
+	/* and only one process may use it at a time */
+	if ((wal2 = otp_wal_open(t_walpath, t_path)) != NULL) {
+		otp_wal_close(wal2);
+		ret = 0;
+	} else {
+		ret &= t_compare_i(EWOULDBLOCK, errno);
+	}
+	otp_wal_close(wal);
+	return (ret);
+}
+
+static int
+t_otp_wal_torn(char **desc, void *arg)
+{
+	struct stat sb;
+	off_t recsize;
+	otp_wal *wal;
+	int ret;
+
+	(void)desc;
+	(void)arg;
+	if (t_init() != 0 || t_crash(1) != 0 || t_revert() != 0 ||
+	    stat(t_walpath, &sb) != 0)
+		return (0);
+	/* cut the last record in half */
+	recsize = sb.st_size / T_CODES;
+	ret = t_compare_sz(T_CODES * recsize, sb.st_size);
+	if (truncate(t_walpath, sb.st_size - recsize / 2) != 0)
+		return (0);
+	if ((wal = otp_wal_open(t_walpath, t_path)) == NULL)
+		return (0);
+	ret &= t_check(1, T_CODES - 1);
+	otp_wal_close(wal);
+	return (ret);
+}
+
+static int
+t_prepare(int argc, char *argv[])
+{
+	unsigned int i;
+
+	(void)argc;
+	(void)argv;
+	if (mkdtemp(t_dir) == NULL)
+		return (-1);
+	snprintf(t_path, sizeof t_path, "%s/store", t_dir);
+	snprintf(t_walpath, sizeof t_walpath, "%s/wal", t_dir);
+	oath_key_create(&t_key, om_hotp, oh_sha1, 6, "cryb.to", "alice",
+	    "12345678901234567890", 20);
+	for (i = 0; i < T_CODES; ++i)
+		t_codes[i] = oath_hotp(t_key.key, t_key.keylen, i, t_key.digits);
+	t_add_test(t_otp_wal_replay, NULL, "replay");
+	t_add_test(t_otp_wal_torn, NULL, "torn record");
+	return (0);
+}
+
+static void
+t_cleanup(void)
+{
+
+	otp_key_destroy(&t_key);
+	unlink(t_walpath);
+	unlink(t_path);
+	rmdir(t_dir);
+}
+
+int
+main(int argc, char *argv[])
+{
+
+	t_main(t_prepare, t_cleanup, argc, argv);
+}
@@ -0,0 +1,266 @@
+/*-
+ * Copyright (c) 2026 Dag-Erling Smørgrav
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "cryb/impl.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <cryb/oath.h>
+#include <cryb/otp.h>
+
+#include <cryb/test.h>
+
+#ifndef OTPD
+#define OTPD "../sbin/otpd/otpd"
+#endif
+
+/*
+ * These tests run the daemon on a socket in a temporary directory and
+ * talk to it through the client library.  The key is the RFC 4226
+ * test key, for which the first ten codes are known.
+ */
+
+#define T_NUSERS	100
+
+static const unsigned long t_codes[] = {
+	755224, 287082, 359152, 969429, 338314,
+	254676, 287922, 162583, 399871, 520489,
+};
+
+static char t_dir[] = "/tmp/t_otpd.XXXXXX";
+static char t_store[64], t_sock[64];
+static pid_t t_pid = -1;
+static otp_client *t_cl;
+
+/*
+ * Accept a correct code, then reject a replay, a wrong code, and codes
+ * for users who have no key or whose names are too long.
+ */
+static int
+t_verify(char **desc, void *arg)
+{
+	char longname[OTPD_MAXUSERLEN + 2];
+	int ret;
+
+	(void)desc;
+	(void)arg;
+	ret = t_compare_i(1, otp_client_verify(t_cl, "alice", t_codes[0]));
+	ret &= t_compare_i(0, otp_client_verify(t_cl, "alice", t_codes[0]));
+	ret &= t_compare_i(0, otp_client_verify(t_cl, "alice", 123456));
+	ret &= t_compare_i(-1, otp_client_verify(t_cl, "nobody", t_codes[1]));
+	ret &= t_compare_i(ENOENT, errno);
+	memset(longname, 'x', sizeof longname - 1);
+	longname[sizeof longname - 1] = '\0';
+	ret &= t_compare_i(-1, otp_client_verify(t_cl, longname, t_codes[1]));
+	ret &= t_compare_i(EINVAL, errno);
+	ret &= t_compare_i(1, otp_client_verify(t_cl, "alice", t_codes[1]));
+	return (ret);
+}
+
+/*
+ * Resynchronize with two codes well past the verification window,
+ * after which the next code is accepted.
+ */
+static int
+t_resync(char **desc, void *arg)
+{
+	unsigned long codes[2] = { t_codes[5], t_codes[6] };
+	int ret;
+
+	(void)desc;
+	(void)arg;
+	ret = t_compare_i(0, otp_client_verify(t_cl, "bob", t_codes[9]));
+	ret &= t_compare_i(1, otp_client_resync(t_cl, "bob", codes, 2));
+	ret &= t_compare_i(0, otp_client_resync(t_cl, "bob", codes, 2));
+	ret &= t_compare_i(1, otp_client_verify(t_cl, "bob", t_codes[7]));
+	return (ret);
+}
+
+/*
+ * Send the first two codes for every user in one pipelined batch,
+ * which is larger than the client's internal batch size.  Requests on
+ * a connection are answered in order, so all are accepted.  Then do
+ * it again and check that all are rejected.
+ */
+static int
+t_pipeline(char **desc, void *arg)
+{
+	static char names[T_NUSERS][16];
+	const char *users[2 * T_NUSERS];
+	unsigned long responses[2 * T_NUSERS];
+	int results[2 * T_NUSERS];
+	unsigned int i;
+	int ret;
+
+	(void)desc;
+	(void)arg;
+	for (i = 0; i < 2 * T_NUSERS; ++i) {
+		snprintf(names[i / 2], sizeof names[i / 2], "user%u", i / 2);
+		users[i] = names[i / 2];
+		responses[i] = t_codes[i % 2];
+	}
+	ret = t_compare_i(0, otp_client_verify_batch(t_cl, users, responses,
+	    results, 2 * T_NUSERS));
+	for (i = 0; i < 2 * T_NUSERS; ++i)
+		ret &= t_compare_i(1, results[i]);
+	ret &= t_compare_i(0, otp_client_verify_batch(t_cl, users, responses,
+	    results, 2 * T_NUSERS));
+	for (i = 0; i < 2 * T_NUSERS; ++i)
+		ret &= t_compare_i(0, results[i]);
+	return (ret);
+}
+
+/*
+ * Send garbage on a separate connection.  The daemon should hang up
+ * on us without disturbing other clients.
+ */
+static int
+t_garbage(char **desc, void *arg)
+{
+	struct sockaddr_un sun;
+	uint8_t buf[OTPD_HDRLEN];
+	int fd, ret;
+
+	(void)desc;
+	(void)arg;
+	memset(&sun, 0, sizeof sun);
+	sun.sun_family = AF_UNIX;
+	strcpy(sun.sun_path, t_sock);
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+		return (0);
+	if (connect(fd, (struct sockaddr *)&sun, sizeof sun) != 0) {
+		close(fd);
+		return (0);
+	}
+	memset(buf, 0xff, sizeof buf);
+	ret = t_compare_i(OTPD_HDRLEN, write(fd, buf, sizeof buf));
+	ret &= t_compare_i(0, read(fd, buf, sizeof buf));
+	close(fd);
+	ret &= t_compare_i(1, otp_client_verify(t_cl, "alice", t_codes[2]));
+	return (ret);
+}
+
+static int
+t_start(void)
+{
+	char user[16];
+	oath_key key;
+	otp_store *st;
+	unsigned int i;
+	int ret;
+
+	if (mkdtemp(t_dir) == NULL)
+		return (-1);
+	snprintf(t_store, sizeof t_store, "%s/store", t_dir);
+	snprintf(t_sock, sizeof t_sock, "%s/sock", t_dir);
+	if ((st = otp_store_open(t_store, O_RDWR|O_CREAT)) == NULL)
+		return (-1);
+	oath_key_create(&key, om_hotp, oh_sha1, 6, "cryb.to", "alice",
+	    "12345678901234567890", 20);
+	ret = otp_store_update(st, "alice", &key);
+	if (ret == 0)
+		ret = otp_store_update(st, "bob", &key);
+	for (i = 0; ret == 0 && i < T_NUSERS; ++i) {
+		snprintf(user, sizeof user, "user%u", i);
+		ret = otp_store_update(st, user, &key);
+	}
+	oath_key_destroy(&key);
+	otp_store_close(st);
+	if (ret != 0)
+		return (-1);
+
+	if ((t_pid = fork()) < 0)
+		return (-1);
+	if (t_pid == 0) {
+		execl(OTPD, "otpd", "-f", "-t", "2", "-k", t_store,
+		    "-s", t_sock, (char *)NULL);
+		_exit(1);
+	}
+
+	/* wait for the daemon to start listening */
+	for (i = 0; i < 25; ++i) {
+		if ((t_cl = otp_client_open(t_sock)) != NULL)
+			return (0);
+		usleep(200000);
+	}
+	return (-1);
+}
+
+static void t_cleanup(void);
+
+static int
+t_prepare(int argc, char *argv[])
+{
+
+	(void)argc;
+	(void)argv;
+	if (t_start() != 0) {
+		t_cleanup();
+		return (-1);
+	}
+	t_add_test(t_verify, NULL, "verify");
+	t_add_test(t_resync, NULL, "resync");
+	t_add_test(t_pipeline, NULL, "pipeline");
+	t_add_test(t_garbage, NULL, "garbage");
+	return (0);
+}
+
+static void
+t_cleanup(void)
+{
+	int status;
+
+	otp_client_close(t_cl);
+	if (t_pid > 0) {
+		kill(t_pid, SIGTERM);
+		waitpid(t_pid, &status, 0);
+	}
+	unlink(t_sock);
+	unlink(t_store);
+	rmdir(t_dir);
+}
+
+int
+main(int argc, char *argv[])
+{
+
+	t_main(t_prepare, t_cleanup, argc, argv);
+}
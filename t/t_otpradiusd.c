@@ -0,0 +1,392 @@
+/*-
+ * Copyright (c) 2026 Dag-Erling Smørgrav
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "cryb/impl.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <cryb/endian.h>
+#include <cryb/md5.h>
+#include <cryb/oath.h>
+#include <cryb/otp.h>
+
+#include <cryb/test.h>
+
+#ifndef OTPRADIUSD
+#define OTPRADIUSD "../sbin/otpradiusd/otpradiusd"
+#endif
+
+/*
+ * These tests run the server on the loopback interface and talk to it
+ * through a minimal RADIUS client.
+ */
+
+static char t_dir[] = "/tmp/t_otpradiusd.XXXXXX";
+static char t_store[64], t_secretfile[64];
+static const char t_secret[] = "xyzzy";
+static struct sockaddr_in t_sin;
+static pid_t t_pid = -1;
+static int t_sock = -1;
+static uint8_t t_id;
+
+struct t_packet {
+	uint8_t		 buf[4096];
+	size_t		 len;
+};
+
+static void
+t_hmac_md5(const char *key, const uint8_t *msg, size_t len, uint8_t *mac)
+{
+	uint8_t pad[MD5_BLOCK_LEN];
+	md5_ctx ctx;
+	size_t i;
+
+	memset(pad, 0x36, sizeof pad);
+	for (i = 0; key[i] != '\0'; ++i)
+		pad[i] ^= key[i];
+	md5_init(&ctx);
+	md5_update(&ctx, pad, sizeof pad);
+	md5_update(&ctx, msg, len);
+	md5_final(&ctx, mac);
+	for (i = 0; i < sizeof pad; ++i)
+		pad[i] ^= 0x36 ^ 0x5c;
+	md5_init(&ctx);
+	md5_update(&ctx, pad, sizeof pad);
+	md5_update(&ctx, mac, MD5_DIGEST_LEN);
+	md5_final(&ctx, mac);
+}
+
+/*
+ * Build an Access-Request with a hidden User-Password and, optionally,
+ * a Message-Authenticator.
+ */
+static void
+t_request(struct t_packet *req, const char *secret, const char *user,
+    const char *pass, int msgauth)
+{
+	uint8_t b[MD5_DIGEST_LEN], *p;
+	const uint8_t *prev;
+	size_t i, j, passlen;
+	md5_ctx ctx;
+
+	memset(req, 0, sizeof *req);
+	p = req->buf;
+	p[0] = 1;
+	p[1] = t_id++;
+	for (i = 0; i < 16; ++i)
+		p[4 + i] = random();
+	req->len = 20;
+	p[req->len++] = 1;
+	p[req->len++] = 2 + strlen(user);
+	memcpy(p + req->len, user, strlen(user));
+	req->len += strlen(user);
+	passlen = (strlen(pass) + 15) / 16 * 16;
+	p[req->len++] = 2;
+	p[req->len++] = 2 + passlen;
+	memcpy(p + req->len, pass, strlen(pass));
+	for (i = 0, prev = p + 4; i < passlen; i += 16) {
+		md5_init(&ctx);
+		md5_update(&ctx, secret, strlen(secret));
+		md5_update(&ctx, prev, 16);
+		md5_final(&ctx, b);
+		for (j = 0; j < 16; ++j)
+			p[req->len + i + j] ^= b[j];
+		prev = p + req->len + i;
+	}
+	req->len += passlen;
+	if (msgauth) {
+		p[req->len++] = 80;
+		p[req->len++] = 18;
+		req->len += 16;
+	}
+	be16enc(p + 2, req->len);
+	if (msgauth)
+		t_hmac_md5(secret, p, req->len, p + req->len - 16);
+}
+
+/*
+ * Send a request and wait for a response, retransmitting up to tries
+ * times.  Returns 1 if we got a response, otherwise 0.
+ */
+static int
+t_exchange(const struct t_packet *req, struct t_packet *resp, int tries)
+{
+	struct pollfd pfd;
+	ssize_t len;
+
+	while (tries-- > 0) {
+		/* ECONNREFUSED means nobody is listening (yet) */
+		if (send(t_sock, req->buf, req->len, 0) != (ssize_t)req->len) {
+			if (errno != ECONNREFUSED)
+				return (0);
+			usleep(200000);
+			continue;
+		}
+		pfd.fd = t_sock;
+		pfd.events = POLLIN;
+		if (poll(&pfd, 1, 200) != 1)
+			continue;
+		if ((len = recv(t_sock, resp->buf, sizeof resp->buf, 0)) < 0) {
+			if (errno != ECONNREFUSED)
+				return (0);
+			usleep(200000);
+			continue;
+		}
+		resp->len = len;
+		return (1);
+	}
+	return (0);
+}
+
+/*
+ * Check that a response matches a request and carries a correct
+ * response authenticator and, if present, Message-Authenticator.
+ */
+static int
+t_response(const struct t_packet *req, const struct t_packet *resp,
+    uint8_t code)
+{
+	uint8_t buf[4096], mac[MD5_DIGEST_LEN];
+	md5_ctx ctx;
+	int ret;
+
+	if (!t_compare_sz(be16dec(resp->buf + 2), resp->len))
+		return (0);
+	ret = t_compare_u(code, resp->buf[0]);
+	ret &= t_compare_u(req->buf[1], resp->buf[1]);
+	memcpy(buf, resp->buf, resp->len);
+	memcpy(buf + 4, req->buf + 4, 16);
+	md5_init(&ctx);
+	md5_update(&ctx, buf, resp->len);
+	md5_update(&ctx, t_secret, strlen(t_secret));
+	md5_final(&ctx, mac);
+	ret &= t_compare_mem(mac, resp->buf + 4, sizeof mac);
+	if (resp->len == 38 && buf[20] == 80) {
+		memset(buf + 22, 0, 16);
+		t_hmac_md5(t_secret, buf, resp->len, mac);
+		ret &= t_compare_mem(mac, resp->buf + 22, sizeof mac);
+	} else {
+		ret &= t_compare_sz(20, resp->len);
+	}
+	return (ret);
+}
+
+/*
+ * Accept a correct code, accept a retransmission of the same request,
+ * and reject a replay of the same code in a new request.
+ */
+static int
+t_accept(char **desc, void *arg)
+{
+	struct t_packet req, req2, resp;
+	int ret;
+
+	(void)desc;
+	(void)arg;
+	t_request(&req, t_secret, "alice", "755224", 1);
+	ret = t_exchange(&req, &resp, 1);
+	ret &= t_response(&req, &resp, 2);
+	ret &= t_exchange(&req, &resp, 1);
+	ret &= t_response(&req, &resp, 2);
+	t_request(&req2, t_secret, "alice", "755224", 1);
+	ret &= t_exchange(&req2, &resp, 1);
+	ret &= t_response(&req2, &resp, 3);
+	t_request(&req, t_secret, "alice", "359152", 1);
+	ret &= t_exchange(&req, &resp, 1);
+	ret &= t_response(&req, &resp, 2);
+	return (ret);
+}
+
+/*
+ * Reject unknown users and wrong codes, and ignore requests from
+ * clients that do not know the shared secret.
+ */
+static int
+t_reject(char **desc, void *arg)
+{
+	struct t_packet req, resp;
+	int ret;
+
+	(void)desc;
+	(void)arg;
+	t_request(&req, t_secret, "nobody", "755224", 1);
+	ret = t_exchange(&req, &resp, 1);
+	ret &= t_response(&req, &resp, 3);
+	t_request(&req, t_secret, "bob", "123456", 1);
+	ret &= t_exchange(&req, &resp, 1);
+	ret &= t_response(&req, &resp, 3);
+	t_request(&req, "plugh", "bob", "755224", 1);
+	ret &= t_compare_i(0, t_exchange(&req, &resp, 1));
+	return (ret);
+}
+
+/*
+ * Check Message-Authenticator handling, and that malformed or forged
+ * requests, and requests without a Message-Authenticator, are silently
+ * discarded.
+ */
+static int
+t_msgauth(char **desc, void *arg)
+{
+	struct t_packet req, resp;
+	int ret;
+
+	(void)desc;
+	(void)arg;
+	t_request(&req, t_secret, "bob", "755224", 1);
+	ret = t_exchange(&req, &resp, 1);
+	ret &= t_response(&req, &resp, 2);
+	t_request(&req, t_secret, "bob", "287082", 1);
+	req.buf[req.len - 1] ^= 1;
+	ret &= t_compare_i(0, t_exchange(&req, &resp, 1));
+	t_request(&req, t_secret, "bob", "287082", 1);
+	be16enc(req.buf + 2, req.len + 1);
+	ret &= t_compare_i(0, t_exchange(&req, &resp, 1));
+	t_request(&req, t_secret, "bob", "287082", 0);
+	ret &= t_compare_i(0, t_exchange(&req, &resp, 1));
+	return (ret);
+}
+
+static int
+t_start(void)
+{
+	struct t_packet req, resp;
+	socklen_t len;
+	char port[8];
+	oath_key key;
+	otp_store *st;
+	FILE *f;
+	int ret, sock;
+
+	if (mkdtemp(t_dir) == NULL)
+		return (-1);
+	snprintf(t_store, sizeof t_store, "%s/store", t_dir);
+	snprintf(t_secretfile, sizeof t_secretfile, "%s/secret", t_dir);
+	if ((f = fopen(t_secretfile, "w")) == NULL)
+		return (-1);
+	fprintf(f, "%s\n", t_secret);
+	fclose(f);
+	if ((st = otp_store_open(t_store, O_RDWR|O_CREAT)) == NULL)
+		return (-1);
+	oath_key_create(&key, om_hotp, oh_sha1, 6, "cryb.to", "alice",
+	    "12345678901234567890", 20);
+	ret = otp_store_update(st, "alice", &key);
+	if (ret == 0)
+		ret = otp_store_update(st, "bob", &key);
+	oath_key_destroy(&key);
+	otp_store_close(st);
+	if (ret != 0)
+		return (-1);
+
+	/* find a free port */
+	memset(&t_sin, 0, sizeof t_sin);
+	t_sin.sin_family = AF_INET;
+	t_sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	len = sizeof t_sin;
+	if ((sock = socket(AF_INET, SOCK_DGRAM, 0)) < 0 ||
+	    bind(sock, (struct sockaddr *)&t_sin, sizeof t_sin) != 0 ||
+	    getsockname(sock, (struct sockaddr *)&t_sin, &len) != 0)
+		return (-1);
+	close(sock);
+	snprintf(port, sizeof port, "%u", ntohs(t_sin.sin_port));
+
+	if ((t_pid = fork()) < 0)
+		return (-1);
+	if (t_pid == 0) {
+		execl(OTPRADIUSD, "otpradiusd", "-f", "-t", "2",
+		    "-a", "127.0.0.1", "-p", port, "-k", t_store,
+		    "-s", t_secretfile, (char *)NULL);
+		_exit(1);
+	}
+	if ((t_sock = socket(AF_INET, SOCK_DGRAM, 0)) < 0 ||
+	    connect(t_sock, (struct sockaddr *)&t_sin, sizeof t_sin) != 0)
+		return (-1);
+
+	/* wait for the server to start answering */
+	t_request(&req, t_secret, "nobody", "000000", 1);
+	if (!t_exchange(&req, &resp, 25))
+		return (-1);
+	return (0);
+}
+
+static void t_cleanup(void);
+
+static int
+t_prepare(int argc, char *argv[])
+{
+
+	(void)argc;
+	(void)argv;
+	if (t_start() != 0) {
+		t_cleanup();
+		return (-1);
+	}
+	t_add_test(t_accept, NULL, "accept");
+	t_add_test(t_reject, NULL, "reject");
+	t_add_test(t_msgauth, NULL, "message authenticator");
+	return (0);
+}
+
+static void
+t_cleanup(void)
+{
+	int status;
+
+	if (t_sock >= 0)
+		close(t_sock);
+	if (t_pid > 0) {
+		kill(t_pid, SIGTERM);
+		waitpid(t_pid, &status, 0);
+	}
+	unlink(t_store);
+	unlink(t_secretfile);
+	rmdir(t_dir);
+}
+
+int
+main(int argc, char *argv[])
+{
+
+	t_main(t_prepare, t_cleanup, argc, argv);
+}